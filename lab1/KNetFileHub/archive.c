@@ -0,0 +1,842 @@
+/*************************************
+ *       Archive Stream Transfer      *
+ *************************************/
+
+#define _GNU_SOURCE
+#include "archive.h"
+#include "util.h"
+#include "staging.h"
+#include "walker.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// a member on its way between the stream and a reader or writer thread
+struct archive_item
+{
+    struct archive_item *next;
+    struct tree_entry ent;
+    char *name;
+    char *data;    // buffered content, NULL if streamed
+    int fd;        // file to stream the content from, -1 if buffered
+};
+
+struct archive_queue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+    struct archive_item *head, *tail;
+    size_t bytes;      // buffered content in the queue
+    int producers;     // threads still pushing
+    int aborted;
+};
+
+struct archive_sender
+{
+    struct archive_list *list;
+    struct archive_queue q;
+    size_t next;                  // next member to read, accessed atomically
+    struct archive_stats *stats;
+};
+
+// buffered reader of the stream, so that small members don't cost a read() each
+struct archive_reader
+{
+    int s;
+    bw_session *bw;
+    char *buf;
+    size_t pos, len;
+};
+
+struct archive_receiver
+{
+    int dirfd;
+    int flags;
+    struct archive_queue q;
+    struct archive_stats *stats;
+};
+
+struct archive_walk
+{
+    struct archive_list *list;
+    int root;
+    const char *prefix;    // name of the root in the archive, "" if none
+};
+
+static void __archive_queue_init(struct archive_queue *q, int producers)
+{
+    memset(q, 0, sizeof(struct archive_queue));
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    q->producers = producers;
+}
+
+static void __archive_item_free(struct archive_item *it)
+{
+    if (it->fd >= 0)
+        close(it->fd);
+    free(it->data);
+    free(it->name);
+    free(it);
+}
+
+static void __archive_queue_destroy(struct archive_queue *q)
+{
+    struct archive_item *it;
+    while ((it = q->head))
+    {
+        q->head = it->next;
+        __archive_item_free(it);
+    }
+    pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_mutex_destroy(&q->lock);
+}
+
+static size_t __archive_item_bytes(const struct archive_item *it)
+{
+    return it->data ? it->ent.size : 0;
+}
+
+static int __archive_queue_push(struct archive_queue *q, struct archive_item *it)
+{
+    const size_t bytes = __archive_item_bytes(it);
+    pthread_mutex_lock(&q->lock);
+    // an empty queue takes anything, so a member larger than the budget can't get stuck
+    while (!q->aborted && q->head && q->bytes + bytes > ARCHIVE_INFLIGHT_BYTES)
+        pthread_cond_wait(&q->not_full, &q->lock);
+    if (q->aborted)
+    {
+        pthread_mutex_unlock(&q->lock);
+        return -1;
+    }
+    it->next = NULL;
+    if (q->tail)
+        q->tail->next = it;
+    else
+        q->head = it;
+    q->tail = it;
+    q->bytes += bytes;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+static struct archive_item *__archive_queue_pop(struct archive_queue *q, int wait)
+{
+    pthread_mutex_lock(&q->lock);
+    while (wait && !q->head && q->producers && !q->aborted)
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    struct archive_item *it = q->aborted ? NULL : q->head;
+    if (it)
+    {
+        if (!(q->head = it->next))
+            q->tail = NULL;
+        q->bytes -= __archive_item_bytes(it);
+        pthread_cond_broadcast(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return it;
+}
+
+static void __archive_queue_producer_done(struct archive_queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    --q->producers;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void __archive_queue_abort(struct archive_queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->aborted = 1;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_cond_broadcast(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * @brief Initialize an empty member list.
+ *
+ * @param l the list.
+ */
+void archive_list_init(struct archive_list *l)
+{
+    memset(l, 0, sizeof(struct archive_list));
+    pthread_mutex_init(&l->lock, NULL);
+}
+
+/**
+ * @brief Release a member list, and close everything it opened.
+ *
+ * @param l the list.
+ */
+void archive_list_free(struct archive_list *l)
+{
+    for (size_t i = 0; i < l->count; ++i)
+    {
+        if (l->members[i].fd >= 0)
+            close(l->members[i].fd);
+        free(l->members[i].path);
+        free(l->members[i].name);
+    }
+    for (int i = 0; i < l->root_count; ++i)
+        close(l->roots[i]);
+    free(l->members);
+    free(l->roots);
+    pthread_mutex_destroy(&l->lock);
+    memset(l, 0, sizeof(struct archive_list));
+}
+
+static int __archive_list_push(struct archive_list *l, int root, int fd, int type, const char *path, const char *name)
+{
+    char *p = path ? strdup(path) : NULL, *n = strdup(name);
+    if ((path && !p) || !n)
+        goto LIST_PUSH_FAIL;
+    pthread_mutex_lock(&l->lock);
+    if (l->count == l->cap)
+    {
+        size_t cap = l->cap ? l->cap * 2 : 1024;
+        struct archive_member *m = realloc(l->members, sizeof(struct archive_member) * cap);
+        if (!m)
+        {
+            pthread_mutex_unlock(&l->lock);
+            goto LIST_PUSH_FAIL;
+        }
+        l->members = m;
+        l->cap = cap;
+    }
+    struct archive_member *m = &l->members[l->count++];
+    m->root = root;
+    m->fd = fd;
+    m->type = type;
+    m->path = p;
+    m->name = n;
+    pthread_mutex_unlock(&l->lock);
+    return 0;
+LIST_PUSH_FAIL:
+    fprintf(stderr, "Failed to malloc.\n");
+    free(p);
+    free(n);
+    return -1;
+}
+
+static int __archive_visit(void *arg, int worker, const char *path, size_t path_len, int type, const struct stat *st)
+{
+    struct archive_walk *w = arg;
+    const char *base = strrchr(path, '/');
+    if (is_staging_temp_name(base ? base + 1 : path))
+        return 0; // skip unfinished uploads
+
+    char name[MAX_PATH_LENGTH + 1];
+    if ((size_t)snprintf(name, sizeof(name), "%s%s%s", w->prefix, *w->prefix ? "/" : "", path) >= sizeof(name))
+    {
+        fprintf(stderr, "Path is too long: %s/%s. Skip.\n", w->prefix, path);
+        return 0;
+    }
+    if (type == WALK_DIR)
+        return __archive_list_push(w->list, -1, -1, TREE_ENTRY_DIR, NULL, name);
+    return __archive_list_push(w->list, w->root, -1, TREE_ENTRY_FILE, path, name);
+}
+
+/**
+ * @brief Add a file, or a directory with everything in it, to a member list.
+ *        Members are named after the last component of `path`.
+ *
+ * @param l the list.
+ * @param dirfd the directory `path` is relative to, or AT_FDCWD.
+ * @param path the file or directory. "." adds the content of `dirfd` without a name prefix.
+ * @param beneath resolve `path` with `open_beneath`, i.e. it must be a safe relative path.
+ * @return int 0 if success, non-zero if failed.
+ */
+int archive_list_add(struct archive_list *l, int dirfd, const char *path, int beneath)
+{
+    int fd = beneath ? open_beneath(dirfd, path, O_RDONLY, 0, 0) : openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        int errsv = errno;
+        fprintf(stderr, "Cannot open `%s` [errno %d]: %s\n", path, errsv, strerror(errsv));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st))
+    {
+        perror("Error occurred in fstat");
+        close(fd);
+        return -1;
+    }
+
+    // the last component, without trailing slashes
+    char prefix[MAX_PATH_LENGTH + 1];
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/')
+        --len;
+    const char *base = memrchr(path, '/', len);
+    base = base ? base + 1 : path;
+    len -= base - path;
+    if (len > MAX_PATH_LENGTH)
+        len = MAX_PATH_LENGTH;
+    memcpy(prefix, base, len);
+    prefix[len] = '\0';
+    if (!strcmp(prefix, ".") || !strcmp(prefix, "/"))
+        *prefix = '\0';
+    if (*prefix && !is_safe_relative_path(prefix))
+    {
+        fprintf(stderr, "Cannot send `%s` under this name.\n", path);
+        close(fd);
+        return -1;
+    }
+
+    if (S_ISREG(st.st_mode))
+    {
+        if (!*prefix || __archive_list_push(l, -1, fd, TREE_ENTRY_FILE, NULL, prefix))
+        {
+            close(fd);
+            return -1;
+        }
+        return 0;
+    }
+    if (!S_ISDIR(st.st_mode))
+    {
+        fprintf(stderr, "`%s` is not a regular file or directory.\n", path);
+        close(fd);
+        return -1;
+    }
+
+    int *roots = realloc(l->roots, sizeof(int) * (l->root_count + 1));
+    if (!roots)
+    {
+        fprintf(stderr, "Failed to malloc.\n");
+        close(fd);
+        return -1;
+    }
+    l->roots = roots;
+    l->roots[l->root_count] = fd;
+    struct archive_walk w = {l, l->root_count++, prefix};
+    if (*prefix && __archive_list_push(l, -1, -1, TREE_ENTRY_DIR, NULL, prefix))
+        return -1;
+    return walk_tree(fd, walker_default_threads(), &__archive_visit, &w);
+}
+
+static struct archive_item *__archive_read_member(struct archive_list *l, struct archive_member *m)
+{
+    int fd = m->fd;
+    m->fd = -1; // the item owns it now
+    if (fd < 0 && (fd = open_beneath(l->roots[m->root], m->path, O_RDONLY, 0, 0)) < 0)
+    {
+        int errsv = errno;
+        fprintf(stderr, "Cannot open `%s` [errno %d]: %s. Skip.\n", m->name, errsv, strerror(errsv));
+        return NULL;
+    }
+    struct stat st;
+    struct archive_item *it = calloc(1, sizeof(struct archive_item));
+    if (!it || !(it->name = strdup(m->name)))
+    {
+        fprintf(stderr, "Failed to malloc.\n");
+        goto READ_MEMBER_FAIL;
+    }
+    it->fd = -1;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+    {
+        fprintf(stderr, "`%s` is not a regular file any more. Skip.\n", m->name);
+        goto READ_MEMBER_FAIL;
+    }
+    it->ent.type = TREE_ENTRY_FILE;
+    it->ent.path_length = strlen(m->name);
+    it->ent.ts_modified = st.st_mtime;
+    if (st.st_size > ARCHIVE_INLINE_MAX)
+    {
+        // too large to buffer, the sending thread streams it
+        it->ent.size = st.st_size;
+        it->fd = fd;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        return it;
+    }
+
+    // whatever is there now is the content, even if the file is being changed
+    if (!(it->data = malloc(st.st_size ? st.st_size : 1)))
+    {
+        fprintf(stderr, "Failed to malloc.\n");
+        goto READ_MEMBER_FAIL;
+    }
+    size_t n = 0;
+    ssize_t r;
+    while (n < st.st_size && (r = read(fd, it->data + n, st.st_size - n)) != 0)
+    {
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            int errsv = errno;
+            fprintf(stderr, "Cannot read `%s` [errno %d]: %s. Skip.\n", m->name, errsv, strerror(errsv));
+            goto READ_MEMBER_FAIL;
+        }
+        n += r;
+    }
+    it->ent.size = n;
+    close(fd);
+    return it;
+READ_MEMBER_FAIL:
+    close(fd);
+    if (it)
+    {
+        free(it->data);
+        free(it->name);
+        free(it);
+    }
+    return NULL;
+}
+
+static void *__archive_reader_thread(void *arg)
+{
+    struct archive_sender *as = arg;
+    size_t i;
+    while ((i = __atomic_fetch_add(&as->next, 1, __ATOMIC_SEQ_CST)) < as->list->count)
+    {
+        struct archive_member *m = &as->list->members[i];
+        if (m->type != TREE_ENTRY_FILE)
+            continue;
+        struct archive_item *it = __archive_read_member(as->list, m);
+        if (!it)
+        {
+            __atomic_fetch_add(&as->stats->failed, 1, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        if (__archive_queue_push(&as->q, it))
+        {
+            // the stream is broken
+            __archive_item_free(it);
+            break;
+        }
+    }
+    __archive_queue_producer_done(&as->q);
+    return NULL;
+}
+
+static int __archive_flush(int s, char *batch, size_t *used, bw_session *bw)
+{
+    if (!*used)
+        return 0;
+    int r = send_buffer(s, batch, *used, bw);
+    *used = 0;
+    return r;
+}
+
+static int __archive_put_header(int s, char *batch, size_t *used, bw_session *bw,
+    const struct tree_entry *ent, const char *name)
+{
+    if (*used + sizeof(struct tree_entry) + ent->path_length > ARCHIVE_IO_BUFFER_SIZE
+        && __archive_flush(s, batch, used, bw))
+        return -1;
+    memcpy(batch + *used, ent, sizeof(struct tree_entry));
+    memcpy(batch + *used + sizeof(struct tree_entry), name, ent->path_length);
+    *used += sizeof(struct tree_entry) + ent->path_length;
+    return 0;
+}
+
+static int __archive_put_content(int s, char *batch, size_t *used, bw_session *bw, struct archive_item *it)
+{
+    if (it->data)
+    {
+        if (*used + it->ent.size <= ARCHIVE_IO_BUFFER_SIZE)
+        {
+            memcpy(batch + *used, it->data, it->ent.size);
+            *used += it->ent.size;
+            return 0;
+        }
+        if (__archive_flush(s, batch, used, bw))
+            return -1;
+        return send_buffer(s, it->data, it->ent.size, bw);
+    }
+
+    // exactly the announced size, or the stream is corrupt
+    if (__archive_flush(s, batch, used, bw))
+        return -1;
+    for (uint64_t off = 0; off < it->ent.size; )
+    {
+        size_t want = it->ent.size - off < ARCHIVE_IO_BUFFER_SIZE ? it->ent.size - off : ARCHIVE_IO_BUFFER_SIZE;
+        ssize_t r = read(it->fd, batch, want);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+        {
+            fprintf(stderr, "`%s` is shorter than %" PRIu64 " bytes now. Cannot go on.\n", it->name, (uint64_t)it->ent.size);
+            return -1;
+        }
+        if (send_buffer(s, batch, r, bw))
+            return -1;
+        off += r;
+    }
+    return 0;
+}
+
+/**
+ * @brief Send the members of a list as an archive stream.
+ *
+ * @param s the socket.
+ * @param l the members. Files opened by `archive_list_add` are consumed.
+ * @param bw the bandwidth scheduler session. If NULL, the transfer is not throttled.
+ * @param stats counters to update.
+ * @return int 0 if the whole archive is sent, non-zero if failed. Unreadable files are skipped, not failures.
+ */
+int archive_send(int s, struct archive_list *l, bw_session *bw, struct archive_stats *stats)
+{
+    char *batch = malloc(ARCHIVE_IO_BUFFER_SIZE);
+    if (!batch)
+    {
+        fprintf(stderr, "Failed to malloc.\n");
+        return -1;
+    }
+    size_t used = 0;
+    int failed = 0;
+
+    // directories first, they are cheap and the receiver wants them before the files
+    size_t file_count = 0;
+    for (size_t i = 0; i < l->count && !failed; ++i)
+    {
+        struct archive_member *m = &l->members[i];
+        if (m->type != TREE_ENTRY_DIR)
+        {
+            ++file_count;
+            continue;
+        }
+        struct tree_entry ent;
+        memset(&ent, 0, sizeof(ent));
+        ent.type = TREE_ENTRY_DIR;
+        ent.path_length = strlen(m->name);
+        failed = __archive_put_header(s, batch, &used, bw, &ent, m->name);
+        ++stats->dirs;
+    }
+
+    struct archive_sender as;
+    memset(&as, 0, sizeof(as));
+    as.list = l;
+    as.stats = stats;
+    pthread_t tids[ARCHIVE_READER_THREADS];
+    int started = 0;
+    __archive_queue_init(&as.q, 0);
+    for (; !failed && started < ARCHIVE_READER_THREADS && started < file_count; ++started)
+    {
+        __atomic_fetch_add(&as.q.producers, 1, __ATOMIC_SEQ_CST);
+        if (pthread_create(&tids[started], NULL, &__archive_reader_thread, &as))
+        {
+            __atomic_fetch_sub(&as.q.producers, 1, __ATOMIC_SEQ_CST);
+            break;
+        }
+    }
+    if (!started && file_count)
+    {
+        fprintf(stderr, "Cannot start reader threads.\n");
+        failed = 1;
+    }
+
+    // send whatever is ready, flush the batch only when waiting
+    struct archive_item *it;
+    while (!failed)
+    {
+        if (!(it = __archive_queue_pop(&as.q, 0)))
+        {
+            if ((failed = __archive_flush(s, batch, &used, bw)))
+                break;
+            if (!(it = __archive_queue_pop(&as.q, 1)))
+                break;
+        }
+        failed = __archive_put_header(s, batch, &used, bw, &it->ent, it->name)
+            || __archive_put_content(s, batch, &used, bw, it);
+        if (!failed)
+        {
+            ++stats->files;
+            stats->bytes += it->ent.size;
+        }
+        __archive_item_free(it);
+    }
+    if (failed)
+        __archive_queue_abort(&as.q);
+    for (int i = 0; i < started; ++i)
+        pthread_join(tids[i], NULL);
+    __archive_queue_destroy(&as.q);
+
+    if (!failed)
+    {
+        struct tree_entry end;
+        memset(&end, 0, sizeof(end));
+        end.type = TREE_ENTRY_END;
+        failed = __archive_put_header(s, batch, &used, bw, &end, "")
+            || __archive_flush(s, batch, &used, bw);
+    }
+    free(batch);
+    if (failed)
+        fprintf(stderr, "Failed to send archive.\n");
+    return failed ? -1 : 0;
+}
+
+static int __archive_read(struct archive_reader *r, void *dst, size_t n)
+{
+    size_t done = 0;
+    while (done < n)
+    {
+        if (r->pos == r->len)
+        {
+            // large reads skip the buffer
+            const int direct = n - done >= ARCHIVE_IO_BUFFER_SIZE;
+            size_t grant = bw_acquire(r->bw, direct ? n - done : ARCHIVE_IO_BUFFER_SIZE);
+            ssize_t got = read(r->s, direct ? (char *)dst + done : r->buf, grant);
+            bw_refund(r->bw, got > 0 ? grant - got : grant);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got <= 0)
+            {
+                if (got < 0)
+                    perror("Failed to read archive");
+                else
+                    fprintf(stderr, "Unexpected EOF in archive.\n");
+                return -1;
+            }
+            if (direct)
+            {
+                done += got;
+                continue;
+            }
+            r->pos = 0;
+            r->len = got;
+        }
+        size_t k = r->len - r->pos < n - done ? r->len - r->pos : n - done;
+        memcpy((char *)dst + done, r->buf + r->pos, k);
+        r->pos += k;
+        done += k;
+    }
+    return 0;
+}
+
+/**
+ * @brief Save one member. The content is either buffered or read from the stream.
+ *
+ * @return int 0 if the stream is still good, even if the member could not be saved. Non-zero if the stream failed.
+ */
+static int __archive_store(struct archive_receiver *rc, const struct tree_entry *ent, const char *path,
+    const char *data, struct archive_reader *in)
+{
+    const char *slash = strrchr(path, '/');
+    const char *base = slash ? slash + 1 : path;
+    int parent = rc->dirfd, fd = -1, staged = 0, stream_failed = 0, write_failed = 0;
+    struct staged_file sf;
+
+    if (rc->flags & ARCHIVE_NO_OVERWRITE)
+    {
+        if (slash)
+        {
+            char dir[MAX_PATH_LENGTH + 1];
+            memcpy(dir, path, slash - path);
+            dir[slash - path] = '\0';
+            parent = open_beneath(rc->dirfd, dir, O_RDONLY | O_DIRECTORY, 0, 1);
+        }
+        if (parent < 0)
+            fprintf(stderr, "Cannot create directory for `%s`.\n", path);
+        else if (is_staging_temp_name(base))
+            fprintf(stderr, "File name is reserved: %s.\n", path);
+        else if (!faccessat(parent, base, F_OK, AT_SYMLINK_NOFOLLOW))
+            fprintf(stderr, "File %s already exists. Skip.\n", path);
+        else if (!staged_openat(&sf, parent, base, ent->size))
+        {
+            staged = 1;
+            fd = sf.fd;
+        }
+    }
+    else
+    {
+        fd = open_beneath(rc->dirfd, path, O_WRONLY | O_CREAT | O_TRUNC, 0644, 1);
+        if (fd < 0)
+            fprintf(stderr, "Cannot create `%s`.\n", path);
+    }
+
+    if (data)
+    {
+        write_failed = fd >= 0 && write_exactly(fd, data, ent->size) < 0;
+    }
+    else
+    {
+        // the content has to be read even if it can't be saved
+        char *chunk = malloc(ARCHIVE_IO_BUFFER_SIZE);
+        if (!chunk)
+        {
+            fprintf(stderr, "Failed to malloc.\n");
+            stream_failed = 1;
+        }
+        for (uint64_t off = 0; chunk && off < ent->size; )
+        {
+            size_t want = ent->size - off < ARCHIVE_IO_BUFFER_SIZE ? ent->size - off : ARCHIVE_IO_BUFFER_SIZE;
+            if (__archive_read(in, chunk, want))
+            {
+                stream_failed = 1;
+                break;
+            }
+            if (fd >= 0 && !write_failed && write_exactly(fd, chunk, want) < 0)
+                write_failed = 1;
+            off += want;
+        }
+        free(chunk);
+    }
+    if (write_failed)
+        fprintf(stderr, "Failed to write `%s`.\n", path);
+
+    int saved = 0;
+    if (fd >= 0 && !write_failed && !stream_failed)
+    {
+        struct timespec times[2] = {{0, UTIME_OMIT}, {ent->ts_modified, 0}};
+        futimens(fd, times);
+        // synced together after the whole archive
+        saved = staged ? !staged_publish_ex(&sf, STAGING_NO_SYNC) : !close(fd);
+    }
+    else if (staged)
+    {
+        staged_abort(&sf);
+    }
+    else if (fd >= 0)
+    {
+        close(fd);
+    }
+    if (parent >= 0 && parent != rc->dirfd)
+        close(parent);
+
+    if (saved)
+    {
+        __atomic_fetch_add(&rc->stats->files, 1, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&rc->stats->bytes, ent->size, __ATOMIC_SEQ_CST);
+    }
+    else
+    {
+        __atomic_fetch_add(&rc->stats->failed, 1, __ATOMIC_SEQ_CST);
+    }
+    return stream_failed ? -1 : 0;
+}
+
+static void *__archive_writer_thread(void *arg)
+{
+    struct archive_receiver *rc = arg;
+    struct archive_item *it;
+    while ((it = __archive_queue_pop(&rc->q, 1)))
+    {
+        __archive_store(rc, &it->ent, it->name, it->data, NULL);
+        __archive_item_free(it);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Receive an archive stream, and save the members under a directory.
+ *
+ * @param s the socket.
+ * @param dirfd the directory to save in. Member names are checked, and never leave it.
+ * @param flags ARCHIVE_* flags.
+ * @param bw the bandwidth scheduler session. If NULL, the transfer is not throttled.
+ * @param stats counters to update.
+ * @return int 0 if the whole archive is received, non-zero if failed. Members that can't be saved are skipped, not failures.
+ */
+int archive_receive(int s, int dirfd, int flags, bw_session *bw, struct archive_stats *stats)
+{
+    struct archive_reader in = {s, bw, malloc(ARCHIVE_IO_BUFFER_SIZE), 0, 0};
+    if (!in.buf)
+    {
+        fprintf(stderr, "Failed to malloc.\n");
+        return -1;
+    }
+    struct archive_receiver rc;
+    memset(&rc, 0, sizeof(rc));
+    rc.dirfd = dirfd;
+    rc.flags = flags;
+    rc.stats = stats;
+    __archive_queue_init(&rc.q, 1);
+    pthread_t tids[ARCHIVE_WRITER_THREADS];
+    int started = 0;
+    for (; started < ARCHIVE_WRITER_THREADS; ++started)
+    {
+        if (pthread_create(&tids[started], NULL, &__archive_writer_thread, &rc))
+            break;
+    }
+
+    int failed = 0;
+    char path[MAX_PATH_LENGTH + 1];
+    while (1)
+    {
+        struct tree_entry ent;
+        if ((failed = __archive_read(&in, &ent, sizeof(ent))))
+            break;
+        if (ent.type == TREE_ENTRY_END)
+            break;
+        if (!ent.path_length || ent.path_length > MAX_PATH_LENGTH
+            || (ent.type != TREE_ENTRY_DIR && ent.type != TREE_ENTRY_FILE))
+        {
+            fprintf(stderr, "Corrupt archive member.\n");
+            failed = 1;
+            break;
+        }
+        if ((failed = __archive_read(&in, path, ent.path_length)))
+            break;
+        path[ent.path_length] = '\0';
+        if (memchr(path, '\0', ent.path_length) || !is_safe_relative_path(path))
+        {
+            fprintf(stderr, "Unsafe path in archive: %s.\n", path);
+            failed = 1;
+            break;
+        }
+
+        if (ent.type == TREE_ENTRY_DIR)
+        {
+            int fd = open_beneath(dirfd, path, O_RDONLY | O_DIRECTORY, 0, 1);
+            if (fd < 0)
+                fprintf(stderr, "Cannot create directory `%s`.\n", path);
+            else
+                close(fd);
+            ++stats->dirs;
+            continue;
+        }
+        if (ent.size > ARCHIVE_INLINE_MAX || !started)
+        {
+            // stream it from here
+            if ((failed = __archive_store(&rc, &ent, path, NULL, &in)))
+                break;
+            continue;
+        }
+
+        // small member, let a writer save it
+        struct archive_item *it = calloc(1, sizeof(struct archive_item));
+        if (!it || !(it->name = strdup(path)) || !(it->data = malloc(ent.size ? ent.size : 1)))
+        {
+            fprintf(stderr, "Failed to malloc.\n");
+            if (it)
+                free(it->name);
+            free(it);
+            failed = 1;
+            break;
+        }
+        it->fd = -1;
+        it->ent = ent;
+        if ((failed = __archive_read(&in, it->data, ent.size)) || (failed = __archive_queue_push(&rc.q, it)))
+        {
+            __archive_item_free(it);
+            break;
+        }
+    }
+
+    if (failed)
+        __archive_queue_abort(&rc.q);
+    __archive_queue_producer_done(&rc.q);
+    for (int i = 0; i < started; ++i)
+        pthread_join(tids[i], NULL);
+    __archive_queue_destroy(&rc.q);
+    free(in.buf);
+
+    // staged members were published without syncing, sync them all at once
+    if (!failed && (flags & ARCHIVE_NO_OVERWRITE) && syncfs(dirfd))
+    {
+        perror("Failed to sync received files");
+        failed = 1;
+    }
+    if (failed)
+        fprintf(stderr, "Failed to receive archive.\n");
+    return failed ? -1 : 0;
+}
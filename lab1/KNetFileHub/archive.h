@@ -0,0 +1,73 @@
+#ifndef __ARCHIVE_H
+#define __ARCHIVE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "nfh.h"
+
+/* configurations */
+#define ARCHIVE_READER_THREADS 4           /* members read in parallel by the sender */
+#define ARCHIVE_WRITER_THREADS 4           /* members written in parallel by the receiver */
+#define ARCHIVE_INLINE_MAX 1048576U        /* 1MB, larger members are streamed instead of buffered */
+#define ARCHIVE_INFLIGHT_BYTES 33554432U   /* 32MB, buffered members waiting for the stream or a writer */
+#define ARCHIVE_IO_BUFFER_SIZE 262144U     /* headers and small members are batched in this */
+
+/* receive flags */
+#define ARCHIVE_NO_OVERWRITE 1 /* stage every member and publish it atomically, never replace a file */
+
+/*
+
+Archive Stream:
+    Many files sent as one payload, without a round trip per file. Every
+    member is a `struct tree_entry` followed by the member name and, for a
+    TREE_ENTRY_FILE, exactly `size` bytes of content. A TREE_ENTRY_END
+    entry ends the archive. Members come in no particular order, and
+    nothing has to be seeked, so both sides work while the stream flows:
+        Sender: reader threads open and read members in parallel, small
+        members into memory, and queue them. The sending thread takes
+        whatever is ready and batches headers and small contents into
+        large writes. Large members are streamed from the file directly.
+        Receiver: the receiving thread parses the stream and hands small
+        members to a pool of writer threads, so opening, writing and
+        closing files overlap with the network. Large members are written
+        by the receiving thread as they arrive.
+    The memory held by queued members is bounded by ARCHIVE_INFLIGHT_BYTES.
+
+*/
+
+struct archive_member
+{
+    int root;      // index of the directory `path` is relative to, -1 if `fd` is set
+    int fd;        // the file, already opened, -1 if not
+    int type;      // TREE_ENTRY_DIR or TREE_ENTRY_FILE
+    char *path;    // relative to the root
+    char *name;    // name in the archive
+};
+
+struct archive_list
+{
+    pthread_mutex_t lock;             // the walker adds members from several threads
+    struct archive_member *members;
+    size_t count, cap;
+    int *roots;                       // directories being archived
+    int root_count;
+};
+
+struct archive_stats
+{
+    uint64_t files;   // files transferred
+    uint64_t dirs;
+    uint64_t bytes;
+    uint64_t failed;  // files skipped
+};
+
+void archive_list_init(struct archive_list *l);
+void archive_list_free(struct archive_list *l);
+int archive_list_add(struct archive_list *l, int dirfd, const char *path, int beneath);
+int archive_send(int s, struct archive_list *l, bw_session *bw, struct archive_stats *stats);
+int archive_receive(int s, int dirfd, int flags, bw_session *bw, struct archive_stats *stats);
+
+#endif
@@ -0,0 +1,126 @@
+/******************************************
+ *        Tree Hash Throughput             *
+ ******************************************/
+
+/*
+ * Hashes a file with one sequential SHA-256, then with the tree hash on
+ * 1, 2, 4, ... threads up to the given count, and prints the throughput
+ * and the speedup over one thread.
+ * Usage: bench_hash <file> [max threads] [rounds]    (default one thread per CPU, 3 rounds)
+ * The file is read once before measuring, so this measures hashing, not
+ * the disk, as long as it fits in the page cache.
+ */
+
+#include "nfh.h"
+#include "util.h"
+#include <openssl/evp.h>
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// what a plain digest of the whole file costs, for comparison
+static double sequential(const char *path, uint64_t size)
+{
+    EVP_MD *sha256 = EVP_MD_fetch(NULL, "SHA256", NULL);
+    EVP_MD_CTX *md = EVP_MD_CTX_new();
+    char *buf = malloc(TREE_HASH_CHUNK_SIZE);
+    FILE *fp = fopen(path, "rb");
+    double mbps = -1;
+    if (!sha256 || !md || !buf || !fp || !EVP_DigestInit_ex(md, sha256, NULL))
+        goto DONE;
+    const uint64_t t0 = now_ns();
+    size_t n;
+    while ((n = fread(buf, 1, TREE_HASH_CHUNK_SIZE, fp)))
+        EVP_DigestUpdate(md, buf, n);
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    EVP_DigestFinal_ex(md, digest, NULL);
+    mbps = size / 1E6 / ((now_ns() - t0) / 1E9);
+DONE:
+    if (fp)
+        fclose(fp);
+    free(buf);
+    EVP_MD_CTX_free(md);
+    EVP_MD_free(sha256);
+    return mbps;
+}
+
+static double tree(const char *path, int threads, int rounds, uint8_t *root)
+{
+    double best = 0;
+    for (int i = 0; i < rounds; ++i)
+    {
+        struct tree_digest d;
+        FILE *fp = fopen(path, "rb");
+        if (!fp)
+            return -1;
+        const uint64_t t0 = now_ns();
+        int r = tree_hash_file(fp, threads, &d);
+        const double mbps = d.size / 1E6 / ((now_ns() - t0) / 1E9);
+        fclose(fp);
+        if (r)
+            return -1;
+        // every thread count must give the same root
+        if (root[0] == 0xff && root[1] == 0xff)
+            memcpy(root, d.root, TREE_HASH_SIZE);
+        else if (memcmp(root, d.root, TREE_HASH_SIZE))
+        {
+            fprintf(stderr, "Root differs with %d threads.\n", threads);
+            tree_digest_free(&d);
+            return -1;
+        }
+        tree_digest_free(&d);
+        if (mbps > best)
+            best = mbps;
+    }
+    return best;
+}
+
+int main(int argc, char **argv)
+{
+    setbuf(stdout, 0);
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <file> [max threads] [rounds]\n", argv[0]);
+        return -1;
+    }
+    const int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    const int max_threads = argc > 2 ? atoi(argv[2]) : cpus;
+    const int rounds = argc > 3 ? atoi(argv[3]) : 3;
+    struct stat st;
+    if (stat(argv[1], &st) || !S_ISREG(st.st_mode) || max_threads < 1
+        || max_threads > TREE_HASH_MAX_THREADS || rounds < 1)
+    {
+        fprintf(stderr, "Cannot use %s.\n", argv[1]);
+        return -1;
+    }
+    printf("%" PRIu64 " bytes, %d online CPUs, best of %d rounds:\n", (uint64_t)st.st_size, cpus, rounds);
+    if (sequential(argv[1], st.st_size) < 0) // warm up the page cache
+        return -1;
+    printf("%-16s %10.1f MB/s\n", "sha256", sequential(argv[1], st.st_size));
+
+    uint8_t root[TREE_HASH_SIZE];
+    memset(root, 0xff, sizeof(root));
+    double single = 0;
+    for (int threads = 1; ; threads = threads * 2 > max_threads && threads < max_threads ? max_threads : threads * 2)
+    {
+        const double mbps = tree(argv[1], threads, rounds, root);
+        if (mbps < 0)
+            return -1;
+        if (threads == 1)
+            single = mbps;
+        char title[32];
+        snprintf(title, sizeof(title), "tree, %d thread%s", threads, threads > 1 ? "s" : "");
+        printf("%-16s %10.1f MB/s, %.2fx\n", title, mbps, mbps / single);
+        if (threads >= max_threads)
+            break;
+    }
+    printf("root ");
+    for (int i = 0; i < TREE_HASH_SIZE; ++i)
+        printf("%02x", root[i]);
+    printf("\n");
+    return 0;
+}
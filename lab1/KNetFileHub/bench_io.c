@@ -0,0 +1,157 @@
+/******************************************
+ *  Page-cache I/O Policy Latency Bench   *
+ ******************************************/
+
+/*
+ * Measures read latency of small hot files while a bulk file is streamed
+ * the way `send_file` does it, with and without the I/O policy.
+ * Usage: bench_io [-n] <bulk_file>
+ *     -n: read the bulk file without the I/O policy (baseline)
+ * Use a bulk file larger than the free memory to see the page cache effect.
+ */
+
+#include "nfh.h"
+#include "util.h"
+#include "iopolicy.h"
+#include <pthread.h>
+#include <fcntl.h>
+
+#define SMALL_FILE_COUNT 256
+#define SMALL_FILE_SIZE 16384
+#define SMALL_FILE_DIR "bench_io.tmp"
+#define SAMPLE_COUNT 20000
+
+static volatile int bulk_running = 1;
+static int use_policy = 1;
+
+static void *bulk_reader(void *arg)
+{
+    FILE *fp = fopen(arg, "rb");
+    if (!fp)
+    {
+        perror("Cannot open bulk file");
+        bulk_running = 0;
+        return NULL;
+    }
+    void *buf = malloc(SEND_BUFFER_SIZE);
+    struct io_cursor cur;
+    if (use_policy)
+        io_read_begin(&cur, fp);
+    size_t n, total = 0;
+    while (bulk_running && (n = fread(buf, 1, SEND_BUFFER_SIZE, fp)) > 0)
+    {
+        if (use_policy)
+            io_read_advance(&cur, n);
+        total += n;
+    }
+    if (use_policy)
+        io_read_end(&cur);
+    printf("Bulk reader: %zu bytes.\n", total);
+    free(buf);
+    fclose(fp);
+    bulk_running = 0;
+    return NULL;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int sample_small_files(uint64_t *samples, int count, int stop_with_bulk)
+{
+    char name[64], buf[SMALL_FILE_SIZE];
+    int i;
+    for (i = 0; i < count && (!stop_with_bulk || bulk_running); ++i)
+    {
+        snprintf(name, sizeof(name), SMALL_FILE_DIR "/%d", rand() % SMALL_FILE_COUNT);
+        uint64_t t0 = now_ns();
+        int fd = open(name, O_RDONLY);
+        if (fd < 0 || read_exactly(fd, buf, SMALL_FILE_SIZE) != SMALL_FILE_SIZE)
+        {
+            perror("Cannot read small file");
+            exit(-1);
+        }
+        close(fd);
+        samples[i] = now_ns() - t0;
+        usleep(100);
+    }
+    return i;
+}
+
+static void report(const char *title, uint64_t *samples, int n)
+{
+    if (!n)
+    {
+        printf("%s: no samples.\n", title);
+        return;
+    }
+    qsort(samples, n, sizeof(uint64_t), cmp_u64);
+    printf("%-24s %6d reads, p50 %8.1fus, p99 %8.1fus, max %8.1fus\n", title, n,
+        samples[n / 2] / 1E3, samples[n * 99 / 100] / 1E3, samples[n - 1] / 1E3);
+}
+
+int main(int argc, char **argv)
+{
+    setbuf(stdout, 0);
+    const char *bulk_file = NULL;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-n"))
+            use_policy = 0;
+        else
+            bulk_file = argv[i];
+    }
+    if (!bulk_file)
+    {
+        fprintf(stderr, "Usage: %s [-n] <bulk_file>\n", argv[0]);
+        return -1;
+    }
+
+    // the hot working set
+    char name[64], buf[SMALL_FILE_SIZE];
+    mkdir(SMALL_FILE_DIR, 0755);
+    memset(buf, 'x', sizeof(buf));
+    for (int i = 0; i < SMALL_FILE_COUNT; ++i)
+    {
+        snprintf(name, sizeof(name), SMALL_FILE_DIR "/%d", i);
+        FILE *fp = fopen(name, "wb");
+        if (!fp || fwrite(buf, 1, sizeof(buf), fp) != sizeof(buf))
+        {
+            perror("Cannot create small file");
+            return -1;
+        }
+        fclose(fp);
+    }
+
+    uint64_t *samples = malloc(sizeof(uint64_t) * SAMPLE_COUNT);
+    int n = sample_small_files(samples, SAMPLE_COUNT / 4, 0);
+    report("idle", samples, n);
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, &bulk_reader, (void *)bulk_file);
+    n = sample_small_files(samples, SAMPLE_COUNT, 1);
+    bulk_running = 0;
+    pthread_join(tid, NULL);
+    report(use_policy ? "bulk (I/O policy)" : "bulk (no policy)", samples, n);
+
+    n = sample_small_files(samples, SAMPLE_COUNT / 4, 0);
+    report("after bulk", samples, n);
+
+    for (int i = 0; i < SMALL_FILE_COUNT; ++i)
+    {
+        snprintf(name, sizeof(name), SMALL_FILE_DIR "/%d", i);
+        unlink(name);
+    }
+    rmdir(SMALL_FILE_DIR);
+    free(samples);
+    return 0;
+}
@@ -0,0 +1,122 @@
+/******************************************
+ *   Storage Backend Lookup Latency Bench  *
+ ******************************************/
+
+/*
+ * Grows a flat directory and a hashed store side by side, and measures at
+ * every size what the server does per request: look up a name (half of them
+ * missing), open a stored file, and list the files offered for download.
+ * Usage: bench_store [max_files]    (default 100000)
+ * Drop the page cache between runs (echo 3 > /proc/sys/vm/drop_caches) for
+ * cold numbers.
+ */
+
+#include "nfh.h"
+#include "store.h"
+#include <fcntl.h>
+
+#define BENCH_DIR "bench_store.tmp"
+#define FLAT_DIR BENCH_DIR "/flat"
+#define STORE_DIR BENCH_DIR "/store"
+#define INCOMING_DIR BENCH_DIR "/incoming"
+#define LOOKUP_COUNT 20000
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int count_visit(void *arg, const char *name, uint64_t size, uint64_t ts_modified)
+{
+    return ++*(int *)arg == FILE_LIST_MAX;
+}
+
+static void make_name(char *buf, size_t size, uint64_t i)
+{
+    snprintf(buf, size, "file-%08" PRIu64 ".dat", i);
+}
+
+static void measure(const char *title, storage *st, uint64_t n)
+{
+    char name[64], path[PATH_MAX];
+    // lookups, every other one for a missing name
+    uint64_t t0 = now_ns();
+    int found = 0;
+    for (int i = 0; i < LOOKUP_COUNT; ++i)
+    {
+        uint64_t k = (uint64_t)rand() % n;
+        make_name(name, sizeof(name), i % 2 ? k : k + n);
+        found += st->vf_exists(st, name);
+    }
+    const double exists_us = (now_ns() - t0) / 1E3 / LOOKUP_COUNT;
+
+    // opening stored files
+    t0 = now_ns();
+    for (int i = 0; i < LOOKUP_COUNT; ++i)
+    {
+        make_name(name, sizeof(name), (uint64_t)rand() % n);
+        int fd;
+        if (st->vf_path(st, name, path, sizeof(path)) || (fd = open(path, O_RDONLY)) < 0)
+        {
+            fprintf(stderr, "Cannot open %s.\n", name);
+            exit(-1);
+        }
+        close(fd);
+    }
+    const double open_us = (now_ns() - t0) / 1E3 / LOOKUP_COUNT;
+
+    // the DOWNLOAD file list
+    t0 = now_ns();
+    int listed = 0;
+    st->vf_list(st, &count_visit, &listed);
+    const double list_us = (now_ns() - t0) / 1E3;
+
+    printf("%-8s %10" PRIu64 " files: exists %7.2fus, open %7.2fus, list %d %10.1fus (%d/%d found)\n",
+        title, n, exists_us, open_us, listed, list_us, found, LOOKUP_COUNT);
+}
+
+int main(int argc, char **argv)
+{
+    setbuf(stdout, 0);
+    uint64_t max_files = argc > 1 ? strtoull(argv[1], NULL, 10) : 100000;
+    if (max_files < 1000)
+        max_files = 1000;
+    mkdir(BENCH_DIR, 0755);
+    mkdir(FLAT_DIR, 0755);
+    mkdir(INCOMING_DIR, 0755);
+    storage *flat = storage_open_flat(FLAT_DIR), *hashed = storage_open_hashed(STORE_DIR);
+    if (!flat || !hashed)
+        return -1;
+
+    char name[64], path[PATH_MAX];
+    uint64_t n = 0;
+    for (uint64_t target = 1000; target <= max_files; target *= 10)
+    {
+        uint64_t t0 = now_ns();
+        for (; n < target; ++n)
+        {
+            make_name(name, sizeof(name), n);
+            snprintf(path, sizeof(path), FLAT_DIR "/%s", name);
+            int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+            snprintf(path, sizeof(path), INCOMING_DIR "/%s", name);
+            int fd2 = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+            if (fd < 0 || fd2 < 0 || storage_import(hashed, path, name))
+            {
+                perror("Cannot create file");
+                return -1;
+            }
+            close(fd);
+            close(fd2);
+        }
+        printf("Created %" PRIu64 " files in %.2fs.\n", n, (now_ns() - t0) / 1E9);
+        measure("flat", flat, n);
+        measure("hashed", hashed, n);
+    }
+
+    flat->vf_close(flat);
+    hashed->vf_close(hashed);
+    printf("Remove " BENCH_DIR " when done.\n");
+    return 0;
+}
@@ -0,0 +1,154 @@
+/******************************************
+ *     Encrypted Transport Throughput      *
+ ******************************************/
+
+/*
+ * Sends a file over TCP loopback the way the server and the client do it,
+ * in plaintext, with TLS in user space (a relay thread, like without kernel
+ * support) and with kernel TLS, and prints the throughput of each.
+ * Usage: bench_tls <file> [rounds]    (default 5 rounds)
+ * The certificate and key are taken from env NFH_TLS_CERT and NFH_TLS_KEY,
+ * or nfh.crt and nfh.key, as made by `make tls-certs`.
+ */
+
+#include "nfh.h"
+#include "util.h"
+#include "tls.h"
+#include <pthread.h>
+#include <signal.h>
+
+#define OUTPUT_FILE "bench_tls.out"
+
+struct sender_arg
+{
+    int socket;
+    const char *path;
+    int tls;
+    int ktls; // out: the kernel took the keys
+    int result;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *sender(void *arg)
+{
+    // the client side: connect, then upload
+    struct sender_arg *a = arg;
+    int s = a->socket;
+    if (a->tls)
+    {
+        if ((s = tls_connect(a->socket, "127.0.0.1")) < 0)
+        {
+            a->result = -1;
+            return NULL;
+        }
+        a->ktls = s == a->socket;
+    }
+    FILE *fp = fopen(a->path, "rb");
+    a->result = !fp || send_file_ex(s, fp, NULL, TRANSFER_QUIET);
+    if (fp)
+        fclose(fp);
+    if (s != a->socket)
+        close(s);
+    return NULL;
+}
+
+static int make_pair(int pair[2])
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(addr);
+    int l = socket(AF_INET, SOCK_STREAM, 0);
+    if (l < 0 || bind(l, (struct sockaddr *)&addr, sizeof(addr)) || listen(l, 1)
+        || getsockname(l, (struct sockaddr *)&addr, &len)
+        || (pair[0] = socket(AF_INET, SOCK_STREAM, 0)) < 0
+        || connect(pair[0], (struct sockaddr *)&addr, sizeof(addr))
+        || (pair[1] = accept(l, NULL, NULL)) < 0)
+    {
+        perror("Cannot connect over loopback");
+        return -1;
+    }
+    close(l);
+    return 0;
+}
+
+static int measure(const char *title, int tls, const char *path, uint64_t size, int rounds)
+{
+    double best = 0, total = 0;
+    int ktls = 1;
+    for (int i = 0; i < rounds; ++i)
+    {
+        int pair[2];
+        FILE *out = fopen(OUTPUT_FILE, "wb");
+        if (!out || make_pair(pair))
+            return -1;
+        struct sender_arg a = { pair[0], path, tls, 0, 0 };
+        pthread_t tid;
+        const uint64_t t0 = now_ns();
+        pthread_create(&tid, NULL, &sender, &a);
+        // the server side: accept, then receive
+        int s = tls ? tls_accept(pair[1]) : pair[1];
+        int r = s < 0 || receive_file_ex(s, out, size, NULL, TRANSFER_QUIET);
+        if (s >= 0 && s != pair[1])
+            close(s);
+        else if (s < 0)
+            shutdown(pair[1], SHUT_RDWR);
+        pthread_join(tid, NULL);
+        fflush(out);
+        const double mbps = size / 1E6 / ((now_ns() - t0) / 1E9);
+        fclose(out);
+        close(pair[0]);
+        close(pair[1]);
+        if (r || a.result)
+        {
+            fprintf(stderr, "%s: transfer failed.\n", title);
+            return -1;
+        }
+        ktls &= s == pair[1] && a.ktls;
+        total += mbps;
+        if (mbps > best)
+            best = mbps;
+    }
+    printf("%-12s %10.1f MB/s average, %10.1f MB/s best\n", title, total / rounds, best);
+    if (tls == 2 && !ktls)
+        printf("%-12s the kernel did not take the keys (is the tls module loaded?), "
+            "so this is TLS in user space too\n", "");
+    return 0;
+}
+
+// TLS in user space if `ktls` is 0
+static int setup(int ktls, const char *cert, const char *key)
+{
+    setenv(ENV_TLS_KTLS, ktls ? "1" : "0", 1);
+    return tls_server_init(cert, key) || tls_client_init(cert);
+}
+
+int main(int argc, char **argv)
+{
+    setbuf(stdout, 0);
+    signal(SIGPIPE, SIG_IGN);
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <file> [rounds]\n", argv[0]);
+        return -1;
+    }
+    const int rounds = argc > 2 ? atoi(argv[2]) : 5;
+    const char *cert = getenv(ENV_TLS_CERT) ? getenv(ENV_TLS_CERT) : "nfh.crt";
+    const char *key = getenv(ENV_TLS_KEY) ? getenv(ENV_TLS_KEY) : "nfh.key";
+    struct stat st;
+    if (stat(argv[1], &st) || !S_ISREG(st.st_mode) || rounds < 1)
+    {
+        fprintf(stderr, "Cannot use %s.\n", argv[1]);
+        return -1;
+    }
+    printf("%" PRIu64 " bytes, %d rounds:\n", (uint64_t)st.st_size, rounds);
+    int r = measure("plaintext", 0, argv[1], st.st_size, rounds)
+        || setup(0, cert, key) || measure("tls (user)", 1, argv[1], st.st_size, rounds)
+        || setup(1, cert, key) || measure("tls (kernel)", 2, argv[1], st.st_size, rounds);
+    unlink(OUTPUT_FILE);
+    return r;
+}
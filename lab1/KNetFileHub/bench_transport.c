@@ -0,0 +1,135 @@
+/******************************************
+ *     Same-host Transport Throughput      *
+ ******************************************/
+
+/*
+ * Sends a file between two threads the way the server and the client do it,
+ * over TCP loopback and over a UNIX domain socket with every local method,
+ * and prints the throughput of each.
+ * Usage: bench_transport <file> [rounds]    (default 5 rounds)
+ * The file is read from the page cache after the first round, so this
+ * measures the transport, not the disk.
+ */
+
+#include "nfh.h"
+#include "util.h"
+#include "transport.h"
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/un.h>
+
+#define OUTPUT_FILE "bench_transport.out"
+#define SOCKET_PATH "bench_transport.sock"
+
+struct sender_arg
+{
+    int socket;
+    const char *path;
+    int result;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *sender(void *arg)
+{
+    struct sender_arg *a = arg;
+    FILE *fp = fopen(a->path, "rb");
+    a->result = !fp || send_file_ex(a->socket, fp, NULL, TRANSFER_QUIET);
+    if (fp)
+        fclose(fp);
+    return NULL;
+}
+
+// a connected pair of sockets, over TCP loopback or a UNIX domain socket
+static int make_pair(int local, int pair[2])
+{
+    if (local)
+    {
+        // a socketpair is not a local transport, connect to a path like a client does
+        int l = transport_listen_local(SOCKET_PATH);
+        if (l < 0 || (pair[0] = transport_connect(TRANSPORT_UNIX_PREFIX SOCKET_PATH, 0)) < 0
+            || (pair[1] = accept(l, NULL, NULL)) < 0)
+            return -1;
+        close(l);
+        unlink(SOCKET_PATH);
+        return 0;
+    }
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(addr);
+    int l = socket(AF_INET, SOCK_STREAM, 0);
+    if (l < 0 || bind(l, (struct sockaddr *)&addr, sizeof(addr)) || listen(l, 1)
+        || getsockname(l, (struct sockaddr *)&addr, &len)
+        || (pair[0] = socket(AF_INET, SOCK_STREAM, 0)) < 0
+        || connect(pair[0], (struct sockaddr *)&addr, sizeof(addr))
+        || (pair[1] = accept(l, NULL, NULL)) < 0)
+    {
+        perror("Cannot connect over loopback");
+        return -1;
+    }
+    close(l);
+    return 0;
+}
+
+static int measure(const char *title, int local, const char *method, const char *path, uint64_t size, int rounds)
+{
+    if (method)
+        setenv(ENV_LOCAL_TRANSPORT, method, 1);
+    double best = 0, total = 0;
+    for (int i = 0; i < rounds; ++i)
+    {
+        int pair[2];
+        FILE *out = fopen(OUTPUT_FILE, "wb");
+        if (!out || make_pair(local, pair))
+            return -1;
+        struct sender_arg a = { pair[0], path, 0 };
+        pthread_t tid;
+        const uint64_t t0 = now_ns();
+        pthread_create(&tid, NULL, &sender, &a);
+        int r = receive_file_ex(pair[1], out, size, NULL, TRANSFER_QUIET);
+        pthread_join(tid, NULL);
+        fflush(out);
+        const double mbps = size / 1E6 / ((now_ns() - t0) / 1E9);
+        fclose(out);
+        close(pair[0]);
+        close(pair[1]);
+        if (r || a.result)
+        {
+            fprintf(stderr, "%s: transfer failed.\n", title);
+            return -1;
+        }
+        total += mbps;
+        if (mbps > best)
+            best = mbps;
+    }
+    printf("%-12s %10.1f MB/s average, %10.1f MB/s best\n", title, total / rounds, best);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    setbuf(stdout, 0);
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <file> [rounds]\n", argv[0]);
+        return -1;
+    }
+    const int rounds = argc > 2 ? atoi(argv[2]) : 5;
+    struct stat st;
+    if (stat(argv[1], &st) || !S_ISREG(st.st_mode) || rounds < 1)
+    {
+        fprintf(stderr, "Cannot use %s.\n", argv[1]);
+        return -1;
+    }
+    printf("%" PRIu64 " bytes, %d rounds:\n", (uint64_t)st.st_size, rounds);
+    int r = measure("tcp", 0, NULL, argv[1], st.st_size, rounds)
+        || measure("unix stream", 1, "stream", argv[1], st.st_size, rounds)
+        || measure("unix shm", 1, "shm", argv[1], st.st_size, rounds)
+        || measure("unix fd", 1, "fd", argv[1], st.st_size, rounds);
+    unlink(OUTPUT_FILE);
+    return r;
+}
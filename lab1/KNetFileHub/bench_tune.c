@@ -0,0 +1,147 @@
+/******************************************
+ *      TCP Auto-tuning Throughput         *
+ ******************************************/
+
+/*
+ * Sends a file over TCP loopback the way the server and the client do it,
+ * with fixed chunks and the kernel's buffers, then with the auto-tuner, at
+ * every given round-trip time, and prints the throughput of each and the
+ * tuner's decisions.
+ * Usage: bench_tune <file> [rtt in ms]...    (default 0 10 50 100)
+ * RTTs are emulated with netem on the loopback device (as root, needs the
+ * sch_netem module), which is removed afterwards. RTTs that can't be
+ * emulated are skipped.
+ */
+
+#include "nfh.h"
+#include "util.h"
+#include <pthread.h>
+
+#define OUTPUT_FILE "bench_tune.out"
+#define ROUNDS 3
+
+struct sender_arg
+{
+    int socket;
+    const char *path;
+    int result;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *sender(void *arg)
+{
+    struct sender_arg *a = arg;
+    FILE *fp = fopen(a->path, "rb");
+    a->result = !fp || send_file_ex(a->socket, fp, NULL, TRANSFER_QUIET);
+    if (fp)
+        fclose(fp);
+    return NULL;
+}
+
+static int make_pair(int pair[2])
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(addr);
+    int l = socket(AF_INET, SOCK_STREAM, 0);
+    if (l < 0 || bind(l, (struct sockaddr *)&addr, sizeof(addr)) || listen(l, 1)
+        || getsockname(l, (struct sockaddr *)&addr, &len)
+        || (pair[0] = socket(AF_INET, SOCK_STREAM, 0)) < 0
+        || connect(pair[0], (struct sockaddr *)&addr, sizeof(addr))
+        || (pair[1] = accept(l, NULL, NULL)) < 0)
+    {
+        perror("Cannot connect over loopback");
+        return -1;
+    }
+    close(l);
+    tcp_set_congestion(pair[0], getenv(ENV_TCP_CC));
+    tcp_set_congestion(pair[1], getenv(ENV_TCP_CC));
+    return 0;
+}
+
+static double measure(const char *path, uint64_t size, int tuned)
+{
+    setenv(ENV_TCP_AUTOTUNE, tuned ? "1" : "0", 1);
+    double best = 0;
+    for (int i = 0; i < ROUNDS; ++i)
+    {
+        int pair[2];
+        FILE *out = fopen(OUTPUT_FILE, "wb");
+        if (!out || make_pair(pair))
+            return -1;
+        struct sender_arg a = { pair[0], path, 0 };
+        pthread_t tid;
+        const uint64_t t0 = now_ns();
+        pthread_create(&tid, NULL, &sender, &a);
+        int r = receive_file_ex(pair[1], out, size, NULL, TRANSFER_QUIET);
+        pthread_join(tid, NULL);
+        fflush(out);
+        const double mbps = size / 1E6 / ((now_ns() - t0) / 1E9);
+        fclose(out);
+        close(pair[0]);
+        close(pair[1]);
+        if (r || a.result)
+        {
+            fprintf(stderr, "Transfer failed.\n");
+            return -1;
+        }
+        if (mbps > best)
+            best = mbps;
+    }
+    return best;
+}
+
+// delay every packet on lo by half the RTT, so both directions add up to it
+static int emulate_rtt(int rtt_ms)
+{
+    char cmd[128];
+    if (!rtt_ms)
+        return system("tc qdisc del dev lo root 2>/dev/null"), 0;
+    snprintf(cmd, sizeof(cmd), "tc qdisc replace dev lo root netem delay %.1fms limit 100000", rtt_ms / 2.0);
+    return system(cmd);
+}
+
+int main(int argc, char **argv)
+{
+    setbuf(stdout, 0);
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <file> [rtt in ms]...\n", argv[0]);
+        return -1;
+    }
+    struct stat st;
+    if (stat(argv[1], &st) || !S_ISREG(st.st_mode))
+    {
+        fprintf(stderr, "Cannot use %s.\n", argv[1]);
+        return -1;
+    }
+    int default_rtts[] = {0, 10, 50, 100};
+    const int count = argc > 2 ? argc - 2 : sizeof(default_rtts) / sizeof(*default_rtts);
+    printf("%" PRIu64 " bytes, best of %d rounds, congestion control %s:\n", (uint64_t)st.st_size, ROUNDS,
+        getenv(ENV_TCP_CC) ? getenv(ENV_TCP_CC) : "default");
+    int r = 0;
+    for (int i = 0; i < count && !r; ++i)
+    {
+        const int rtt = argc > 2 ? atoi(argv[i + 2]) : default_rtts[i];
+        if (emulate_rtt(rtt))
+        {
+            printf("rtt %4dms: cannot emulate (needs root and netem), skipped\n", rtt);
+            continue;
+        }
+        const double fixed = measure(argv[1], st.st_size, 0);
+        const double tuned = fixed < 0 ? -1 : measure(argv[1], st.st_size, 1);
+        if (tuned < 0)
+            r = -1;
+        else
+            printf("rtt %4dms: fixed %10.1f MB/s, tuned %10.1f MB/s, %.2fx\n", rtt, fixed, tuned, tuned / fixed);
+    }
+    emulate_rtt(0);
+    unlink(OUTPUT_FILE);
+    tcp_tune_print_stats(stdout);
+    return r;
+}
@@ -0,0 +1,533 @@
+/*************************************
+ *  Bandwidth Scheduler (DRR + TBF)  *
+ *************************************/
+
+#include "bwsched.h"
+#include "util.h"
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+
+#define BW_UNLIMITED_ROOM ((double)SIZE_MAX)
+
+struct bw_bucket
+{
+    char peer[BW_MAX_PEER_NAME + 1]; // client address
+    uint64_t rate;                   // bytes per second, 0 = unlimited
+    int pinned;                      // rate is set by `client <addr> <rate>`, the default rate does not apply
+    int refs;                        // open sessions using this bucket
+    double tokens;
+    struct timespec ts_refill;
+    uint64_t bytes;                  // bytes granted in total
+    struct bw_bucket *next;
+};
+
+struct bw_session
+{
+    struct bw_bucket *bucket;
+    size_t want;                     // bytes the blocked transfer asks for, 0 if not waiting
+    size_t granted;                  // bytes handed out by the dispatcher, not yet taken
+    uint64_t deficit;                // DRR deficit counter
+    uint64_t bytes;                  // bytes granted in total
+    bw_session *prev, *next;         // ring of open sessions
+};
+
+static pthread_mutex_t bw_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bw_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t global_rate = BW_RATE_UNLIMITED;
+static uint64_t default_client_rate = BW_RATE_UNLIMITED;
+static double global_tokens;
+static struct timespec global_ts_refill;
+static uint64_t global_bytes;
+static struct bw_bucket *buckets;    // all known client buckets
+static bw_session *cursor;           // DRR position in the session ring
+static int session_count;
+
+static double __bw_burst(uint64_t rate)
+{
+    // allow 250ms worth of traffic to pile up, but never less than two quanta
+    double b = rate / 4.0;
+    return b < 2.0 * BW_QUANTUM ? 2.0 * BW_QUANTUM : b;
+}
+
+static void __bw_refill(double *tokens, uint64_t rate, struct timespec *last, const struct timespec *now)
+{
+    if (rate != BW_RATE_UNLIMITED)
+    {
+        double dt = (now->tv_sec - last->tv_sec) + (now->tv_nsec - last->tv_nsec) / 1.0E9;
+        if (dt > 0)
+            *tokens += rate * dt;
+        double burst = __bw_burst(rate);
+        if (*tokens > burst)
+            *tokens = burst;
+    }
+    *last = *now;
+}
+
+static double __bw_room(double tokens, uint64_t rate)
+{
+    return rate == BW_RATE_UNLIMITED ? BW_UNLIMITED_ROOM : tokens;
+}
+
+static void __bw_set_rate(struct bw_bucket *b, uint64_t rate)
+{
+    if (b->rate == rate)
+        return;
+    __atomic_store_n(&b->rate, rate, __ATOMIC_RELAXED); // read without the lock by bw_acquire()
+    // don't let a rate change hand out a burst of the old rate
+    if (b->tokens > __bw_burst(rate))
+        b->tokens = __bw_burst(rate);
+}
+
+static struct bw_bucket *__bw_find_bucket(const char *peer)
+{
+    for (struct bw_bucket *b = buckets; b; b = b->next)
+    {
+        if (!strcmp(b->peer, peer))
+            return b;
+    }
+    return NULL;
+}
+
+static struct bw_bucket *__bw_new_bucket(const char *peer)
+{
+    struct bw_bucket *b = calloc(1, sizeof(struct bw_bucket));
+    if (!b)
+        return NULL;
+    strncpy(b->peer, peer, BW_MAX_PEER_NAME);
+    b->rate = default_client_rate;
+    clock_gettime(CLOCK_MONOTONIC, &b->ts_refill);
+    b->next = buckets;
+    buckets = b;
+    return b;
+}
+
+static void __bw_drop_bucket_if_unused(struct bw_bucket *victim)
+{
+    if (victim->refs || victim->pinned)
+        return;
+    struct bw_bucket **pp = &buckets;
+    while (*pp && *pp != victim)
+        pp = &(*pp)->next;
+    if (*pp)
+    {
+        *pp = victim->next;
+        free(victim);
+    }
+}
+
+// nothing to schedule: the counters are bumped and no lock is taken
+static int __bw_unlimited(bw_session *s)
+{
+    return __atomic_load_n(&global_rate, __ATOMIC_RELAXED) == BW_RATE_UNLIMITED
+        && __atomic_load_n(&s->bucket->rate, __ATOMIC_RELAXED) == BW_RATE_UNLIMITED;
+}
+
+static void __bw_count(bw_session *s, size_t n)
+{
+    __atomic_add_fetch(&s->bytes, n, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->bucket->bytes, n, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&global_bytes, n, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Hand out available tokens to waiting sessions in deficit round robin order.
+ *        Must be called with `bw_lock` held.
+ *
+ * @return int 1 if anything was granted, 0 otherwise.
+ */
+static int __bw_dispatch(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    __bw_refill(&global_tokens, global_rate, &global_ts_refill, &now);
+    for (struct bw_bucket *b = buckets; b; b = b->next)
+        __bw_refill(&b->tokens, b->rate, &b->ts_refill, &now);
+
+    int any = 0, granted;
+    do
+    {
+        // one DRR round: visit every session once, starting from the cursor
+        granted = 0;
+        for (int i = 0; i < session_count; ++i)
+        {
+            bw_session *p = cursor;
+            cursor = cursor->next;
+            if (!p->want)
+            {
+                p->deficit = 0; // idle flows don't keep their deficit
+                continue;
+            }
+            if (p->granted)
+                continue; // hasn't taken the last grant yet
+
+            struct bw_bucket *b = p->bucket;
+            double room = __bw_room(global_tokens, global_rate);
+            double bucket_room = __bw_room(b->tokens, b->rate);
+            if (bucket_room < room)
+                room = bucket_room;
+
+            size_t n;
+            if (room == BW_UNLIMITED_ROOM)
+            {
+                // nothing to share, give it all
+                n = p->want;
+            }
+            else
+            {
+                const size_t floor = p->want < BW_MIN_GRANT ? p->want : BW_MIN_GRANT;
+                if (room < floor)
+                    continue; // the deficit only grows while the flow could be served
+                p->deficit += BW_QUANTUM;
+                n = p->want;
+                if (n > p->deficit)
+                    n = p->deficit;
+                if (n > room)
+                    n = (size_t)room;
+                if (n < floor)
+                    continue;
+                p->deficit -= n;
+            }
+
+            p->granted = n;
+            if (global_rate != BW_RATE_UNLIMITED)
+                global_tokens -= n;
+            if (b->rate != BW_RATE_UNLIMITED)
+                b->tokens -= n;
+            granted = any = 1;
+        }
+    } while (granted);
+    return any;
+}
+
+/**
+ * @brief Set the total rate of the server.
+ *
+ * @param rate bytes per second, 0 for unlimited.
+ */
+void bw_set_global_rate(uint64_t rate)
+{
+    pthread_mutex_lock(&bw_lock);
+    __atomic_store_n(&global_rate, rate, __ATOMIC_RELAXED); // read without the lock by bw_acquire()
+    if (global_tokens > __bw_burst(rate))
+        global_tokens = __bw_burst(rate);
+    pthread_cond_broadcast(&bw_cond);
+    pthread_mutex_unlock(&bw_lock);
+}
+
+/**
+ * @brief Set the rate of a client address.
+ *
+ * @param peer the client address. If NULL, set the default rate of all
+ *        client addresses which don't have a rate of their own.
+ * @param rate bytes per second, 0 for unlimited.
+ */
+void bw_set_client_rate(const char *peer, uint64_t rate)
+{
+    pthread_mutex_lock(&bw_lock);
+    if (!peer)
+    {
+        default_client_rate = rate;
+        for (struct bw_bucket *b = buckets; b; b = b->next)
+        {
+            if (!b->pinned)
+                __bw_set_rate(b, rate);
+        }
+    }
+    else
+    {
+        struct bw_bucket *b = __bw_find_bucket(peer);
+        if (!b && !(b = __bw_new_bucket(peer)))
+        {
+            fprintf(stderr, "Failed to malloc bucket for %s.\n", peer);
+        }
+        else
+        {
+            b->pinned = 1;
+            __bw_set_rate(b, rate);
+        }
+    }
+    pthread_cond_broadcast(&bw_cond);
+    pthread_mutex_unlock(&bw_lock);
+}
+
+static int __bw_parse_rate(const char *s, uint64_t *rate)
+{
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (errno || end == s)
+        return -1;
+    switch (toupper((unsigned char)*end))
+    {
+        case 'G':
+            v <<= 10;
+            // fall through
+        case 'M':
+            v <<= 10;
+            // fall through
+        case 'K':
+            v <<= 10;
+            ++end;
+            break;
+        case '\0':
+            break;
+        default:
+            return -1;
+    }
+    if (*end)
+        return -1;
+    *rate = v;
+    return 0;
+}
+
+/**
+ * @brief Load rates from a config file, replacing all previously configured rates.
+ *        Safe to call while transfers are running.
+ *
+ * @param path the config file.
+ * @return int 0 if success, non-zero if the file cannot be read or has a bad line.
+ *         Nothing is changed if failed.
+ */
+int bw_load_config(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+    {
+        int errsv = errno;
+        fprintf(stderr, "Cannot open bandwidth config %s [errno %d]: %s\n", path, errsv, strerror(errsv));
+        return -1;
+    }
+
+    // parse everything before applying, so a bad file doesn't leave half of it applied
+    struct bw_rule
+    {
+        char peer[BW_MAX_PEER_NAME + 1];
+        uint64_t rate;
+    } *rules = NULL;
+    int rule_count = 0;
+    uint64_t new_global = BW_RATE_UNLIMITED, new_default = BW_RATE_UNLIMITED;
+    char line[256];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), fp))
+    {
+        ++lineno;
+        char *comment = strchr(line, '#');
+        if (comment)
+            *comment = '\0';
+        char w1[16], w2[BW_MAX_PEER_NAME + 1], w3[32];
+        int n = sscanf(line, "%15s %63s %31s", w1, w2, w3);
+        if (n <= 0)
+            continue; // blank line
+        uint64_t rate;
+        if (n == 2 && !strcmp(w1, "global") && !__bw_parse_rate(w2, &rate))
+        {
+            new_global = rate;
+        }
+        else if (n == 2 && !strcmp(w1, "client") && !__bw_parse_rate(w2, &rate))
+        {
+            new_default = rate;
+        }
+        else if (n == 3 && !strcmp(w1, "client") && !__bw_parse_rate(w3, &rate))
+        {
+            struct bw_rule *r = realloc(rules, sizeof(struct bw_rule) * (rule_count + 1));
+            if (!r)
+            {
+                fprintf(stderr, "Failed to malloc.\n");
+                goto BW_CONF_FAIL;
+            }
+            rules = r;
+            strcpy(rules[rule_count].peer, w2);
+            rules[rule_count++].rate = rate;
+        }
+        else
+        {
+            fprintf(stderr, "Bad bandwidth config at %s:%d.\n", path, lineno);
+BW_CONF_FAIL:
+            free(rules);
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+
+    // forget old per-client rates, then apply the new ones
+    pthread_mutex_lock(&bw_lock);
+    struct bw_bucket *b = buckets;
+    while (b)
+    {
+        struct bw_bucket *next = b->next;
+        b->pinned = 0;
+        __bw_set_rate(b, new_default);
+        __bw_drop_bucket_if_unused(b);
+        b = next;
+    }
+    pthread_mutex_unlock(&bw_lock);
+    bw_set_global_rate(new_global);
+    bw_set_client_rate(NULL, new_default);
+    for (int i = 0; i < rule_count; ++i)
+        bw_set_client_rate(rules[i].peer, rules[i].rate);
+    free(rules);
+    printf("Loaded bandwidth config %s: global %" PRIu64 " B/s, client %" PRIu64 " B/s, %d client rule(s).\n",
+        path, new_global, new_default, rule_count);
+    return 0;
+}
+
+/**
+ * @brief Register a transfer session to the scheduler.
+ *
+ * @param peer the client address, sessions with the same address share one bucket. May be NULL.
+ * @return bw_session* the session. If failed, return NULL.
+ */
+bw_session *bw_session_open(const char *peer)
+{
+    if (!peer)
+        peer = "";
+    bw_session *s = calloc(1, sizeof(bw_session));
+    if (!s)
+        return NULL;
+
+    pthread_mutex_lock(&bw_lock);
+    struct bw_bucket *b = __bw_find_bucket(peer);
+    if (!b && !(b = __bw_new_bucket(peer)))
+    {
+        pthread_mutex_unlock(&bw_lock);
+        free(s);
+        return NULL;
+    }
+    ++b->refs;
+    s->bucket = b;
+
+    // join the ring, right behind the cursor so it is visited last in this round
+    if (!cursor)
+    {
+        s->prev = s->next = s;
+        cursor = s;
+    }
+    else
+    {
+        s->next = cursor;
+        s->prev = cursor->prev;
+        cursor->prev->next = s;
+        cursor->prev = s;
+    }
+    ++session_count;
+    pthread_mutex_unlock(&bw_lock);
+    return s;
+}
+
+/**
+ * @brief Unregister a session. Once closed, the pointer become invalid.
+ *
+ * @param s the session, may be NULL.
+ */
+void bw_session_close(bw_session *s)
+{
+    if (!s)
+        return;
+    pthread_mutex_lock(&bw_lock);
+    if (s->next == s)
+    {
+        cursor = NULL;
+    }
+    else
+    {
+        if (cursor == s)
+            cursor = s->next;
+        s->prev->next = s->next;
+        s->next->prev = s->prev;
+    }
+    --session_count;
+    --s->bucket->refs;
+    __bw_drop_bucket_if_unused(s->bucket);
+    // give our share to the others
+    pthread_cond_broadcast(&bw_cond);
+    pthread_mutex_unlock(&bw_lock);
+    free(s);
+}
+
+/**
+ * @brief Wait until the session is allowed to move some bytes.
+ *
+ * @param s the session. If NULL, the transfer is not throttled.
+ * @param want bytes the caller would like to transfer.
+ * @return size_t bytes the caller may transfer now, 0 < ret <= want (0 only if want is 0).
+ */
+size_t bw_acquire(bw_session *s, size_t want)
+{
+    if (!s || !want)
+        return want;
+    if (__bw_unlimited(s))
+    {
+        __bw_count(s, want);
+        return want;
+    }
+
+    pthread_mutex_lock(&bw_lock);
+    s->want = want;
+    while (1)
+    {
+        if (__bw_dispatch())
+            pthread_cond_broadcast(&bw_cond); // others may have been granted as well
+        if (s->granted)
+            break;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += BW_TICK_NS;
+        if (ts.tv_nsec >= 1000000000L)
+        {
+            ts.tv_nsec -= 1000000000L;
+            ++ts.tv_sec;
+        }
+        pthread_cond_timedwait(&bw_cond, &bw_lock, &ts);
+    }
+    const size_t n = s->granted;
+    s->granted = 0;
+    s->want = 0;
+    __bw_count(s, n);
+    pthread_mutex_unlock(&bw_lock);
+    return n;
+}
+
+/**
+ * @brief Return bytes which were granted but not transferred (e.g. a short read).
+ *
+ * @param s the session, may be NULL.
+ * @param n bytes to return.
+ */
+void bw_refund(bw_session *s, size_t n)
+{
+    if (!s || !n)
+        return;
+    __bw_count(s, -n); // unsigned, wraps back
+    if (__bw_unlimited(s))
+        return;
+    pthread_mutex_lock(&bw_lock);
+    if (global_rate != BW_RATE_UNLIMITED)
+        global_tokens += n;
+    if (s->bucket->rate != BW_RATE_UNLIMITED)
+        s->bucket->tokens += n;
+    pthread_cond_broadcast(&bw_cond);
+    pthread_mutex_unlock(&bw_lock);
+}
+
+/**
+ * @brief Print configured rates and transferred bytes.
+ *
+ * @param fp the file to print to.
+ */
+void bw_print_stats(FILE *fp)
+{
+    pthread_mutex_lock(&bw_lock);
+    fprintf(fp, "[bw] global: rate %" PRIu64 " B/s, %d session(s), %" PRIu64 " bytes.\n",
+        global_rate, session_count, __atomic_load_n(&global_bytes, __ATOMIC_RELAXED));
+    for (struct bw_bucket *b = buckets; b; b = b->next)
+    {
+        fprintf(fp, "[bw] client %s: rate %" PRIu64 " B/s%s, %d session(s), %" PRIu64 " bytes.\n",
+            *b->peer ? b->peer : "<unknown>", b->rate, b->pinned ? " (pinned)" : "", b->refs,
+            __atomic_load_n(&b->bytes, __ATOMIC_RELAXED));
+    }
+    pthread_mutex_unlock(&bw_lock);
+}
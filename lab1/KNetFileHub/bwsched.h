@@ -0,0 +1,52 @@
+#ifndef __BWSCHED_H
+#define __BWSCHED_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* configurations */
+#define BW_QUANTUM 65536U     /* DRR quantum, also the largest grant when throttled */
+#define BW_MIN_GRANT 4096U    /* don't wake a transfer up for less than this */
+#define BW_TICK_NS 5000000L   /* 5ms, how long a throttled transfer sleeps before re-checking */
+#define BW_MAX_PEER_NAME 63
+#define BW_RATE_UNLIMITED 0
+
+/*
+
+Bandwidth Scheduler:
+    Every transfer asks the scheduler for permission before moving bytes
+    through the socket (`bw_acquire`). Two levels of token buckets apply:
+        1. The global bucket, which caps the whole server.
+        2. One bucket per client address, shared by all sessions
+           coming from the same peer.
+    When the global bucket is the bottleneck, the available tokens are
+    handed out in deficit round robin order over the sessions which are
+    waiting, so an idle or client-capped session never holds bandwidth
+    the other transfers could use. While neither the global nor the
+    client rate is set, `bw_acquire` grants at once without taking the
+    scheduler lock, so unlimited sessions don't contend for it.
+    All rates are in bytes per second, 0 means unlimited. Rates can be
+    changed at any time, they take effect from the next grant.
+
+Config file (see `bw_load_config`), one directive per line:
+    global <rate>          total rate of the server
+    client <rate>          default rate of each client address
+    client <addr> <rate>   rate of one specific client address
+    Rates accept K/M/G suffixes (powers of 1024). `#` starts a comment.
+
+*/
+
+typedef struct bw_session bw_session;
+
+void bw_set_global_rate(uint64_t rate);
+void bw_set_client_rate(const char *peer, uint64_t rate);
+int bw_load_config(const char *path);
+bw_session *bw_session_open(const char *peer);
+void bw_session_close(bw_session *s);
+size_t bw_acquire(bw_session *s, size_t want);
+void bw_refund(bw_session *s, size_t n);
+void bw_print_stats(FILE *fp);
+
+#endif
@@ -0,0 +1,787 @@
+/*************************************
+ *   Content-defined Chunk Storage    *
+ *************************************/
+
+#define _GNU_SOURCE
+#include "chunkstore.h"
+#include "nfh.h"
+#include "util.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <openssl/evp.h>
+
+#define CHUNK_PACK_LOST UINT32_MAX /* in memory: writing the chunk failed */
+
+struct chunked_storage
+{
+    storage base;
+    char *root;
+    storage *recipes;
+    EVP_MD *sha256;                   // fetched once, not per chunk
+    pthread_mutex_t lock;             // the index and the packs
+    // the chunk index, open addressing
+    struct chunk_index_record *slots;
+    size_t slot_count, count;
+    int index_fd;
+    // packs, the last one is appended to
+    int *pack_fds;
+    uint32_t pack_count;
+    uint64_t pack_size;               // of the last pack
+    // since startup
+    uint64_t logical_bytes, stored_bytes;
+};
+
+// an upload being chunked, the cookie of its stream
+struct chunk_ingest
+{
+    struct chunked_storage *cs;
+    struct staged_file recipe;
+    EVP_MD_CTX *md;
+    uint8_t *buf;                     // incoming bytes not chunked yet
+    size_t buffered;
+    uint8_t *batch;                   // new chunks not written yet
+    size_t batch_size;
+    struct chunk_ref *pending;        // the chunks in the batch
+    size_t pending_count;
+    uint64_t size, chunks, new_chunks, new_bytes;
+    uint64_t cpu_ns;                  // spent on chunking, hashing and storing
+    int failed;
+};
+
+// a download being reconstructed, the cookie of its stream
+struct chunk_reader
+{
+    struct chunked_storage *cs;
+    FILE *recipe;
+    uint64_t chunks_left;             // in the recipe, not resolved yet
+    struct chunk_index_record window[CHUNK_READAHEAD];
+    size_t window_pos, window_count;
+    uint8_t *data;                    // chunks read, not consumed yet
+    size_t data_pos, data_size;
+};
+
+static uint64_t gear[256], gear_ls[256];
+
+static void __cdc_init_gear(void)
+{
+    // splitmix64, so every build and every run cuts at the same points
+    uint64_t x = CHUNK_GEAR_SEED;
+    for (int i = 0; i < 256; ++i)
+    {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+        gear_ls[i] = gear[i] << 1;
+    }
+}
+
+/**
+ * @brief Find the first cut point of a buffer.
+ *
+ * @param p the data.
+ * @param n bytes of data, at least CHUNK_MAX_SIZE unless it is the end of the file.
+ * @return size_t the length of the first chunk.
+ */
+static size_t __cdc_cut(const uint8_t *p, size_t n)
+{
+    if (n <= CHUNK_MIN_SIZE)
+        return n;
+    if (n > CHUNK_MAX_SIZE)
+        n = CHUNK_MAX_SIZE;
+    const size_t normal = n < CHUNK_AVG_SIZE ? n : CHUNK_AVG_SIZE;
+    uint64_t fp = 0;
+    size_t i = CHUNK_MIN_SIZE;
+    // two bytes per step: (fp << 2) + (gear[a] << 1) + gear[b] is two single-byte steps
+    for (; i + 2 <= normal; i += 2)
+    {
+        fp = (fp << 2) + gear_ls[p[i]];
+        if (!(fp & (CHUNK_MASK_S << 1)))
+            return i + 1;
+        fp += gear[p[i + 1]];
+        if (!(fp & CHUNK_MASK_S))
+            return i + 2;
+    }
+    for (; i + 2 <= n; i += 2)
+    {
+        fp = (fp << 2) + gear_ls[p[i]];
+        if (!(fp & (CHUNK_MASK_L << 1)))
+            return i + 1;
+        fp += gear[p[i + 1]];
+        if (!(fp & CHUNK_MASK_L))
+            return i + 2;
+    }
+    return n;
+}
+
+static uint64_t __thread_cpu_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* ---------------- index and packs ---------------- */
+
+static uint64_t __chunk_key(const uint8_t *hash)
+{
+    uint64_t k;
+    memcpy(&k, hash, sizeof(k));
+    return k;
+}
+
+static struct chunk_index_record *__chunk_find(struct chunked_storage *cs, const uint8_t *hash)
+{
+    if (!cs->slot_count)
+        return NULL;
+    const size_t mask = cs->slot_count - 1;
+    for (size_t i = __chunk_key(hash) & mask; cs->slots[i].length; i = (i + 1) & mask)
+    {
+        if (!memcmp(cs->slots[i].hash, hash, CHUNK_HASH_SIZE))
+            return &cs->slots[i];
+    }
+    return NULL;
+}
+
+static int __chunk_insert(struct chunked_storage *cs, const struct chunk_index_record *r)
+{
+    if ((cs->count + 1) * 2 > cs->slot_count)
+    {
+        // keep the load factor <= 1/2
+        const size_t new_count = cs->slot_count ? cs->slot_count * 2 : 65536;
+        struct chunk_index_record *slots = calloc(new_count, sizeof(struct chunk_index_record));
+        if (!slots)
+        {
+            fprintf(stderr, "Failed to malloc.\n");
+            return -1;
+        }
+        for (size_t i = 0; i < cs->slot_count; ++i)
+        {
+            if (!cs->slots[i].length)
+                continue;
+            size_t j = __chunk_key(cs->slots[i].hash) & (new_count - 1);
+            while (slots[j].length)
+                j = (j + 1) & (new_count - 1);
+            slots[j] = cs->slots[i];
+        }
+        free(cs->slots);
+        cs->slots = slots;
+        cs->slot_count = new_count;
+    }
+    size_t i = __chunk_key(r->hash) & (cs->slot_count - 1);
+    while (cs->slots[i].length)
+        i = (i + 1) & (cs->slot_count - 1);
+    cs->slots[i] = *r;
+    ++cs->count;
+    return 0;
+}
+
+static int __chunk_open_pack(struct chunked_storage *cs, uint32_t pack, int create)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/" CHUNK_PACK_FORMAT, cs->root, pack);
+    int fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0644);
+    if (fd < 0)
+        return -1;
+    int *fds = realloc(cs->pack_fds, (pack + 1) * sizeof(int));
+    if (!fds)
+    {
+        close(fd);
+        return -1;
+    }
+    cs->pack_fds = fds;
+    cs->pack_fds[pack] = fd;
+    cs->pack_count = pack + 1;
+    return 0;
+}
+
+static int __chunk_load(struct chunked_storage *cs)
+{
+    // every pack, until the first missing one
+    uint64_t *pack_sizes = NULL;
+    struct stat a;
+    while (!__chunk_open_pack(cs, cs->pack_count, 0))
+    {
+        uint64_t *sizes = realloc(pack_sizes, cs->pack_count * sizeof(uint64_t));
+        if (!sizes || fstat(cs->pack_fds[cs->pack_count - 1], &a))
+        {
+            free(sizes ? sizes : pack_sizes);
+            return -1;
+        }
+        pack_sizes = sizes;
+        pack_sizes[cs->pack_count - 1] = a.st_size;
+    }
+    if (errno != ENOENT || (!cs->pack_count && __chunk_open_pack(cs, 0, 1)))
+    {
+        free(pack_sizes);
+        return -1;
+    }
+    cs->pack_size = pack_sizes ? pack_sizes[cs->pack_count - 1] : 0;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/" CHUNK_INDEX_FILE, cs->root);
+    if ((cs->index_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0 || fstat(cs->index_fd, &a))
+    {
+        free(pack_sizes);
+        return -1;
+    }
+    FILE *fp = fdopen(dup(cs->index_fd), "rb");
+    if (!fp)
+    {
+        free(pack_sizes);
+        return -1;
+    }
+    struct chunk_index_record r;
+    uint64_t records = 0, dropped = 0;
+    int failed = 0;
+    while (!failed && fread(&r, sizeof(r), 1, fp) == 1)
+    {
+        ++records;
+        if (r.pack >= cs->pack_count || !r.length || r.offset + r.length > pack_sizes[r.pack])
+            ++dropped; // the data never made it to the pack
+        else if (!__chunk_find(cs, r.hash))
+            failed = __chunk_insert(cs, &r);
+    }
+    failed |= ferror(fp);
+    fclose(fp);
+    free(pack_sizes);
+    // cut off a torn record, so appended records stay aligned
+    if (failed || ftruncate(cs->index_fd, records * sizeof(r)) || lseek(cs->index_fd, 0, SEEK_END) < 0)
+        return -1;
+    if (dropped)
+        fprintf(stderr, "Dropped %" PRIu64 " chunk records without data.\n", dropped);
+    return 0;
+}
+
+/**
+ * @brief Write the new chunks of an upload to the last pack, and index them.
+ *
+ * @param in the upload.
+ * @return int 0 if success, non-zero if failed.
+ */
+static int __chunk_flush_batch(struct chunk_ingest *in)
+{
+    struct chunked_storage *cs = in->cs;
+    struct iovec iov[CHUNK_BATCH_SIZE / CHUNK_MIN_SIZE + 1];
+    struct chunk_index_record records[CHUNK_BATCH_SIZE / CHUNK_MIN_SIZE + 1];
+    int n = 0, r = 0;
+    if (!in->pending_count)
+        return 0;
+
+    pthread_mutex_lock(&cs->lock);
+    if (cs->pack_size + in->batch_size > CHUNK_PACK_MAX_SIZE)
+    {
+        // the full pack is synced now, the new one when the upload is published
+        if (fdatasync(cs->pack_fds[cs->pack_count - 1]) || __chunk_open_pack(cs, cs->pack_count, 1))
+        {
+            perror("Cannot start a new pack");
+            r = -1;
+            goto FLUSH_END;
+        }
+        cs->pack_size = 0;
+    }
+    uint64_t offset = cs->pack_size;
+    size_t pos = 0;
+    for (size_t i = 0; i < in->pending_count; ++i)
+    {
+        const struct chunk_ref *ref = &in->pending[i];
+        // another upload (or this batch) may have stored it meanwhile
+        struct chunk_index_record *known = __chunk_find(cs, ref->hash);
+        if (!known || known->pack == CHUNK_PACK_LOST)
+        {
+            struct chunk_index_record *rec = &records[n];
+            memcpy(rec->hash, ref->hash, CHUNK_HASH_SIZE);
+            rec->pack = cs->pack_count - 1;
+            rec->length = ref->length;
+            rec->offset = offset;
+            iov[n].iov_base = in->batch + pos;
+            iov[n].iov_len = ref->length;
+            offset += ref->length;
+            if (known)
+                *known = *rec;
+            else if (__chunk_insert(cs, rec))
+            {
+                r = -1;
+                goto FLUSH_END;
+            }
+            ++n;
+            ++in->new_chunks;
+            in->new_bytes += ref->length;
+        }
+        pos += ref->length;
+    }
+    if (n)
+    {
+        const ssize_t want = offset - cs->pack_size;
+        if (pwritev(cs->pack_fds[cs->pack_count - 1], iov, n, cs->pack_size) != want
+            || write(cs->index_fd, records, n * sizeof(struct chunk_index_record))
+                != n * sizeof(struct chunk_index_record))
+        {
+            // the index entries in memory point to nothing now
+            perror("Cannot store chunks");
+            for (int i = 0; i < n; ++i)
+                __chunk_find(cs, records[i].hash)->pack = CHUNK_PACK_LOST;
+            in->failed = 1;
+            r = -1;
+            goto FLUSH_END;
+        }
+        cs->pack_size = offset;
+        cs->stored_bytes += want;
+    }
+FLUSH_END:
+    pthread_mutex_unlock(&cs->lock);
+    in->batch_size = 0;
+    in->pending_count = 0;
+    return r;
+}
+
+/* ---------------- ingest ---------------- */
+
+static int __chunk_add(struct chunk_ingest *in, const uint8_t *data, size_t length)
+{
+    struct chunk_ref ref = { .length = length };
+    unsigned int md_len;
+    if (!EVP_DigestInit_ex(in->md, in->cs->sha256, NULL) || !EVP_DigestUpdate(in->md, data, length)
+        || !EVP_DigestFinal_ex(in->md, ref.hash, &md_len))
+    {
+        fprintf(stderr, "Cannot hash chunk.\n");
+        return -1;
+    }
+    if (fwrite(&ref, sizeof(ref), 1, in->recipe.fp) != 1)
+        return -1;
+    ++in->chunks;
+    in->size += length;
+
+    pthread_mutex_lock(&in->cs->lock);
+    const struct chunk_index_record *r = __chunk_find(in->cs, ref.hash);
+    const int known = r && r->pack != CHUNK_PACK_LOST;
+    pthread_mutex_unlock(&in->cs->lock);
+    if (known)
+        return 0;
+    if (in->batch_size + length > CHUNK_BATCH_SIZE && __chunk_flush_batch(in))
+        return -1;
+    memcpy(in->batch + in->batch_size, data, length);
+    in->batch_size += length;
+    in->pending[in->pending_count++] = ref;
+    return 0;
+}
+
+// chunk what is buffered, keeping a tail which may be cut differently once more data arrives
+static int __chunk_consume(struct chunk_ingest *in, int eof)
+{
+    size_t pos = 0;
+    while (in->buffered - pos >= CHUNK_MAX_SIZE || (eof && pos < in->buffered))
+    {
+        const size_t n = __cdc_cut(in->buf + pos, in->buffered - pos);
+        if (__chunk_add(in, in->buf + pos, n))
+            return -1;
+        pos += n;
+    }
+    memmove(in->buf, in->buf + pos, in->buffered - pos);
+    in->buffered -= pos;
+    return 0;
+}
+
+static ssize_t __ingest_write(void *cookie, const char *buf, size_t size)
+{
+    struct chunk_ingest *in = cookie;
+    const uint64_t t0 = __thread_cpu_ns();
+    size_t done = 0;
+    while (!in->failed && done < size)
+    {
+        size_t k = CHUNK_INGEST_BUFFER + CHUNK_MAX_SIZE - in->buffered;
+        if (k > size - done)
+            k = size - done;
+        memcpy(in->buf + in->buffered, buf + done, k);
+        in->buffered += k;
+        done += k;
+        if (in->buffered >= CHUNK_INGEST_BUFFER && __chunk_consume(in, 0))
+            in->failed = 1;
+    }
+    in->cpu_ns += __thread_cpu_ns() - t0;
+    if (in->failed)
+    {
+        errno = EIO;
+        return 0;
+    }
+    return size;
+}
+
+static void __ingest_free(struct chunk_ingest *in)
+{
+    if (in->recipe.fp || in->recipe.fd >= 0)
+        staged_abort(&in->recipe);
+    EVP_MD_CTX_free(in->md);
+    free(in->buf);
+    free(in->batch);
+    free(in->pending);
+    free(in);
+}
+
+static int __ingest_close(void *cookie)
+{
+    // published or not, the upload is over
+    __ingest_free(cookie);
+    return 0;
+}
+
+/* ---------------- download ---------------- */
+
+// resolve the next chunks of the recipe, and let the kernel start reading them
+static int __reader_fill_window(struct chunk_reader *rd)
+{
+    struct chunk_ref refs[CHUNK_READAHEAD];
+    size_t n = rd->chunks_left < CHUNK_READAHEAD ? rd->chunks_left : CHUNK_READAHEAD;
+    if (fread(refs, sizeof(struct chunk_ref), n, rd->recipe) != n)
+        return -1;
+    rd->chunks_left -= n;
+    pthread_mutex_lock(&rd->cs->lock);
+    for (size_t i = 0; i < n; ++i)
+    {
+        const struct chunk_index_record *r = __chunk_find(rd->cs, refs[i].hash);
+        if (!r || r->pack >= rd->cs->pack_count || r->length != refs[i].length)
+        {
+            pthread_mutex_unlock(&rd->cs->lock);
+            fprintf(stderr, "Chunk of %" PRIu32 " bytes is missing from the store.\n", refs[i].length);
+            return -1;
+        }
+        rd->window[i] = *r;
+    }
+    pthread_mutex_unlock(&rd->cs->lock);
+    rd->window_pos = 0;
+    rd->window_count = n;
+
+    // one advice per run of adjacent chunks
+    for (size_t i = 0, j; i < n; i = j)
+    {
+        uint64_t end = rd->window[i].offset + rd->window[i].length;
+        for (j = i + 1; j < n && rd->window[j].pack == rd->window[i].pack && rd->window[j].offset == end; ++j)
+            end += rd->window[j].length;
+        posix_fadvise(rd->cs->pack_fds[rd->window[i].pack], rd->window[i].offset,
+            end - rd->window[i].offset, POSIX_FADV_WILLNEED);
+    }
+    return 0;
+}
+
+static int __reader_fill_data(struct chunk_reader *rd)
+{
+    if (rd->window_pos == rd->window_count && __reader_fill_window(rd))
+        return -1;
+    // adjacent chunks are read at once
+    const struct chunk_index_record *first = &rd->window[rd->window_pos];
+    size_t size = first->length;
+    size_t j = rd->window_pos + 1;
+    for (; j < rd->window_count && rd->window[j].pack == first->pack
+        && rd->window[j].offset == first->offset + size && size + rd->window[j].length <= CHUNK_READ_SIZE; ++j)
+        size += rd->window[j].length;
+    for (size_t got = 0; got < size; )
+    {
+        ssize_t r = pread(rd->cs->pack_fds[first->pack], rd->data + got, size - got, first->offset + got);
+        if (r <= 0)
+        {
+            if (r < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        got += r;
+    }
+    rd->window_pos = j;
+    rd->data_pos = 0;
+    rd->data_size = size;
+    return 0;
+}
+
+static ssize_t __reader_read(void *cookie, char *buf, size_t size)
+{
+    struct chunk_reader *rd = cookie;
+    size_t done = 0;
+    while (done < size)
+    {
+        if (rd->data_pos == rd->data_size)
+        {
+            if (!rd->chunks_left && rd->window_pos == rd->window_count)
+                break; // end of file
+            if (__reader_fill_data(rd))
+            {
+                errno = EIO;
+                return -1;
+            }
+        }
+        size_t k = rd->data_size - rd->data_pos;
+        if (k > size - done)
+            k = size - done;
+        memcpy(buf + done, rd->data + rd->data_pos, k);
+        rd->data_pos += k;
+        done += k;
+    }
+    return done;
+}
+
+static int __reader_seek(void *cookie, off64_t *offset, int whence)
+{
+    // only rewinding is supported
+    struct chunk_reader *rd = cookie;
+    struct chunk_recipe_header hdr;
+    if (*offset || whence != SEEK_SET || fseek(rd->recipe, 0, SEEK_SET)
+        || fread(&hdr, sizeof(hdr), 1, rd->recipe) != 1)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    rd->chunks_left = hdr.chunk_count;
+    rd->window_pos = rd->window_count = 0;
+    rd->data_pos = rd->data_size = 0;
+    return 0;
+}
+
+static int __reader_close(void *cookie)
+{
+    struct chunk_reader *rd = cookie;
+    fclose(rd->recipe);
+    free(rd->data);
+    free(rd);
+    return 0;
+}
+
+/* ---------------- storage ---------------- */
+
+static int __chunked_path(storage *st, const char *name, char *path, size_t path_size)
+{
+    return -1; // files are only in chunks
+}
+
+static int __chunked_exists(storage *st, const char *name)
+{
+    storage *recipes = ((struct chunked_storage *)st)->recipes;
+    return recipes->vf_exists(recipes, name);
+}
+
+static int __chunked_stage(storage *st, const char *name, uint64_t length, struct staged_file *f)
+{
+    struct chunked_storage *cs = (struct chunked_storage *)st;
+    struct chunk_ingest *in = calloc(1, sizeof(struct chunk_ingest));
+    if (!in)
+    {
+        fprintf(stderr, "Failed to malloc.\n");
+        return -1;
+    }
+    in->cs = cs;
+    in->recipe.fd = -1;
+    if (!(in->md = EVP_MD_CTX_new()) || !(in->buf = malloc(CHUNK_INGEST_BUFFER + CHUNK_MAX_SIZE))
+        || !(in->batch = malloc(CHUNK_BATCH_SIZE))
+        || !(in->pending = malloc((CHUNK_BATCH_SIZE / CHUNK_MIN_SIZE + 1) * sizeof(struct chunk_ref))))
+    {
+        fprintf(stderr, "Failed to malloc.\n");
+        __ingest_free(in);
+        return -1;
+    }
+    // the header is written when the chunk count is known
+    struct chunk_recipe_header hdr = { 0 };
+    if (cs->recipes->vf_stage(cs->recipes, name, 0, &in->recipe)
+        || fwrite(&hdr, sizeof(hdr), 1, in->recipe.fp) != 1)
+    {
+        __ingest_free(in);
+        return -1;
+    }
+
+    // the handler writes into the chunker
+    cookie_io_functions_t io = { .write = &__ingest_write, .close = &__ingest_close };
+    memset(f, 0, sizeof(struct staged_file));
+    f->fd = -1;
+    f->dirfd = AT_FDCWD;
+    f->anonymous = 1; // nothing to unlink when aborted
+    f->length = length;
+    snprintf(f->name, sizeof(f->name), "%s", name);
+    f->cookie = in;
+    if (!(f->fp = fopencookie(in, "wb", io)))
+    {
+        perror("fopencookie() failed");
+        __ingest_free(in);
+        return -1;
+    }
+    setvbuf(f->fp, NULL, _IONBF, 0);
+    return 0;
+}
+
+static int __chunked_publish(storage *st, const char *name, struct staged_file *f)
+{
+    struct chunked_storage *cs = (struct chunked_storage *)st;
+    struct chunk_ingest *in = f->cookie;
+    const uint64_t t0 = __thread_cpu_ns();
+    if (in->failed || __chunk_consume(in, 1) || __chunk_flush_batch(in))
+        goto PUBLISH_FAIL;
+    if (in->size != f->length)
+    {
+        fprintf(stderr, "Uploaded file %s has %" PRIu64 " bytes, but %" PRIu64 " bytes expected.\n",
+            name, in->size, f->length);
+        goto PUBLISH_FAIL;
+    }
+    // the chunks must be on disk before a recipe uses them
+    pthread_mutex_lock(&cs->lock);
+    int r = fdatasync(cs->pack_fds[cs->pack_count - 1]) || fdatasync(cs->index_fd);
+    cs->logical_bytes += in->size;
+    const double store_ratio = cs->stored_bytes ? (double)cs->logical_bytes / cs->stored_bytes : 0;
+    pthread_mutex_unlock(&cs->lock);
+    if (r)
+    {
+        perror("Failed to sync chunks");
+        goto PUBLISH_FAIL;
+    }
+
+    struct chunk_recipe_header hdr = { .magic = CHUNK_RECIPE_MAGIC, .size = in->size, .chunk_count = in->chunks };
+    if (fflush(in->recipe.fp) || pwrite(in->recipe.fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+    {
+        perror("Failed to write recipe");
+        goto PUBLISH_FAIL;
+    }
+    in->recipe.length = sizeof(hdr) + in->chunks * sizeof(struct chunk_ref);
+    if (cs->recipes->vf_publish(cs->recipes, name, &in->recipe))
+        goto PUBLISH_FAIL;
+    in->cpu_ns += __thread_cpu_ns() - t0;
+
+    printf("Chunked %s: %" PRIu64 " chunks, %" PRIu64 " new (%" PRIu64 " bytes), dedup ratio %.2f "
+        "(%.2f since startup), ingest %.1f MB/s per core.\n",
+        name, in->chunks, in->new_chunks, in->new_bytes, in->new_bytes ? (double)in->size / in->new_bytes : 0,
+        store_ratio, in->cpu_ns ? in->size / 1E6 / (in->cpu_ns / 1E9) : 0);
+    fclose(f->fp);
+    f->fp = NULL;
+    return 0;
+
+PUBLISH_FAIL:
+    staged_abort(f);
+    return -1;
+}
+
+struct chunked_list
+{
+    storage *recipes;
+    storage_visit *visit;
+    void *arg;
+};
+
+static int __chunked_list_visit(void *arg, const char *name, uint64_t size, uint64_t ts_modified)
+{
+    // offer the size of the file, not of its recipe
+    struct chunked_list *l = arg;
+    struct chunk_recipe_header hdr;
+    char path[PATH_MAX];
+    FILE *fp;
+    if (l->recipes->vf_path(l->recipes, name, path, sizeof(path)) || !(fp = fopen(path, "rb")))
+        return 0;
+    const int ok = fread(&hdr, sizeof(hdr), 1, fp) == 1 && !memcmp(hdr.magic, CHUNK_RECIPE_MAGIC, 8);
+    fclose(fp);
+    return ok ? l->visit(l->arg, name, hdr.size, ts_modified) : 0;
+}
+
+static int __chunked_list(storage *st, storage_visit *visit, void *arg)
+{
+    struct chunked_list l = { ((struct chunked_storage *)st)->recipes, visit, arg };
+    return l.recipes->vf_list(l.recipes, &__chunked_list_visit, &l);
+}
+
+static FILE *__chunked_open(storage *st, const char *name)
+{
+    struct chunked_storage *cs = (struct chunked_storage *)st;
+    struct chunk_reader *rd = calloc(1, sizeof(struct chunk_reader));
+    if (!rd || !(rd->data = malloc(CHUNK_READ_SIZE > CHUNK_MAX_SIZE ? CHUNK_READ_SIZE : CHUNK_MAX_SIZE)))
+    {
+        fprintf(stderr, "Failed to malloc.\n");
+        free(rd);
+        return NULL;
+    }
+    rd->cs = cs;
+    off64_t zero = 0;
+    if (!(rd->recipe = cs->recipes->vf_open(cs->recipes, name)) || __reader_seek(rd, &zero, SEEK_SET))
+    {
+        fprintf(stderr, "Cannot read recipe of %s.\n", name);
+        if (rd->recipe)
+            fclose(rd->recipe);
+        free(rd->data);
+        free(rd);
+        return NULL;
+    }
+    cookie_io_functions_t io = { .read = &__reader_read, .seek = &__reader_seek, .close = &__reader_close };
+    FILE *fp = fopencookie(rd, "rb", io);
+    if (!fp)
+    {
+        perror("fopencookie() failed");
+        __reader_close(rd);
+    }
+    return fp;
+}
+
+static void __chunked_close(storage *st)
+{
+    struct chunked_storage *cs = (struct chunked_storage *)st;
+    if (cs->recipes)
+        cs->recipes->vf_close(cs->recipes);
+    for (uint32_t i = 0; i < cs->pack_count; ++i)
+        close(cs->pack_fds[i]);
+    if (cs->index_fd >= 0)
+        close(cs->index_fd);
+    pthread_mutex_destroy(&cs->lock);
+    EVP_MD_free(cs->sha256);
+    free(cs->pack_fds);
+    free(cs->slots);
+    free(cs->root);
+    free(cs);
+}
+
+/**
+ * @brief Open a chunked storage, creating it if it doesn't exist.
+ *
+ * @param root the root directory of the store.
+ * @return storage* the backend, NULL if failed.
+ */
+storage *storage_open_chunked(const char *root)
+{
+    static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+    pthread_once(&gear_once, &__cdc_init_gear);
+
+    struct chunked_storage *cs = calloc(1, sizeof(struct chunked_storage));
+    if (!cs || !(cs->root = strdup(root)))
+    {
+        fprintf(stderr, "Failed to malloc.\n");
+        free(cs);
+        return NULL;
+    }
+    cs->index_fd = -1;
+    pthread_mutex_init(&cs->lock, NULL);
+    cs->base.kind = "chunked";
+    cs->base.vf_path = &__chunked_path;
+    cs->base.vf_exists = &__chunked_exists;
+    cs->base.vf_stage = &__chunked_stage;
+    cs->base.vf_publish = &__chunked_publish;
+    cs->base.vf_list = &__chunked_list;
+    cs->base.vf_open = &__chunked_open;
+    cs->base.vf_close = &__chunked_close;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/" CHUNK_RECIPE_DIR, root);
+    if (!(cs->sha256 = EVP_MD_fetch(NULL, "SHA256", NULL)))
+    {
+        fprintf(stderr, "SHA-256 is not available.\n");
+        __chunked_close(&cs->base);
+        return NULL;
+    }
+    if ((mkdir(root, 0755) && errno != EEXIST) || __chunk_load(cs))
+    {
+        int errsv = errno;
+        fprintf(stderr, "Cannot open chunk store %s [errno %d]: %s\n", root, errsv, strerror(errsv));
+        __chunked_close(&cs->base);
+        return NULL;
+    }
+    if (!(cs->recipes = storage_open_hashed(path)))
+    {
+        __chunked_close(&cs->base);
+        return NULL;
+    }
+    printf("Chunk store %s: %zu chunks in %" PRIu32 " packs.\n", root, cs->count, cs->pack_count);
+    return &cs->base;
+}
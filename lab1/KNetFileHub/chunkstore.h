@@ -0,0 +1,76 @@
+#ifndef __CHUNKSTORE_H
+#define __CHUNKSTORE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "store.h"
+
+/* configurations */
+#define CHUNK_MIN_SIZE 2048                 /* no cut point before this */
+#define CHUNK_AVG_SIZE 8192                 /* normalized chunking switches masks here */
+#define CHUNK_MAX_SIZE 65536                /* forced cut point */
+#define CHUNK_MASK_S 0x0000d9f003530000ULL  /* 15 bits, used before CHUNK_AVG_SIZE */
+#define CHUNK_MASK_L 0x0000d90003530000ULL  /* 11 bits, used after CHUNK_AVG_SIZE */
+#define CHUNK_GEAR_SEED 0x4e46484344433031ULL /* never change it, or no chunk dedups with the old ones */
+#define CHUNK_HASH_SIZE 32                  /* SHA-256 */
+#define CHUNK_INGEST_BUFFER (1024 * 1024)   /* incoming bytes chunked at once */
+#define CHUNK_BATCH_SIZE (1024 * 1024)      /* new chunks written to a pack at once */
+#define CHUNK_PACK_MAX_SIZE (1ULL << 30)    /* start a new pack file after this */
+#define CHUNK_READAHEAD 256                 /* chunks resolved and advised ahead of a download */
+#define CHUNK_READ_SIZE (1024 * 1024)       /* adjacent chunks read at once */
+#define CHUNK_INDEX_FILE "chunks"           /* `struct chunk_index_record` of every stored chunk */
+#define CHUNK_PACK_FORMAT "pack-%08" PRIu32 /* chunk data, in the order it was stored */
+#define CHUNK_RECIPE_DIR "recipes"          /* a hashed store of recipes */
+#define CHUNK_RECIPE_MAGIC "NFHRCP1"
+
+/*
+
+Chunked Storage:
+    Every upload is cut into chunks of 2K..64K (8K on average) at
+    content-defined cut points, found with the gear rolling hash of FastCDC
+    (normalized chunking, rolling two bytes per step). An insertion or
+    deletion only changes the chunks around it, so a new version of a file,
+    or a file sharing content with another one, only adds the chunks which
+    really differ. Chunks are named by their SHA-256 and stored once:
+        `<root>/pack-NNNNNNNN` has the data of the chunks, appended in batches.
+        `<root>/chunks` has a `struct chunk_index_record` of every chunk. It is
+        loaded into a hash table at startup. Records pointing beyond the end
+        of a pack (a crash between the two writes) are dropped.
+        `<root>/recipes/` is a hashed store (see store.h) holding one recipe
+        per uploaded file: a `struct chunk_recipe_header` and the
+        `struct chunk_ref` of every chunk, in order.
+    A recipe is published only after the chunks it uses are synced, so a
+    published file is always complete. Chunks of failed uploads are kept,
+    and no chunk is ever removed.
+    Downloads read the recipe ahead, advise the kernel to read the upcoming
+    chunks, and read adjacent chunks with a single pread.
+
+*/
+
+struct chunk_ref
+{
+    uint8_t hash[CHUNK_HASH_SIZE];
+    uint32_t length;
+    uint32_t reserved;
+};
+
+struct chunk_recipe_header
+{
+    char magic[8];
+    uint64_t size;         // bytes of the file
+    uint64_t chunk_count;  // followed by this many `struct chunk_ref`
+};
+
+struct chunk_index_record
+{
+    uint8_t hash[CHUNK_HASH_SIZE];
+    uint32_t pack;
+    uint32_t length;       // 0 for an empty slot in memory
+    uint64_t offset;       // in the pack
+};
+
+storage *storage_open_chunked(const char *root);
+
+#endif
@@ -24,6 +24,10 @@ int main()
     while (scanf("%hd", &port) != 1)
         ;
 
+    // env NFH_TLS=1 connects with TLS, trusting the certificates in env NFH_TLS_CA
+    if (getenv(ENV_TLS) && strcmp(getenv(ENV_TLS), "0") && tls_client_init(getenv(ENV_TLS_CA)))
+        return -1;
+
     fsm_context *ctx = client_new(host, port);
     if (!ctx)
     {
@@ -0,0 +1,302 @@
+/*************************************
+ *   Hot-file Cache (LRU + TinyLFU)   *
+ *************************************/
+
+#include "fcache.h"
+#include "util.h"
+#include <fcntl.h>
+
+static pthread_mutex_t fc_lock = PTHREAD_MUTEX_INITIALIZER;
+static fcache_entry *hash_table[FCACHE_HASH_SIZE];
+static fcache_entry *lru_head, *lru_tail; // head is the most recently used
+static size_t bytes_used;
+static int entry_count;
+
+// frequency sketch
+static uint8_t sketch[FCACHE_SKETCH_DEPTH][FCACHE_SKETCH_WIDTH];
+static unsigned sketch_additions;
+
+// statistics
+static uint64_t stat_hits, stat_misses, stat_bypasses, stat_evictions, stat_rejections, stat_invalidations;
+
+static uint64_t __fc_hash(const char *s)
+{
+    // FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    while (*s)
+    {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static unsigned __fc_sketch_index(uint64_t h, int row)
+{
+    // derive one index per row from the two halves of the hash
+    uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32);
+    return (h1 + row * h2) % FCACHE_SKETCH_WIDTH;
+}
+
+static unsigned __fc_frequency(uint64_t h)
+{
+    unsigned f = 255;
+    for (int i = 0; i < FCACHE_SKETCH_DEPTH; ++i)
+    {
+        unsigned c = sketch[i][__fc_sketch_index(h, i)];
+        if (c < f)
+            f = c;
+    }
+    return f;
+}
+
+static void __fc_record_access(uint64_t h)
+{
+    for (int i = 0; i < FCACHE_SKETCH_DEPTH; ++i)
+    {
+        uint8_t *c = &sketch[i][__fc_sketch_index(h, i)];
+        if (*c < 15)
+            ++*c;
+    }
+    if (++sketch_additions == FCACHE_SKETCH_RESET)
+    {
+        // age: old popularity fades out
+        for (int i = 0; i < FCACHE_SKETCH_DEPTH; ++i)
+            for (int j = 0; j < FCACHE_SKETCH_WIDTH; ++j)
+                sketch[i][j] >>= 1;
+        sketch_additions = 0;
+    }
+}
+
+static void __fc_lru_unlink(fcache_entry *e)
+{
+    if (e->lru_prev)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        lru_head = e->lru_next;
+    if (e->lru_next)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void __fc_lru_push_front(fcache_entry *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = lru_head;
+    if (lru_head)
+        lru_head->lru_prev = e;
+    lru_head = e;
+    if (!lru_tail)
+        lru_tail = e;
+}
+
+static void __fc_free_entry(fcache_entry *e)
+{
+    free(e->name);
+    free(e->data);
+    free(e);
+}
+
+/**
+ * @brief Take an entry out of the cache. It is freed once the last user puts it back.
+ *        Must be called with `fc_lock` held.
+ */
+static void __fc_remove(fcache_entry *e)
+{
+    fcache_entry **pp = &hash_table[__fc_hash(e->name) % FCACHE_HASH_SIZE];
+    while (*pp != e)
+        pp = &(*pp)->hash_next;
+    *pp = e->hash_next;
+    __fc_lru_unlink(e);
+    e->cached = 0;
+    bytes_used -= e->size;
+    --entry_count;
+    if (!e->refs)
+        __fc_free_entry(e);
+}
+
+static fcache_entry *__fc_lookup(const char *name, uint64_t h)
+{
+    for (fcache_entry *e = hash_table[h % FCACHE_HASH_SIZE]; e; e = e->hash_next)
+    {
+        if (!strcmp(e->name, name))
+            return e;
+    }
+    return NULL;
+}
+
+static int __fc_is_fresh(const fcache_entry *e, const struct stat *st)
+{
+    return e->dev == st->st_dev && e->ino == st->st_ino && e->size == st->st_size
+        && e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/**
+ * @brief Read a whole file into a new entry.
+ *
+ * @return fcache_entry* the entry, not in the cache yet. NULL if the file cannot be
+ *         read or has changed since `st` was taken.
+ */
+static fcache_entry *__fc_load(const char *name, const struct stat *st)
+{
+    int fd = open(name, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    fcache_entry *e = calloc(1, sizeof(fcache_entry));
+    void *data = malloc(st->st_size ? st->st_size : 1);
+    struct stat st2;
+    if (!e || !data || fstat(fd, &st2) || st2.st_ino != st->st_ino || st2.st_size != st->st_size
+        || read_exactly(fd, data, st->st_size) != st->st_size)
+    {
+        // file is gone or changed under us, don't cache it this time
+        close(fd);
+        free(e);
+        free(data);
+        return NULL;
+    }
+    close(fd);
+    if (!(e->name = strdup(name)))
+    {
+        free(e);
+        free(data);
+        return NULL;
+    }
+    e->data = data;
+    e->size = st->st_size;
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->mtime = st->st_mtim;
+    return e;
+}
+
+/**
+ * @brief Decide if `e` may enter the cache, evicting less popular entries to make room.
+ *        Must be called with `fc_lock` held.
+ *
+ * @return int 1 if admitted and inserted, 0 if rejected.
+ */
+static int __fc_admit(fcache_entry *e, uint64_t h)
+{
+    if (e->size > FCACHE_MAX_BYTES)
+        return 0;
+    // only evict if the newcomer is more popular than every victim
+    const unsigned freq = __fc_frequency(h);
+    size_t reclaimable = FCACHE_MAX_BYTES - bytes_used;
+    for (fcache_entry *v = lru_tail; v && reclaimable < e->size; v = v->lru_prev)
+    {
+        if (__fc_frequency(__fc_hash(v->name)) >= freq)
+            return 0;
+        reclaimable += v->size;
+    }
+    if (reclaimable < e->size)
+        return 0;
+    while (FCACHE_MAX_BYTES - bytes_used < e->size)
+    {
+        __fc_remove(lru_tail);
+        ++stat_evictions;
+    }
+
+    fcache_entry **bucket = &hash_table[h % FCACHE_HASH_SIZE];
+    e->hash_next = *bucket;
+    *bucket = e;
+    __fc_lru_push_front(e);
+    e->cached = 1;
+    bytes_used += e->size;
+    ++entry_count;
+    return 1;
+}
+
+/**
+ * @brief Get the cached content of a file, loading it into the cache if it is worth it.
+ *
+ * @param name path of the file.
+ * @return fcache_entry* the entry, which must be released by `fcache_put`.
+ *         NULL if the file is not cached, read it from disk then.
+ */
+fcache_entry *fcache_get(const char *name)
+{
+    struct stat st;
+    if (stat(name, &st) || !S_ISREG(st.st_mode) || st.st_size > FCACHE_MAX_FILE_SIZE)
+    {
+        pthread_mutex_lock(&fc_lock);
+        ++stat_bypasses;
+        pthread_mutex_unlock(&fc_lock);
+        return NULL;
+    }
+
+    const uint64_t h = __fc_hash(name);
+    pthread_mutex_lock(&fc_lock);
+    __fc_record_access(h);
+    fcache_entry *e = __fc_lookup(name, h);
+    if (e && !__fc_is_fresh(e, &st))
+    {
+        __fc_remove(e);
+        ++stat_invalidations;
+        e = NULL;
+    }
+    if (e)
+    {
+        ++stat_hits;
+        ++e->refs;
+        __fc_lru_unlink(e);
+        __fc_lru_push_front(e);
+        pthread_mutex_unlock(&fc_lock);
+        return e;
+    }
+    ++stat_misses;
+    pthread_mutex_unlock(&fc_lock);
+
+    // miss: read the file without holding the lock
+    fcache_entry *loaded = __fc_load(name, &st);
+    if (!loaded)
+        return NULL;
+
+    pthread_mutex_lock(&fc_lock);
+    if ((e = __fc_lookup(name, h)) && __fc_is_fresh(e, &st))
+    {
+        // someone else has loaded it in the meantime
+        __fc_free_entry(loaded);
+    }
+    else
+    {
+        if (e)
+            __fc_remove(e);
+        e = loaded;
+        if (!__fc_admit(e, h))
+            ++stat_rejections; // still serve it from memory this time, then drop it
+    }
+    ++e->refs;
+    pthread_mutex_unlock(&fc_lock);
+    return e;
+}
+
+/**
+ * @brief Release an entry returned by `fcache_get`.
+ *
+ * @param e the entry.
+ */
+void fcache_put(fcache_entry *e)
+{
+    pthread_mutex_lock(&fc_lock);
+    if (!--e->refs && !e->cached)
+        __fc_free_entry(e);
+    pthread_mutex_unlock(&fc_lock);
+}
+
+/**
+ * @brief Print hit ratio, memory usage and eviction counters.
+ *
+ * @param fp the file to print to.
+ */
+void fcache_print_stats(FILE *fp)
+{
+    pthread_mutex_lock(&fc_lock);
+    const uint64_t lookups = stat_hits + stat_misses;
+    fprintf(fp, "[cache] %d file(s), %zu/%u bytes, hit ratio %.2f%% (%" PRIu64 " hits, %" PRIu64 " misses, "
+        "%" PRIu64 " bypassed), %" PRIu64 " evicted, %" PRIu64 " rejected, %" PRIu64 " invalidated.\n",
+        entry_count, bytes_used, FCACHE_MAX_BYTES, lookups ? stat_hits * 100.0 / lookups : 0.0,
+        stat_hits, stat_misses, stat_bypasses, stat_evictions, stat_rejections, stat_invalidations);
+    pthread_mutex_unlock(&fc_lock);
+}
@@ -0,0 +1,52 @@
+#ifndef __FCACHE_H
+#define __FCACHE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "nfh.h"
+
+/* configurations */
+#define FCACHE_MAX_BYTES 67108864U    /* 64MB, memory used by cached file contents */
+#define FCACHE_MAX_FILE_SIZE 1048576U /* 1MB, larger files are never cached */
+#define FCACHE_HASH_SIZE 4096         /* buckets of the name index */
+#define FCACHE_SKETCH_WIDTH 4096      /* counters per row of the frequency sketch */
+#define FCACHE_SKETCH_DEPTH 4
+#define FCACHE_SKETCH_RESET (FCACHE_SKETCH_WIDTH * 10) /* halve all counters after this many requests */
+
+/*
+
+Hot-file Cache:
+    Keeps the content of small, frequently downloaded files in memory.
+    Entries are kept in LRU order. When the cache is full, a new file
+    is only admitted if it was requested more often than the files it
+    would evict (TinyLFU: frequencies are estimated by a count-min sketch
+    which ages by halving). A cached entry is valid as long as the file's
+    device, inode, size and mtime are unchanged, which is checked with a
+    `stat` on every lookup.
+
+*/
+
+typedef struct fcache_entry fcache_entry;
+struct fcache_entry
+{
+    char *name;      // path of the file
+    void *data;
+    size_t size;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    int refs;        // the entry is freed when evicted and no one uses it
+    int cached;      // still in the cache
+    fcache_entry *lru_prev, *lru_next;
+    fcache_entry *hash_next;
+};
+
+fcache_entry *fcache_get(const char *name);
+void fcache_put(fcache_entry *e);
+void fcache_print_stats(FILE *fp);
+
+#endif
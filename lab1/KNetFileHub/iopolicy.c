@@ -0,0 +1,238 @@
+/*************************************
+ *   Page-cache-aware I/O Policy     *
+ *************************************/
+
+#define _GNU_SOURCE
+#include "iopolicy.h"
+#include "util.h"
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+/**
+ * @brief Allocate a buffer which can be used for O_DIRECT I/O.
+ *
+ * @param size bytes to allocate.
+ * @return void* the buffer, release it with free(). NULL if failed.
+ */
+void *io_alloc_buffer(size_t size)
+{
+    void *p;
+    if (posix_memalign(&p, IO_DIRECT_ALIGN, size))
+        return NULL;
+    return p;
+}
+
+/**
+ * @brief Start reading a file sequentially from the beginning.
+ *
+ * @param c the cursor to initialize.
+ * @param fp the file.
+ */
+void io_read_begin(struct io_cursor *c, FILE *fp)
+{
+    memset(c, 0, sizeof(struct io_cursor));
+    c->fp = fp;
+    c->fd = fileno(fp);
+    struct stat st;
+    if (!fstat(c->fd, &st))
+        c->size = st.st_size;
+    c->drop_behind = c->size >= IO_DROPBEHIND_THRESHOLD;
+    // advices are hints, failures don't matter
+    posix_fadvise(c->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(c->fd, 0, IO_READAHEAD_WINDOW, POSIX_FADV_WILLNEED);
+    c->advised = IO_READAHEAD_WINDOW;
+}
+
+/**
+ * @brief Tell the policy that n more bytes have been read.
+ *
+ * @param c the cursor.
+ * @param n bytes read.
+ */
+void io_read_advance(struct io_cursor *c, size_t n)
+{
+    const off_t old_pos = c->pos;
+    c->pos += n;
+    // keep one window of read-ahead in front of the cursor
+    if (c->pos + IO_READAHEAD_WINDOW / 2 > c->advised && c->advised < c->size)
+    {
+        posix_fadvise(c->fd, c->advised, IO_READAHEAD_WINDOW, POSIX_FADV_WILLNEED);
+        c->advised += IO_READAHEAD_WINDOW;
+    }
+    // drop what we have sent
+    if (c->drop_behind)
+        posix_fadvise(c->fd, old_pos, n, POSIX_FADV_DONTNEED);
+}
+
+/**
+ * @brief Finish reading a file.
+ *
+ * @param c the cursor.
+ */
+void io_read_end(struct io_cursor *c)
+{
+    if (c->drop_behind)
+        posix_fadvise(c->fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+static void __io_writeback(struct io_cursor *c)
+{
+    // start writeback of the newest window, then wait for the one before it and drop it
+    while (c->pos - c->synced >= IO_WRITEBACK_WINDOW)
+    {
+        sync_file_range(c->fd, c->synced, IO_WRITEBACK_WINDOW, SYNC_FILE_RANGE_WRITE);
+        if (c->synced >= IO_WRITEBACK_WINDOW)
+        {
+            const off_t prev = c->synced - IO_WRITEBACK_WINDOW;
+            sync_file_range(c->fd, prev, IO_WRITEBACK_WINDOW,
+                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            if (c->drop_behind)
+                posix_fadvise(c->fd, prev, IO_WRITEBACK_WINDOW, POSIX_FADV_DONTNEED);
+        }
+        c->synced += IO_WRITEBACK_WINDOW;
+    }
+}
+
+static int __io_write_fd(int fd, const void *buf, size_t n)
+{
+    const char *p = buf;
+    while (n)
+    {
+        ssize_t w = write(fd, p, n);
+        if (w < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += w;
+        n -= w;
+    }
+    return 0;
+}
+
+/**
+ * @brief Start writing a file sequentially from the beginning.
+ *
+ * @param c the cursor to initialize.
+ * @param fp the file, opened for writing and empty.
+ * @param size the expected file size.
+ * @return int 0 if success, non-zero if failed.
+ */
+int io_write_begin(struct io_cursor *c, FILE *fp, off_t size)
+{
+    memset(c, 0, sizeof(struct io_cursor));
+    c->fp = fp;
+    c->fd = fileno(fp);
+    c->size = size;
+    // a stream of a storage backend has no descriptor, it is just written to
+    c->drop_behind = c->fd >= 0 && size >= IO_DROPBEHIND_THRESHOLD;
+
+    const char *env = getenv(ENV_IO_DIRECT);
+    if (env && !strcmp(env, "1") && c->fd >= 0 && size >= IO_DIRECT_ALIGN)
+    {
+        int flags;
+        fflush(fp);
+        if (!(c->stage = io_alloc_buffer(IO_DIRECT_STAGE_SIZE)))
+            return -1;
+        if ((flags = fcntl(c->fd, F_GETFL)) < 0 || fcntl(c->fd, F_SETFL, flags | O_DIRECT) < 0)
+        {
+            int errsv = errno;
+            fprintf(stderr, "O_DIRECT is not available [errno %d]: %s. Use buffered writes.\n", errsv, strerror(errsv));
+            free(c->stage);
+            c->stage = NULL;
+        }
+        else
+        {
+            c->direct = 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Append data to the file.
+ *
+ * @param c the cursor.
+ * @param buf the data.
+ * @param n bytes to write.
+ * @return int 0 if success, non-zero if failed.
+ */
+int io_write(struct io_cursor *c, const void *buf, size_t n)
+{
+    if (!c->direct)
+    {
+        if (fwrite(buf, 1, n, c->fp) != n)
+            return -1;
+        c->pos += n;
+        if (c->fd >= 0 && c->pos - c->synced >= IO_WRITEBACK_WINDOW)
+        {
+            if (fflush(c->fp))
+                return -1;
+            __io_writeback(c);
+        }
+        return 0;
+    }
+
+    // O_DIRECT: only write out whole staging buffers
+    const char *p = buf;
+    while (n)
+    {
+        size_t k = IO_DIRECT_STAGE_SIZE - c->staged;
+        if (k > n)
+            k = n;
+        memcpy((char *)c->stage + c->staged, p, k);
+        c->staged += k;
+        p += k;
+        n -= k;
+        if (c->staged == IO_DIRECT_STAGE_SIZE)
+        {
+            if (__io_write_fd(c->fd, c->stage, c->staged))
+                return -1;
+            c->pos += c->staged;
+            c->staged = 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Finish writing a file, flush everything to the kernel.
+ *
+ * @param c the cursor.
+ * @return int 0 if success, non-zero if failed.
+ */
+int io_write_end(struct io_cursor *c)
+{
+    int r = 0;
+    if (c->direct)
+    {
+        // write the aligned part directly, the unaligned tail through the page cache
+        size_t aligned = c->staged & ~(size_t)(IO_DIRECT_ALIGN - 1);
+        if (aligned && __io_write_fd(c->fd, c->stage, aligned))
+            r = -1;
+        int flags = fcntl(c->fd, F_GETFL);
+        if (!r && (flags < 0 || fcntl(c->fd, F_SETFL, flags & ~O_DIRECT) < 0))
+            r = -1;
+        if (!r && __io_write_fd(c->fd, (char *)c->stage + aligned, c->staged - aligned))
+            r = -1;
+        c->pos += c->staged;
+        c->staged = 0;
+        free(c->stage);
+        c->stage = NULL;
+        c->direct = 0;
+        return r;
+    }
+
+    if (fflush(c->fp))
+        return -1;
+    if (c->drop_behind)
+    {
+        sync_file_range(c->fd, 0, 0,
+            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(c->fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    return r;
+}
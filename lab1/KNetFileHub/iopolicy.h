@@ -0,0 +1,56 @@
+#ifndef __IOPOLICY_H
+#define __IOPOLICY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+/* configurations */
+#define IO_READAHEAD_WINDOW 16777216L      /* 16MB, read-ahead issued in front of the cursor */
+#define IO_WRITEBACK_WINDOW 8388608L       /* 8MB, writeback is started every this many bytes */
+#define IO_DROPBEHIND_THRESHOLD 67108864L  /* 64MB, larger files don't stay in the page cache */
+#define IO_DIRECT_ALIGN 4096U              /* O_DIRECT buffer, offset and length alignment */
+#define IO_DIRECT_STAGE_SIZE 4194304U      /* 4MB, O_DIRECT staging buffer */
+#define ENV_IO_DIRECT "NFH_IO_DIRECT"      /* set to 1 to write uploads with O_DIRECT */
+
+/*
+
+Page-cache-aware I/O Policy:
+    A transfer walks a file once from the beginning to the end, so:
+    Reading: the kernel is told the access is sequential, and read-ahead
+        is issued one window in front of the cursor. For files larger than
+        IO_DROPBEHIND_THRESHOLD, pages behind the cursor are dropped, so a
+        bulk transfer doesn't evict everyone else's working set.
+    Writing: writeback is started for every window as soon as it is
+        written, and the window before it is waited for, so dirty pages
+        never pile up into a writeback storm. Large files are dropped from
+        the page cache once written back.
+        If ENV_IO_DIRECT is set, writes bypass the page cache (O_DIRECT)
+        through an aligned staging buffer. Falls back to buffered writes
+        if the file system doesn't support it.
+
+*/
+
+struct io_cursor
+{
+    FILE *fp;
+    int fd;
+    off_t size;       // file size, or the expected size when writing
+    off_t pos;        // bytes read or written so far
+    off_t advised;    // read-ahead has been issued up to here
+    off_t synced;     // writeback has been started up to here
+    int drop_behind;  // don't keep the file in the page cache
+    int direct;       // writing with O_DIRECT
+    void *stage;      // O_DIRECT staging buffer
+    size_t staged;    // bytes in the staging buffer
+};
+
+void *io_alloc_buffer(size_t size);
+void io_read_begin(struct io_cursor *c, FILE *fp);
+void io_read_advance(struct io_cursor *c, size_t n);
+void io_read_end(struct io_cursor *c);
+int io_write_begin(struct io_cursor *c, FILE *fp, off_t size);
+int io_write(struct io_cursor *c, const void *buf, size_t n);
+int io_write_end(struct io_cursor *c);
+
+#endif
@@ -1,5 +1,8 @@
 #include "nfh.h"
 #include "util.h"
+#include <pthread.h>
+#include <fcntl.h>
+#include <openssl/evp.h>
 
 // private methods
 static int __vf_is_accepted_state(fsm_context *ctx);
@@ -30,8 +33,10 @@ fsm_context *new_fsm_context(char *host, uint16_t port)
     p->host = buf_host;
     p->port = port;
     p->socket = -1;
+    p->local_socket = -1;
     p->state = FSM_INIT;
     p->client_socket = -1; // in server
+    p->tcp_socket = -1;
     p->vf_is_accepted_state = &__vf_is_accepted_state;
     p->vf_fsm = &__vf_fsm;
     return p;
@@ -53,31 +58,110 @@ void del_fsm_context(fsm_context *ctx)
  * 
  * @param socket the socket.
  * @param fp the file discriptor.
+ * @param bw the bandwidth scheduler session. If NULL, the transfer is not throttled.
  * @return int 0 if succeed, non-zero if an error occurred.
  */
-int send_file(int socket, FILE *fp)
+int send_file(int socket, FILE *fp, bw_session *bw)
 {
-    // send file content in 4k slices
-    void *read_buf = malloc(SEND_BUFFER_SIZE);
-    if (!read_buf)
-    {
-        fprintf(stderr, "Failed to allocate %" PRIu64 " bytes.\n", (uint64_t)SEND_BUFFER_SIZE);
-        return CLIENT_ERR_MALLOC_FAILURE;
-    }
+    return send_file_ex(socket, fp, bw, 0);
+}
 
+/**
+ * @brief Send the whole file content via a socket, by the transport of the socket.
+ * 
+ * @param socket the socket.
+ * @param fp the file discriptor.
+ * @param bw the bandwidth scheduler session. If NULL, the transfer is not throttled.
+ * @param flags TRANSFER_* flags.
+ * @return int 0 if succeed, non-zero if an error occurred.
+ */
+int send_file_ex(int socket, FILE *fp, bw_session *bw, int flags)
+{
+    return send_file_n(socket, fp, SEND_UNTIL_EOF, bw, flags);
+}
+
+/**
+ * @brief Send exactly `size` bytes of the file content via a socket.
+ * 
+ * The peer was told the size beforehand, so a file that ends early is an error:
+ * the stream can no longer be framed and the session must be dropped.
+ * 
+ * @param socket the socket.
+ * @param fp the file discriptor.
+ * @param size the number of bytes to send, or SEND_UNTIL_EOF to send the whole file.
+ * @param bw the bandwidth scheduler session. If NULL, the transfer is not throttled.
+ * @param flags TRANSFER_* flags.
+ * @return int 0 if succeed, non-zero if an error occurred.
+ */
+int send_file_n(int socket, FILE *fp, uint64_t size, bw_session *bw, int flags)
+{
+    return transport_of(socket)->vf_send_file(socket, fp, size, bw, flags);
+}
+
+/**
+ * @brief Write `size` bytes of the file content to a socket.
+ * 
+ * @param socket the socket.
+ * @param fp the file discriptor.
+ * @param size the number of bytes to send, or SEND_UNTIL_EOF to send the whole file.
+ * @param bw the bandwidth scheduler session. If NULL, the transfer is not throttled.
+ * @param flags TRANSFER_* flags.
+ * @return int 0 if succeed, non-zero if an error occurred.
+ */
+int stream_send_file(int socket, FILE *fp, uint64_t size, bw_session *bw, int flags)
+{
     if (fseek(fp, 0L, SEEK_SET))
     {
         perror("Failed to rewind file");
-        free(read_buf);
         return CLIENT_ERR_FAILED_TO_READ_FILE;
     }
 
     ssize_t total_size_sent = 0;
     struct timespec ts_start, ts_end;
+    struct io_cursor cur;
+    tcp_tuner tune;
+    io_read_begin(&cur, fp);
+    tcp_tune_begin(&tune, socket, 1);
     clock_gettime(CLOCK_MONOTONIC_RAW, &ts_start);
-    while (!feof(fp))
+
+    // regular files are sent by the kernel without copying, also over kernel TLS
+    const int fd = fileno(fp);
+    struct stat st;
+    const int zero_copy = fd >= 0 && !fstat(fd, &st) && S_ISREG(st.st_mode);
+    for (off_t pos = 0; zero_copy && (uint64_t)total_size_sent < size; )
+    {
+        uint64_t left = size - total_size_sent;
+        const size_t sz_chunk = tcp_tune_update(&tune, total_size_sent);
+        size_t sz_grant = bw_acquire(bw, left < sz_chunk ? left : sz_chunk);
+        ssize_t sz_sent = sendfile(socket, fd, &pos, sz_grant);
+        if (sz_sent <= 0)
+        {
+            bw_refund(bw, sz_grant);
+            if (!sz_sent)
+                break; // EOF
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Failed to write socket: %d\n", errno);
+            fprintf(stderr, "Sent %zd bytes.\n", total_size_sent);
+            return CLIENT_ERR_SOCKET_ERROR;
+        }
+        bw_refund(bw, sz_grant - sz_sent);
+        io_read_advance(&cur, sz_sent);
+        total_size_sent += sz_sent;
+    }
+
+    // anything else is sent in slices through a buffer
+    void *read_buf = NULL;
+    if (!zero_copy && !(read_buf = malloc(SEND_BUFFER_SIZE)))
+    {
+        fprintf(stderr, "Failed to allocate %" PRIu64 " bytes.\n", (uint64_t)SEND_BUFFER_SIZE);
+        return CLIENT_ERR_MALLOC_FAILURE;
+    }
+    while (!zero_copy && (uint64_t)total_size_sent < size && !feof(fp))
     {
-        size_t sz_read = fread(read_buf, 1, SEND_BUFFER_SIZE, fp);
+        uint64_t left = size - total_size_sent;
+        const size_t sz_chunk = tcp_tune_update(&tune, total_size_sent);
+        size_t sz_read = fread(read_buf, 1, left < sz_chunk ? left : sz_chunk, fp);
         if (ferror(fp))
         {
             // failed to read
@@ -86,17 +170,26 @@ int send_file(int socket, FILE *fp)
             free(read_buf);
             return CLIENT_ERR_FAILED_TO_READ_FILE;
         }
-        ssize_t sz_sent = write(socket, read_buf, sz_read);
-        if (sz_sent == -1 || sz_read != sz_sent)
+        io_read_advance(&cur, sz_read);
+        // send the slice in pieces granted by the scheduler
+        for (size_t off = 0; off < sz_read; )
         {
-            fprintf(stderr, "Failed to write socket: %d\n", errno);
-            fprintf(stderr, "Sent %zd bytes.\n", total_size_sent);
-            free(read_buf);
-            return CLIENT_ERR_SOCKET_ERROR;
+            size_t sz_grant = bw_acquire(bw, sz_read - off);
+            ssize_t sz_sent = write(socket, (char *)read_buf + off, sz_grant);
+            if (sz_sent == -1 || sz_grant != sz_sent)
+            {
+                fprintf(stderr, "Failed to write socket: %d\n", errno);
+                fprintf(stderr, "Sent %zd bytes.\n", total_size_sent);
+                free(read_buf);
+                return CLIENT_ERR_SOCKET_ERROR;
+            }
+            off += sz_sent;
+            total_size_sent += sz_sent;
         }
-        total_size_sent += sz_sent;
     }
     clock_gettime(CLOCK_MONOTONIC_RAW, &ts_end);
+    tcp_tune_end(&tune);
+    io_read_end(&cur);
     free(read_buf);
 
     // quit by EOF or error
@@ -107,16 +200,44 @@ int send_file(int socket, FILE *fp)
         return CLIENT_ERR_FAILED_TO_READ_FILE;
     }
 
-    // // check sent size
-    // if (total_size_sent != preamble.length)
-    // {
-    //     fprintf(stderr, "Wrong sent size: %llu bytes rather than %llu bytes.\n"
-    //         , total_size_sent, preamble.length);
-    //     return CLIENT_ERR_SEND_SIZE_MISMATCH;
-    // }
+    // check sent size
+    if (size != SEND_UNTIL_EOF && (uint64_t)total_size_sent != size)
+    {
+        fprintf(stderr, "File ended after %zd bytes of %" PRIu64 " bytes.\n", total_size_sent, size);
+        return CLIENT_ERR_SEND_SIZE_MISMATCH;
+    }
     uint64_t delta_us = (ts_end.tv_sec - ts_start.tv_sec) * 1000000 + (ts_end.tv_nsec - ts_start.tv_nsec) / 1000;
     // 0.95367431640625 == (1000 / 1024) * (1000 / 1024)
-    printf("Time elapsed: %.2fs. Average speed: %.2fMB/s.\n", delta_us / 1.0E6, total_size_sent * 0.95367431640625 / delta_us);
+    if (!(flags & TRANSFER_QUIET))
+        printf("Time elapsed: %.2fs. Average speed: %.2fMB/s.\n", delta_us / 1.0E6, total_size_sent * 0.95367431640625 / delta_us);
+    return CLIENT_ERR_SUCCESS;
+}
+
+/**
+ * @brief Send a memory buffer via a socket, e.g. a file served from the cache.
+ * 
+ * @param socket the socket.
+ * @param buf the data.
+ * @param n bytes to send.
+ * @param bw the bandwidth scheduler session. If NULL, the transfer is not throttled.
+ * @return int 0 if succeed, non-zero if an error occurred.
+ */
+int send_buffer(int socket, const void *buf, size_t n, bw_session *bw)
+{
+    // unthrottled: the whole buffer in a single write
+    for (size_t off = 0; off < n; )
+    {
+        size_t sz_grant = bw_acquire(bw, n - off);
+        ssize_t sz_sent = write(socket, (const char *)buf + off, sz_grant);
+        if (sz_sent <= 0)
+        {
+            fprintf(stderr, "Failed to write socket: %d\n", errno);
+            fprintf(stderr, "Sent %zu bytes.\n", off);
+            return CLIENT_ERR_SOCKET_ERROR;
+        }
+        bw_refund(bw, sz_grant - sz_sent);
+        off += sz_sent;
+    }
     return CLIENT_ERR_SUCCESS;
 }
 
@@ -126,44 +247,95 @@ int send_file(int socket, FILE *fp)
  * @param socket the socket to read.
  * @param fp the opened file to save in.
  * @param file_size the file size.
+ * @param bw the bandwidth scheduler session. If NULL, the transfer is not throttled.
  * @return int 0 if success, non-zero if an error had occurred.
  */
-int receive_file(int socket, FILE *fp, u_int64_t file_size)
+int receive_file(int socket, FILE *fp, u_int64_t file_size, bw_session *bw)
+{
+    return receive_file_ex(socket, fp, file_size, bw, 0);
+}
+
+/**
+ * @brief Receive file from peer, by the transport of the socket. Save it into given file discriptor.
+ * 
+ * @param socket the socket to read.
+ * @param fp the opened file to save in.
+ * @param file_size the file size.
+ * @param bw the bandwidth scheduler session. If NULL, the transfer is not throttled.
+ * @param flags TRANSFER_* flags.
+ * @return int 0 if success, non-zero if an error had occurred.
+ */
+int receive_file_ex(int socket, FILE *fp, u_int64_t file_size, bw_session *bw, int flags)
+{
+    return transport_of(socket)->vf_receive_file(socket, fp, file_size, bw, flags);
+}
+
+/**
+ * @brief Read file content from a socket. Save it into given file discriptor.
+ * 
+ * @param socket the socket to read.
+ * @param fp the opened file to save in.
+ * @param file_size the file size.
+ * @param bw the bandwidth scheduler session. If NULL, the transfer is not throttled.
+ * @param flags TRANSFER_* flags.
+ * @return int 0 if success, non-zero if an error had occurred.
+ */
+int stream_receive_file(int socket, FILE *fp, uint64_t file_size, bw_session *bw, int flags)
 {
     // FIXME: may go into unrecoverable error, thus timeout is needed
 
     // initialize buffer
-    void *read_buf = malloc(RECV_BUFFER_SIZE);
+    void *read_buf = io_alloc_buffer(RECV_BUFFER_SIZE);
     if (!read_buf)
     {
         fprintf(stderr, "Failed to malloc %" PRIu64 " bytes.\n", (uint64_t)RECV_BUFFER_SIZE);
         return CLIENT_ERR_MALLOC_FAILURE;
     }
+    struct io_cursor cur;
+    if (io_write_begin(&cur, fp, file_size))
+    {
+        fprintf(stderr, "Failed to prepare file for writing.\n");
+        free(read_buf);
+        return CLIENT_ERR_MALLOC_FAILURE;
+    }
 
     // read from socket
     __DEBUG("Reading socket..");
-    ssize_t sz_recv, total_recv = 0;
+    ssize_t sz_recv = 0, total_recv = 0;
     struct timespec ts_start, ts_end;
+    tcp_tuner tune;
+    tcp_tune_begin(&tune, socket, 0);
     clock_gettime(CLOCK_MONOTONIC_RAW, &ts_start);
-    while ((sz_recv = read(socket, read_buf, RECV_BUFFER_SIZE)) > 0)
+    while (total_recv < file_size)
     {
-        size_t sz_written;
+        // never read beyond the file, and only as much as the scheduler allows
+        const size_t sz_chunk = tcp_tune_update(&tune, total_recv);
+        size_t sz_want = file_size - total_recv < sz_chunk ? file_size - total_recv : sz_chunk;
+        size_t sz_grant = bw_acquire(bw, sz_want);
+        if ((sz_recv = read(socket, read_buf, sz_grant)) <= 0)
+        {
+            bw_refund(bw, sz_grant);
+            break;
+        }
+        bw_refund(bw, sz_grant - sz_recv);
         DEBUGS(printf("Read %zd bytes from socket.\n", sz_recv));
-        if ((sz_written = fwrite(read_buf, 1, sz_recv, fp)) != sz_recv)
+        if (io_write(&cur, read_buf, sz_recv))
         {
             perror("An I/O error occurred while writing file");
-            fprintf(stderr, "Failed to write %zd bytes to file: %zd bytes actually.\n"
-                , sz_recv, sz_written);
+            fprintf(stderr, "Failed to write %zd bytes to file.\n", sz_recv);
+            io_write_end(&cur);
             free(read_buf);
-            fflush(fp);
             return CLIENT_ERR_FAILED_TO_WRITE_FILE;
         }
-        if ((total_recv += sz_recv) == file_size)
-            break; // all data has been received
+        total_recv += sz_recv;
     }
     clock_gettime(CLOCK_MONOTONIC_RAW, &ts_end);
-    fflush(fp);
     free(read_buf);
+    if (io_write_end(&cur))
+    {
+        perror("An I/O error occurred while writing file");
+        return CLIENT_ERR_FAILED_TO_WRITE_FILE;
+    }
 
     // socket read failure
     if (sz_recv < 0)
@@ -172,16 +344,292 @@ int receive_file(int socket, FILE *fp, u_int64_t file_size)
         return CLIENT_ERR_SOCKET_ERROR;
     }
 
-    if (!sz_recv)
-        DEBUGS(printf("Encountered EOF.\n"));
     DEBUGS(printf("total_recv=%zd, file_size=%" PRIu64 ".\n", total_recv, file_size));
+    if (total_recv != file_size)
+    {
+        fprintf(stderr, "Unexpected EOF: received %zd bytes of %" PRIu64 " bytes.\n", total_recv, file_size);
+        return CLIENT_ERR_SEND_SIZE_MISMATCH;
+    }
     uint64_t delta_us = (ts_end.tv_sec - ts_start.tv_sec) * 1000000 + (ts_end.tv_nsec - ts_start.tv_nsec) / 1000;
     // 0.95367431640625 == (1000 / 1024) * (1000 / 1024)
-    printf("Time elapsed: %.2fs. Average speed: %.2fMB/s.\n", delta_us / 1.0E6, file_size * 0.95367431640625 / delta_us);
-    ASSERT2(total_recv == file_size, "File size mismatch");
+    if (!(flags & TRANSFER_QUIET))
+        printf("Time elapsed: %.2fs. Average speed: %.2fMB/s.\n", delta_us / 1.0E6, file_size * 0.95367431640625 / delta_us);
     return CLIENT_ERR_SUCCESS;
 }
 
+/* tree hash, see `struct tree_digest` */
+
+struct tree_hash_job
+{
+    int fd;              // read the chunks from this file, or
+    const char *buf;     // take them from memory, which starts with chunk `first`
+    uint64_t size;       // where the data ends, as a file offset
+    uint64_t first, end; // chunks [first, end) are hashed
+    uint64_t next;       // the next chunk to take, shared by the workers
+    uint8_t *leaves;     // the digest of chunk i goes to leaves[(i - first) * TREE_HASH_SIZE]
+    int failed;
+};
+
+static EVP_MD *tree_hash_md = NULL;
+static pthread_once_t tree_hash_md_once = PTHREAD_ONCE_INIT;
+
+static void tree_hash_md_fetch(void)
+{
+    // fetched once, an implicit fetch on every digest is slow
+    tree_hash_md = EVP_MD_fetch(NULL, "SHA256", NULL);
+}
+
+static void put_le64(uint8_t *p, uint64_t v)
+{
+    for (int i = 0; i < 8; ++i)
+        p[i] = v >> (i * 8);
+}
+
+/**
+ * @brief Hash a node of the tree: the domain byte, a prefix and the content.
+ *
+ * @return int 0 if success, non-zero if failed.
+ */
+static int tree_hash_node(EVP_MD_CTX *md, uint8_t domain, const void *prefix, size_t prefix_len,
+    const void *data, size_t len, uint8_t *out)
+{
+    return !EVP_DigestInit_ex(md, tree_hash_md, NULL) || !EVP_DigestUpdate(md, &domain, 1)
+        || (prefix_len && !EVP_DigestUpdate(md, prefix, prefix_len))
+        || (len && !EVP_DigestUpdate(md, data, len)) || !EVP_DigestFinal_ex(md, out, NULL);
+}
+
+static void *tree_hash_worker(void *arg)
+{
+    // take chunks one by one until all of them are taken, so a slow read doesn't hold the others
+    struct tree_hash_job *j = arg;
+    EVP_MD_CTX *md = EVP_MD_CTX_new();
+    char *buf = j->buf ? NULL : malloc(TREE_HASH_CHUNK_SIZE);
+    if (!md || (!j->buf && !buf))
+    {
+        fprintf(stderr, "Failed to malloc.\n");
+        __atomic_store_n(&j->failed, 1, __ATOMIC_RELAXED);
+        goto DONE;
+    }
+    for (;;)
+    {
+        const uint64_t i = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED);
+        if (i >= j->end || __atomic_load_n(&j->failed, __ATOMIC_RELAXED))
+            break;
+        const uint64_t offset = i * TREE_HASH_CHUNK_SIZE;
+        const size_t len = j->size - offset < TREE_HASH_CHUNK_SIZE ? j->size - offset : TREE_HASH_CHUNK_SIZE;
+        const char *data = j->buf ? j->buf + (i - j->first) * TREE_HASH_CHUNK_SIZE : buf;
+        for (size_t done = 0; !j->buf && done < len; )
+        {
+            ssize_t n = pread(j->fd, buf + done, len - done, offset + done);
+            if (n <= 0)
+            {
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0)
+                    perror("Failed to read file for hashing");
+                else
+                    fprintf(stderr, "File shrank while hashing.\n");
+                __atomic_store_n(&j->failed, 1, __ATOMIC_RELAXED);
+                goto DONE;
+            }
+            done += n;
+        }
+        uint8_t index[8];
+        put_le64(index, i);
+        if (tree_hash_node(md, 0, index, sizeof(index), data, len, j->leaves + (i - j->first) * TREE_HASH_SIZE))
+        {
+            fprintf(stderr, "Failed to hash chunk %" PRIu64 ".\n", i);
+            __atomic_store_n(&j->failed, 1, __ATOMIC_RELAXED);
+            goto DONE;
+        }
+    }
+DONE:
+    free(buf);
+    EVP_MD_CTX_free(md);
+    return NULL;
+}
+
+/**
+ * @brief Run the workers of a job, the calling thread being one of them.
+ *
+ * @return int 0 if success, non-zero if failed.
+ */
+static int tree_hash_run(struct tree_hash_job *j, int threads)
+{
+    pthread_once(&tree_hash_md_once, &tree_hash_md_fetch);
+    if (!tree_hash_md)
+    {
+        fprintf(stderr, "SHA-256 is not available.\n");
+        return -1;
+    }
+    if (threads > j->end - j->first)
+        threads = j->end - j->first;
+    pthread_t tids[TREE_HASH_MAX_THREADS];
+    int spawned = 0;
+    for (; spawned < threads - 1; ++spawned)
+    {
+        if (pthread_create(&tids[spawned], NULL, &tree_hash_worker, j))
+            break; // fewer threads are still fine
+    }
+    tree_hash_worker(j);
+    for (int i = 0; i < spawned; ++i)
+        pthread_join(tids[i], NULL);
+    return j->failed;
+}
+
+static int tree_hash_threads(int threads)
+{
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    return threads < 1 ? 1 : threads > TREE_HASH_MAX_THREADS ? TREE_HASH_MAX_THREADS : threads;
+}
+
+/**
+ * @brief Hash some chunks of a file in parallel, e.g. to verify a resumed or striped range.
+ *
+ * @param fd the file, read with pread().
+ * @param size the size of the file.
+ * @param first the first chunk to hash.
+ * @param count how many chunks to hash.
+ * @param threads how many threads to use, 0 for one per CPU.
+ * @param leaves where to put `count` digests.
+ * @return int 0 if success, non-zero if failed.
+ */
+int tree_hash_range(int fd, uint64_t size, uint64_t first, uint64_t count, int threads, uint8_t *leaves)
+{
+    struct tree_hash_job j = { fd, NULL, size, first, first + count, first, leaves, 0 };
+    if (!count)
+        return 0;
+    if (first + count > (size ? (size + TREE_HASH_CHUNK_SIZE - 1) / TREE_HASH_CHUNK_SIZE : 1))
+    {
+        fprintf(stderr, "Chunks to hash are out of bound.\n");
+        return -1;
+    }
+    posix_fadvise(fd, first * TREE_HASH_CHUNK_SIZE, count * TREE_HASH_CHUNK_SIZE, POSIX_FADV_SEQUENTIAL);
+    return tree_hash_run(&j, tree_hash_threads(threads));
+}
+
+/**
+ * @brief Combine the leaves into the root of the tree.
+ *
+ * @param leaves the digests of all chunks.
+ * @param count how many chunks, at least 1.
+ * @param size the size of the file.
+ * @param root where to put the root digest.
+ * @return int 0 if success, non-zero if failed.
+ */
+int tree_hash_root(const uint8_t *leaves, uint64_t count, uint64_t size, uint8_t *root)
+{
+    pthread_once(&tree_hash_md_once, &tree_hash_md_fetch);
+    EVP_MD_CTX *md = EVP_MD_CTX_new();
+    uint8_t *level = malloc(count * TREE_HASH_SIZE);
+    int r = -1;
+    if (!md || !level || !tree_hash_md || !count)
+        goto DONE;
+    memcpy(level, leaves, count * TREE_HASH_SIZE);
+    // pair up the nodes of each level, an odd one out is moved up as it is
+    while (count > 1)
+    {
+        uint64_t n = 0;
+        for (uint64_t i = 0; i + 1 < count; i += 2, ++n)
+        {
+            if (tree_hash_node(md, 1, level + i * TREE_HASH_SIZE, 2 * TREE_HASH_SIZE, NULL, 0, level + n * TREE_HASH_SIZE))
+                goto DONE;
+        }
+        if (count & 1)
+            memmove(level + n++ * TREE_HASH_SIZE, level + (count - 1) * TREE_HASH_SIZE, TREE_HASH_SIZE);
+        count = n;
+    }
+    uint8_t length[8];
+    put_le64(length, size);
+    r = tree_hash_node(md, 2, length, sizeof(length), level, TREE_HASH_SIZE, root);
+DONE:
+    free(level);
+    EVP_MD_CTX_free(md);
+    return r;
+}
+
+/**
+ * @brief Hash a whole file into a tree digest, in parallel.
+ *
+ * @param fp the file. A regular file is read by all threads at once,
+ * any other stream is read from the current position in batches.
+ * @param threads how many threads to use, 0 for one per CPU.
+ * @param d the digest to fill, free it with `tree_digest_free`.
+ * @return int 0 if success, non-zero if failed.
+ */
+int tree_hash_file(FILE *fp, int threads, struct tree_digest *d)
+{
+    memset(d, 0, sizeof(*d));
+    threads = tree_hash_threads(threads);
+    const int fd = fileno(fp);
+    struct stat st;
+    if (fd >= 0 && !fstat(fd, &st) && S_ISREG(st.st_mode))
+    {
+        d->size = st.st_size;
+        d->chunk_count = d->size ? (d->size + TREE_HASH_CHUNK_SIZE - 1) / TREE_HASH_CHUNK_SIZE : 1;
+        if (!(d->leaves = malloc(d->chunk_count * TREE_HASH_SIZE)))
+            goto FAILED;
+        if (tree_hash_range(fd, d->size, 0, d->chunk_count, threads, d->leaves))
+            goto FAILED;
+        if (tree_hash_root(d->leaves, d->chunk_count, d->size, d->root))
+            goto FAILED;
+        return 0;
+    }
+
+    // a stream: one thread reads a batch while nobody hashes, which is fine as reading is much faster
+    const size_t batch = (size_t)threads * TREE_HASH_BATCH * TREE_HASH_CHUNK_SIZE;
+    char *buf = malloc(batch);
+    if (!buf)
+        goto FAILED;
+    for (;;)
+    {
+        size_t n = fread(buf, 1, batch, fp);
+        if (ferror(fp))
+        {
+            perror("Failed to read file for hashing");
+            free(buf);
+            goto FAILED;
+        }
+        if (!n && d->chunk_count)
+            break;
+        const uint64_t count = n ? (n + TREE_HASH_CHUNK_SIZE - 1) / TREE_HASH_CHUNK_SIZE : 1;
+        uint8_t *leaves = realloc(d->leaves, (d->chunk_count + count) * TREE_HASH_SIZE);
+        if (!leaves)
+        {
+            free(buf);
+            goto FAILED;
+        }
+        d->leaves = leaves;
+        struct tree_hash_job j = { -1, buf, d->size + n, d->chunk_count, d->chunk_count + count,
+            d->chunk_count, leaves + d->chunk_count * TREE_HASH_SIZE, 0 };
+        if (tree_hash_run(&j, threads))
+        {
+            free(buf);
+            goto FAILED;
+        }
+        d->size += n;
+        d->chunk_count += count;
+        if (n < batch)
+            break;
+    }
+    free(buf);
+    if (tree_hash_root(d->leaves, d->chunk_count, d->size, d->root))
+        goto FAILED;
+    return 0;
+
+FAILED:
+    fprintf(stderr, "Failed to hash file.\n");
+    tree_digest_free(d);
+    return -1;
+}
+
+void tree_digest_free(struct tree_digest *d)
+{
+    free(d->leaves);
+    d->leaves = NULL;
+}
+
 /**
  * @brief Send a HandShake message to the remote peer.
  * 
@@ -290,6 +738,68 @@ int receive_bye_message(int s)
     return 0;
 }
 
+/**
+ * @brief Send a `struct path_request` followed by the path.
+ * 
+ * @param s the socket to use.
+ * @param path the path, "" for an empty request.
+ * @return int 0 if succeed, non-zero if failed.
+ */
+int send_path_request(int s, const char *path)
+{
+    char buf[sizeof(struct path_request) + MAX_PATH_LENGTH];
+    struct path_request req;
+    const size_t len = strlen(path);
+    if (len > MAX_PATH_LENGTH)
+    {
+        fprintf(stderr, "Path is too long: %s.\n", path);
+        return -1;
+    }
+    req.length = len;
+    memcpy(buf, &req, sizeof(req));
+    memcpy(buf + sizeof(req), path, len);
+    if (write_exactly(s, buf, sizeof(req) + len) < 0)
+    {
+        perror("Failed to send path request");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Receive a `struct path_request` and the path, and check if the path is safe.
+ * 
+ * @param s the socket to use.
+ * @param path buffer of at least MAX_PATH_LENGTH + 1 bytes. Set to "" for an empty request.
+ * @return int 0 if succeed, non-zero if failed or the path is unsafe.
+ */
+int receive_path_request(int s, char *path)
+{
+    struct path_request req;
+    if (read_exactly(s, &req, sizeof(req)) != sizeof(req))
+    {
+        fprintf(stderr, "Failed to read path request.\n");
+        return -1;
+    }
+    if (req.length > MAX_PATH_LENGTH)
+    {
+        fprintf(stderr, "Path in request is too long: %u bytes.\n", req.length);
+        return -1;
+    }
+    if (req.length && read_exactly(s, path, req.length) != req.length)
+    {
+        fprintf(stderr, "Failed to read path of request.\n");
+        return -1;
+    }
+    path[req.length] = '\0';
+    if (req.length && (memchr(path, '\0', req.length) || !is_safe_relative_path(path)))
+    {
+        fprintf(stderr, "Unsafe path in request: %s.\n", path);
+        return -1;
+    }
+    return 0;
+}
+
 static int __vf_is_accepted_state(fsm_context *ctx)
 {
     return ctx->state == FSM_STOP;
@@ -302,7 +812,7 @@ static int __vf_fsm(fsm_context *ctx)
     int failed = 0;
     while (!ctx->vf_is_accepted_state(ctx))
     {
-        int r;
+        int r = 0;
         switch(ctx->state)
         {
             case FSM_INIT:
@@ -7,16 +7,34 @@
 #include <errno.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <inttypes.h>
 #include <time.h>
 
+#include "util.h"
+#include "bwsched.h"
+#include "iopolicy.h"
+#include "store.h"
+#include "transport.h"
+#include "tcptune.h"
+#include "udpxfer.h"
+#include "notify.h"
+#include "trace.h"
+
 /* configurations */
 #define SERVER_DEDFAULT_PORT 3789
-#define SEND_BUFFER_SIZE 4194304U /* 4KB */ /* match the system's page size */
-#define RECV_BUFFER_SIZE 4194304U /* 4KB */
+#define SEND_BUFFER_SIZE 4194304U /* 4MB, the largest chunk, see tcptune.h */
+#define RECV_BUFFER_SIZE 4194304U /* 4MB, the largest chunk, see tcptune.h */
 #define SERVER_LISTEN_BACKLOG 0 /* disable client queue */
+#define FILE_LIST_MAX 1024 /* files offered to the client in DOWNLOAD mode */
+#define SERVER_MAX_SESSIONS 64 /* clients served at the same time, each one in its own thread */
+#define TREE_FETCH_CONNECTIONS 4 /* parallel connections pulling files in tree mode */
+#define TREE_STREAM_BUFFER_SIZE 65536U /* manifest entries are sent in batches of this size */
+#define TREE_HASH_CHUNK_SIZE 1048576U /* 1MB */ /* leaves of the tree hash, each one can be verified on its own */
+#define TREE_HASH_BATCH 4 /* chunks per thread read at once when hashing a stream */
+#define TREE_HASH_MAX_THREADS 64
 
 /* protocol specific constants */
 #define MAX_FILENAME_LENGTH 255
@@ -25,6 +43,26 @@
 #define NFHC_MODE_DOWNLOAD "MODESW.DOWNLD"
 #define NFHS_ALLOW_UPLOAD "SA.ALLOWUPLD"
 #define NFHS_ALLOW_DOWNLOAD "SA.ALLOWDNLD"
+#define NFHC_MODE_TREE "MODESW.TREEDL"
+#define NFHC_MODE_FETCH "MODESW.FETCHP"
+#define NFHS_ALLOW_TREE "SA.ALLOWTREE"
+#define NFHS_ALLOW_FETCH "SA.ALLOWFTCH"
+#define NFHC_MODE_ARCHIVE_UPLOAD "MODESW.AGGRUP"
+#define NFHC_MODE_ARCHIVE_DOWNLOAD "MODESW.AGGRDL"
+#define NFHS_ALLOW_ARCHIVE_UPLOAD "SA.ALLOWAGUP"
+#define NFHS_ALLOW_ARCHIVE_DOWNLOAD "SA.ALLOWAGDL"
+#define NFHC_MODE_DIGEST "MODESW.DIGEST"
+#define NFHS_ALLOW_DIGEST "SA.ALLOWDGST"
+#define NFHC_MODE_UDP_DOWNLOAD "MODESW.UDPDNL"
+#define NFHC_MODE_UDP_UPLOAD "MODESW.UDPUPL"
+#define NFHS_ALLOW_UDP_DOWNLOAD "SA.ALLOWUDPD"
+#define NFHS_ALLOW_UDP_UPLOAD "SA.ALLOWUDPU"
+#define NFHC_MODE_SUBSCRIBE "MODESW.SUBSCR"
+#define NFHS_ALLOW_SUBSCRIBE "SA.ALLOWSUBS"
+#define NFHC_MODE_CONGESTION "MODESW.CONGCT"
+#define NFHS_ALLOW_CONGESTION "SA.ALLOWCONG"
+#define NFHS_REFUSE_CONGESTION "SA.REFUSECCA"
+#define NFHS_REFUSE_MODE "SA.REFUSEMOD"
 #define NFHS_OFFER_FILES "SA.FILES"
 #define NFH_BYE "NFH.BYE"
 
@@ -55,6 +93,19 @@
 #define FSM_DIE 10   /* clean up, recover from a broken connection or invalid peer */
 #define FSM_STOP 11  /* no vfunc, when reached, stop the main loop. Only joined from DIE */
 
+/* tree mode */
+#define TREE_ENTRY_END 0
+#define TREE_ENTRY_DIR 1
+#define TREE_ENTRY_FILE 2
+#define FETCH_NOT_FOUND UINT64_MAX
+
+/* tree hash */
+#define TREE_HASH_SIZE 32 /* SHA-256 */
+
+/* transfer flags */
+#define TRANSFER_QUIET 1 /* don't print the speed of every file */
+#define SEND_UNTIL_EOF UINT64_MAX /* send_file_n() size: no announced size */
+
 /* DataExchange modes */
 #define DE_MODE_UPLOAD 1
 #define DE_MODE_DOWNLOAD 2
@@ -79,11 +130,17 @@ struct fsm_context
     // members
     int state;      // fsm state
     int socket;     // tcp socket. If the context is server, this is the greeting socket
+    int local_socket; // server: greeting socket for same-host clients (AF_UNIX), -1 if none
     char *host;     // server address: listen to or connect to
     u_int16_t port; // server port: listen to or connect to
 
     // server members
     int client_socket; // the real socket to the client, once connected
+    int tcp_socket; // the TCP connection under client_socket, which TLS may relay through a socketpair, -1 if none
+    char peer_name[INET6_ADDRSTRLEN]; // client address, used as the bandwidth scheduler key
+    bw_session *bw; // bandwidth scheduler session, NULL if the transfer is not throttled
+    storage *store; // where uploaded files are kept, shared by all sessions
+    uint32_t trace; // the session's number in the trace (trace.h), 0 if not recording
     // int de_mode; // refactor to polymorphic vfunc
 
     // methods
@@ -114,6 +171,54 @@ struct so_s2c_file_entry
     char name[MAX_FILENAME_LENGTH + 1];
 };
 
+struct path_request
+{
+    u_int16_t length; // followed by `length` bytes of path, without '\0'
+};
+
+struct tree_entry
+{
+    u_int64_t size;
+    u_int64_t ts_modified;
+    u_int16_t path_length; // followed by `path_length` bytes of path, without '\0'
+    u_int8_t type;
+    u_int8_t reserved[5];
+};
+
+struct tree_digest_header
+{
+    u_int64_t size;        // FETCH_NOT_FOUND if there is no such file
+    u_int64_t chunk_size;  // TREE_HASH_CHUNK_SIZE
+    u_int64_t chunk_count; // followed by `chunk_count` leaves of TREE_HASH_SIZE bytes
+    u_int8_t root[TREE_HASH_SIZE];
+};
+
+/*
+
+Tree Hash:
+    A file is cut into chunks of TREE_HASH_CHUNK_SIZE bytes (an empty file
+    has one empty chunk), which are hashed independently by a pool of
+    threads, so hashing scales with cores instead of being one long
+    sequential digest:
+        leaf[i] = SHA-256(0x00 || le64(i) || chunk[i])
+    Leaves are paired up level by level, an odd one out is moved up as it is:
+        node = SHA-256(0x01 || left || right)
+    and the top node is bound to the file size:
+        root = SHA-256(0x02 || le64(size) || top)
+    OpenSSL picks the fastest SHA-256 of the CPU (SHA-NI, AVX2, ...).
+    Given leaves that match the root, any range of chunks can be checked on
+    its own, e.g. what a resumed or striped transfer has received so far.
+
+*/
+
+struct tree_digest
+{
+    uint64_t size;
+    uint64_t chunk_count;
+    uint8_t root[TREE_HASH_SIZE];
+    uint8_t *leaves; // chunk_count * TREE_HASH_SIZE bytes
+};
+
 /*
 
 NFH Protocol Specification:
@@ -141,6 +246,57 @@ Session Phases:
             Phase 3.2: ContentTransfer: [CT]
                 After deciding which file to download, the client sends id of the file to get.
                 The server then send the whole file to the client.
+        If the client want to copy a directory tree, send `MODESW.TREEDL` (TreeDownload):
+            Phase 3.1: Manifest:
+                The client sends a `struct path_request` with the directory to copy
+                (length 0 for the whole server directory).
+                The server walks the directory and streams a `struct tree_entry` plus
+                the relative path of every directory and regular file, in no particular
+                order except that a directory always comes before its content. A
+                TREE_ENTRY_END entry ends the manifest.
+            Phase 3.2: Fetch:
+                The client opens more connections in `MODESW.FETCHP` (Fetch) mode to pull
+                the files in parallel. In Fetch mode, the client sends any number of
+                `struct path_request`s, each one is answered with the file size as an
+                unsigned int64 followed by the content, or FETCH_NOT_FOUND without content.
+                A request of length 0 ends the Fetch phase.
+            Paths are relative, '/' separated, and must not contain empty, `.` or `..`
+            components. Both sides reject unsafe paths, and never follow symbolic links.
+            TreeDownload, Fetch, AggregateUpload and AggregateDownload work on the server's
+            directory tree, which is where the flat storage backend keeps files. With any
+            other backend (see store.h) the server replies `SA.REFUSEMOD` instead of the
+            ALLOW message, and closes the connection.
+        If the client want to send many files at once, send `MODESW.AGGRUP` (AggregateUpload):
+            The client sends the files as one archive stream (see archive.h): a
+            `struct tree_entry` plus the path of every directory and file, each file
+            followed by its content, ended with a TREE_ENTRY_END entry. The server
+            saves every file atomically and never replaces an existing one, then
+            replies with two unsigned int64: files saved and files skipped.
+        If the client want to get many files at once, send `MODESW.AGGRDL` (AggregateDownload):
+            The client sends a `struct path_request` for every file or directory it wants,
+            ended with a request of length 0. An empty first request selects the whole
+            server directory. The server replies with one archive stream of all of them.
+        If the client want to check a file, send `MODESW.DIGEST` (Digest):
+            The client sends a `struct path_request` with the name of a stored file.
+            The server replies with a `struct tree_digest_header` and the leaves of the
+            file's tree hash, so the client can tell which chunks of its copy differ.
+        If the client want to move one file over UDP, send `MODESW.UDPDNL` (UdpDownload)
+        or `MODESW.UDPUPL` (UdpUpload):
+            Same as DOWNLOAD and UPLOAD, but before the file content the server sends a
+            `struct udp_offer`, and unless its port is 0 the content goes over that UDP
+            port while the receiver reports on this connection (see udpxfer.h).
+        If the client want to follow the changes of the server's files, send `MODESW.SUBSCR`
+        (Subscribe):
+            The client sends a `struct notify_request` with where it stopped, the server
+            replies with a `struct notify_hello`, maybe a snapshot of all files, then a
+            `struct notify_event` plus the name of every change, until the connection is
+            closed (see notify.h). There is no Quit phase.
+        Before any of these, the client may ask for a congestion control for this
+        connection with `MODESW.CONGCT` (CongestionControl):
+            The client sends a `struct path_request` with the name, e.g. `bbr`. The server
+            uses it on its end (TCP_CONGESTION) and replies `SA.ALLOWCONG`, or
+            `SA.REFUSECCA` if the kernel refused it and the default stays. Either way
+            the ModeSwitch phase goes on, and the client sends its mode next.
     Phase 4: Quit (Client <=> Server): [Q]
         After all data has been received correctly, the receiver should send a `NFH.BYE`
         message to indicate an end. The other side should reply with another `NFH.BYTE`
@@ -151,8 +307,20 @@ Session Phases:
 fsm_context *new_fsm_context(char *host, uint16_t port);
 void del_fsm_context(fsm_context *ctx);
 int client_send_file_preamble(int socket, FILE *fp, char *file_name);
-int send_file(int socket, FILE *fp);
-int receive_file(int socket, FILE *fp, u_int64_t file_size);
+int send_file(int socket, FILE *fp, bw_session *bw);
+int send_file_ex(int socket, FILE *fp, bw_session *bw, int flags);
+int send_file_n(int socket, FILE *fp, uint64_t size, bw_session *bw, int flags);
+int send_buffer(int socket, const void *buf, size_t n, bw_session *bw);
+int receive_file(int socket, FILE *fp, u_int64_t file_size, bw_session *bw);
+int receive_file_ex(int socket, FILE *fp, u_int64_t file_size, bw_session *bw, int flags);
+int stream_send_file(int socket, FILE *fp, uint64_t size, bw_session *bw, int flags);
+int stream_receive_file(int socket, FILE *fp, uint64_t file_size, bw_session *bw, int flags);
+int send_path_request(int s, const char *path);
+int receive_path_request(int s, char *path);
+int tree_hash_file(FILE *fp, int threads, struct tree_digest *d);
+int tree_hash_range(int fd, uint64_t size, uint64_t first, uint64_t count, int threads, uint8_t *leaves);
+int tree_hash_root(const uint8_t *leaves, uint64_t count, uint64_t size, uint8_t *root);
+void tree_digest_free(struct tree_digest *d);
 int send_handshake(int s);
 int expect_handshake(int s);
 int send_bye_message(int s);
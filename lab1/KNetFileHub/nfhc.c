@@ -10,6 +10,42 @@ static int __vf_client_dataexchange_upload(fsm_context *ctx);
 static int __vf_client_dataexchange_download(fsm_context *ctx);
 static int __vf_client_quit_from_download_handler(fsm_context *ctx);
 static int __vf_client_quit_from_upload_handler(fsm_context *ctx);
+static int __vf_client_dataexchange_tree(fsm_context *ctx);
+static int __vf_client_dataexchange_archive_upload(fsm_context *ctx);
+static int __vf_client_dataexchange_archive_download(fsm_context *ctx);
+static int __vf_client_dataexchange_digest(fsm_context *ctx);
+static int __vf_client_dataexchange_udp_download(fsm_context *ctx);
+static int __vf_client_dataexchange_udp_upload(fsm_context *ctx);
+static int __vf_client_dataexchange_subscribe(fsm_context *ctx);
+
+// modes the user may choose, in menu order
+static const struct client_mode
+{
+    const char *name;
+    const char *modesw;   // ModeSwitch instruction
+    const char *allow;    // expected ALLOW message
+    vfunc_dataexchange_handler *de_handler;
+    vfunc_quit_handler *quit_handler;
+} client_modes[] = {
+    {"DOWNLOAD", NFHC_MODE_DOWNLOAD, NFHS_ALLOW_DOWNLOAD,
+        &__vf_client_dataexchange_download, &__vf_client_quit_from_download_handler},
+    {"UPLOAD", NFHC_MODE_UPLOAD, NFHS_ALLOW_UPLOAD,
+        &__vf_client_dataexchange_upload, &__vf_client_quit_from_upload_handler},
+    {"TREE DOWNLOAD", NFHC_MODE_TREE, NFHS_ALLOW_TREE,
+        &__vf_client_dataexchange_tree, &__vf_client_quit_from_download_handler},
+    {"AGGREGATE UPLOAD", NFHC_MODE_ARCHIVE_UPLOAD, NFHS_ALLOW_ARCHIVE_UPLOAD,
+        &__vf_client_dataexchange_archive_upload, &__vf_client_quit_from_upload_handler},
+    {"AGGREGATE DOWNLOAD", NFHC_MODE_ARCHIVE_DOWNLOAD, NFHS_ALLOW_ARCHIVE_DOWNLOAD,
+        &__vf_client_dataexchange_archive_download, &__vf_client_quit_from_download_handler},
+    {"VERIFY", NFHC_MODE_DIGEST, NFHS_ALLOW_DIGEST,
+        &__vf_client_dataexchange_digest, &__vf_client_quit_from_download_handler},
+    {"UDP DOWNLOAD", NFHC_MODE_UDP_DOWNLOAD, NFHS_ALLOW_UDP_DOWNLOAD,
+        &__vf_client_dataexchange_udp_download, &__vf_client_quit_from_download_handler},
+    {"UDP UPLOAD", NFHC_MODE_UDP_UPLOAD, NFHS_ALLOW_UDP_UPLOAD,
+        &__vf_client_dataexchange_udp_upload, &__vf_client_quit_from_upload_handler},
+    {"SUBSCRIBE", NFHC_MODE_SUBSCRIBE, NFHS_ALLOW_SUBSCRIBE,
+        &__vf_client_dataexchange_subscribe, &__vf_client_quit_from_download_handler},
+};
 
 // int main(int argc, char** argv)
 // {
@@ -38,35 +74,109 @@ static int __vf_client_quit_from_upload_handler(fsm_context *ctx);
     
 // }
 
-static int __vf_client_init(fsm_context *ctx)
+/**
+ * @brief Connect to a server.
+ * 
+ * @param host the server address, inet4 or "unix:<path>".
+ * @param port the server port.
+ * @return int the socket, -1 if failed.
+ */
+static int client_connect(const char *host, u_int16_t port)
 {
-    // mostly copied from `__vf_server_init` and `server_new`
-    // establish connection to the server
-    puts("Connecting to server...");
-    int s = socket(AF_INET, SOCK_STREAM, 0);
-    if (s < 0)
+    int s = transport_connect(host, port);
+    if (s >= 0)
+        tcp_set_congestion(s, getenv(ENV_TCP_CC));
+    // only TCP is encrypted, a local socket never leaves the host
+    if (s < 0 || !tls_client_enabled() || transport_of(s) != &transport_tcp)
+        return s;
+    int t = tls_connect(s, host);
+    if (t < 0)
+        close(s);
+    return t;
+}
+
+/**
+ * @brief Send a ModeSwitch instruction and expect the matching ALLOW message.
+ * 
+ * @param s the socket, handshake finished.
+ * @param modesw_cmd the ModeSwitch instruction.
+ * @param allow the expected ALLOW message.
+ * @return int 0 if the server allows, non-zero if failed.
+ */
+static int client_switch_mode(int s, const char *modesw_cmd, const char *allow)
+{
+    int write_sz;
+    if ((write_sz = write(s, modesw_cmd, LEN_NFHC_MODE_SWITCH)) != LEN_NFHC_MODE_SWITCH)
     {
-        int errsv = errno;
-        fprintf(stderr, "Failed to create socket: [errno %d] %s\n", errsv, strerror(errsv));
-FAILED:
-        ctx->state = FSM_DIE;
+        if (write_sz < 0)
+            perror("Failed to send MODESW command");
+        else
+            fprintf(stderr, "Cannot write %d bytes to socket:"
+                " %d bytes actually.\n", LEN_NFHC_MODE_SWITCH, write_sz);
         return -1;
     }
 
-    // parse host string
-    struct sockaddr_in addr;
-    if ((addr.sin_addr.s_addr = inet_addr(ctx->host)) == INADDR_NONE)
+    // wait for response
+    char read_buf[LEN_NFHS_ALLOW + 1];
+    int read_sz;
+    if ((read_sz = read_exactly(s, read_buf, LEN_NFHS_ALLOW)) != LEN_NFHS_ALLOW)
     {
-        fprintf(stderr, "Invalid inet4 address: %s\n", ctx->host);
-        goto FAILED;
+        fprintf(stderr, "Cannot read %d bytes NFHS_ALLOW from socket:"
+            " %d bytes actually.\n", LEN_NFHS_ALLOW, read_sz);
+        return -1;
     }
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(ctx->port);
+    read_buf[LEN_NFHS_ALLOW] = '\0';
+    if (strcmp(read_buf, allow))
+    {
+        fprintf(stderr, "Bad response from server: \"%s\", failed to switch mode.\n", read_buf);
+        return -1;
+    }
+    return 0;
+}
 
-    if (connect(s, (struct sockaddr *)&addr, sizeof(addr)))
+/**
+ * @brief Ask the server to use the congestion control of env NFH_TCP_CC on its end too, if it is set.
+ *
+ * @param s the socket, handshake finished.
+ * @return int 0 if the server replied, whether it used it or not, non-zero if failed.
+ */
+static int client_switch_congestion(int s)
+{
+    const char *cc = getenv(ENV_TCP_CC);
+    if (!cc || !*cc)
+        return 0;
+    if (write_exactly(s, NFHC_MODE_CONGESTION, LEN_NFHC_MODE_SWITCH) < 0 || send_path_request(s, cc))
     {
-        perror("Failed to connect to server");
-        goto FAILED;
+        perror("Failed to send MODESW command");
+        return -1;
+    }
+    char read_buf[LEN_NFHS_ALLOW + 1];
+    if (read_exactly(s, read_buf, LEN_NFHS_ALLOW) != LEN_NFHS_ALLOW)
+    {
+        fprintf(stderr, "Cannot read NFHS_ALLOW from socket.\n");
+        return -1;
+    }
+    read_buf[LEN_NFHS_ALLOW] = '\0';
+    if (!strcmp(read_buf, NFHS_REFUSE_CONGESTION))
+        fprintf(stderr, "The server cannot use congestion control %s, it keeps its default.\n", cc);
+    else if (strcmp(read_buf, NFHS_ALLOW_CONGESTION))
+    {
+        fprintf(stderr, "Bad response from server: \"%s\", failed to switch congestion control.\n", read_buf);
+        return -1;
+    }
+    return 0;
+}
+
+static int __vf_client_init(fsm_context *ctx)
+{
+    // mostly copied from `__vf_server_init` and `server_new`
+    // establish connection to the server
+    puts("Connecting to server...");
+    int s = client_connect(ctx->host, ctx->port);
+    if (s < 0)
+    {
+        ctx->state = FSM_DIE;
+        return -1;
     }
 
     // connected successfully
@@ -128,85 +238,40 @@ static int __vf_client_modeswitch(fsm_context *ctx)
     // read mode from stdin
     // send ModeSwitch command to server
     const int s = ctx->socket;
-    const int mode_upload = 2, mode_download = 1;
+    const int mode_count = sizeof(client_modes) / sizeof(client_modes[0]);
     int mode = 0;
     do
     {
-        printf("Select mode ([%d] DOWNLOAD, [%d] UPLOAD): ", mode_download, mode_upload);
-    } while (scanf("%d", &mode) != 1 || (mode != mode_upload && mode != mode_download));
-    
-    char *modesw_cmd;
-    if (mode == mode_download)
-        modesw_cmd = NFHC_MODE_DOWNLOAD;
-    else if (mode == mode_upload)
-        modesw_cmd = NFHC_MODE_UPLOAD;
-    else
-        ASSERT2(0, "should not go here");
-    
-    int write_sz;
-    if ((write_sz = write(s, modesw_cmd, LEN_NFHC_MODE_SWITCH) != LEN_NFHC_MODE_SWITCH))
-    {
-        if (write_sz < 0)
-        {
-            perror("Failed to send MODESW command");
-VF_C_MS_FAILED:
-            ctx->state = FSM_DIE;
-            return -1;
-        }
-        else
-        {
-            fprintf(stderr, "Cannot write %d bytes to socket:"
-                " %d bytes actually.\n", LEN_NFHC_MODE_SWITCH, write_sz);
-            goto VF_C_MS_FAILED;
-        }
-    }
+        printf("Select mode (");
+        for (int i = 0; i < mode_count; ++i)
+            printf("%s[%d] %s", i ? ", " : "", i + 1, client_modes[i].name);
+        printf("): ");
+    } while (scanf("%d", &mode) != 1 || mode < 1 || mode > mode_count);
 
-    // switched successfully
-    // wait for response
-    char read_buf[LEN_NFHS_ALLOW + 1];
-    int read_sz;
-    if ((read_sz = read_exactly(s, read_buf, LEN_NFHS_ALLOW)) != LEN_NFHS_ALLOW)
+    const struct client_mode *m = &client_modes[mode - 1];
+    if (client_switch_congestion(s) || client_switch_mode(s, m->modesw, m->allow))
     {
-        if (write_sz < 0)
-        {
-            perror("Failed to read SA.ALLOW command");
-            goto VF_C_MS_FAILED;
-        }
-        else
-        {
-            fprintf(stderr, "Cannot read %d bytes NFHS_ALLOW from socket:"
-                " %d bytes actually.\n", LEN_NFHC_MODE_SWITCH, read_sz);
-            goto VF_C_MS_FAILED;
-        }
+        ctx->state = FSM_DIE;
+        return -1;
     }
 
-    // read successfully
-    // check message semantic
+    // switched successfully
     // bind vfunc
-    if (mode == mode_upload && !strcmp(read_buf, NFHS_ALLOW_UPLOAD))
-    {
-        // success
-        ctx->vf_dataexchange_handler = __vf_client_dataexchange_upload;
-        ctx->vf_quit_handler = &__vf_client_quit_from_upload_handler;
-        ctx->state = FSM_DE;
-        puts("Switch mode to UPLOAD.");
-        return 0;
-    }
-    if (mode == mode_download && !strcmp(read_buf, NFHS_ALLOW_DOWNLOAD))
-    {
-        // success
-        ctx->vf_dataexchange_handler = __vf_client_dataexchange_download;
-        ctx->vf_quit_handler = &__vf_client_quit_from_download_handler;
-        ctx->state = FSM_DE;
-        puts("Switch mode to DOWNLOAD.");
-        return 0;
-    }
-
-    fprintf(stderr, "Bad response from server: \"%s\", failed to switch mode.\n", read_buf);
-    return -1;
+    ctx->vf_dataexchange_handler = m->de_handler;
+    ctx->vf_quit_handler = m->quit_handler;
+    ctx->state = FSM_DE;
+    printf("Switch mode to %s.\n", m->name);
+    return 0;
 }
 
-static int __vf_client_dataexchange_upload(fsm_context *ctx)
+/**
+ * @brief Pick a file and send it to the server.
+ *
+ * @param ctx the session.
+ * @param udp 1 to send the content over UDP, if the server offers it.
+ * @return int 0 if success, non-zero if failed.
+ */
+static int client_upload(fsm_context *ctx, int udp)
 {
     const int s = ctx->socket;
     // select a file, then send it
@@ -274,7 +339,16 @@ C_DE_U_FAIL:
 
     puts("Sending file content...");
 
-    if (send_file(s, fp))
+    int r = 1;
+    udp_channel ch;
+    if (udp && !(r = udp_channel_accept(s, &ch)))
+    {
+        r = udp_send_file(&ch, s, fileno(fp), a.st_size, NULL, 0);
+        udp_channel_close(&ch);
+    }
+    if (r > 0)
+        r = send_file(s, fp, NULL);
+    if (r)
     {
         goto C_DE_U_FAIL;
     }
@@ -284,7 +358,24 @@ C_DE_U_FAIL:
     return 0;
 }
 
-static int __vf_client_dataexchange_download(fsm_context *ctx)
+static int __vf_client_dataexchange_upload(fsm_context *ctx)
+{
+    return client_upload(ctx, 0);
+}
+
+static int __vf_client_dataexchange_udp_upload(fsm_context *ctx)
+{
+    return client_upload(ctx, 1);
+}
+
+/**
+ * @brief Pick one of the server's files and save it.
+ *
+ * @param ctx the session.
+ * @param udp 1 to receive the content over UDP, if the server offers it.
+ * @return int 0 if success, non-zero if failed.
+ */
+static int client_download(fsm_context *ctx, int udp)
 {
     const int s = ctx->socket;
     // receive file list
@@ -393,7 +484,17 @@ C_DE_D_FAIL_FREE:
     const uint64_t total_size = file_list[file_id].size;
     const char *file_name = file_list[file_id].name;
     printf("Receiving file %s...\n", file_name);
-    if (receive_file(s, fp_save, total_size))
+    int r = 1;
+    udp_channel ch;
+    if (udp && !(r = udp_channel_accept(s, &ch)))
+    {
+        fflush(fp_save);
+        r = udp_receive_file(&ch, s, fileno(fp_save), total_size, 0);
+        udp_channel_close(&ch);
+    }
+    if (r > 0)
+        r = receive_file(s, fp_save, total_size, NULL);
+    if (r)
     {
         // failed
         fclose(fp_save);
@@ -405,6 +506,519 @@ C_DE_D_FAIL_FREE:
     return 0;
 }
 
+static int __vf_client_dataexchange_download(fsm_context *ctx)
+{
+    return client_download(ctx, 0);
+}
+
+static int __vf_client_dataexchange_udp_download(fsm_context *ctx)
+{
+    return client_download(ctx, 1);
+}
+
+// files to pull in tree mode, shared by the fetch threads
+struct tree_job
+{
+    char *path;           // relative to the tree root
+    u_int64_t size;
+    u_int64_t ts_modified;
+};
+
+struct tree_fetch
+{
+    const char *host;
+    u_int16_t port;
+    const char *root;     // remote root, "" for the whole server directory
+    int local_fd;         // local root directory
+    struct tree_job *jobs;
+    size_t job_count;
+    size_t next_job;      // accessed atomically
+    size_t done, failed;  // accessed atomically
+};
+
+static void *__tree_fetch_thread(void *arg)
+{
+    // one connection in Fetch mode, pulling jobs until there are none
+    struct tree_fetch *tf = arg;
+    int s = client_connect(tf->host, tf->port);
+    if (s < 0)
+        return NULL;
+    if (send_handshake(s) || expect_handshake(s) || client_switch_congestion(s)
+        || client_switch_mode(s, NFHC_MODE_FETCH, NFHS_ALLOW_FETCH))
+        goto FETCH_THREAD_END;
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    size_t i;
+    char remote[MAX_PATH_LENGTH + 2];
+    while ((i = __atomic_fetch_add(&tf->next_job, 1, __ATOMIC_SEQ_CST)) < tf->job_count)
+    {
+        struct tree_job *job = &tf->jobs[i];
+        if ((size_t)snprintf(remote, sizeof(remote), "%s%s%s", tf->root, *tf->root ? "/" : "", job->path)
+            > MAX_PATH_LENGTH)
+        {
+            fprintf(stderr, "Path is too long: %s/%s. Skip.\n", tf->root, job->path);
+            __atomic_fetch_add(&tf->failed, 1, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        u_int64_t size;
+        if (send_path_request(s, remote) || read_exactly(s, &size, sizeof(size)) != sizeof(size))
+            goto FETCH_THREAD_END;
+        if (size == FETCH_NOT_FOUND)
+        {
+            fprintf(stderr, "Server cannot send `%s`. Skip.\n", remote);
+            __atomic_fetch_add(&tf->failed, 1, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        // the content has to be read even if it can't be saved
+        int fd = open_beneath(tf->local_fd, job->path, O_WRONLY | O_CREAT | O_TRUNC, 0644, 1);
+        FILE *fp = fd < 0 ? fopen("/dev/null", "wb") : fdopen(fd, "wb");
+        if (!fp)
+        {
+            perror("Cannot open file");
+            if (fd >= 0)
+                close(fd);
+            goto FETCH_THREAD_END;
+        }
+        int r = receive_file_ex(s, fp, size, NULL, TRANSFER_QUIET);
+        if (fd >= 0 && !r)
+        {
+            struct timespec times[2] = {{0, UTIME_OMIT}, {job->ts_modified, 0}};
+            futimens(fd, times);
+        }
+        fclose(fp);
+        if (r)
+            goto FETCH_THREAD_END;
+        if (fd < 0)
+        {
+            fprintf(stderr, "Cannot save `%s`. Skip.\n", job->path);
+            __atomic_fetch_add(&tf->failed, 1, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        __atomic_fetch_add(&tf->done, 1, __ATOMIC_SEQ_CST);
+    }
+
+    // end of Fetch phase, the receiver says BYE first
+    if (!send_path_request(s, "") && !send_bye_message(s))
+        receive_bye_message(s);
+FETCH_THREAD_END:
+    close(s);
+    return NULL;
+}
+
+static int __vf_client_dataexchange_tree(fsm_context *ctx)
+{
+    const int s = ctx->socket;
+    char root[MAX_PATH_LENGTH + 1], save_to[256];
+    do
+    {
+        printf("Remote directory (. for everything):");
+    } while (scanf("%4095s", root) != 1 || (strcmp(root, ".") && !is_safe_relative_path(root)));
+    if (!strcmp(root, "."))
+        *root = '\0';
+    do
+    {
+        printf("Save to directory:");
+    } while (scanf("%255s", save_to) != 1);
+
+    mkdir(save_to, 0755);
+    struct tree_fetch tf;
+    memset(&tf, 0, sizeof(tf));
+    if ((tf.local_fd = open(save_to, O_RDONLY | O_DIRECTORY)) < 0)
+    {
+        perror("Cannot open directory");
+C_DE_T_FAIL:
+        ctx->state = FSM_DIE;
+        return -1;
+    }
+    if (send_path_request(s, root))
+        goto C_DE_T_FAIL_CLOSE;
+
+    // receive the manifest, create directories as they come
+    size_t job_cap = 0;
+    char path[MAX_PATH_LENGTH + 1];
+    uint64_t dir_count = 0, total_size = 0;
+    while (1)
+    {
+        struct tree_entry ent;
+        if (read_exactly(s, &ent, sizeof(ent)) != sizeof(ent))
+        {
+            fprintf(stderr, "Failed to read manifest.\n");
+            goto C_DE_T_FAIL_FREE;
+        }
+        if (ent.type == TREE_ENTRY_END)
+            break;
+        if (!ent.path_length || ent.path_length > MAX_PATH_LENGTH
+            || read_exactly(s, path, ent.path_length) != ent.path_length)
+        {
+            fprintf(stderr, "Corrupt manifest entry.\n");
+            goto C_DE_T_FAIL_FREE;
+        }
+        path[ent.path_length] = '\0';
+        if (memchr(path, '\0', ent.path_length) || !is_safe_relative_path(path))
+        {
+            fprintf(stderr, "Unsafe path from server: %s.\n", path);
+            goto C_DE_T_FAIL_FREE;
+        }
+        if (ent.type == TREE_ENTRY_DIR)
+        {
+            int fd = open_beneath(tf.local_fd, path, O_RDONLY | O_DIRECTORY, 0, 1);
+            if (fd < 0)
+                fprintf(stderr, "Cannot create directory `%s`.\n", path);
+            else
+                close(fd);
+            ++dir_count;
+        }
+        else if (ent.type == TREE_ENTRY_FILE)
+        {
+            if (tf.job_count == job_cap)
+            {
+                job_cap = job_cap ? job_cap * 2 : 1024;
+                struct tree_job *p = realloc(tf.jobs, sizeof(struct tree_job) * job_cap);
+                if (!p)
+                {
+                    fprintf(stderr, "Failed to malloc.\n");
+                    goto C_DE_T_FAIL_FREE;
+                }
+                tf.jobs = p;
+            }
+            struct tree_job *job = &tf.jobs[tf.job_count];
+            if (!(job->path = strdup(path)))
+            {
+                fprintf(stderr, "Failed to malloc.\n");
+                goto C_DE_T_FAIL_FREE;
+            }
+            job->size = ent.size;
+            job->ts_modified = ent.ts_modified;
+            total_size += ent.size;
+            ++tf.job_count;
+        }
+    }
+    printf("Server offers %" PRIu64 " directories, %zu files, %" PRIu64 " bytes in total.\n",
+        dir_count, tf.job_count, total_size);
+
+    // pull files in parallel
+    tf.host = ctx->host;
+    tf.port = ctx->port;
+    tf.root = root;
+    pthread_t tids[TREE_FETCH_CONNECTIONS];
+    int started = 0;
+    struct timespec ts_start, ts_end;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts_start);
+    for (; started < TREE_FETCH_CONNECTIONS && started < tf.job_count; ++started)
+    {
+        if (pthread_create(&tids[started], NULL, &__tree_fetch_thread, &tf))
+            break;
+    }
+    for (int i = 0; i < started; ++i)
+        pthread_join(tids[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts_end);
+    uint64_t delta_us = (ts_end.tv_sec - ts_start.tv_sec) * 1000000 + (ts_end.tv_nsec - ts_start.tv_nsec) / 1000;
+    printf("Fetched %zu of %zu files in %.2fs with %d connections, %zu failed.\n",
+        tf.done, tf.job_count, delta_us / 1.0E6, started, tf.failed);
+    int incomplete = tf.done != tf.job_count;
+
+    for (size_t i = 0; i < tf.job_count; ++i)
+        free(tf.jobs[i].path);
+    free(tf.jobs);
+    close(tf.local_fd);
+    if (incomplete)
+    {
+        ctx->state = FSM_DIE;
+        return -1;
+    }
+    ctx->state = FSM_Q;
+    return 0;
+
+C_DE_T_FAIL_FREE:
+    for (size_t i = 0; i < tf.job_count; ++i)
+        free(tf.jobs[i].path);
+    free(tf.jobs);
+C_DE_T_FAIL_CLOSE:
+    close(tf.local_fd);
+    goto C_DE_T_FAIL;
+}
+
+static int __vf_client_dataexchange_archive_upload(fsm_context *ctx)
+{
+    // select files and directories, then send them all in one archive stream
+    const int s = ctx->socket;
+    char path[MAX_PATH_LENGTH + 1];
+    struct archive_list list;
+    archive_list_init(&list);
+    while (1)
+    {
+        printf("Input file or directory to send (/ to finish):");
+        if (scanf("%4095s", path) != 1 || !strcmp(path, "/"))
+            break;
+        if (archive_list_add(&list, AT_FDCWD, path, 0))
+            puts("Cannot send it! Try again.");
+    }
+
+    puts("Sending files...");
+    struct archive_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    struct timespec ts_start, ts_end;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts_start);
+    int r = archive_send(s, &list, NULL, &stats);
+    archive_list_free(&list);
+    uint64_t result[2];
+    if (r || read_exactly(s, result, sizeof(result)) != sizeof(result))
+    {
+        fprintf(stderr, "Failed to send files.\n");
+        ctx->state = FSM_DIE;
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts_end);
+    uint64_t delta_us = (ts_end.tv_sec - ts_start.tv_sec) * 1000000 + (ts_end.tv_nsec - ts_start.tv_nsec) / 1000;
+    printf("Sent %" PRIu64 " files (%" PRIu64 " bytes) in %.2fs, %" PRIu64 " unreadable.\n",
+        stats.files, stats.bytes, delta_us / 1.0E6, stats.failed);
+    printf("Server saved %" PRIu64 " files, %" PRIu64 " skipped.\n", result[0], result[1]);
+    ctx->state = FSM_Q;
+    return 0;
+}
+
+static int __vf_client_dataexchange_archive_download(fsm_context *ctx)
+{
+    // request files and directories, then unpack the archive stream
+    const int s = ctx->socket;
+    char path[MAX_PATH_LENGTH + 1], save_to[256];
+    do
+    {
+        printf("Remote file or directory (. for everything):");
+    } while (scanf("%4095s", path) != 1 || (strcmp(path, ".") && !is_safe_relative_path(path)));
+    if (strcmp(path, "."))
+    {
+        // more selections, an empty request ends the list
+        do
+        {
+            if (!is_safe_relative_path(path))
+                puts("Invalid path! Try again.");
+            else if (send_path_request(s, path))
+                goto C_DE_A_FAIL;
+            printf("More remote files or directories (/ to finish):");
+        } while (scanf("%4095s", path) == 1 && strcmp(path, "/"));
+    }
+    if (send_path_request(s, ""))
+        goto C_DE_A_FAIL;
+    do
+    {
+        printf("Save to directory:");
+    } while (scanf("%255s", save_to) != 1);
+
+    mkdir(save_to, 0755);
+    int dirfd = open(save_to, O_RDONLY | O_DIRECTORY);
+    if (dirfd < 0)
+    {
+        perror("Cannot open directory");
+C_DE_A_FAIL:
+        ctx->state = FSM_DIE;
+        return -1;
+    }
+    puts("Receiving files...");
+    struct archive_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    struct timespec ts_start, ts_end;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts_start);
+    int r = archive_receive(s, dirfd, 0, NULL, &stats);
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts_end);
+    close(dirfd);
+    if (r)
+        goto C_DE_A_FAIL;
+    uint64_t delta_us = (ts_end.tv_sec - ts_start.tv_sec) * 1000000 + (ts_end.tv_nsec - ts_start.tv_nsec) / 1000;
+    printf("Received %" PRIu64 " directories, %" PRIu64 " files (%" PRIu64 " bytes) in %.2fs, %" PRIu64 " not saved.\n",
+        stats.dirs, stats.files, stats.bytes, delta_us / 1.0E6, stats.failed);
+    ctx->state = FSM_Q;
+    return 0;
+}
+
+static int __vf_client_dataexchange_digest(fsm_context *ctx)
+{
+    // get the tree hash of a stored file, and tell which chunks of the local copy differ
+    const int s = ctx->socket;
+    char name[MAX_FILENAME_LENGTH + 1], local[4096];
+    struct tree_digest_header h;
+    struct tree_digest remote, mine;
+    memset(&remote, 0, sizeof(remote));
+    memset(&mine, 0, sizeof(mine));
+    do
+    {
+        printf("Remote file:");
+    } while (scanf("%255s", name) != 1 || !is_safe_relative_path(name));
+    do
+    {
+        printf("Local file:");
+    } while (scanf("%4095s", local) != 1);
+    if (send_path_request(s, name))
+        goto C_DE_D_FAIL;
+
+    if (read_exactly(s, &h, sizeof(h)) != sizeof(h))
+    {
+        fprintf(stderr, "Failed to read digest.\n");
+        goto C_DE_D_FAIL;
+    }
+    if (h.size == FETCH_NOT_FOUND)
+    {
+        printf("Server cannot hash %s.\n", name);
+        ctx->state = FSM_Q;
+        return 0;
+    }
+    if (h.chunk_size != TREE_HASH_CHUNK_SIZE
+        || h.chunk_count != (h.size ? (h.size + TREE_HASH_CHUNK_SIZE - 1) / TREE_HASH_CHUNK_SIZE : 1))
+    {
+        fprintf(stderr, "Bad digest: %" PRIu64 " chunks of %" PRIu64 " bytes for %" PRIu64 " bytes.\n",
+            h.chunk_count, h.chunk_size, h.size);
+        goto C_DE_D_FAIL;
+    }
+    remote.size = h.size;
+    remote.chunk_count = h.chunk_count;
+    if (!(remote.leaves = malloc(h.chunk_count * TREE_HASH_SIZE))
+        || read_exactly(s, remote.leaves, h.chunk_count * TREE_HASH_SIZE) != h.chunk_count * TREE_HASH_SIZE)
+    {
+        fprintf(stderr, "Failed to read digest.\n");
+        goto C_DE_D_FAIL;
+    }
+    // the leaves are only trusted if they make the root
+    if (tree_hash_root(remote.leaves, remote.chunk_count, remote.size, remote.root)
+        || memcmp(remote.root, h.root, TREE_HASH_SIZE))
+    {
+        fprintf(stderr, "Bad digest: the leaves don't match the root.\n");
+        goto C_DE_D_FAIL;
+    }
+
+    FILE *fp = fopen(local, "rb");
+    if (!fp)
+    {
+        perror("Cannot open local file");
+        ctx->state = FSM_Q;
+        tree_digest_free(&remote);
+        return 0;
+    }
+    struct timespec ts_start, ts_end;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts_start);
+    int r = tree_hash_file(fp, 0, &mine);
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts_end);
+    fclose(fp);
+    if (r)
+        goto C_DE_D_FAIL;
+    uint64_t delta_us = (ts_end.tv_sec - ts_start.tv_sec) * 1000000 + (ts_end.tv_nsec - ts_start.tv_nsec) / 1000;
+    printf("Hashed %" PRIu64 " bytes in %.2fs (%.2fMB/s).\n", mine.size, delta_us / 1.0E6,
+        delta_us ? mine.size / 1.0 / delta_us : 0);
+
+    // compare chunk by chunk, a chunk the local copy doesn't have differs
+    uint64_t matched = 0, ranges = 0;
+    for (uint64_t i = 0; i < remote.chunk_count; )
+    {
+        if (i < mine.chunk_count && !memcmp(remote.leaves + i * TREE_HASH_SIZE, mine.leaves + i * TREE_HASH_SIZE, TREE_HASH_SIZE))
+        {
+            ++matched;
+            ++i;
+            continue;
+        }
+        uint64_t end = i + 1;
+        while (end < remote.chunk_count && (end >= mine.chunk_count
+            || memcmp(remote.leaves + end * TREE_HASH_SIZE, mine.leaves + end * TREE_HASH_SIZE, TREE_HASH_SIZE)))
+            ++end;
+        if (++ranges <= 16)
+            printf("Differs: bytes [%" PRIu64 ", %" PRIu64 ").\n", i * TREE_HASH_CHUNK_SIZE,
+                end == remote.chunk_count ? remote.size : end * TREE_HASH_CHUNK_SIZE);
+        i = end;
+    }
+    if (ranges > 16)
+        printf("... %" PRIu64 " ranges differ in total.\n", ranges);
+    if (!memcmp(remote.root, mine.root, TREE_HASH_SIZE))
+        printf("%s matches %s.\n", local, name);
+    else
+        printf("%s differs from %s: %" PRIu64 " of %" PRIu64 " chunks match, %" PRIu64 " of %" PRIu64 " bytes here.\n",
+            local, name, matched, remote.chunk_count, mine.size, remote.size);
+    tree_digest_free(&remote);
+    tree_digest_free(&mine);
+    ctx->state = FSM_Q;
+    return 0;
+
+C_DE_D_FAIL:
+    tree_digest_free(&remote);
+    ctx->state = FSM_DIE;
+    return -1;
+}
+
+static int __vf_client_dataexchange_subscribe(fsm_context *ctx)
+{
+    // print the server's changes until the connection ends, keeping the cursor in a file to resume from
+    static const char *types[] = {"?", "ADD", "MODIFY", "DELETE", "EXISTS", "SYNC"};
+    const int s = ctx->socket;
+    char cursor_file[4096];
+    do
+    {
+        printf("Cursor file:");
+    } while (scanf("%4095s", cursor_file) != 1);
+    int fd = open(cursor_file, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        perror("Cannot open cursor file");
+C_DE_S_FAIL:
+        if (fd >= 0)
+            close(fd);
+        ctx->state = FSM_DIE;
+        return -1;
+    }
+    struct notify_request req;
+    if (pread(fd, &req, sizeof(req), 0) != sizeof(req))
+        memset(&req, 0, sizeof(req)); // a new file, start with a snapshot
+    struct notify_hello hello;
+    if (write_exactly(s, &req, sizeof(req)) != sizeof(req)
+        || read_exactly(s, &hello, sizeof(hello)) != sizeof(hello))
+    {
+        fprintf(stderr, "Failed to subscribe.\n");
+        goto C_DE_S_FAIL;
+    }
+    if (hello.reset)
+        printf("Snapshot of epoch %016" PRIx64 " follows.\n", hello.epoch);
+    else
+        printf("Resuming from event %" PRIu64 ".\n", hello.cursor);
+    // the cursor is only good once the snapshot is complete
+    struct notify_request saved = {hello.epoch, hello.cursor};
+    int in_snapshot = hello.reset;
+    while (1)
+    {
+        struct notify_event ev;
+        char name[MAX_FILENAME_LENGTH + 1];
+        const ssize_t n = read_exactly(s, &ev, sizeof(ev));
+        if (!n)
+            break;
+        if (n != sizeof(ev) || ev.name_length > MAX_FILENAME_LENGTH || ev.type < NOTIFY_ADD || ev.type > NOTIFY_SYNC
+            || read_exactly(s, name, ev.name_length) != ev.name_length)
+        {
+            fprintf(stderr, "Bad event from the server.\n");
+            goto C_DE_S_FAIL;
+        }
+        name[ev.name_length] = '\0';
+        if (ev.type == NOTIFY_SYNC)
+        {
+            puts("Snapshot complete, following changes.");
+            in_snapshot = 0;
+        }
+        else if (ev.seq)
+        {
+            printf("%8" PRIu64 " %-6s %12" PRIu64 " %s\n", ev.seq, types[ev.type], ev.size, name);
+            saved.cursor = ev.seq + 1;
+        }
+        else
+            printf("%8s %-6s %12" PRIu64 " %s\n", "-", types[ev.type], ev.size, name);
+        if (!in_snapshot && ev.type != NOTIFY_EXISTS && pwrite(fd, &saved, sizeof(saved), 0) != sizeof(saved))
+        {
+            perror("Cannot save the cursor");
+            goto C_DE_S_FAIL;
+        }
+    }
+    puts("Server closed the change feed.");
+    close(fd);
+    // no Quit phase, the feed ends with the connection
+    ctx->state = FSM_DIE;
+    return 0;
+}
+
 static int __vf_client_quit_from_upload_handler(fsm_context *ctx)
 {
     // obey to `vfunc_quit_handler`
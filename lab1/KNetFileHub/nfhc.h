@@ -2,6 +2,8 @@
 #define __NFHC_H
 
 #include "nfh.h"
+#include "archive.h"
+#include "tls.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
@@ -9,6 +11,9 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <libgen.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
 
 fsm_context *client_new(char *host, u_int16_t port);
 void client_delete(fsm_context *ctx);
@@ -14,6 +14,50 @@ static int __vf_server_dataexchange_upload(fsm_context *ctx);
 static int __vf_server_dataexchange_download(fsm_context *ctx);
 static int __vf_server_quit_from_upload_handler(fsm_context *ctx);
 static int __vf_server_quit_from_download_handler(fsm_context *ctx);
+static int __vf_server_session_die(fsm_context *ctx);
+static int __vf_server_dataexchange_tree(fsm_context *ctx);
+static int __vf_server_dataexchange_fetch(fsm_context *ctx);
+static int __vf_server_dataexchange_archive_upload(fsm_context *ctx);
+static int __vf_server_dataexchange_archive_download(fsm_context *ctx);
+static int __vf_server_dataexchange_digest(fsm_context *ctx);
+static int __vf_server_dataexchange_udp_upload(fsm_context *ctx);
+static int __vf_server_dataexchange_udp_download(fsm_context *ctx);
+static int __vf_server_dataexchange_subscribe(fsm_context *ctx);
+
+// modes a client may switch to
+static const struct server_mode
+{
+    const char *modesw;   // ModeSwitch instruction from the client
+    const char *allow;    // ALLOW message to reply
+    const char *name;
+    const char *description;
+    vfunc_dataexchange_handler *de_handler;
+    vfunc_quit_handler *quit_handler;
+    int flat_only;        // works on the directory tree of the working directory, which only the flat backend keeps files in
+} server_modes[] = {
+    {NFHC_MODE_UPLOAD, NFHS_ALLOW_UPLOAD, "UPLOAD", "upload",
+        &__vf_server_dataexchange_upload, &__vf_server_quit_from_upload_handler},
+    {NFHC_MODE_DOWNLOAD, NFHS_ALLOW_DOWNLOAD, "DOWNLOAD", "download",
+        &__vf_server_dataexchange_download, &__vf_server_quit_from_download_handler},
+    {NFHC_MODE_TREE, NFHS_ALLOW_TREE, "TREE", "copy a directory tree",
+        &__vf_server_dataexchange_tree, &__vf_server_quit_from_download_handler, 1},
+    {NFHC_MODE_FETCH, NFHS_ALLOW_FETCH, "FETCH", "fetch files",
+        &__vf_server_dataexchange_fetch, &__vf_server_quit_from_download_handler, 1},
+    {NFHC_MODE_ARCHIVE_UPLOAD, NFHS_ALLOW_ARCHIVE_UPLOAD, "AGGREGATE UPLOAD", "upload many files",
+        &__vf_server_dataexchange_archive_upload, &__vf_server_quit_from_upload_handler, 1},
+    {NFHC_MODE_ARCHIVE_DOWNLOAD, NFHS_ALLOW_ARCHIVE_DOWNLOAD, "AGGREGATE DOWNLOAD", "download many files",
+        &__vf_server_dataexchange_archive_download, &__vf_server_quit_from_download_handler, 1},
+    {NFHC_MODE_DIGEST, NFHS_ALLOW_DIGEST, "DIGEST", "check a file",
+        &__vf_server_dataexchange_digest, &__vf_server_quit_from_download_handler},
+    {NFHC_MODE_UDP_UPLOAD, NFHS_ALLOW_UDP_UPLOAD, "UDP UPLOAD", "upload over UDP",
+        &__vf_server_dataexchange_udp_upload, &__vf_server_quit_from_upload_handler},
+    {NFHC_MODE_UDP_DOWNLOAD, NFHS_ALLOW_UDP_DOWNLOAD, "UDP DOWNLOAD", "download over UDP",
+        &__vf_server_dataexchange_udp_download, &__vf_server_quit_from_download_handler},
+    {NFHC_MODE_SUBSCRIBE, NFHS_ALLOW_SUBSCRIBE, "SUBSCRIBE", "follow changes",
+        &__vf_server_dataexchange_subscribe, &__vf_server_quit_from_download_handler},
+};
+
+static int session_count = 0; // sessions being served, accessed atomically
 
 fsm_context *server_new(char *host, u_int16_t port)
 {
@@ -98,11 +142,91 @@ void server_delete(fsm_context *ctx)
 {
     if (!ctx)
         return;
+    if (ctx->local_socket >= 0)
+        close(ctx->local_socket);
     // call super destructor
     del_fsm_context(ctx);
 }
 
 
+static void *__server_session_thread(void *arg)
+{
+    // run the session FSM from Handshake to Stop, then release it
+    fsm_context *sess = arg;
+    sess->trace = trace_session_open();
+    trace_event(sess->trace, TRACE_CONNECT, 0);
+    sess->tcp_socket = strcmp(sess->peer_name, "local") ? sess->client_socket : -1;
+    // the TLS handshake comes before NFH.HELLO, and is made here so a slow client holds only its own thread
+    if (tls_server_enabled() && strcmp(sess->peer_name, "local"))
+    {
+        int s = tls_accept(sess->client_socket);
+        if (s < 0)
+        {
+            sess->vf_connection_die(sess);
+            goto DONE;
+        }
+        sess->client_socket = s;
+    }
+    sess->vf_fsm(sess);
+DONE:
+    trace_event(sess->trace, TRACE_CLOSE, 0);
+    del_fsm_context(sess);
+    __atomic_fetch_sub(&session_count, 1, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+/**
+ * @brief Create a session for a newly accepted client, and serve it in a new thread.
+ * 
+ * @param ctx the server (greeting) instance.
+ * @param s the client socket.
+ * @param peer the client address.
+ * @return int 0 if success, non-zero if failed. The client socket is not closed if failed.
+ */
+static int server_spawn_session(fsm_context *ctx, int s, const struct sockaddr_storage *peer)
+{
+    fsm_context *sess = new_fsm_context(ctx->host, ctx->port);
+    if (!sess)
+        return -1;
+    // the session shares the server's vfuncs, except that it stops when the client is gone
+    sess->vf_init = ctx->vf_init;
+    sess->vf_handshake = ctx->vf_handshake;
+    sess->vf_modeswitch = ctx->vf_modeswitch;
+    sess->vf_connection_die = &__vf_server_session_die;
+    sess->client_socket = s;
+    sess->store = ctx->store;
+    if (peer->ss_family == AF_INET)
+        inet_ntop(AF_INET, &((struct sockaddr_in *)peer)->sin_addr, sess->peer_name, sizeof(sess->peer_name));
+    else if (peer->ss_family == AF_INET6)
+        inet_ntop(AF_INET6, &((struct sockaddr_in6 *)peer)->sin6_addr, sess->peer_name, sizeof(sess->peer_name));
+    else if (peer->ss_family == AF_UNIX)
+        strcpy(sess->peer_name, "local");
+    if (!(sess->bw = bw_session_open(sess->peer_name)))
+    {
+        fprintf(stderr, "Failed to register client %s to the bandwidth scheduler.\n", sess->peer_name);
+        goto SPAWN_FAILED;
+    }
+    sess->state = FSM_HS;
+
+    pthread_t tid;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    __atomic_fetch_add(&session_count, 1, __ATOMIC_SEQ_CST);
+    int err = pthread_create(&tid, &attr, &__server_session_thread, sess);
+    pthread_attr_destroy(&attr);
+    if (err)
+    {
+        __atomic_fetch_sub(&session_count, 1, __ATOMIC_SEQ_CST);
+        fprintf(stderr, "Failed to create session thread [errno %d]: %s\n", err, strerror(err));
+        bw_session_close(sess->bw);
+SPAWN_FAILED:
+        del_fsm_context(sess);
+        return -1;
+    }
+    return 0;
+}
+
 static int __vf_server_init(fsm_context *ctx)
 {
     // mostly copied to `__vf_client_init`
@@ -110,8 +234,27 @@ static int __vf_server_init(fsm_context *ctx)
     // accept new connections
     printf("\nWaiting for clients...\n");
     int s;
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
     ASSERT2(ctx->socket >= 0, "Invalid greeting socket");
-    if ((s = accept(ctx->socket, NULL, NULL)) < 0)
+    int greeting = ctx->socket;
+    if (ctx->local_socket >= 0)
+    {
+        // same-host clients may come from the local socket
+        struct pollfd fds[2] = {{ .fd = ctx->socket, .events = POLLIN }, { .fd = ctx->local_socket, .events = POLLIN }};
+        while (poll(fds, 2, -1) < 0)
+        {
+            if (errno != EINTR)
+            {
+                perror("Failed to wait for new connection");
+                ctx->state = FSM_DIE;
+                return -1;
+            }
+        }
+        if (fds[1].revents & POLLIN)
+            greeting = ctx->local_socket;
+    }
+    if ((s = accept(greeting, (struct sockaddr *)&peer, &peer_len)) < 0)
     {
         // failed to accept
         // ctx->client_socket = -1; // in case we forgot to reset the socket
@@ -124,11 +267,37 @@ static int __vf_server_init(fsm_context *ctx)
     // connected successfully
 
     // new client
-    // update client socket
-    ctx->client_socket = s;
+    // serve it in a new session, this instance keeps accepting
+    if (__atomic_load_n(&session_count, __ATOMIC_SEQ_CST) >= SERVER_MAX_SESSIONS)
+    {
+        fprintf(stderr, "Too many clients (%d). Rejected.\n", SERVER_MAX_SESSIONS);
+        close(s);
+        return 0;
+    }
+    if (server_spawn_session(ctx, s, &peer))
+    {
+        fprintf(stderr, "Cannot serve new client.\n");
+        close(s);
+        return -1;
+    }
+
+    // stay in Init state
+    return 0;
+}
 
-    // go into Handshake state
-    ctx->state = FSM_HS;
+static int __vf_server_session_die(fsm_context *ctx)
+{
+    // the session version of `__vf_server_connection_die`
+    // there is no greeting socket, so just clean up and stop
+    if (ctx->client_socket != -1)
+    {
+        fprintf(stderr, "Disconnected from client %s.\n", ctx->peer_name);
+        close(ctx->client_socket);
+        ctx->client_socket = -1;
+    }
+    bw_session_close(ctx->bw);
+    ctx->bw = NULL;
+    ctx->state = FSM_STOP;
     return 0;
 }
 
@@ -189,11 +358,35 @@ HS_ERR_SUCCESS_ACCEPT_FAILED_READ:
     // now switch to ModeSwitch phase
     // wait for client selecting mode
     puts("Connection established.");
+    trace_event(ctx->trace, TRACE_HELLO, 0);
     ctx->state = FSM_MS;
     return 0;
 }
 
 
+/**
+ * @brief Use the congestion control the client asks for on this session's connection.
+ *
+ * @param ctx the session, in ModeSwitch phase, `MODESW.CONGCT` read.
+ * @return int 0 if the reply was sent, whether the congestion control was used or not, non-zero if failed.
+ */
+static int server_switch_congestion(fsm_context *ctx)
+{
+    const int s = ctx->client_socket;
+    char cc[MAX_PATH_LENGTH + 1];
+    if (receive_path_request(s, cc))
+        return -1;
+    // no other session is touched, a refused name leaves this one as it was
+    const int refused = ctx->tcp_socket < 0 || !*cc || tcp_set_congestion(ctx->tcp_socket, cc);
+    printf("Client asks for congestion control %s: %s.\n", cc, refused ? "refused" : "used");
+    if (write_exactly(s, refused ? NFHS_REFUSE_CONGESTION : NFHS_ALLOW_CONGESTION, LEN_NFHS_ALLOW) < 0)
+    {
+        perror("Failed to write to socket");
+        return -1;
+    }
+    return 0;
+}
+
 static int __vf_server_modeswitch(fsm_context *ctx)
 {
     // server read mode switch instruction
@@ -209,43 +402,47 @@ static int __vf_server_modeswitch(fsm_context *ctx)
         // compare length
         if (read_sz != LEN_NFHC_MODE_SWITCH)
         {
-            fprintf(stderr, "Invalid MODE_SWITCH instruction: %s instead of "
-                "`" NFHC_MODE_DOWNLOAD "` or `" NFHC_MODE_UPLOAD "`.\n", read_buf);
+            fprintf(stderr, "Invalid MODE_SWITCH instruction: %s.\n", read_buf);
             goto MS_FAILED;
         }
 
-        // do action
-        vfunc_dataexchange_handler *de_handler; // dataexchange handler
-        char *allow_message;
-        if (!strcmp(read_buf, NFHC_MODE_UPLOAD))
+        // not a mode, the session stays in ModeSwitch
+        if (!strcmp(read_buf, NFHC_MODE_CONGESTION))
         {
-            // upload
-            puts("Client wants to upload.");
-            de_handler = &__vf_server_dataexchange_upload;
-            allow_message = NFHS_ALLOW_UPLOAD;
-            ctx->vf_dataexchange_handler = &__vf_server_dataexchange_upload;
-            ctx->vf_quit_handler = &__vf_server_quit_from_upload_handler;
+            if (server_switch_congestion(ctx))
+                goto MS_FAILED;
+            return 0;
         }
-        else if (!strcmp(read_buf, NFHC_MODE_DOWNLOAD))
+
+        // do action
+        const struct server_mode *mode = NULL;
+        for (size_t i = 0; i < sizeof(server_modes) / sizeof(server_modes[0]); ++i)
         {
-            // download
-            puts("Client wants to download.");
-            de_handler = &__vf_server_dataexchange_download;
-            allow_message = NFHS_ALLOW_DOWNLOAD;
-            ctx->vf_dataexchange_handler = &__vf_server_dataexchange_download;
-            ctx->vf_quit_handler = &__vf_server_quit_from_download_handler;
+            if (!strcmp(read_buf, server_modes[i].modesw))
+                mode = &server_modes[i];
         }
-        else
+        if (!mode)
         {
             // invalid instruction
             fprintf(stderr, "Bad client: Invalid MODE_SWITCH instruction: %s.\n", read_buf);
             goto MS_FAILED;
         }
+        printf("Client wants to %s.\n", mode->description);
+        if (mode->flat_only && strcmp(ctx->store->kind, "flat"))
+        {
+            // the tree would be a second namespace next to the store, with the store's own files in it
+            fprintf(stderr, "Refused: %s mode needs the flat storage backend, not %s.\n", mode->name, ctx->store->kind);
+            if (write_exactly(s, NFHS_REFUSE_MODE, LEN_NFHS_ALLOW) < 0)
+                perror("Failed to write to socket");
+            goto MS_FAILED;
+        }
+        ctx->vf_dataexchange_handler = mode->de_handler;
+        ctx->vf_quit_handler = mode->quit_handler;
 
         // send ALLOW message
         puts("Sending ALLOW message...");
         int sz_write;
-        if ((sz_write = write(s, allow_message, LEN_NFHS_ALLOW)) != LEN_NFHS_ALLOW)
+        if ((sz_write = write(s, mode->allow, LEN_NFHS_ALLOW)) != LEN_NFHS_ALLOW)
         {
             if (sz_write == -1)
             {
@@ -259,11 +456,10 @@ static int __vf_server_modeswitch(fsm_context *ctx)
         }
 
         // update state
-        ctx->vf_dataexchange_handler = de_handler;
         ctx->state = FSM_DE;
+        trace_event(ctx->trace, TRACE_MODE, trace_mode_index(mode->modesw));
 
-        char *mode_name = ((void*)allow_message == (void*)NFHS_ALLOW_UPLOAD) ? "UPLOAD" : "DOWNLOAD";
-        printf("Switched to %s mode.\n", mode_name);
+        printf("Switched to %s mode.\n", mode->name);
         return 0;
     }
     else
@@ -276,9 +472,15 @@ MS_FAILED: // ModeSwitch failed
 }
 
 
-static int __vf_server_dataexchange_upload(fsm_context *ctx)
+/**
+ * @brief Receive one file from the client.
+ *
+ * @param ctx the session.
+ * @param udp 1 to offer a UDP channel for the content.
+ * @return int 0 if success, non-zero if failed.
+ */
+static int server_receive_upload(fsm_context *ctx, int udp)
 {
-    // polymorphic methods (of vfunc_dataexchange_handler)
     // accept one sa_c2s_file_preamble, then a byte seq with given size
     const int s = ctx->client_socket;
 
@@ -316,46 +518,100 @@ SERVER_DE_FAIL:
         goto SERVER_DE_FAIL;
     }
     printf("File name: %s, size: %" PRIu64 " bytes.\n", preamble.name, preamble.length);
+    trace_event(ctx->trace, TRACE_REQUEST, preamble.length);
 
-    // save file from socket
-    FILE *fp = fopen(preamble.name, "rb");
+    if (is_staging_temp_name(preamble.name))
+    {
+        fprintf(stderr, "File name is reserved: %s.\n", preamble.name);
+        goto SERVER_DE_FAIL;
+    }
 
     // check if the file already exists
-    if (fp)
+    // it is checked again when publishing, in case someone uploads the same name meanwhile
+    storage *store = ctx->store;
+    if (store->vf_exists(store, preamble.name))
     {
-        fclose(fp);
         fprintf(stderr, "File %s already exists. Cannot receive.\n", preamble.name);
         goto SERVER_DE_FAIL;
     }
 
-    // receive file
-    if (!(fp = fopen(preamble.name, "wb")))
-    {
-        int errsv = errno;
-        fprintf(stderr, "Cannot open file %s [errno %d]: %s\n",
-            preamble.name, errsv, strerror(errsv));
+    // receive file into an invisible, preallocated file
+    struct staged_file staged;
+    if (store->vf_stage(store, preamble.name, preamble.length, &staged))
         goto SERVER_DE_FAIL;
-    }
 
     __DEBUG("Receiving file content");
-    if (receive_file(s, fp, preamble.length))
+    trace_event(ctx->trace, TRACE_DATA_BEGIN, preamble.length);
+    // UDP is not encrypted, and needs a plain file to write anywhere in
+    int r = 1;
+    udp_channel ch;
+    if (udp && !(r = udp_channel_offer(s, staged.fd >= 0 && !tls_server_enabled(), &ch)))
     {
-        fclose(fp);
+        r = udp_receive_file(&ch, s, staged.fd, preamble.length, 0);
+        udp_channel_close(&ch);
+    }
+    if (r > 0)
+        r = receive_file(s, staged.fp, preamble.length, ctx->bw);
+    if (r)
+    {
+        staged_abort(&staged);
         fprintf(stderr, "Failed to receive file!\n");
         goto SERVER_DE_FAIL;
     }
 
+    trace_event(ctx->trace, TRACE_DATA_END, preamble.length);
+
+    // make it visible
+    if (store->vf_publish(store, preamble.name, &staged))
+        goto SERVER_DE_FAIL;
+    notify_post(NOTIFY_ADD, preamble.name, preamble.length, time(NULL));
+
     // success
-    fclose(fp);
     ctx->state = FSM_Q;
     printf("Received file %s successfully!\n", preamble.name);
     return 0;
 }
 
-static int __vf_server_dataexchange_download(fsm_context *ctx)
+static int __vf_server_dataexchange_upload(fsm_context *ctx)
 {
-    // polymorphic methods
+    // polymorphic methods (of vfunc_dataexchange_handler)
+    return server_receive_upload(ctx, 0);
+}
+
+static int __vf_server_dataexchange_udp_upload(fsm_context *ctx)
+{
+    return server_receive_upload(ctx, 1);
+}
+
+// files offered in DOWNLOAD mode
+struct file_listing
+{
+    struct so_s2c_file_entry *entries; // FILE_LIST_MAX entries
+    int count;
+};
+
+static int __server_list_visit(void *arg, const char *name, uint64_t size, uint64_t ts_modified)
+{
+    struct file_listing *l = arg;
+    if (strlen(name) > MAX_FILENAME_LENGTH)
+        return 0;
+    struct so_s2c_file_entry *e = &l->entries[l->count];
+    e->id = l->count;
+    strcpy(e->name, name);
+    e->size = size;
+    e->ts_modified = ts_modified; // Unix epoch (UTC)
+    return ++l->count == FILE_LIST_MAX;
+}
 
+/**
+ * @brief Offer the file list, then send the file the client picks.
+ *
+ * @param ctx the session.
+ * @param udp 1 to offer a UDP channel for the content.
+ * @return int 0 if success, non-zero if failed.
+ */
+static int server_send_download(fsm_context *ctx, int udp)
+{
     // firstly send file list
     // then get response (file selection) from client
     // then send file back to the client
@@ -363,55 +619,21 @@ static int __vf_server_dataexchange_download(fsm_context *ctx)
     int s = ctx->client_socket;
 
     // list files
-    DIR *dir = NULL;
-    struct dirent *entry;
-    dir = opendir(".");
-    const int list_sz = 1024;
-    const int list_bytes = sizeof(struct so_s2c_file_entry) * list_sz; // bytes of file_list buffer in memory
-    int p = 0;
-    struct so_s2c_file_entry *file_list = calloc(list_sz, list_bytes);
+    struct file_listing listing;
+    listing.count = 0;
+    listing.entries = calloc(FILE_LIST_MAX, sizeof(struct so_s2c_file_entry));
+    struct so_s2c_file_entry *file_list = listing.entries;
     if (!file_list)
     {
         fprintf(stderr, "Failed to malloc.\n");
 DE_DOWNLOAD_FAIL:
         ctx->state = FSM_DIE;
-        if (dir)
-            closedir(dir);
+        free(file_list);
         return -1;
     }
-    if (!dir)
-    {
-        perror("Cannot list files");
+    if (ctx->store->vf_list(ctx->store, &__server_list_visit, &listing))
         goto DE_DOWNLOAD_FAIL;
-    }
-    while ((entry = readdir(dir)))
-    {
-        if (entry->d_type != DT_REG)
-            continue; // skip non-regular files
-        file_list[p].id = p;
-        strcpy(file_list[p].name, entry->d_name);
-
-        FILE *fp = fopen(entry->d_name, "rb");
-        if (!fp)
-        {
-            fprintf(stderr, "Cannot open file `%s`. Skip.\n", entry->d_name);
-            continue;
-        }
-        struct stat a;
-        if (fstat(fileno(fp), &a))
-        {
-            perror("Error occurred in fstat");
-            fclose(fp);
-            goto DE_DOWNLOAD_FAIL;
-        }
-        fclose(fp);
-        file_list[p].size = a.st_size;
-        file_list[p].ts_modified = a.st_mtime; // Unix epoch (UTC)
-        if (++p == list_sz)
-            break;
-    }
-    closedir(dir);
-    dir = NULL;
+    int p = listing.count;
 
     // send file list to the client
     uint64_t buf_file_count;
@@ -447,6 +669,7 @@ DE_DOWNLOAD_FAIL:
         }
         goto DE_DOWNLOAD_FAIL;
     }
+    trace_event(ctx->trace, TRACE_LIST, p);
 
     // get client selection
     // and send file
@@ -475,20 +698,55 @@ DE_DOWNLOAD_FAIL:
     // good selection
     // send file data
     struct so_s2c_file_entry *file_ent = &file_list[client_selection];
-    FILE *fp = fopen(file_ent->name, "rb");
-    if (!fp)
+    trace_event(ctx->trace, TRACE_REQUEST, file_ent->size);
+
+    // small hot files are served from memory, if the backend keeps plain files
+    // same-host clients get the file itself, which is cheaper than copying it from memory
+    char path[PATH_MAX];
+    fcache_entry *cached = udp || transport_of(s) != &transport_tcp
+        || ctx->store->vf_path(ctx->store, file_ent->name, path, sizeof(path)) ? NULL : fcache_get(path);
+    if (cached)
     {
-        int errsv = errno;
-        fprintf(stderr, "Failed to open file %s [errno %d]: %s.\n", file_ent->name, errsv, strerror(errsv));
-        goto DE_DOWNLOAD_FAIL;
+        trace_event(ctx->trace, TRACE_DATA_BEGIN, cached->size);
+        int r = send_buffer(s, cached->data, cached->size, ctx->bw);
+        fcache_put(cached);
+        if (r)
+            goto DE_DOWNLOAD_FAIL;
+        trace_event(ctx->trace, TRACE_DATA_END, file_ent->size);
+        free(file_list);
+        ctx->state = FSM_Q;
+        return 0;
     }
 
-    if (send_file(s, fp))
+    FILE *fp = ctx->store->vf_open(ctx->store, file_ent->name);
+    if (!fp)
+        goto DE_DOWNLOAD_FAIL;
+
+    trace_event(ctx->trace, TRACE_DATA_BEGIN, file_ent->size);
+    int r = 1;
+    if (udp)
+    {
+        // UDP is not encrypted, and needs a plain file to read anywhere in
+        struct stat st;
+        const int usable = !tls_server_enabled() && !fstat(fileno(fp), &st)
+            && S_ISREG(st.st_mode) && st.st_size == file_ent->size;
+        udp_channel ch;
+        if (!(r = udp_channel_offer(s, usable, &ch)))
+        {
+            r = udp_send_file(&ch, s, fileno(fp), file_ent->size, ctx->bw, 0);
+            udp_channel_close(&ch);
+        }
+    }
+    if (r > 0)
+        r = send_file(s, fp, ctx->bw);
+    if (r)
     {
         fclose(fp);
         goto DE_DOWNLOAD_FAIL;
     }
     fclose(fp);
+    trace_event(ctx->trace, TRACE_DATA_END, file_ent->size);
+    free(file_list);
 
     // success
     // goto Quit state, waiting for client's BYE message, then send another BYE.
@@ -496,6 +754,335 @@ DE_DOWNLOAD_FAIL:
     return 0;
 }
 
+static int __vf_server_dataexchange_download(fsm_context *ctx)
+{
+    // polymorphic methods
+    return server_send_download(ctx, 0);
+}
+
+static int __vf_server_dataexchange_udp_download(fsm_context *ctx)
+{
+    return server_send_download(ctx, 1);
+}
+
+static int __vf_server_dataexchange_subscribe(fsm_context *ctx)
+{
+    // the connection goes to the change feed, and the session ends here
+    if (notify_serve(ctx->client_socket, ctx->store))
+    {
+        ctx->state = FSM_DIE;
+        return -1;
+    }
+    printf("Client %s subscribed to changes.\n", ctx->peer_name);
+    ctx->client_socket = -1;
+    ctx->state = FSM_DIE;
+    return 0;
+}
+
+// manifest stream shared by the walker threads
+struct tree_stream
+{
+    int socket;
+    pthread_mutex_t lock;               // serializes batches on the socket
+    char *buffers[WALKER_MAX_THREADS];  // one batch buffer per walker thread
+    size_t used[WALKER_MAX_THREADS];
+    uint64_t dirs, files;               // accessed atomically
+};
+
+static int __tree_stream_flush(struct tree_stream *ts, int worker)
+{
+    int r = 0;
+    if (!ts->used[worker])
+        return 0;
+    pthread_mutex_lock(&ts->lock);
+    if (write_exactly(ts->socket, ts->buffers[worker], ts->used[worker]) < 0)
+    {
+        perror("Failed to send manifest");
+        r = -1;
+    }
+    pthread_mutex_unlock(&ts->lock);
+    ts->used[worker] = 0;
+    return r;
+}
+
+static int __tree_visit(void *arg, int worker, const char *path, size_t path_len, int type, const struct stat *st)
+{
+    struct tree_stream *ts = arg;
+    const char *base = strrchr(path, '/');
+    if (is_staging_temp_name(base ? base + 1 : path))
+        return 0; // skip unfinished uploads
+
+    const size_t entry_sz = sizeof(struct tree_entry) + path_len;
+    if (ts->used[worker] + entry_sz > TREE_STREAM_BUFFER_SIZE && __tree_stream_flush(ts, worker))
+        return -1;
+    struct tree_entry ent;
+    memset(&ent, 0, sizeof(ent));
+    ent.path_length = path_len;
+    if (type == WALK_DIR)
+    {
+        ent.type = TREE_ENTRY_DIR;
+        __atomic_fetch_add(&ts->dirs, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        ent.type = TREE_ENTRY_FILE;
+        ent.size = st->st_size;
+        ent.ts_modified = st->st_mtime;
+        __atomic_fetch_add(&ts->files, 1, __ATOMIC_RELAXED);
+    }
+    char *p = ts->buffers[worker] + ts->used[worker];
+    memcpy(p, &ent, sizeof(ent));
+    memcpy(p + sizeof(ent), path, path_len);
+    ts->used[worker] += entry_sz;
+    // a directory is flushed right away, so that it reaches the client before its content,
+    // which may be found by another thread
+    if (type == WALK_DIR)
+        return __tree_stream_flush(ts, worker);
+    return 0;
+}
+
+static int __vf_server_dataexchange_tree(fsm_context *ctx)
+{
+    // read the root directory, walk it and stream the manifest
+    // then the client fetches files through other connections, and says BYE on this one
+    const int s = ctx->client_socket;
+    char root[MAX_PATH_LENGTH + 1];
+    if (receive_path_request(s, root))
+    {
+        ctx->state = FSM_DIE;
+        return -1;
+    }
+    int root_fd = open_beneath(AT_FDCWD, *root ? root : ".", O_RDONLY | O_DIRECTORY, 0, 0);
+    if (root_fd < 0)
+    {
+        int errsv = errno;
+        fprintf(stderr, "Cannot open directory `%s` [errno %d]: %s\n", root, errsv, strerror(errsv));
+        ctx->state = FSM_DIE;
+        return -1;
+    }
+    printf("Walking directory `%s`...\n", *root ? root : ".");
+
+    const int threads = walker_default_threads();
+    struct tree_stream ts;
+    memset(&ts, 0, sizeof(ts));
+    ts.socket = s;
+    pthread_mutex_init(&ts.lock, NULL);
+    int failed = 0;
+    for (int i = 0; i < threads; ++i)
+    {
+        if (!(ts.buffers[i] = malloc(TREE_STREAM_BUFFER_SIZE)))
+        {
+            fprintf(stderr, "Failed to malloc.\n");
+            failed = 1;
+        }
+    }
+    struct timespec ts_start, ts_end;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts_start);
+    if (!failed)
+        failed = walk_tree(root_fd, threads, &__tree_visit, &ts);
+    for (int i = 0; i < threads; ++i)
+    {
+        if (!failed)
+            failed = __tree_stream_flush(&ts, i);
+        free(ts.buffers[i]);
+    }
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts_end);
+    close(root_fd);
+    pthread_mutex_destroy(&ts.lock);
+
+    struct tree_entry end;
+    memset(&end, 0, sizeof(end));
+    end.type = TREE_ENTRY_END;
+    if (failed || write_exactly(s, &end, sizeof(end)) < 0)
+    {
+        fprintf(stderr, "Failed to send manifest.\n");
+        ctx->state = FSM_DIE;
+        return -1;
+    }
+    uint64_t delta_us = (ts_end.tv_sec - ts_start.tv_sec) * 1000000 + (ts_end.tv_nsec - ts_start.tv_nsec) / 1000;
+    printf("Sent manifest: %" PRIu64 " directories, %" PRIu64 " files in %.2fs (%d threads).\n",
+        ts.dirs, ts.files, delta_us / 1.0E6, threads);
+    ctx->state = FSM_Q;
+    return 0;
+}
+
+static int __vf_server_dataexchange_fetch(fsm_context *ctx)
+{
+    // answer path requests until an empty one
+    const int s = ctx->client_socket;
+    char path[MAX_PATH_LENGTH + 1];
+    uint64_t count = 0;
+    // requests and small files go back and forth, don't let Nagle delay them
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    while (1)
+    {
+        if (receive_path_request(s, path))
+        {
+            ctx->state = FSM_DIE;
+            return -1;
+        }
+        if (!*path)
+            break;
+
+        struct stat st;
+        FILE *fp = NULL;
+        int fd = open_beneath(AT_FDCWD, path, O_RDONLY, 0, 0);
+        if (fd >= 0 && (fstat(fd, &st) || !S_ISREG(st.st_mode) || !(fp = fdopen(fd, "rb"))))
+        {
+            close(fd);
+            fd = -1;
+        }
+        uint64_t size = fd < 0 ? FETCH_NOT_FOUND : (uint64_t)st.st_size;
+        if (fd < 0)
+            fprintf(stderr, "Cannot fetch `%s`.\n", path);
+        if (write_exactly(s, &size, sizeof(size)) < 0 || (fp && send_file_n(s, fp, size, ctx->bw, TRANSFER_QUIET)))
+        {
+            if (fp)
+                fclose(fp);
+            ctx->state = FSM_DIE;
+            return -1;
+        }
+        if (fp)
+        {
+            fclose(fp);
+            ++count;
+        }
+    }
+    printf("Client %s fetched %" PRIu64 " files.\n", ctx->peer_name, count);
+    ctx->state = FSM_Q;
+    return 0;
+}
+
+static int __vf_server_dataexchange_archive_upload(fsm_context *ctx)
+{
+    // receive an archive stream into the working directory, then report the result
+    const int s = ctx->client_socket;
+    int dirfd = open(".", O_RDONLY | O_DIRECTORY);
+    if (dirfd < 0)
+    {
+        perror("Cannot open working directory");
+        ctx->state = FSM_DIE;
+        return -1;
+    }
+    struct archive_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    struct timespec ts_start, ts_end;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts_start);
+    int r = archive_receive(s, dirfd, ARCHIVE_NO_OVERWRITE, ctx->bw, &stats);
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts_end);
+    close(dirfd);
+    uint64_t result[2] = {stats.files, stats.failed};
+    if (r || write_exactly(s, result, sizeof(result)) < 0)
+    {
+        ctx->state = FSM_DIE;
+        return -1;
+    }
+    uint64_t delta_us = (ts_end.tv_sec - ts_start.tv_sec) * 1000000 + (ts_end.tv_nsec - ts_start.tv_nsec) / 1000;
+    printf("Received %" PRIu64 " files (%" PRIu64 " bytes) from %s in %.2fs, %" PRIu64 " skipped.\n",
+        stats.files, stats.bytes, ctx->peer_name, delta_us / 1.0E6, stats.failed);
+    ctx->state = FSM_Q;
+    return 0;
+}
+
+static int __vf_server_dataexchange_archive_download(fsm_context *ctx)
+{
+    // collect the requested files and directories, then send them in one archive stream
+    const int s = ctx->client_socket;
+    char path[MAX_PATH_LENGTH + 1];
+    struct archive_list list;
+    archive_list_init(&list);
+    for (int first = 1; ; first = 0)
+    {
+        if (receive_path_request(s, path))
+        {
+            archive_list_free(&list);
+            ctx->state = FSM_DIE;
+            return -1;
+        }
+        if (!*path)
+        {
+            if (first && archive_list_add(&list, AT_FDCWD, ".", 1))
+                fprintf(stderr, "Cannot list files.\n");
+            break;
+        }
+        if (archive_list_add(&list, AT_FDCWD, path, 1))
+            fprintf(stderr, "Cannot send `%s`. Skip.\n", path);
+    }
+
+    struct archive_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    struct timespec ts_start, ts_end;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts_start);
+    int r = archive_send(s, &list, ctx->bw, &stats);
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts_end);
+    archive_list_free(&list);
+    if (r)
+    {
+        ctx->state = FSM_DIE;
+        return -1;
+    }
+    uint64_t delta_us = (ts_end.tv_sec - ts_start.tv_sec) * 1000000 + (ts_end.tv_nsec - ts_start.tv_nsec) / 1000;
+    printf("Sent %" PRIu64 " files (%" PRIu64 " bytes) to %s in %.2fs, %" PRIu64 " skipped.\n",
+        stats.files, stats.bytes, ctx->peer_name, delta_us / 1.0E6, stats.failed);
+    ctx->state = FSM_Q;
+    return 0;
+}
+
+static int __vf_server_dataexchange_digest(fsm_context *ctx)
+{
+    // hash the requested file with all cores, then send the root and the leaves
+    const int s = ctx->client_socket;
+    char name[MAX_PATH_LENGTH + 1];
+    if (receive_path_request(s, name))
+    {
+        ctx->state = FSM_DIE;
+        return -1;
+    }
+    trace_event(ctx->trace, TRACE_REQUEST, 0);
+    trace_event(ctx->trace, TRACE_DATA_BEGIN, 0);
+
+    struct tree_digest_header h;
+    struct tree_digest d;
+    memset(&h, 0, sizeof(h));
+    memset(&d, 0, sizeof(d));
+    h.size = FETCH_NOT_FOUND;
+    FILE *fp = *name ? ctx->store->vf_open(ctx->store, name) : NULL;
+    struct timespec ts_start, ts_end;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts_start);
+    if (fp && !tree_hash_file(fp, 0, &d))
+    {
+        h.size = d.size;
+        h.chunk_size = TREE_HASH_CHUNK_SIZE;
+        h.chunk_count = d.chunk_count;
+        memcpy(h.root, d.root, TREE_HASH_SIZE);
+    }
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts_end);
+    if (fp)
+        fclose(fp);
+    if (h.size == FETCH_NOT_FOUND)
+        fprintf(stderr, "Cannot hash `%s`.\n", name);
+    else
+    {
+        uint64_t delta_us = (ts_end.tv_sec - ts_start.tv_sec) * 1000000 + (ts_end.tv_nsec - ts_start.tv_nsec) / 1000;
+        printf("Hashed %s for %s: %" PRIu64 " chunks in %.2fs (%.2fMB/s).\n", name, ctx->peer_name,
+            d.chunk_count, delta_us / 1.0E6, delta_us ? d.size / 1.0 / delta_us : 0);
+    }
+    if (write_exactly(s, &h, sizeof(h)) < 0
+        || (d.leaves && write_exactly(s, d.leaves, d.chunk_count * TREE_HASH_SIZE) < 0))
+    {
+        perror("Failed to send digest");
+        tree_digest_free(&d);
+        ctx->state = FSM_DIE;
+        return -1;
+    }
+    tree_digest_free(&d);
+    if (h.size != FETCH_NOT_FOUND)
+        trace_event(ctx->trace, TRACE_DATA_END, h.size);
+    ctx->state = FSM_Q;
+    return 0;
+}
+
 static int __vf_server_quit_from_upload_handler(fsm_context *ctx)
 {
     // obey to `vfunc_quit_handler`
@@ -520,6 +1107,7 @@ static int __vf_server_quit_from_upload_handler(fsm_context *ctx)
 
     // good end
     puts("Bye bye.");
+    trace_event(ctx->trace, TRACE_BYE, 0);
     ctx->state = FSM_DIE;
     return 0;
 }
@@ -548,6 +1136,7 @@ static int __vf_server_quit_from_download_handler(fsm_context *ctx)
 
     // good end
     puts("Bye bye.");
+    trace_event(ctx->trace, TRACE_BYE, 0);
     ctx->state = FSM_DIE;
     return 0;
 }
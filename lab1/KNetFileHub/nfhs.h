@@ -3,8 +3,18 @@
 
 #include "nfh.h"
 #include "util.h"
+#include "fcache.h"
+#include "staging.h"
+#include "walker.h"
+#include "archive.h"
+#include "chunkstore.h"
+#include "tls.h"
+#include <fcntl.h>
+#include <netinet/tcp.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
 
 fsm_context *server_new(char *host, u_int16_t port);
 void server_delete(fsm_context *ctx);
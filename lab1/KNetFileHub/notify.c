@@ -0,0 +1,518 @@
+/*************************************
+ *       Change Feed                 *
+ *************************************/
+
+#define _GNU_SOURCE
+#include "notify.h"
+#include "nfh.h"
+#include "util.h"
+#include "staging.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/random.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+struct notify_record
+{
+    struct notify_event ev;
+    char name[MAX_FILENAME_LENGTH + 1];
+};
+
+struct subscriber
+{
+    int socket;
+    uint64_t seq;    // the next event to send
+    size_t offset;   // bytes of it already sent
+    size_t index;    // in hub.subs
+    int waiting;     // for the socket to be writable (EPOLLOUT)
+};
+
+struct handover
+{
+    int socket;
+    uint64_t cursor;
+};
+
+static struct
+{
+    pthread_mutex_t lock;          // everything but the hub thread's own members
+    struct notify_record *log;     // a ring, event `seq` at seq % NOTIFY_LOG_SIZE
+    uint64_t next_seq;
+    uint64_t epoch;
+    struct handover *pending;      // connections for the hub to take
+    size_t pending_count;
+    size_t pending_cap;
+    int running;
+    int watching;                  // inotify is the source of events
+    int epoll;
+    int inotify;
+    int wake;                      // eventfd, new events or connections
+    int dirfd;                     // the watched directory
+
+    // hub thread only
+    struct subscriber **subs;
+    size_t sub_count;
+    size_t sub_cap;
+    int overflowed;
+
+    // statistics
+    uint64_t events;
+    uint64_t subscribed;
+    uint64_t snapshots;
+    uint64_t dropped;
+    uint64_t overflows;
+} hub = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .epoll = -1,
+    .inotify = -1,
+    .wake = -1,
+    .dirfd = -1,
+};
+
+// the oldest event still in the log, must hold the lock
+static uint64_t notify_oldest(void)
+{
+    return hub.next_seq > NOTIFY_LOG_SIZE ? hub.next_seq - NOTIFY_LOG_SIZE : 1;
+}
+
+// add an event to the log, must hold the lock
+static void notify_append(int type, const char *name, uint64_t size, uint64_t ts_modified)
+{
+    const size_t len = strnlen(name, MAX_FILENAME_LENGTH);
+    if (type == NOTIFY_MODIFY && hub.next_seq > notify_oldest())
+    {
+        // a file created and closed at once, e.g. an upload, is announced once
+        const struct notify_record *last = &hub.log[(hub.next_seq - 1) % NOTIFY_LOG_SIZE];
+        if ((last->ev.type == NOTIFY_ADD || last->ev.type == NOTIFY_MODIFY) && last->ev.size == size
+            && last->ev.ts_modified == ts_modified && last->ev.name_length == len && !memcmp(last->name, name, len))
+            return;
+    }
+    struct notify_record *rec = &hub.log[hub.next_seq % NOTIFY_LOG_SIZE];
+    memset(&rec->ev, 0, sizeof(rec->ev));
+    rec->ev.seq = hub.next_seq++;
+    rec->ev.size = size;
+    rec->ev.ts_modified = ts_modified;
+    rec->ev.type = type;
+    rec->ev.name_length = len;
+    memcpy(rec->name, name, len);
+    ++hub.events;
+}
+
+static void notify_wake(void)
+{
+    const uint64_t one = 1;
+    if (write(hub.wake, &one, sizeof(one)) != sizeof(one))
+        perror("Cannot wake the change feed");
+}
+
+/**
+ * @brief Announce a change made by the server itself, for stores that are not watched.
+ *
+ * @param type NOTIFY_ADD, NOTIFY_MODIFY or NOTIFY_DELETE.
+ * @param name the file name.
+ * @param size the file size.
+ * @param ts_modified the time of the change.
+ */
+void notify_post(int type, const char *name, uint64_t size, uint64_t ts_modified)
+{
+    if (!hub.running || hub.watching)
+        return; // inotify sees it
+    pthread_mutex_lock(&hub.lock);
+    notify_append(type, name, size, ts_modified);
+    pthread_mutex_unlock(&hub.lock);
+    notify_wake();
+}
+
+static void notify_drop(struct subscriber *sub)
+{
+    epoll_ctl(hub.epoll, EPOLL_CTL_DEL, sub->socket, NULL);
+    close(sub->socket);
+    hub.subs[sub->index] = hub.subs[--hub.sub_count];
+    hub.subs[sub->index]->index = sub->index;
+    free(sub);
+    pthread_mutex_lock(&hub.lock);
+    ++hub.dropped;
+    pthread_mutex_unlock(&hub.lock);
+}
+
+static void notify_wait_writable(struct subscriber *sub, int waiting)
+{
+    if (sub->waiting == waiting)
+        return;
+    struct epoll_event e = {.events = EPOLLIN | EPOLLRDHUP | (waiting ? EPOLLOUT : 0), .data.ptr = sub};
+    epoll_ctl(hub.epoll, EPOLL_CTL_MOD, sub->socket, &e);
+    sub->waiting = waiting;
+}
+
+/**
+ * @brief Write the events a subscriber hasn't got, until its socket is full.
+ *
+ * @return int 0 if the subscriber is still there, -1 if it was dropped.
+ */
+static int notify_flush(struct subscriber *sub)
+{
+    pthread_mutex_lock(&hub.lock);
+    while (sub->seq < hub.next_seq)
+    {
+        if (sub->seq < notify_oldest())
+        {
+            pthread_mutex_unlock(&hub.lock);
+            fprintf(stderr, "A subscriber fell %u events behind, dropped.\n", NOTIFY_LOG_SIZE);
+            notify_drop(sub);
+            return -1;
+        }
+        struct iovec iov[NOTIFY_SEND_BATCH * 2];
+        int count = 0;
+        for (uint64_t seq = sub->seq; seq < hub.next_seq && count < NOTIFY_SEND_BATCH * 2; ++seq)
+        {
+            struct notify_record *rec = &hub.log[seq % NOTIFY_LOG_SIZE];
+            iov[count++] = (struct iovec){&rec->ev, sizeof(rec->ev)};
+            if (rec->ev.name_length)
+                iov[count++] = (struct iovec){rec->name, rec->ev.name_length};
+        }
+        // skip what went out last time
+        int first = 0;
+        for (size_t skip = sub->offset; skip; )
+        {
+            const size_t n = skip < iov[first].iov_len ? skip : iov[first].iov_len;
+            iov[first].iov_base = (char *)iov[first].iov_base + n;
+            iov[first].iov_len -= n;
+            skip -= n;
+            if (!iov[first].iov_len)
+                ++first;
+        }
+        const ssize_t written = writev(sub->socket, iov + first, count - first);
+        if (written < 0)
+        {
+            pthread_mutex_unlock(&hub.lock);
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                notify_wait_writable(sub, 1);
+                return 0;
+            }
+            notify_drop(sub);
+            return -1;
+        }
+        size_t left = sub->offset + written;
+        while (1)
+        {
+            const size_t size = sizeof(struct notify_event) + hub.log[sub->seq % NOTIFY_LOG_SIZE].ev.name_length;
+            if (left < size)
+                break;
+            left -= size;
+            ++sub->seq;
+        }
+        sub->offset = left;
+    }
+    pthread_mutex_unlock(&hub.lock);
+    notify_wait_writable(sub, 0);
+    return 0;
+}
+
+// take the connections handed over by the session threads
+static void notify_adopt(void)
+{
+    pthread_mutex_lock(&hub.lock);
+    struct handover *pending = hub.pending;
+    const size_t count = hub.pending_count;
+    hub.pending = NULL;
+    hub.pending_count = hub.pending_cap = 0;
+    pthread_mutex_unlock(&hub.lock);
+    for (size_t i = 0; i < count; ++i)
+    {
+        const int s = pending[i].socket;
+        struct subscriber *sub = calloc(1, sizeof(struct subscriber));
+        if (hub.sub_count == hub.sub_cap)
+        {
+            const size_t cap = hub.sub_cap ? hub.sub_cap * 2 : 64;
+            struct subscriber **subs = realloc(hub.subs, cap * sizeof(*subs));
+            if (subs)
+            {
+                hub.subs = subs;
+                hub.sub_cap = cap;
+            }
+        }
+        // an idle subscriber costs a socket and this, so dead ones are found by keepalive
+        const int one = 1, idle = NOTIFY_KEEPALIVE_IDLE;
+        setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+        setsockopt(s, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+        struct epoll_event e = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = sub};
+        if (!sub || hub.sub_count == hub.sub_cap || fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK)
+            || epoll_ctl(hub.epoll, EPOLL_CTL_ADD, s, &e))
+        {
+            perror("Cannot take a subscriber");
+            close(s);
+            free(sub);
+            continue;
+        }
+        sub->socket = s;
+        sub->seq = pending[i].cursor;
+        sub->index = hub.sub_count;
+        hub.subs[hub.sub_count++] = sub;
+    }
+    free(pending);
+}
+
+// read what inotify has, return 1 if any event was logged
+static int notify_read_inotify(void)
+{
+    char buf[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int logged = 0;
+    ssize_t n;
+    while ((n = read(hub.inotify, buf, sizeof(buf))) > 0)
+    {
+        const struct inotify_event *ev;
+        for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len)
+        {
+            ev = (const struct inotify_event *)p;
+            if (ev->mask & IN_Q_OVERFLOW)
+            {
+                hub.overflowed = 1;
+                continue;
+            }
+            if (!ev->len || (ev->mask & IN_ISDIR) || is_staging_temp_name(ev->name))
+                continue;
+            const int type = ev->mask & (IN_CREATE | IN_MOVED_TO) ? NOTIFY_ADD
+                : ev->mask & IN_CLOSE_WRITE ? NOTIFY_MODIFY : NOTIFY_DELETE;
+            struct stat st;
+            memset(&st, 0, sizeof(st));
+            if (type != NOTIFY_DELETE
+                && (fstatat(hub.dirfd, ev->name, &st, AT_SYMLINK_NOFOLLOW) || !S_ISREG(st.st_mode)))
+                continue; // gone already, or not a file
+            pthread_mutex_lock(&hub.lock);
+            notify_append(type, ev->name, st.st_size, st.st_mtime);
+            pthread_mutex_unlock(&hub.lock);
+            logged = 1;
+        }
+    }
+    return logged;
+}
+
+static void *notify_thread(void *arg)
+{
+    struct epoll_event evs[64];
+    while (1)
+    {
+        const int n = epoll_wait(hub.epoll, evs, sizeof(evs) / sizeof(*evs), -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait() failed, the change feed stops");
+            break;
+        }
+        int changed = 0;
+        for (int i = 0; i < n; ++i)
+        {
+            void *p = evs[i].data.ptr;
+            if (p == &hub.wake)
+            {
+                uint64_t v;
+                if (read(hub.wake, &v, sizeof(v)) == sizeof(v))
+                    notify_adopt();
+                changed = 1;
+            }
+            else if (p == &hub.inotify)
+                changed |= notify_read_inotify();
+            else if (evs[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                notify_drop(p); // subscribers have nothing to say
+            else if (evs[i].events & EPOLLOUT)
+                notify_flush(p);
+        }
+        if (hub.overflowed)
+        {
+            // events were lost, so the log can't be trusted: everyone starts over with a snapshot
+            fprintf(stderr, "inotify overflowed, %zu subscribers resubscribe.\n", hub.sub_count);
+            pthread_mutex_lock(&hub.lock);
+            ++hub.epoch;
+            ++hub.overflows;
+            pthread_mutex_unlock(&hub.lock);
+            while (hub.sub_count)
+                notify_drop(hub.subs[hub.sub_count - 1]);
+            hub.overflowed = 0;
+        }
+        if (changed)
+        {
+            // from the end, as a dropped subscriber is replaced by the last one
+            for (size_t i = hub.sub_count; i; --i)
+                if (i <= hub.sub_count && !hub.subs[i - 1]->waiting)
+                    notify_flush(hub.subs[i - 1]);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Start the change feed.
+ *
+ * @param dir the directory to watch with inotify, NULL if only the server changes the store.
+ * @return int 0 if success, non-zero if failed.
+ */
+int notify_start(const char *dir)
+{
+    if (getrandom(&hub.epoch, sizeof(hub.epoch), 0) != sizeof(hub.epoch))
+        hub.epoch = time(NULL);
+    hub.epoch |= 1; // never 0, which asks for a snapshot
+    hub.next_seq = 1;
+    if (!(hub.log = calloc(NOTIFY_LOG_SIZE, sizeof(struct notify_record)))
+        || (hub.epoll = epoll_create1(EPOLL_CLOEXEC)) < 0
+        || (hub.wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    {
+        perror("Cannot start the change feed");
+        return -1;
+    }
+    struct epoll_event e = {.events = EPOLLIN, .data.ptr = &hub.wake};
+    epoll_ctl(hub.epoll, EPOLL_CTL_ADD, hub.wake, &e);
+    if (dir)
+    {
+        if ((hub.inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0
+            || inotify_add_watch(hub.inotify, dir, IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE
+                | IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR | IN_EXCL_UNLINK) < 0
+            || (hub.dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        {
+            perror("Cannot watch the store");
+            return -1;
+        }
+        e.data.ptr = &hub.inotify;
+        epoll_ctl(hub.epoll, EPOLL_CTL_ADD, hub.inotify, &e);
+        hub.watching = 1;
+    }
+    // every subscriber holds a descriptor
+    struct rlimit rl;
+    if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, &notify_thread, NULL))
+    {
+        fprintf(stderr, "Cannot create the change feed thread.\n");
+        return -1;
+    }
+    pthread_detach(tid);
+    hub.running = 1;
+    return 0;
+}
+
+struct snapshot_writer
+{
+    int socket;
+    char *buf;
+    size_t used;
+    int failed;
+};
+
+static int notify_snapshot_flush(struct snapshot_writer *w)
+{
+    if (w->used && write_exactly(w->socket, w->buf, w->used) != w->used)
+        w->failed = 1;
+    w->used = 0;
+    return w->failed;
+}
+
+static int notify_snapshot_visit(void *arg, const char *name, uint64_t size, uint64_t ts_modified)
+{
+    struct snapshot_writer *w = arg;
+    struct notify_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = name ? NOTIFY_EXISTS : NOTIFY_SYNC;
+    ev.size = size;
+    ev.ts_modified = ts_modified;
+    ev.name_length = name ? strnlen(name, MAX_FILENAME_LENGTH) : 0;
+    if (w->used + sizeof(ev) + ev.name_length > NOTIFY_SNAPSHOT_BUFFER && notify_snapshot_flush(w))
+        return -1;
+    memcpy(w->buf + w->used, &ev, sizeof(ev));
+    if (ev.name_length)
+        memcpy(w->buf + w->used + sizeof(ev), name, ev.name_length);
+    w->used += sizeof(ev) + ev.name_length;
+    return 0;
+}
+
+/**
+ * @brief Answer a subscription, then hand the connection to the change feed. Server side, in the session thread.
+ *
+ * @param socket the connection, after MODESW.SUBSCR.
+ * @param store the store, listed for a snapshot.
+ * @return int 0 if the connection belongs to the change feed now, non-zero if failed.
+ */
+int notify_serve(int socket, storage *store)
+{
+    struct notify_request req;
+    if (read_exactly(socket, &req, sizeof(req)) != sizeof(req))
+    {
+        fprintf(stderr, "Failed to read the subscription.\n");
+        return -1;
+    }
+    if (!hub.running)
+    {
+        fprintf(stderr, "The change feed is not running.\n");
+        return -1;
+    }
+    struct notify_hello hello;
+    memset(&hello, 0, sizeof(hello));
+    pthread_mutex_lock(&hub.lock);
+    hello.epoch = hub.epoch;
+    hello.reset = req.epoch != hub.epoch || req.cursor < notify_oldest() || req.cursor > hub.next_seq;
+    // events from now on come after the snapshot, some of them may be in it already
+    hello.cursor = hello.reset ? hub.next_seq : req.cursor;
+    hub.snapshots += hello.reset;
+    pthread_mutex_unlock(&hub.lock);
+    // the hello and the snapshot go out together, small writes would wait for delayed ACKs
+    struct snapshot_writer w = {socket, malloc(NOTIFY_SNAPSHOT_BUFFER), sizeof(hello), 0};
+    if (!w.buf)
+    {
+        perror("malloc() failed");
+        return -1;
+    }
+    memcpy(w.buf, &hello, sizeof(hello));
+    if ((hello.reset && (store->vf_list(store, &notify_snapshot_visit, &w) || w.failed
+        || notify_snapshot_visit(&w, NULL, 0, 0))) || notify_snapshot_flush(&w))
+    {
+        fprintf(stderr, "Failed to answer the subscription.\n");
+        free(w.buf);
+        return -1;
+    }
+    free(w.buf);
+
+    pthread_mutex_lock(&hub.lock);
+    if (hub.pending_count == hub.pending_cap)
+    {
+        const size_t cap = hub.pending_cap ? hub.pending_cap * 2 : 16;
+        struct handover *pending = realloc(hub.pending, cap * sizeof(*pending));
+        if (!pending)
+        {
+            pthread_mutex_unlock(&hub.lock);
+            perror("realloc() failed");
+            return -1;
+        }
+        hub.pending = pending;
+        hub.pending_cap = cap;
+    }
+    hub.pending[hub.pending_count++] = (struct handover){socket, hello.cursor};
+    ++hub.subscribed;
+    pthread_mutex_unlock(&hub.lock);
+    notify_wake();
+    return 0;
+}
+
+void notify_print_stats(FILE *fp)
+{
+    if (!hub.running)
+        return;
+    pthread_mutex_lock(&hub.lock);
+    fprintf(fp, "[notify] %s, %" PRIu64 " events (next %" PRIu64 "), %" PRIu64 " subscriptions (%" PRIu64 " snapshots), "
+        "%" PRIu64 " subscribers dropped, %" PRIu64 " inotify overflows.\n", hub.watching ? "watching" : "posted by uploads",
+        hub.events, hub.next_seq, hub.subscribed, hub.snapshots, hub.dropped, hub.overflows);
+    pthread_mutex_unlock(&hub.lock);
+}
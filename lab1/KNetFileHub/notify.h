@@ -0,0 +1,84 @@
+#ifndef __NOTIFY_H
+#define __NOTIFY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "store.h"
+
+/* configurations */
+#define NOTIFY_LOG_SIZE 16384U          /* recent events kept for reconnecting clients, a power of 2 */
+#define NOTIFY_SEND_BATCH 64            /* events written to a subscriber at once */
+#define NOTIFY_SNAPSHOT_BUFFER 65536U
+#define NOTIFY_KEEPALIVE_IDLE 60        /* seconds, TCP keepalive finds dead subscribers */
+
+/*
+
+Change Feed:
+    A client that mirrors the server switches to `MODESW.SUBSCR` (Subscribe)
+    instead of listing the files over and over. It sends a `struct notify_request`
+    with the epoch and the cursor it stopped at (0 and 0 the first time), and
+    the server replies with a `struct notify_hello`:
+        If the epoch matches and the server still has every event since the
+        cursor, `reset` is 0 and the events from the cursor follow.
+        Otherwise `reset` is 1 and a snapshot follows: a NOTIFY_EXISTS event
+        for every stored file, ended by a NOTIFY_SYNC event. The client drops
+        the files it has not seen in it.
+    Then events stream for as long as the connection is open, each one a
+    `struct notify_event` plus the file name. Live events are numbered
+    from 1 on in the order they happened; the client keeps the next number
+    (its cursor) with the epoch, to resume after a reconnect.
+    Events:
+        The working directory of a flat store is watched with inotify, so
+        files copied in or deleted by hand are seen as well. Other stores are
+        only changed by uploads, which post their events themselves.
+        NOTIFY_ADD: a file appeared (created, moved in or uploaded).
+        NOTIFY_MODIFY: a file was written and closed.
+        NOTIFY_DELETE: a file was deleted or moved away.
+    Server side:
+        Once the snapshot is sent, the session thread hands the connection to
+        one hub thread, which serves every subscriber with epoll, nonblocking,
+        and closes the connection of a subscriber that falls NOTIFY_LOG_SIZE
+        events behind or says anything. The last NOTIFY_LOG_SIZE events are
+        kept in a ring. If inotify overflows the epoch changes and everyone
+        resubscribes, getting a snapshot.
+
+*/
+
+#define NOTIFY_ADD 1
+#define NOTIFY_MODIFY 2
+#define NOTIFY_DELETE 3
+#define NOTIFY_EXISTS 4    /* snapshot entry, seq 0 */
+#define NOTIFY_SYNC 5      /* end of the snapshot, seq 0, no name */
+
+struct notify_request
+{
+    uint64_t epoch;        // 0 for a snapshot
+    uint64_t cursor;       // the first event wanted
+};
+
+struct notify_hello
+{
+    uint64_t epoch;
+    uint64_t cursor;       // the first live event that follows
+    uint8_t reset;         // a snapshot comes first
+    uint8_t reserved[7];
+};
+
+struct notify_event
+{
+    uint64_t seq;
+    uint64_t size;
+    uint64_t ts_modified;
+    uint8_t type;
+    uint8_t reserved[5];
+    uint16_t name_length;  // followed by the name, without '\0'
+};
+
+int notify_start(const char *dir);
+void notify_post(int type, const char *name, uint64_t size, uint64_t ts_modified);
+int notify_serve(int socket, storage *store);
+void notify_print_stats(FILE *fp);
+
+#endif
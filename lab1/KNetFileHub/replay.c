@@ -0,0 +1,672 @@
+/******************************************
+ *            Session Replay              *
+ ******************************************/
+
+/*
+ * Plays a trace recorded by the server (env NFH_TRACE, see trace.h) back
+ * against a server, with synthetic files of the recorded sizes, and prints
+ * the latencies and the throughput it measured as a client.
+ * Usage: nfh_replay [-s speed] [-j sessions] [-o output] <trace> <host> [port]
+ *        nfh_replay -c <trace A> <trace B>
+ *   -s  1 keeps the recorded timing (default), 10 plays it 10 times as fast,
+ *       0 takes every step as soon as it can
+ *   -j  sessions played at the same time, at most (default REPLAY_MAX_SESSIONS)
+ *   -o  save the measurements as a trace
+ *   -c  compare two traces: replays of one trace against two builds, or two
+ *       server traces
+ * A session connects, switches mode and asks for its file at the recorded
+ * times (scaled), and takes the other steps as fast as the server answers,
+ * up to the step it ended at. UPLOAD, DOWNLOAD, DIGEST and the UDP modes are
+ * played; sessions of the other modes are counted and skipped.
+ * Files to download and hash are uploaded first as `replay-<size>`, and left
+ * on the server for the next run. Uploads are named `replay-<pid>-<session>`
+ * and are left as well. Every upload of a size sends the same random bytes,
+ * so a deduplicating store sees repeats.
+ * Set NFH_TLS (and NFH_TLS_CA) to connect with TLS, like the client.
+ */
+
+#include "nfh.h"
+#include "util.h"
+#include "tls.h"
+#include "trace.h"
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#define REPLAY_MAX_SESSIONS 32              /* the server serves SERVER_MAX_SESSIONS at once */
+#define REPLAY_START_DELAY_NS 100000000L    /* 100ms, for the workers to start */
+#define REPLAY_LATE_NS 1000000L             /* 1ms, a step later than this is counted late */
+#define REPLAY_SOURCE_DIR "/tmp/nfh_replay.XXXXXX"
+#define REPLAY_FILL_SIZE 1048576U
+
+struct replay
+{
+    const char *host;
+    uint16_t port;
+    double speed;              // 0: as fast as possible
+    const trace_session *sessions; // recorded, by their CONNECT
+    trace_session *measured;   // what the client saw, by the same index
+    size_t count;
+    size_t next;               // the next session to play, taken atomically
+    uint64_t ts_base;          // when the first session starts, CLOCK_MONOTONIC
+    char dir[sizeof(REPLAY_SOURCE_DIR)]; // synthetic files, by size
+    trace_writer *out;         // NULL if the measurements are not saved
+    // results, updated atomically
+    uint64_t played, skipped, failed, late, late_max_ns;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int __compare_connect(const void *a, const void *b)
+{
+    const trace_session *x = a, *y = b;
+    return x->ts[TRACE_CONNECT] < y->ts[TRACE_CONNECT] ? -1 : x->ts[TRACE_CONNECT] > y->ts[TRACE_CONNECT];
+}
+
+static int __has(const trace_session *t, int event)
+{
+    return !!(t->seen & (1U << event));
+}
+
+static int __mode(const trace_session *t)
+{
+    return __has(t, TRACE_MODE) ? (int)t->size[TRACE_MODE] : 0;
+}
+
+static int __is_mode(int mode, const char *modesw)
+{
+    return trace_mode_modesw(mode) && !strcmp(trace_mode_modesw(mode), modesw);
+}
+
+static int __is_upload(int mode)
+{
+    return __is_mode(mode, NFHC_MODE_UPLOAD) || __is_mode(mode, NFHC_MODE_UDP_UPLOAD);
+}
+
+static int __is_download(int mode)
+{
+    return __is_mode(mode, NFHC_MODE_DOWNLOAD) || __is_mode(mode, NFHC_MODE_UDP_DOWNLOAD);
+}
+
+static int __is_udp(int mode)
+{
+    return __is_mode(mode, NFHC_MODE_UDP_UPLOAD) || __is_mode(mode, NFHC_MODE_UDP_DOWNLOAD);
+}
+
+// the size of the file a session moves or hashes, 0 if it asked for none
+static uint64_t __file_size(const trace_session *t)
+{
+    if (__is_mode(__mode(t), NFHC_MODE_DIGEST))
+        return __has(t, TRACE_DATA_END) ? t->size[TRACE_DATA_END] : 0;
+    return __has(t, TRACE_REQUEST) ? t->size[TRACE_REQUEST] : 0;
+}
+
+// sessions in the other modes need files and directories the trace knows nothing of
+static int __playable(const trace_session *t)
+{
+    const int mode = __mode(t);
+    return !__has(t, TRACE_MODE) || __is_upload(mode) || __is_download(mode) || __is_mode(mode, NFHC_MODE_DIGEST);
+}
+
+static void __wait_for(struct replay *r, const trace_session *t, int event, int start)
+{
+    // sleep until the recorded time of the event, scaled
+    if (!r->speed)
+        return;
+    const uint64_t at = r->ts_base + (uint64_t)((t->ts[event] - r->sessions[0].ts[TRACE_CONNECT]) / r->speed);
+    struct timespec ts = {at / 1000000000ULL, at % 1000000000ULL};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+    if (!start)
+        return;
+    // a session starting late means the server, or the replay, cannot keep up
+    const uint64_t late = now_ns() - at;
+    if (late > REPLAY_LATE_NS)
+        __atomic_fetch_add(&r->late, 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&r->late_max_ns, __ATOMIC_RELAXED);
+    while (late > max && !__atomic_compare_exchange_n(&r->late_max_ns, &max, late, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static void __measure(struct replay *r, size_t i, int event, uint64_t size)
+{
+    trace_session *m = &r->measured[i];
+    m->id = r->sessions[i].id;
+    m->seen |= 1U << event;
+    m->ts[event] = now_ns() - r->ts_base;
+    m->size[event] = size;
+    if (r->out)
+        trace_writer_event(r->out, m->id, event, size);
+}
+
+static int __connect(struct replay *r)
+{
+    // as the client does
+    int s = transport_connect(r->host, r->port);
+    if (s >= 0)
+        tcp_set_congestion(s, getenv(ENV_TCP_CC));
+    if (s < 0 || !tls_client_enabled() || transport_of(s) != &transport_tcp)
+        return s;
+    int t = tls_connect(s, r->host);
+    if (t < 0)
+        close(s);
+    return t;
+}
+
+static int __switch_mode(int s, int mode)
+{
+    char read_buf[LEN_NFHS_ALLOW];
+    // as the client does, the server may refuse the congestion control and go on
+    const char *cc = getenv(ENV_TCP_CC);
+    if (cc && *cc && (write_exactly(s, NFHC_MODE_CONGESTION, LEN_NFHC_MODE_SWITCH) < 0 || send_path_request(s, cc)
+        || read_exactly(s, read_buf, LEN_NFHS_ALLOW) != LEN_NFHS_ALLOW))
+    {
+        fprintf(stderr, "Failed to ask for congestion control %s.\n", cc);
+        return -1;
+    }
+    if (write_exactly(s, trace_mode_modesw(mode), LEN_NFHC_MODE_SWITCH) < 0
+        || read_exactly(s, read_buf, LEN_NFHS_ALLOW) != LEN_NFHS_ALLOW
+        || memcmp(read_buf, trace_mode_allow(mode), LEN_NFHS_ALLOW))
+    {
+        fprintf(stderr, "Failed to switch to %s mode.\n", trace_mode_name(mode));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Read the file list of DOWNLOAD mode.
+ *
+ * @param s the socket, switched to DOWNLOAD mode.
+ * @param count set to the number of files.
+ * @return struct so_s2c_file_entry* the files, NULL if failed. Free it with free().
+ */
+static struct so_s2c_file_entry *__read_list(int s, uint64_t *count)
+{
+    if (read_exactly(s, count, sizeof(uint64_t)) != sizeof(uint64_t) || *count > FILE_LIST_MAX)
+    {
+        fprintf(stderr, "Failed to read file list.\n");
+        return NULL;
+    }
+    struct so_s2c_file_entry *list = calloc(*count ? *count : 1, sizeof(struct so_s2c_file_entry));
+    const size_t bytes = *count * sizeof(struct so_s2c_file_entry);
+    if (!list || read_exactly(s, list, bytes) != bytes)
+    {
+        fprintf(stderr, "Failed to read file list.\n");
+        free(list);
+        return NULL;
+    }
+    return list;
+}
+
+static void __source_path(struct replay *r, uint64_t size, char *path, size_t n)
+{
+    snprintf(path, n, "%s/%" PRIu64, r->dir, size);
+}
+
+/**
+ * @brief Create a file of random bytes to upload, unless there is one of the size already.
+ *
+ * @param r the replay.
+ * @param size the file size.
+ * @return int 0 if success, non-zero if failed.
+ */
+static int __make_source(struct replay *r, uint64_t size)
+{
+    char path[PATH_MAX];
+    __source_path(r, size, path, sizeof(path));
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return errno == EEXIST ? 0 : -1;
+    uint64_t *buf = malloc(REPLAY_FILL_SIZE);
+    if (!buf)
+    {
+        close(fd);
+        return -1;
+    }
+    uint64_t x = size ^ ((uint64_t)getpid() << 32) ^ 0x9E3779B97F4A7C15ULL;
+    int failed = 0;
+    for (uint64_t done = 0; done < size && !failed; )
+    {
+        // xorshift, fast and not compressible
+        for (size_t i = 0; i < REPLAY_FILL_SIZE / sizeof(uint64_t); ++i)
+        {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            buf[i] = x;
+        }
+        const size_t n = size - done < REPLAY_FILL_SIZE ? size - done : REPLAY_FILL_SIZE;
+        failed = write_exactly(fd, buf, n) < 0;
+        done += n;
+    }
+    free(buf);
+    close(fd);
+    if (failed)
+        perror("Failed to write synthetic file");
+    return failed ? -1 : 0;
+}
+
+/**
+ * @brief Send a file in UPLOAD mode, from the preamble to BYE.
+ *
+ * @param s the socket, switched to the mode.
+ * @param name the name on the server.
+ * @param fp the file.
+ * @param size the file size.
+ * @param udp 1 to send it over UDP, if the server offers it.
+ * @return int 0 if success, non-zero if failed.
+ */
+static int __upload(int s, const char *name, FILE *fp, uint64_t size, int udp)
+{
+    struct sa_c2s_file_preamble preamble;
+    memset(&preamble, 0, sizeof(preamble));
+    preamble.length = size;
+    strcpy(preamble.name, name);
+    if (write_exactly(s, &preamble, sizeof(preamble)) < 0)
+        return -1;
+    int r = 1;
+    udp_channel ch;
+    if (udp && !(r = udp_channel_accept(s, &ch)))
+    {
+        r = udp_send_file(&ch, s, fileno(fp), size, NULL, TRANSFER_QUIET);
+        udp_channel_close(&ch);
+    }
+    if (r > 0)
+        r = send_file_ex(s, fp, NULL, TRANSFER_QUIET);
+    return r;
+}
+
+/**
+ * @brief Upload the files the downloads and digests of the trace ask for.
+ *
+ * @param r the replay.
+ * @return int 0 if success, non-zero if failed.
+ */
+static int __prepare_server(struct replay *r)
+{
+    // find what the server has already
+    int s = __connect(r);
+    const int download = trace_mode_index(NFHC_MODE_DOWNLOAD);
+    uint64_t count = 0;
+    struct so_s2c_file_entry *list = NULL;
+    if (s < 0 || send_handshake(s) || expect_handshake(s) || __switch_mode(s, download)
+        || !(list = __read_list(s, &count)))
+    {
+        fprintf(stderr, "Cannot list the files of the server.\n");
+        if (s >= 0)
+            close(s);
+        return -1;
+    }
+    // an id out of range ends the session
+    write_exactly(s, &count, sizeof(count));
+    close(s);
+
+    int failed = 0;
+    const int upload = trace_mode_index(NFHC_MODE_UPLOAD);
+    for (size_t i = 0; i < r->count && !failed; ++i)
+    {
+        const trace_session *t = &r->sessions[i];
+        const int mode = __mode(t);
+        if (!(__is_download(mode) || __is_mode(mode, NFHC_MODE_DIGEST)) || !__file_size(t))
+            continue;
+        char name[MAX_FILENAME_LENGTH + 1];
+        snprintf(name, sizeof(name), "replay-%" PRIu64, __file_size(t));
+        int present = 0;
+        for (uint64_t j = 0; j < count && !present; ++j)
+            present = !strcmp(list[j].name, name) && list[j].size == __file_size(t);
+        if (present)
+            continue;
+
+        char path[PATH_MAX];
+        __source_path(r, __file_size(t), path, sizeof(path));
+        FILE *fp = fopen(path, "rb");
+        failed = !fp || (s = __connect(r)) < 0;
+        if (!failed)
+        {
+            printf("Uploading %s...\n", name);
+            failed = send_handshake(s) || expect_handshake(s) || __switch_mode(s, upload)
+                || __upload(s, name, fp, __file_size(t), 0) || receive_bye_message(s) || send_bye_message(s);
+            close(s);
+        }
+        if (fp)
+            fclose(fp);
+        if (!failed)
+        {
+            // the next session of the size finds it
+            struct so_s2c_file_entry *p = realloc(list, (count + 1) * sizeof(struct so_s2c_file_entry));
+            failed = !p;
+            if (p)
+            {
+                list = p;
+                strcpy(list[count].name, name);
+                list[count++].size = __file_size(t);
+            }
+        }
+    }
+    free(list);
+    if (failed)
+        fprintf(stderr, "Failed to upload the files to replay.\n");
+    return failed ? -1 : 0;
+}
+
+/**
+ * @brief Play one session.
+ *
+ * @param r the replay.
+ * @param i the index of the session.
+ * @return int 0 if played, 1 if skipped, -1 if failed.
+ */
+static int __play(struct replay *r, size_t i)
+{
+    const trace_session *t = &r->sessions[i];
+    if (!__playable(t))
+        return 1;
+    const int mode = __mode(t);
+    const uint64_t size = __file_size(t);
+    char name[MAX_FILENAME_LENGTH + 1];
+    if (__is_upload(mode))
+        snprintf(name, sizeof(name), "replay-%d-%" PRIu32, getpid(), t->id);
+    else
+        snprintf(name, sizeof(name), "replay-%" PRIu64, size);
+    FILE *fp = NULL;
+    struct so_s2c_file_entry *list = NULL;
+
+    __wait_for(r, t, TRACE_CONNECT, 1);
+    int s = __connect(r);
+    if (s < 0)
+        return -1;
+    __measure(r, i, TRACE_CONNECT, 0);
+    if (send_handshake(s) || expect_handshake(s))
+        goto PLAY_FAILED;
+    __measure(r, i, TRACE_HELLO, 0);
+    if (!__has(t, TRACE_MODE))
+        goto PLAY_DONE;
+
+    __wait_for(r, t, TRACE_MODE, 0);
+    if (__switch_mode(s, mode))
+        goto PLAY_FAILED;
+    __measure(r, i, TRACE_MODE, mode);
+
+    uint64_t id = 0;
+    if (__is_download(mode))
+    {
+        uint64_t count;
+        if (!(list = __read_list(s, &count)))
+            goto PLAY_FAILED;
+        __measure(r, i, TRACE_LIST, count);
+        if (!__has(t, TRACE_REQUEST))
+            goto PLAY_DONE;
+        for (id = 0; id < count && strcmp(list[id].name, name); ++id)
+            ;
+        if (id == count)
+        {
+            fprintf(stderr, "%s is not offered by the server.\n", name);
+            goto PLAY_FAILED;
+        }
+    }
+    else if (!__has(t, TRACE_REQUEST))
+        goto PLAY_DONE;
+
+    // the file to send, or to receive into
+    char path[PATH_MAX];
+    __source_path(r, size, path, sizeof(path));
+    if (__is_upload(mode) ? !(fp = fopen(path, "rb")) : __is_download(mode) && !(fp = tmpfile()))
+    {
+        perror("Cannot open file");
+        goto PLAY_FAILED;
+    }
+
+    __wait_for(r, t, TRACE_REQUEST, 0);
+    if (__is_upload(mode))
+    {
+        __measure(r, i, TRACE_REQUEST, size);
+        __measure(r, i, TRACE_DATA_BEGIN, size);
+        // the preamble is sent with the content
+        if (__upload(s, name, fp, size, __is_udp(mode)))
+            goto PLAY_FAILED;
+        __measure(r, i, TRACE_DATA_END, size);
+    }
+    else if (__is_download(mode))
+    {
+        if (write_exactly(s, &id, sizeof(id)) < 0)
+            goto PLAY_FAILED;
+        __measure(r, i, TRACE_REQUEST, size);
+        // the first byte of the answer
+        struct pollfd pfd = {s, POLLIN, 0};
+        while (poll(&pfd, 1, -1) < 0 && errno == EINTR)
+            ;
+        __measure(r, i, TRACE_DATA_BEGIN, size);
+        int res = 1;
+        udp_channel ch;
+        if (__is_udp(mode) && !(res = udp_channel_accept(s, &ch)))
+        {
+            res = udp_receive_file(&ch, s, fileno(fp), size, TRANSFER_QUIET);
+            udp_channel_close(&ch);
+        }
+        if (res > 0)
+            res = receive_file_ex(s, fp, size, NULL, TRANSFER_QUIET);
+        if (res)
+            goto PLAY_FAILED;
+        __measure(r, i, TRACE_DATA_END, size);
+    }
+    else
+    {
+        // DIGEST, of a file that was missing if no size was recorded
+        struct tree_digest_header h;
+        if (send_path_request(s, size ? name : ""))
+            goto PLAY_FAILED;
+        __measure(r, i, TRACE_REQUEST, 0);
+        __measure(r, i, TRACE_DATA_BEGIN, 0);
+        if (read_exactly(s, &h, sizeof(h)) != sizeof(h))
+            goto PLAY_FAILED;
+        if (h.size != FETCH_NOT_FOUND)
+        {
+            uint8_t leaf[TREE_HASH_SIZE];
+            for (uint64_t j = 0; j < h.chunk_count; ++j)
+            {
+                if (read_exactly(s, leaf, sizeof(leaf)) != sizeof(leaf))
+                    goto PLAY_FAILED;
+            }
+            __measure(r, i, TRACE_DATA_END, h.size);
+        }
+    }
+
+    if (__has(t, TRACE_BYE))
+    {
+        if (__is_upload(mode) ? receive_bye_message(s) || send_bye_message(s)
+            : send_bye_message(s) || receive_bye_message(s))
+            goto PLAY_FAILED;
+        __measure(r, i, TRACE_BYE, 0);
+    }
+
+PLAY_DONE:
+    close(s);
+    __measure(r, i, TRACE_CLOSE, 0);
+    if (fp)
+        fclose(fp);
+    free(list);
+    return 0;
+
+PLAY_FAILED:
+    close(s);
+    __measure(r, i, TRACE_CLOSE, 0);
+    if (fp)
+        fclose(fp);
+    free(list);
+    return -1;
+}
+
+static void *__worker(void *arg)
+{
+    struct replay *r = arg;
+    size_t i;
+    while ((i = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED)) < r->count)
+    {
+        int res = __play(r, i);
+        __atomic_fetch_add(res < 0 ? &r->failed : res ? &r->skipped : &r->played, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static int compare(const char *path_a, const char *path_b)
+{
+    size_t na, nb;
+    trace_session *a = trace_load(path_a, &na);
+    trace_session *b = a ? trace_load(path_b, &nb) : NULL;
+    if (!b)
+    {
+        free(a);
+        return -1;
+    }
+    trace_print_summary(stdout, path_a, a, na);
+    trace_print_summary(stdout, path_b, b, nb);
+    printf("A: %s, B: %s\n", path_a, path_b);
+    trace_print_comparison(stdout, a, na, b, nb);
+    free(a);
+    free(b);
+    return 0;
+}
+
+static int replay(struct replay *r, const char *path, int workers, const char *output)
+{
+    size_t count;
+    trace_session *sessions = trace_load(path, &count);
+    if (!sessions)
+        return -1;
+    if (!count)
+    {
+        fprintf(stderr, "%s has no sessions.\n", path);
+        free(sessions);
+        return -1;
+    }
+    qsort(sessions, count, sizeof(trace_session), &__compare_connect);
+    r->sessions = sessions;
+    r->count = count;
+    int failed = 0;
+    if (!(r->measured = calloc(count, sizeof(trace_session))) || !mkdtemp(strcpy(r->dir, REPLAY_SOURCE_DIR)))
+    {
+        perror("Cannot prepare the replay");
+        free(r->measured);
+        free(sessions);
+        return -1;
+    }
+
+    // synthetic files of every size that is uploaded, or is uploaded first to be downloaded
+    printf("Making synthetic files in %s...\n", r->dir);
+    for (size_t i = 0; i < count && !failed; ++i)
+    {
+        if (__playable(&sessions[i]) && __file_size(&sessions[i]))
+            failed = __make_source(r, __file_size(&sessions[i]));
+    }
+    if (!failed)
+        failed = __prepare_server(r);
+    if (!failed && output && !(r->out = trace_writer_open(output)))
+        failed = 1;
+
+    if (!failed)
+    {
+        printf("Replaying %zu sessions of %.2fs at %s...\n", count,
+            (sessions[count - 1].ts[TRACE_CONNECT] - sessions[0].ts[TRACE_CONNECT]) / 1.0E9,
+            r->speed ? "the recorded pace" : "full speed");
+        if (r->speed && r->speed != 1)
+            printf("(%g times as fast)\n", r->speed);
+        pthread_t *tids = calloc(workers, sizeof(pthread_t));
+        int started = 0;
+        r->ts_base = now_ns() + REPLAY_START_DELAY_NS;
+        for (; tids && started < workers && started < count; ++started)
+        {
+            if (pthread_create(&tids[started], NULL, &__worker, r))
+                break;
+        }
+        for (int i = 0; i < started; ++i)
+            pthread_join(tids[i], NULL);
+        free(tids);
+        failed = !started;
+        if (failed)
+            fprintf(stderr, "Cannot start the workers.\n");
+        const double elapsed = (now_ns() - r->ts_base) / 1.0E9;
+        trace_writer_close(r->out);
+
+        printf("Played %" PRIu64 " sessions in %.2fs, %" PRIu64 " failed, %" PRIu64 " skipped (mode not replayed).\n",
+            r->played, elapsed, r->failed, r->skipped);
+        if (r->speed)
+            printf("%" PRIu64 " sessions started more than %.1fms late, at most %.1fms.\n",
+                r->late, REPLAY_LATE_NS / 1.0E6, r->late_max_ns / 1.0E6);
+        trace_print_summary(stdout, "Recorded (server)", sessions, count);
+        size_t n = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (r->measured[i].seen)
+                r->measured[n++] = r->measured[i];
+        }
+        trace_print_summary(stdout, "Replayed (client)", r->measured, n);
+    }
+
+    // remove the synthetic files
+    for (size_t i = 0; i < count; ++i)
+    {
+        char p[PATH_MAX];
+        __source_path(r, __file_size(&sessions[i]), p, sizeof(p));
+        unlink(p);
+    }
+    rmdir(r->dir);
+    free(r->measured);
+    free(sessions);
+    return failed ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    setbuf(stdout, 0);
+    // a server that hangs up must not kill the replay
+    signal(SIGPIPE, SIG_IGN);
+
+    struct replay r;
+    memset(&r, 0, sizeof(r));
+    r.speed = 1;
+    int workers = REPLAY_MAX_SESSIONS;
+    const char *output = NULL;
+    int comparing = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:j:o:c")) != -1)
+    {
+        switch (opt)
+        {
+            case 's':
+                r.speed = atof(optarg);
+                break;
+            case 'j':
+                workers = atoi(optarg);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'c':
+                comparing = 1;
+                break;
+            default:
+                goto PRINT_USAGE;
+        }
+    }
+    if (comparing && argc - optind == 2)
+        return compare(argv[optind], argv[optind + 1]);
+    if (comparing || argc - optind < 2 || argc - optind > 3 || r.speed < 0 || workers <= 0)
+    {
+PRINT_USAGE:
+        fprintf(stderr, "Usage: %s [-s speed] [-j sessions] [-o output] <trace> <host> [port]\n"
+            "       %s -c <trace A> <trace B>\n", argv[0], argv[0]);
+        return -1;
+    }
+    r.host = argv[optind + 1];
+    r.port = argc - optind == 3 ? atoi(argv[optind + 2]) : SERVER_DEDFAULT_PORT;
+    if (getenv(ENV_TLS) && strcmp(getenv(ENV_TLS), "0") && tls_client_init(getenv(ENV_TLS_CA)))
+        return -1;
+    return replay(&r, argv[optind], workers, output);
+}
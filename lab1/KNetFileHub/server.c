@@ -3,12 +3,74 @@
  ***********************************/
 
 #include "nfhs.h"
+#include <signal.h>
+
+/* runtime control, handled by the control thread:
+   SIGHUP: reload the bandwidth config file given by env NFH_BW_CONF
+   SIGUSR1: print statistics to stderr */
+#define ENV_BW_CONF "NFH_BW_CONF"
+/* uploads are kept in a hashed store under the directory given by env NFH_STORE,
+   or in the working directory if it is not set */
+#define ENV_STORE "NFH_STORE"
+/* or cut into deduplicated chunks under the directory given by env NFH_CHUNK_STORE */
+#define ENV_CHUNK_STORE "NFH_CHUNK_STORE"
+/* same-host clients may connect to the UNIX domain socket given by env NFH_UNIX_SOCKET */
+#define ENV_UNIX_SOCKET "NFH_UNIX_SOCKET"
+/* TCP clients must use TLS if env NFH_TLS_CERT (and NFH_TLS_KEY, or the key is in the same file) is set */
+/* sessions are recorded to the trace file given by env NFH_TRACE, to replay them with nfh_replay */
+
+static void *control_thread(void *arg)
+{
+    sigset_t *set = arg;
+    int sig;
+    while (!sigwait(set, &sig))
+    {
+        switch (sig)
+        {
+            case SIGHUP:
+                if (getenv(ENV_BW_CONF))
+                    bw_load_config(getenv(ENV_BW_CONF));
+                else
+                    fprintf(stderr, "SIGHUP ignored: " ENV_BW_CONF " is not set.\n");
+                break;
+            case SIGUSR1:
+                bw_print_stats(stderr);
+                fcache_print_stats(stderr);
+                tcp_tune_print_stats(stderr);
+                notify_print_stats(stderr);
+                break;
+        }
+    }
+    return NULL;
+}
 
 int main(int argc, char **argv)
 {
     setbuf(stdout, 0);
     DEBUGS(fprintf(stderr, "**** DEBUG OUTPUT IS ENABLED ****\n"));
 
+    // block control signals in all threads, only the control thread takes them
+    static sigset_t control_signals;
+    sigemptyset(&control_signals);
+    sigaddset(&control_signals, SIGHUP);
+    sigaddset(&control_signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &control_signals, NULL);
+    pthread_t control_tid;
+    if (pthread_create(&control_tid, NULL, &control_thread, &control_signals))
+    {
+        fprintf(stderr, "Cannot create control thread.\n");
+        return -1;
+    }
+    // a dead client must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    if (getenv(ENV_BW_CONF) && bw_load_config(getenv(ENV_BW_CONF)))
+        return -1;
+
+    if (getenv(ENV_TLS_CERT) && tls_server_init(getenv(ENV_TLS_CERT),
+        getenv(ENV_TLS_KEY) ? getenv(ENV_TLS_KEY) : getenv(ENV_TLS_CERT)))
+        return -1;
+
     char *host = "0.0.0.0";
     u_int16_t port = 3789;
     
@@ -23,16 +85,45 @@ int main(int argc, char **argv)
 
     printf("Starting server on %s:%hd...", host, port);
 
+    storage *store = getenv(ENV_CHUNK_STORE) ? storage_open_chunked(getenv(ENV_CHUNK_STORE))
+        : getenv(ENV_STORE) ? storage_open_hashed(getenv(ENV_STORE)) : storage_open_flat(".");
+    if (!store)
+    {
+        fprintf(stderr, "Cannot open storage.\n");
+        return -1;
+    }
+
+    // only a flat store is a plain directory, the others change by uploads alone
+    if (notify_start(getenv(ENV_CHUNK_STORE) || getenv(ENV_STORE) ? NULL : "."))
+        fprintf(stderr, "Change feed is not available.\n");
+
+    if (getenv(ENV_TRACE) && trace_start(getenv(ENV_TRACE)))
+    {
+        store->vf_close(store);
+        return -1;
+    }
+
     fsm_context *ctx = server_new(host, port);
     if (!ctx)
     {
         fprintf(stderr, "Cannot spawn server instance.\n");
+        store->vf_close(store);
+        return -1;
+    }
+    ctx->store = store;
+    if (getenv(ENV_UNIX_SOCKET) && (ctx->local_socket = transport_listen_local(getenv(ENV_UNIX_SOCKET))) < 0)
+    {
+        server_delete(ctx);
+        store->vf_close(store);
         return -1;
     }
 
     // main loop
     int failed = ctx->vf_fsm(ctx);
 
+    if (ctx->local_socket >= 0)
+        unlink(getenv(ENV_UNIX_SOCKET));
     server_delete(ctx);
+    store->vf_close(store);
     return failed;
 }
\ No newline at end of file
@@ -0,0 +1,221 @@
+/*************************************
+ *       Staged (atomic) Upload       *
+ *************************************/
+
+#define _GNU_SOURCE
+#include "staging.h"
+#include "util.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <inttypes.h>
+#include <time.h>
+
+/**
+ * @brief Check if a file name is a temp file of an unfinished upload.
+ *
+ * @param name the file name, without directory.
+ * @return int 1 if it is, 0 if not.
+ */
+int is_staging_temp_name(const char *name)
+{
+    return !strncmp(name, STAGING_TEMP_PREFIX, sizeof(STAGING_TEMP_PREFIX) - 1);
+}
+
+static void __staging_split(const char *name, char *dir, const char **base)
+{
+    // "a/b/c" -> dir "a/b", base "c"; "c" -> dir ".", base "c"
+    const char *slash = strrchr(name, '/');
+    if (!slash)
+    {
+        strcpy(dir, ".");
+        *base = name;
+        return;
+    }
+    memcpy(dir, name, slash - name);
+    dir[slash - name] = '\0';
+    *base = slash + 1;
+}
+
+static unsigned staging_seq = 0; // temp name generator, accessed atomically
+
+/**
+ * @brief Create an invisible file for an upload, with all space preallocated.
+ *
+ * @param f the staged file to initialize.
+ * @param name the name the file will be published as.
+ * @param length the file length.
+ * @return int 0 if success, non-zero if failed. Nothing has to be cleaned up if failed.
+ */
+int staged_open(struct staged_file *f, const char *name, uint64_t length)
+{
+    return staged_openat(f, AT_FDCWD, name, length);
+}
+
+/**
+ * @brief Create an invisible file for an upload, with all space preallocated.
+ *
+ * @param f the staged file to initialize.
+ * @param dirfd the directory `name` is relative to, must stay open until the file is published or discarded.
+ * @param name the name the file will be published as.
+ * @param length the file length.
+ * @return int 0 if success, non-zero if failed. Nothing has to be cleaned up if failed.
+ */
+int staged_openat(struct staged_file *f, int dirfd, const char *name, uint64_t length)
+{
+    memset(f, 0, sizeof(struct staged_file));
+    f->fd = -1;
+    f->dirfd = dirfd;
+    f->length = length;
+    if (strlen(name) >= sizeof(f->name))
+    {
+        fprintf(stderr, "File name is too long: %s.\n", name);
+        return -1;
+    }
+    strcpy(f->name, name);
+
+    char dir[PATH_MAX];
+    const char *base;
+    __staging_split(name, dir, &base);
+
+    if ((f->fd = openat(dirfd, dir, O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644)) >= 0)
+    {
+        f->anonymous = 1;
+    }
+    else
+    {
+        // no O_TMPFILE here, use a hidden name
+        for (int i = 0; i < STAGING_TEMP_ATTEMPTS; ++i)
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            unsigned id = __atomic_fetch_add(&staging_seq, 1, __ATOMIC_RELAXED) * 2654435761U
+                ^ (unsigned)getpid() ^ (unsigned)ts.tv_nsec;
+            if (snprintf(f->tmp_name, sizeof(f->tmp_name), "%s/" STAGING_TEMP_PREFIX "%s.%08x", dir, base, id)
+                >= sizeof(f->tmp_name))
+            {
+                fprintf(stderr, "File name is too long: %s.\n", name);
+                *f->tmp_name = '\0';
+                return -1;
+            }
+            if ((f->fd = openat(dirfd, f->tmp_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644)) >= 0
+                || errno != EEXIST)
+                break;
+        }
+        if (f->fd < 0)
+        {
+            int errsv = errno;
+            fprintf(stderr, "Cannot create temp file for %s [errno %d]: %s\n", name, errsv, strerror(errsv));
+            *f->tmp_name = '\0';
+            return -1;
+        }
+    }
+
+    // reserve the space up front
+    if (length && fallocate(f->fd, FALLOC_FL_KEEP_SIZE, 0, length))
+    {
+        int errsv = errno;
+        if (errsv != EOPNOTSUPP)
+        {
+            fprintf(stderr, "Cannot preallocate %" PRIu64 " bytes for %s [errno %d]: %s\n",
+                length, name, errsv, strerror(errsv));
+            staged_abort(f);
+            return -1;
+        }
+        // the file system can't preallocate, just write it
+    }
+
+    if (!(f->fp = fdopen(f->fd, "wb")))
+    {
+        perror("fdopen() failed");
+        staged_abort(f);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Make a completely received file visible under its real name, and close it.
+ *
+ * @param f the staged file. It is discarded if the publication fails.
+ * @return int 0 if success, non-zero if failed.
+ */
+int staged_publish(struct staged_file *f)
+{
+    return staged_publish_ex(f, 0);
+}
+
+/**
+ * @brief Make a completely received file visible under its real name, and close it.
+ *
+ * @param f the staged file. It is discarded if the publication fails.
+ * @param flags STAGING_* flags.
+ * @return int 0 if success, non-zero if failed.
+ */
+int staged_publish_ex(struct staged_file *f, int flags)
+{
+    struct stat st;
+    if (fflush(f->fp) || fstat(f->fd, &st))
+    {
+        perror("Failed to flush uploaded file");
+        goto PUBLISH_FAIL;
+    }
+    if (st.st_size != f->length)
+    {
+        fprintf(stderr, "Uploaded file %s has %" PRIu64 " bytes, but %" PRIu64 " bytes expected.\n",
+            f->name, (uint64_t)st.st_size, f->length);
+        goto PUBLISH_FAIL;
+    }
+    // the content must be on disk before the name is
+    if (!(flags & STAGING_NO_SYNC) && fdatasync(f->fd))
+    {
+        perror("Failed to sync uploaded file");
+        goto PUBLISH_FAIL;
+    }
+
+    int r;
+    if (f->anonymous)
+    {
+        char proc_path[64];
+        snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", f->fd);
+        r = linkat(AT_FDCWD, proc_path, f->dirfd, f->name, AT_SYMLINK_FOLLOW);
+    }
+    else
+    {
+        // link instead of rename, so an existing file is never replaced
+        if (!(r = linkat(f->dirfd, f->tmp_name, f->dirfd, f->name, 0)))
+            unlinkat(f->dirfd, f->tmp_name, 0);
+    }
+    if (r)
+    {
+        int errsv = errno;
+        fprintf(stderr, "Cannot publish %s [errno %d]: %s\n", f->name, errsv, strerror(errsv));
+PUBLISH_FAIL:
+        staged_abort(f);
+        return -1;
+    }
+
+    fclose(f->fp);
+    f->fp = NULL;
+    f->fd = -1;
+    return 0;
+}
+
+/**
+ * @brief Discard a staged file.
+ *
+ * @param f the staged file.
+ */
+void staged_abort(struct staged_file *f)
+{
+    if (f->fp)
+        fclose(f->fp);
+    else if (f->fd >= 0)
+        close(f->fd);
+    f->fp = NULL;
+    f->fd = -1;
+    if (!f->anonymous && *f->tmp_name)
+        unlinkat(f->dirfd, f->tmp_name, 0);
+}
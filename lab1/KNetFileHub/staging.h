@@ -0,0 +1,54 @@
+#ifndef __STAGING_H
+#define __STAGING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+
+/* configurations */
+#define STAGING_TEMP_PREFIX ".nfh-tmp." /* hidden temp files, never offered to clients */
+#define STAGING_TEMP_ATTEMPTS 16 /* random temp names tried before giving up */
+
+/* publish flags */
+#define STAGING_NO_SYNC 1 /* don't fdatasync, the caller syncs a batch of files at once */
+
+/*
+
+Staged (atomic) Upload:
+    An upload is written to a file nobody else can see, and appears under
+    its real name only after it is complete:
+        1. Create an anonymous file in the target directory (O_TMPFILE).
+           If the file system doesn't support it, use a hidden temp file
+           named STAGING_TEMP_PREFIX + name + random suffix.
+        2. Preallocate the full length, so the file gets contiguous extents,
+           and a full disk is detected (ENOSPC) before receiving anything.
+        3. Receive into it.
+        4. Flush, verify the length, and link it to the real name. Linking
+           never replaces an existing file.
+    If anything fails, the file is discarded.
+    Names are relative to the working directory, or to a directory file
+    descriptor with `staged_openat`.
+
+*/
+
+struct staged_file
+{
+    FILE *fp;                    // write the content here
+    int fd;
+    int dirfd;                   // names are relative to this directory
+    int anonymous;               // O_TMPFILE, has no name until published
+    uint64_t length;             // expected length
+    char name[PATH_MAX];         // the real name
+    char tmp_name[PATH_MAX];     // temp name, if not anonymous
+    void *cookie;                // state of a storage backend which doesn't write plain files
+};
+
+int staged_open(struct staged_file *f, const char *name, uint64_t length);
+int staged_openat(struct staged_file *f, int dirfd, const char *name, uint64_t length);
+int staged_publish(struct staged_file *f);
+int staged_publish_ex(struct staged_file *f, int flags);
+void staged_abort(struct staged_file *f);
+int is_staging_temp_name(const char *name);
+
+#endif
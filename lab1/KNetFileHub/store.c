@@ -0,0 +1,707 @@
+/*************************************
+ *          Storage Backends          *
+ *************************************/
+
+#define _GNU_SOURCE
+#include "store.h"
+#include "nfh.h"
+#include "util.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct flat_storage
+{
+    storage base;
+    char *dir;
+};
+
+// a file stored since the index was written
+struct store_entry
+{
+    uint64_t hash;
+    uint64_t size;
+    uint64_t ts_modified;
+    char name[];
+};
+
+struct hashed_storage
+{
+    storage base;
+    char *root;
+    pthread_rwlock_t lock;
+    // the index, mapped read-only
+    void *map;
+    size_t map_size;
+    const struct store_index_header *hdr;
+    const struct store_slot *slots;
+    const char *heap;
+    // entries in the journal, open addressing
+    struct store_entry **overlay;
+    size_t overlay_cap, overlay_count;
+    int journal_fd;
+};
+
+static uint64_t __store_hash(const char *s, size_t len)
+{
+    // FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i)
+    {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static FILE *__store_open_path(storage *st, const char *name)
+{
+    char path[PATH_MAX];
+    if (st->vf_path(st, name, path, sizeof(path)))
+    {
+        fprintf(stderr, "File name is too long: %s.\n", name);
+        return NULL;
+    }
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+    {
+        int errsv = errno;
+        fprintf(stderr, "Failed to open file %s [errno %d]: %s.\n", name, errsv, strerror(errsv));
+    }
+    return fp;
+}
+
+/* ---------------- flat ---------------- */
+
+static int __flat_path(storage *st, const char *name, char *path, size_t path_size)
+{
+    struct flat_storage *fs = (struct flat_storage *)st;
+    int n = strcmp(fs->dir, ".") ? snprintf(path, path_size, "%s/%s", fs->dir, name)
+        : snprintf(path, path_size, "%s", name);
+    return n < 0 || n >= path_size ? -1 : 0;
+}
+
+static int __flat_exists(storage *st, const char *name)
+{
+    char path[PATH_MAX];
+    return __flat_path(st, name, path, sizeof(path)) || !access(path, F_OK);
+}
+
+static int __flat_stage(storage *st, const char *name, uint64_t length, struct staged_file *f)
+{
+    char path[PATH_MAX];
+    if (__flat_path(st, name, path, sizeof(path)))
+        return -1;
+    return staged_open(f, path, length);
+}
+
+static int __flat_publish(storage *st, const char *name, struct staged_file *f)
+{
+    return staged_publish(f);
+}
+
+static int __flat_list(storage *st, storage_visit *visit, void *arg)
+{
+    struct flat_storage *fs = (struct flat_storage *)st;
+    DIR *dir = opendir(fs->dir);
+    if (!dir)
+    {
+        perror("Cannot list files");
+        return -1;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)))
+    {
+        if (entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN)
+            continue; // skip non-regular files
+        if (is_staging_temp_name(entry->d_name))
+            continue; // skip unfinished uploads
+        struct stat a;
+        if (fstatat(dirfd(dir), entry->d_name, &a, AT_SYMLINK_NOFOLLOW) || !S_ISREG(a.st_mode))
+            continue;
+        if (visit(arg, entry->d_name, a.st_size, a.st_mtime))
+            break;
+    }
+    closedir(dir);
+    return 0;
+}
+
+static void __flat_close(storage *st)
+{
+    struct flat_storage *fs = (struct flat_storage *)st;
+    free(fs->dir);
+    free(fs);
+}
+
+/**
+ * @brief Open a flat storage: every file in one directory.
+ *
+ * @param dir the directory.
+ * @return storage* the backend, NULL if failed.
+ */
+storage *storage_open_flat(const char *dir)
+{
+    struct flat_storage *fs = calloc(1, sizeof(struct flat_storage));
+    if (!fs || !(fs->dir = strdup(dir)))
+    {
+        fprintf(stderr, "Failed to malloc.\n");
+        free(fs);
+        return NULL;
+    }
+    fs->base.kind = "flat";
+    fs->base.vf_path = &__flat_path;
+    fs->base.vf_exists = &__flat_exists;
+    fs->base.vf_stage = &__flat_stage;
+    fs->base.vf_publish = &__flat_publish;
+    fs->base.vf_list = &__flat_list;
+    fs->base.vf_open = &__store_open_path;
+    fs->base.vf_close = &__flat_close;
+    return &fs->base;
+}
+
+/* ---------------- hashed ---------------- */
+
+static int __hashed_shard_path(struct hashed_storage *hs, uint64_t h, const char *name, char *path, size_t path_size)
+{
+    int n = snprintf(path, path_size, "%s/%02x/%02x/%s", hs->root,
+        (unsigned)(h >> 56), (unsigned)(h >> 48) & 0xFF, name);
+    return n < 0 || n >= path_size ? -1 : 0;
+}
+
+// lookups must hold the lock
+static const struct store_slot *__hashed_index_find(struct hashed_storage *hs, const char *name, size_t len, uint64_t h)
+{
+    if (!hs->hdr)
+        return NULL;
+    const uint64_t mask = hs->hdr->slot_count - 1;
+    for (uint64_t i = h & mask; hs->slots[i].name_length; i = (i + 1) & mask)
+    {
+        const struct store_slot *slot = &hs->slots[i];
+        if (slot->hash == h && slot->name_length == len && !memcmp(hs->heap + slot->name_offset, name, len))
+            return slot;
+    }
+    return NULL;
+}
+
+static struct store_entry *__hashed_overlay_find(struct hashed_storage *hs, const char *name, uint64_t h)
+{
+    if (!hs->overlay_cap)
+        return NULL;
+    const size_t mask = hs->overlay_cap - 1;
+    for (size_t i = h & mask; hs->overlay[i]; i = (i + 1) & mask)
+    {
+        if (hs->overlay[i]->hash == h && !strcmp(hs->overlay[i]->name, name))
+            return hs->overlay[i];
+    }
+    return NULL;
+}
+
+static int __hashed_overlay_insert(struct hashed_storage *hs, struct store_entry *e)
+{
+    if ((hs->overlay_count + 1) * 2 > hs->overlay_cap)
+    {
+        // keep the load factor under 1/2
+        size_t cap = hs->overlay_cap ? hs->overlay_cap * 2 : 1024;
+        struct store_entry **t = calloc(cap, sizeof(struct store_entry *));
+        if (!t)
+            return -1;
+        for (size_t i = 0; i < hs->overlay_cap; ++i)
+        {
+            struct store_entry *p = hs->overlay[i];
+            if (!p)
+                continue;
+            size_t j = p->hash & (cap - 1);
+            while (t[j])
+                j = (j + 1) & (cap - 1);
+            t[j] = p;
+        }
+        free(hs->overlay);
+        hs->overlay = t;
+        hs->overlay_cap = cap;
+    }
+    size_t j = e->hash & (hs->overlay_cap - 1);
+    while (hs->overlay[j])
+        j = (j + 1) & (hs->overlay_cap - 1);
+    hs->overlay[j] = e;
+    ++hs->overlay_count;
+    return 0;
+}
+
+static void __hashed_overlay_clear(struct hashed_storage *hs)
+{
+    for (size_t i = 0; i < hs->overlay_cap; ++i)
+        free(hs->overlay[i]);
+    free(hs->overlay);
+    hs->overlay = NULL;
+    hs->overlay_cap = hs->overlay_count = 0;
+}
+
+// every name in the heap, ended with '\0', and an empty slot to end every lookup
+static int __hashed_check_index(const struct store_index_header *hdr)
+{
+    const struct store_slot *slots = (const struct store_slot *)(hdr + 1);
+    const char *heap = (const char *)(slots + hdr->slot_count);
+    uint64_t used = 0;
+    for (uint64_t i = 0; i < hdr->slot_count; ++i)
+    {
+        const struct store_slot *slot = &slots[i];
+        if (!slot->name_length)
+            continue;
+        if (slot->name_length > MAX_FILENAME_LENGTH || (uint64_t)slot->name_offset + slot->name_length >= hdr->heap_size
+            || heap[slot->name_offset + slot->name_length])
+            return -1;
+        ++used;
+    }
+    return used == hdr->slot_count ? -1 : 0;
+}
+
+static int __hashed_map_index(struct hashed_storage *hs)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/" STORE_INDEX_FILE, hs->root);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1; // a new store
+    struct stat st;
+    if (fstat(fd, &st))
+    {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size < sizeof(struct store_index_header))
+    {
+        fprintf(stderr, "Store index %s is truncated.\n", path);
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        perror("Cannot map store index");
+        return -1;
+    }
+    const struct store_index_header *hdr = map;
+    if (memcmp(hdr->magic, STORE_INDEX_MAGIC, sizeof(STORE_INDEX_MAGIC))
+        || !hdr->slot_count || (hdr->slot_count & (hdr->slot_count - 1))
+        || hdr->slot_count > (st.st_size - sizeof(*hdr)) / sizeof(struct store_slot)
+        || sizeof(*hdr) + hdr->slot_count * sizeof(struct store_slot) + hdr->heap_size != st.st_size
+        || __hashed_check_index(hdr))
+    {
+        fprintf(stderr, "Store index %s is corrupt.\n", path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+    // lookups go all over the table
+    madvise(map, st.st_size, MADV_RANDOM);
+    hs->map = map;
+    hs->map_size = st.st_size;
+    hs->hdr = hdr;
+    hs->slots = (const struct store_slot *)(hdr + 1);
+    hs->heap = (const char *)(hs->slots + hdr->slot_count);
+    return 0;
+}
+
+static void __hashed_unmap_index(struct hashed_storage *hs)
+{
+    if (hs->map)
+        munmap(hs->map, hs->map_size);
+    hs->map = NULL;
+    hs->hdr = NULL;
+    hs->slots = NULL;
+    hs->heap = NULL;
+}
+
+static void __hashed_place(struct store_slot *slots, uint64_t slot_count, const struct store_slot *s)
+{
+    uint64_t i = s->hash & (slot_count - 1);
+    while (slots[i].name_length)
+        i = (i + 1) & (slot_count - 1);
+    slots[i] = *s;
+}
+
+/**
+ * @brief Merge the journal into a new index, then empty the journal. Must hold the write lock.
+ */
+static int __hashed_compact(struct hashed_storage *hs)
+{
+    const uint64_t count = (hs->hdr ? hs->hdr->count : 0) + hs->overlay_count;
+    uint64_t slot_count = 1024;
+    while (slot_count < count * 2)
+        slot_count *= 2;
+    uint64_t heap_size = hs->hdr ? hs->hdr->heap_size : 0;
+    for (size_t i = 0; i < hs->overlay_cap; ++i)
+    {
+        if (hs->overlay[i])
+            heap_size += strlen(hs->overlay[i]->name) + 1;
+    }
+    if (heap_size > UINT32_MAX)
+    {
+        fprintf(stderr, "Store index is full.\n");
+        return -1;
+    }
+
+    const size_t file_size = sizeof(struct store_index_header) + slot_count * sizeof(struct store_slot) + heap_size;
+    char path[PATH_MAX], tmp_path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/" STORE_INDEX_FILE, hs->root);
+    snprintf(tmp_path, sizeof(tmp_path), "%s/" STORE_INDEX_FILE ".tmp", hs->root);
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || ftruncate(fd, file_size))
+        goto COMPACT_FAIL;
+    void *map = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        goto COMPACT_FAIL;
+
+    // the file is all zeros: empty slots
+    struct store_index_header *hdr = map;
+    struct store_slot *slots = (struct store_slot *)(hdr + 1);
+    char *heap = (char *)(slots + slot_count);
+    memcpy(hdr->magic, STORE_INDEX_MAGIC, sizeof(STORE_INDEX_MAGIC));
+    hdr->count = count;
+    hdr->slot_count = slot_count;
+    hdr->heap_size = heap_size;
+    size_t heap_used = 0;
+    if (hs->hdr)
+    {
+        // the old heap is copied as a whole, offsets stay valid
+        memcpy(heap, hs->heap, hs->hdr->heap_size);
+        heap_used = hs->hdr->heap_size;
+        for (uint64_t i = 0; i < hs->hdr->slot_count; ++i)
+        {
+            if (hs->slots[i].name_length)
+                __hashed_place(slots, slot_count, &hs->slots[i]);
+        }
+    }
+    for (size_t i = 0; i < hs->overlay_cap; ++i)
+    {
+        const struct store_entry *e = hs->overlay[i];
+        if (!e)
+            continue;
+        struct store_slot s;
+        s.hash = e->hash;
+        s.size = e->size;
+        s.ts_modified = e->ts_modified;
+        s.name_offset = heap_used;
+        s.name_length = strlen(e->name);
+        memcpy(heap + heap_used, e->name, s.name_length + 1);
+        heap_used += s.name_length + 1;
+        __hashed_place(slots, slot_count, &s);
+    }
+    int r = msync(map, file_size, MS_SYNC);
+    munmap(map, file_size);
+    if (r || fsync(fd))
+        goto COMPACT_FAIL;
+    close(fd);
+    fd = -1;
+
+    // the new index replaces the old one at once, then the journal is not needed
+    if (rename(tmp_path, path))
+        goto COMPACT_FAIL;
+    int root_fd = open(hs->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd >= 0)
+    {
+        fsync(root_fd);
+        close(root_fd);
+    }
+    __hashed_unmap_index(hs);
+    __hashed_overlay_clear(hs);
+    if (ftruncate(hs->journal_fd, 0) || fsync(hs->journal_fd))
+        perror("Cannot empty store journal");
+    if (__hashed_map_index(hs))
+        return -1;
+    return 0;
+
+COMPACT_FAIL:
+    perror("Cannot write store index");
+    if (fd >= 0)
+        close(fd);
+    unlink(tmp_path);
+    return -1;
+}
+
+static int __hashed_add(struct hashed_storage *hs, const char *name, uint64_t size, uint64_t ts_modified, int sync)
+{
+    // journal first, so that the entry survives a crash
+    const size_t len = strlen(name);
+    char buf[sizeof(struct store_journal_record) + MAX_FILENAME_LENGTH];
+    struct store_journal_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.size = size;
+    rec.ts_modified = ts_modified;
+    rec.name_length = len;
+    memcpy(buf, &rec, sizeof(rec));
+    memcpy(buf + sizeof(rec), name, len);
+    struct store_entry *e = malloc(sizeof(struct store_entry) + len + 1);
+    if (!e)
+    {
+        fprintf(stderr, "Failed to malloc.\n");
+        return -1;
+    }
+    e->hash = __store_hash(name, len);
+    e->size = size;
+    e->ts_modified = ts_modified;
+    memcpy(e->name, name, len + 1);
+
+    pthread_rwlock_wrlock(&hs->lock);
+    if (write_exactly(hs->journal_fd, buf, sizeof(rec) + len) < 0 || (sync && fdatasync(hs->journal_fd)))
+    {
+        pthread_rwlock_unlock(&hs->lock);
+        perror("Cannot write store journal");
+        free(e);
+        return -1;
+    }
+    if (__hashed_overlay_insert(hs, e))
+    {
+        pthread_rwlock_unlock(&hs->lock);
+        fprintf(stderr, "Failed to malloc.\n");
+        free(e);
+        return -1;
+    }
+    if (hs->overlay_count >= STORE_COMPACT_THRESHOLD)
+        __hashed_compact(hs); // if it fails, the journal still has everything
+    pthread_rwlock_unlock(&hs->lock);
+    return 0;
+}
+
+static int __hashed_replay_journal(struct hashed_storage *hs)
+{
+    struct stat st;
+    if (fstat(hs->journal_fd, &st))
+        return -1;
+    char *buf = malloc(st.st_size ? st.st_size : 1);
+    if (!buf)
+        return -1;
+    if (pread(hs->journal_fd, buf, st.st_size, 0) != st.st_size)
+    {
+        free(buf);
+        return -1;
+    }
+    off_t off = 0;
+    while (off + sizeof(struct store_journal_record) <= st.st_size)
+    {
+        struct store_journal_record rec;
+        memcpy(&rec, buf + off, sizeof(rec));
+        if (!rec.name_length || rec.name_length > MAX_FILENAME_LENGTH
+            || off + sizeof(rec) + rec.name_length > st.st_size)
+            break;
+        struct store_entry *e = malloc(sizeof(struct store_entry) + rec.name_length + 1);
+        if (!e)
+        {
+            free(buf);
+            return -1;
+        }
+        memcpy(e->name, buf + off + sizeof(rec), rec.name_length);
+        e->name[rec.name_length] = '\0';
+        e->hash = __store_hash(e->name, rec.name_length);
+        e->size = rec.size;
+        e->ts_modified = rec.ts_modified;
+        if (__hashed_index_find(hs, e->name, rec.name_length, e->hash) || __hashed_overlay_find(hs, e->name, e->hash)
+            || __hashed_overlay_insert(hs, e))
+            free(e); // already known
+        off += sizeof(rec) + rec.name_length;
+    }
+    free(buf);
+    if (off != st.st_size)
+    {
+        // the last record was cut by a crash
+        fprintf(stderr, "Store journal has a partial record, dropped.\n");
+        if (ftruncate(hs->journal_fd, off))
+            return -1;
+    }
+    return 0;
+}
+
+static int __hashed_path(storage *st, const char *name, char *path, size_t path_size)
+{
+    return __hashed_shard_path((struct hashed_storage *)st, __store_hash(name, strlen(name)), name, path, path_size);
+}
+
+static int __hashed_exists(storage *st, const char *name)
+{
+    struct hashed_storage *hs = (struct hashed_storage *)st;
+    const size_t len = strlen(name);
+    const uint64_t h = __store_hash(name, len);
+    pthread_rwlock_rdlock(&hs->lock);
+    int r = __hashed_index_find(hs, name, len, h) || __hashed_overlay_find(hs, name, h);
+    pthread_rwlock_unlock(&hs->lock);
+    return r;
+}
+
+static int __hashed_make_shard(struct hashed_storage *hs, uint64_t h)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%02x", hs->root, (unsigned)(h >> 56));
+    if (mkdir(path, 0755) && errno != EEXIST)
+        return -1;
+    snprintf(path, sizeof(path), "%s/%02x/%02x", hs->root, (unsigned)(h >> 56), (unsigned)(h >> 48) & 0xFF);
+    if (mkdir(path, 0755) && errno != EEXIST)
+        return -1;
+    return 0;
+}
+
+static int __hashed_stage(storage *st, const char *name, uint64_t length, struct staged_file *f)
+{
+    struct hashed_storage *hs = (struct hashed_storage *)st;
+    const uint64_t h = __store_hash(name, strlen(name));
+    char path[PATH_MAX];
+    if (__hashed_shard_path(hs, h, name, path, sizeof(path)) || __hashed_make_shard(hs, h))
+    {
+        fprintf(stderr, "Cannot make room for %s in the store.\n", name);
+        return -1;
+    }
+    return staged_open(f, path, length);
+}
+
+static int __hashed_publish(storage *st, const char *name, struct staged_file *f)
+{
+    struct stat a;
+    if (fstat(f->fd, &a))
+    {
+        perror("Error occurred in fstat");
+        staged_abort(f);
+        return -1;
+    }
+    if (staged_publish(f))
+        return -1;
+    // the file is there, and can be found again by migrating the shard if the index fails
+    return __hashed_add((struct hashed_storage *)st, name, f->length, a.st_mtime, 1);
+}
+
+static int __hashed_list(storage *st, storage_visit *visit, void *arg)
+{
+    struct hashed_storage *hs = (struct hashed_storage *)st;
+    pthread_rwlock_rdlock(&hs->lock);
+    for (size_t i = 0; i < hs->overlay_cap; ++i)
+    {
+        const struct store_entry *e = hs->overlay[i];
+        if (e && visit(arg, e->name, e->size, e->ts_modified))
+            goto LIST_END;
+    }
+    for (uint64_t i = 0; hs->hdr && i < hs->hdr->slot_count; ++i)
+    {
+        const struct store_slot *s = &hs->slots[i];
+        if (s->name_length && visit(arg, hs->heap + s->name_offset, s->size, s->ts_modified))
+            break;
+    }
+LIST_END:
+    pthread_rwlock_unlock(&hs->lock);
+    return 0;
+}
+
+static void __hashed_close(storage *st)
+{
+    struct hashed_storage *hs = (struct hashed_storage *)st;
+    // leave a compact index for the next start
+    pthread_rwlock_wrlock(&hs->lock);
+    if (hs->overlay_count && hs->journal_fd >= 0)
+        __hashed_compact(hs);
+    pthread_rwlock_unlock(&hs->lock);
+    __hashed_unmap_index(hs);
+    __hashed_overlay_clear(hs);
+    if (hs->journal_fd >= 0)
+        close(hs->journal_fd);
+    pthread_rwlock_destroy(&hs->lock);
+    free(hs->root);
+    free(hs);
+}
+
+/**
+ * @brief Open a hashed storage, creating it if it doesn't exist.
+ *
+ * @param root the root directory of the store.
+ * @return storage* the backend, NULL if failed.
+ */
+storage *storage_open_hashed(const char *root)
+{
+    struct hashed_storage *hs = calloc(1, sizeof(struct hashed_storage));
+    if (!hs || !(hs->root = strdup(root)))
+    {
+        fprintf(stderr, "Failed to malloc.\n");
+        free(hs);
+        return NULL;
+    }
+    hs->journal_fd = -1;
+    pthread_rwlock_init(&hs->lock, NULL);
+    hs->base.kind = "hashed";
+    hs->base.vf_path = &__hashed_path;
+    hs->base.vf_exists = &__hashed_exists;
+    hs->base.vf_stage = &__hashed_stage;
+    hs->base.vf_publish = &__hashed_publish;
+    hs->base.vf_list = &__hashed_list;
+    hs->base.vf_open = &__store_open_path;
+    hs->base.vf_close = &__hashed_close;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/" STORE_JOURNAL_FILE, root);
+    if ((mkdir(root, 0755) && errno != EEXIST) || __hashed_map_index(hs)
+        || (hs->journal_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0
+        || __hashed_replay_journal(hs))
+    {
+        int errsv = errno;
+        fprintf(stderr, "Cannot open store %s [errno %d]: %s\n", root, errsv, strerror(errsv));
+        __hashed_close(&hs->base);
+        return NULL;
+    }
+    // start with everything in the index
+    if (hs->overlay_count && __hashed_compact(hs))
+        fprintf(stderr, "Store index is not compacted, the journal is used.\n");
+    return &hs->base;
+}
+
+/**
+ * @brief Move an existing file into a storage, e.g. to migrate a flat directory.
+ *
+ * @param st the storage.
+ * @param src the file, on the same file system as the storage.
+ * @param name the name to store it as.
+ * @return int 0 if success, non-zero if failed.
+ */
+int storage_import(storage *st, const char *src, const char *name)
+{
+    if (st->vf_exists(st, name))
+    {
+        fprintf(stderr, "%s is already in the store.\n", name);
+        return -1;
+    }
+    struct stat a;
+    char path[PATH_MAX];
+    if (stat(src, &a) || !S_ISREG(a.st_mode) || st->vf_path(st, name, path, sizeof(path)))
+    {
+        fprintf(stderr, "Cannot import %s.\n", src);
+        return -1;
+    }
+    if (st->vf_publish != &__hashed_publish)
+    {
+        // flat: just move it, never replacing a file
+        if (link(src, path) || unlink(src))
+        {
+            perror("Cannot import file");
+            return -1;
+        }
+        return 0;
+    }
+
+    struct hashed_storage *hs = (struct hashed_storage *)st;
+    const uint64_t h = __store_hash(name, strlen(name));
+    struct stat b;
+    if (__hashed_make_shard(hs, h) || (link(src, path)
+        && (errno != EEXIST || stat(path, &b) || b.st_ino != a.st_ino || b.st_dev != a.st_dev)))
+    {
+        // already linked by an interrupted import is fine
+        perror("Cannot import file");
+        return -1;
+    }
+    // many files are imported at once, the journal is synced when the store is closed
+    if (__hashed_add(hs, name, a.st_size, a.st_mtime, 0))
+    {
+        unlink(path);
+        return -1;
+    }
+    unlink(src);
+    return 0;
+}
@@ -0,0 +1,103 @@
+#ifndef __STORE_H
+#define __STORE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "staging.h"
+
+/* configurations */
+#define STORE_INDEX_FILE "index"           /* compact index, mapped at startup */
+#define STORE_JOURNAL_FILE "journal"       /* entries added since the index was written */
+#define STORE_COMPACT_THRESHOLD 65536      /* rewrite the index when the journal has this many entries */
+#define STORE_INDEX_MAGIC "NFHIDX1"
+
+/*
+
+Storage Backend:
+    Uploaded files are kept by a storage backend, which maps a logical file
+    name to the file on disk. The server handlers only use the vfuncs below.
+    Flat:
+        Every file is in one directory under its own name. This is how the
+        server has always stored files.
+    Hashed:
+        A file is stored as `<root>/xx/yy/<name>`, where xx and yy are the
+        top two bytes of the 64-bit FNV-1a hash of the name, so no directory
+        grows large. Names and sizes are kept in an index, so looking up or
+        listing files never touches the directories:
+            `<root>/index` is an open-addressing hash table of `struct store_slot`
+            (load factor <= 1/2), followed by the names. It is mapped read-only
+            at startup, and never changed in place.
+            `<root>/journal` has a `struct store_journal_record` plus the name of
+            every file stored since the index was written. It is replayed into
+            memory at startup, and merged into a new index when it gets long.
+        Files put into the directories by hand are not seen. Use the migration
+        tool (nfh_migrate) to move a flat directory into a hashed store.
+    The modes that copy directory trees (TREEDL, FETCHP, AGGRUP, AGGRDL, see
+    nfh.h) work on the directories themselves, so the server allows them
+    with the flat backend only.
+
+*/
+
+typedef struct storage storage;
+
+/**
+ * @brief Called for every stored file by `vf_list`.
+ *
+ * @return int 0 to continue, non-zero to stop listing.
+ */
+typedef int (storage_visit)(void *arg, const char *name, uint64_t size, uint64_t ts_modified);
+
+typedef int vfunc_storage_path(storage *st, const char *name, char *path, size_t path_size);
+typedef int vfunc_storage_exists(storage *st, const char *name);
+typedef int vfunc_storage_stage(storage *st, const char *name, uint64_t length, struct staged_file *f);
+typedef int vfunc_storage_publish(storage *st, const char *name, struct staged_file *f);
+typedef int vfunc_storage_list(storage *st, storage_visit *visit, void *arg);
+typedef FILE *vfunc_storage_open(storage *st, const char *name);
+typedef void vfunc_storage_close(storage *st);
+
+struct storage
+{
+    const char *kind;
+    // methods
+    vfunc_storage_path *vf_path;       // where the file of a name is, -1 if it isn't kept as a plain file
+    vfunc_storage_exists *vf_exists;   // 1 if a name is taken, 0 if not
+    vfunc_storage_stage *vf_stage;     // create an invisible file for an upload, see staging.h
+    vfunc_storage_publish *vf_publish; // make a staged file visible, never replacing one
+    vfunc_storage_list *vf_list;
+    vfunc_storage_open *vf_open;       // open a stored file for reading, NULL if failed
+    vfunc_storage_close *vf_close;     // release the backend, and the storage object itself
+};
+
+struct store_index_header
+{
+    char magic[8];
+    uint64_t count;       // files in the index
+    uint64_t slot_count;  // a power of 2
+    uint64_t heap_size;   // bytes of names after the slots, each one ends with '\0'
+};
+
+struct store_slot
+{
+    uint64_t hash;
+    uint64_t size;
+    uint64_t ts_modified;
+    uint32_t name_offset;  // in the heap
+    uint32_t name_length;  // 0 if the slot is empty
+};
+
+struct store_journal_record
+{
+    uint64_t size;
+    uint64_t ts_modified;
+    uint16_t name_length;  // followed by the name, without '\0'
+    uint8_t reserved[6];
+};
+
+storage *storage_open_flat(const char *dir);
+storage *storage_open_hashed(const char *root);
+int storage_import(storage *st, const char *src, const char *name);
+
+#endif
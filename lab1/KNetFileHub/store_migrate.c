@@ -0,0 +1,69 @@
+/******************************************
+ *  Flat Directory -> Hashed Store Migrate *
+ ******************************************/
+
+/*
+ * Moves every regular file of a flat server directory into a hashed store,
+ * and writes the store index. Files are hard linked into the store, so the
+ * store must be on the same file system. An interrupted migration can just
+ * be run again.
+ * Usage: nfh_migrate <flat_dir> <store_root>
+ */
+
+#include "nfh.h"
+#include "store.h"
+#include "staging.h"
+#include <dirent.h>
+#include <fcntl.h>
+
+#define PROGRESS_INTERVAL 10000
+
+int main(int argc, char **argv)
+{
+    setbuf(stdout, 0);
+    if (argc != 3)
+    {
+        fprintf(stderr, "Usage: %s <flat_dir> <store_root>\n", argv[0]);
+        return -1;
+    }
+    const char *flat_dir = argv[1], *root = argv[2];
+    DIR *dir = opendir(flat_dir);
+    if (!dir)
+    {
+        perror("Cannot open flat directory");
+        return -1;
+    }
+    storage *store = storage_open_hashed(root);
+    if (!store)
+    {
+        closedir(dir);
+        return -1;
+    }
+
+    uint64_t migrated = 0, skipped = 0;
+    struct dirent *entry;
+    char src[PATH_MAX];
+    while ((entry = readdir(dir)))
+    {
+        struct stat a;
+        if (fstatat(dirfd(dir), entry->d_name, &a, AT_SYMLINK_NOFOLLOW) || !S_ISREG(a.st_mode))
+            continue; // the store itself, other directories and special files
+        if (is_staging_temp_name(entry->d_name) || strlen(entry->d_name) > MAX_FILENAME_LENGTH
+            || snprintf(src, sizeof(src), "%s/%s", flat_dir, entry->d_name) >= sizeof(src))
+        {
+            fprintf(stderr, "Skip %s.\n", entry->d_name);
+            ++skipped;
+            continue;
+        }
+        if (storage_import(store, src, entry->d_name))
+            ++skipped;
+        else if (++migrated % PROGRESS_INTERVAL == 0)
+            printf("%" PRIu64 " files migrated...\n", migrated);
+    }
+    closedir(dir);
+
+    // writes the index
+    store->vf_close(store);
+    printf("Migrated %" PRIu64 " files into %s, %" PRIu64 " skipped.\n", migrated, root, skipped);
+    return skipped ? 1 : 0;
+}
@@ -0,0 +1,272 @@
+/*************************************
+ *       TCP Auto-tuning             *
+ *************************************/
+
+#include "tcptune.h"
+#include "util.h"
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h> /* the struct tcp_info of glibc lacks the newer fields */
+
+struct tune_decision
+{
+    int sending;
+    uint32_t rtt_us;
+    uint64_t rate;   // bytes per second
+    uint64_t bdp;
+    size_t chunk;
+    int buffer;
+    uint32_t lowat;
+    int capped;      // the buffer wanted more than the sysctl limit allows
+};
+
+static pthread_mutex_t tune_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct
+{
+    uint64_t transfers;
+    uint64_t samples;
+    uint64_t chunk_changes;
+    uint64_t buffer_raises;
+    uint64_t buffer_capped;
+    uint64_t lowat_changes;
+} tune_stats;
+static struct tune_decision tune_log[TUNE_LOG_SIZE]; // a ring, the latest at (tune_log_count - 1)
+static uint64_t tune_log_count = 0;
+
+// net.core.wmem_max and rmem_max, what SO_SNDBUF and SO_RCVBUF may ask for without CAP_NET_ADMIN
+static int sysctl_max[2] = {0, 0};
+static pthread_once_t sysctl_once = PTHREAD_ONCE_INIT;
+
+static void read_sysctl_max(void)
+{
+    const char *files[2] = {"/proc/sys/net/core/rmem_max", "/proc/sys/net/core/wmem_max"};
+    for (int i = 0; i < 2; ++i)
+    {
+        FILE *fp = fopen(files[i], "r");
+        if (!fp || fscanf(fp, "%d", &sysctl_max[i]) != 1)
+            sysctl_max[i] = 212992; // the kernel's default
+        if (fp)
+            fclose(fp);
+    }
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t round_up_pow2(uint64_t v)
+{
+    uint64_t p = 1;
+    while (p < v)
+        p <<= 1;
+    return p;
+}
+
+/**
+ * @brief Start tuning a transfer. Always succeeds, a socket that can't be tuned is left alone.
+ *
+ * @param t the tuner.
+ * @param socket the socket.
+ * @param sending 1 if the file is sent, 0 if received.
+ */
+void tcp_tune_begin(tcp_tuner *t, int socket, int sending)
+{
+    memset(t, 0, sizeof(*t));
+    t->socket = socket;
+    t->sending = sending;
+    t->chunk = TUNE_MAX_CHUNK;
+    const char *env = getenv(ENV_TCP_AUTOTUNE);
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    if ((env && !strcmp(env, "0")) || getsockopt(socket, IPPROTO_TCP, TCP_INFO, &ti, &len))
+        return;
+    len = sizeof(t->buffer);
+    if (getsockopt(socket, SOL_SOCKET, sending ? SO_SNDBUF : SO_RCVBUF, &t->buffer, &len))
+        return;
+    pthread_once(&sysctl_once, &read_sysctl_max);
+    t->enabled = 1;
+    // the first sample is taken once the transfer is running, short transfers are left alone
+    t->last_ns = now_ns();
+    t->next_ns = t->last_ns + TUNE_INTERVAL_NS;
+    pthread_mutex_lock(&tune_lock);
+    ++tune_stats.transfers;
+    pthread_mutex_unlock(&tune_lock);
+}
+
+/**
+ * @brief Raise the socket buffer of the direction to `target` bytes, as the kernel counts them.
+ *
+ * @return int 1 if the sysctl limit kept it lower, 0 if not.
+ */
+static int tcp_tune_raise_buffer(tcp_tuner *t, int target)
+{
+    const int opt = t->sending ? SO_SNDBUF : SO_RCVBUF;
+    const int limit = sysctl_max[t->sending];
+    // the kernel doubles what it is given, for its bookkeeping
+    int want = target / 2;
+    int capped = 0;
+    if (setsockopt(t->socket, SOL_SOCKET, t->sending ? SO_SNDBUFFORCE : SO_RCVBUFFORCE, &want, sizeof(want)))
+    {
+        if (want > limit)
+        {
+            want = limit;
+            capped = 1;
+        }
+        // setting a buffer stops the kernel from tuning it, only do it if it is an improvement
+        if (want * 2 > t->buffer)
+            setsockopt(t->socket, SOL_SOCKET, opt, &want, sizeof(want));
+    }
+    socklen_t len = sizeof(t->buffer);
+    getsockopt(t->socket, SOL_SOCKET, opt, &t->buffer, &len);
+    return capped;
+}
+
+/**
+ * @brief Sample the connection and tune it, at most every TUNE_INTERVAL_NS. Called before every chunk.
+ *
+ * @param t the tuner.
+ * @param bytes how many bytes of the file have been moved so far.
+ * @return size_t the chunk size to use.
+ */
+size_t tcp_tune_update(tcp_tuner *t, uint64_t bytes)
+{
+    if (!t->enabled)
+        return t->chunk;
+    const uint64_t now = now_ns();
+    if (now < t->next_ns)
+        return t->chunk;
+    t->next_ns = now + TUNE_INTERVAL_NS;
+
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    if (getsockopt(t->socket, IPPROTO_TCP, TCP_INFO, &ti, &len))
+        return t->chunk;
+    uint32_t rtt_us;
+    uint64_t rate;
+    if (t->sending)
+    {
+        // the path's own delay, without what queues add, which would inflate the estimate
+        rtt_us = ti.tcpi_min_rtt ? ti.tcpi_min_rtt : ti.tcpi_rtt;
+        rate = ti.tcpi_delivery_rate ? ti.tcpi_delivery_rate
+            : rtt_us ? (uint64_t)ti.tcpi_snd_cwnd * ti.tcpi_snd_mss * 1000000 / rtt_us : 0;
+    }
+    else
+    {
+        rtt_us = ti.tcpi_rcv_rtt ? ti.tcpi_rcv_rtt : ti.tcpi_rtt;
+        rate = now > t->last_ns && bytes > t->last_bytes ? (bytes - t->last_bytes) * 1000000000 / (now - t->last_ns) : 0;
+    }
+    t->last_ns = now;
+    t->last_bytes = bytes;
+    if (!rtt_us || !rate)
+        return t->chunk;
+
+    struct tune_decision d;
+    memset(&d, 0, sizeof(d));
+    d.sending = t->sending;
+    d.rtt_us = rtt_us;
+    d.rate = rate;
+    d.bdp = rate * rtt_us / 1000000;
+    d.chunk = round_up_pow2(d.bdp);
+    if (d.chunk < TUNE_MIN_CHUNK)
+        d.chunk = TUNE_MIN_CHUNK;
+    if (d.chunk > TUNE_MAX_CHUNK)
+        d.chunk = TUNE_MAX_CHUNK;
+    if (t->sending)
+    {
+        // enough unsent data to cover the writer's wake-up, and no more
+        uint64_t lowat = round_up_pow2(rate * TUNE_LOWAT_US / 1000000);
+        d.lowat = lowat < TUNE_MIN_LOWAT ? TUNE_MIN_LOWAT : lowat > TUNE_MAX_LOWAT ? TUNE_MAX_LOWAT : lowat;
+    }
+
+    // the kernel may have grown the buffer meanwhile
+    len = sizeof(t->buffer);
+    getsockopt(t->socket, SOL_SOCKET, t->sending ? SO_SNDBUF : SO_RCVBUF, &t->buffer, &len);
+    uint64_t target = TUNE_BUFFER_BDP * d.bdp;
+    if (target > TUNE_MAX_BUFFER)
+        target = TUNE_MAX_BUFFER;
+    const int old_buffer = t->buffer;
+    if (target > (uint64_t)t->buffer)
+        d.capped = tcp_tune_raise_buffer(t, target);
+    d.buffer = t->buffer;
+
+    const int chunk_changed = d.chunk != t->chunk;
+    const int lowat_changed = d.lowat != t->lowat
+        && !setsockopt(t->socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &d.lowat, sizeof(d.lowat));
+    const int raised = d.buffer > old_buffer;
+    t->chunk = d.chunk;
+    if (lowat_changed)
+        t->lowat = d.lowat;
+    d.lowat = t->lowat;
+
+    pthread_mutex_lock(&tune_lock);
+    ++tune_stats.samples;
+    tune_stats.chunk_changes += chunk_changed;
+    tune_stats.lowat_changes += lowat_changed;
+    tune_stats.buffer_raises += raised;
+    tune_stats.buffer_capped += d.capped;
+    if (chunk_changed || lowat_changed || raised || d.capped)
+        tune_log[tune_log_count++ % TUNE_LOG_SIZE] = d;
+    pthread_mutex_unlock(&tune_lock);
+    DEBUGS(fprintf(stderr, "[tune] rtt %" PRIu32 "us, rate %" PRIu64 " B/s, bdp %" PRIu64 ": chunk %zu, buffer %d, lowat %" PRIu32 "%s\n",
+        d.rtt_us, d.rate, d.bdp, d.chunk, d.buffer, d.lowat, d.capped ? " (capped)" : ""));
+    return t->chunk;
+}
+
+/**
+ * @brief Finish tuning a transfer. The socket keeps its buffers and TCP_NOTSENT_LOWAT.
+ *
+ * @param t the tuner.
+ */
+void tcp_tune_end(tcp_tuner *t)
+{
+    DEBUGS(if (t->enabled) fprintf(stderr, "[tune] done: chunk %zu, buffer %d, lowat %" PRIu32 ".\n",
+        t->chunk, t->buffer, t->lowat));
+    t->enabled = 0;
+}
+
+/**
+ * @brief Use a congestion control on one connection.
+ *
+ * @param socket the socket, connected or accepted.
+ * @param cc name of the congestion control, e.g. "bbr". NULL or "" leaves the default.
+ * @return int 0 if success or nothing to do, non-zero if failed. The connection is usable anyway.
+ */
+int tcp_set_congestion(int socket, const char *cc)
+{
+    if (!cc || !*cc)
+        return 0;
+    if (setsockopt(socket, IPPROTO_TCP, TCP_CONGESTION, cc, strlen(cc)))
+    {
+        if (errno == EOPNOTSUPP || errno == ENOPROTOOPT)
+            return 0; // not TCP
+        fprintf(stderr, "Cannot use congestion control %s: %s\n", cc, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+void tcp_tune_print_stats(FILE *fp)
+{
+    pthread_mutex_lock(&tune_lock);
+    fprintf(fp, "[tune] %" PRIu64 " transfer(s), %" PRIu64 " sample(s): chunk changed %" PRIu64 " times, "
+        "buffer raised %" PRIu64 " times (%" PRIu64 " capped by net.core.[rw]mem_max), notsent lowat set %" PRIu64 " times.\n",
+        tune_stats.transfers, tune_stats.samples, tune_stats.chunk_changes,
+        tune_stats.buffer_raises, tune_stats.buffer_capped, tune_stats.lowat_changes);
+    const uint64_t first = tune_log_count > TUNE_LOG_SIZE ? tune_log_count - TUNE_LOG_SIZE : 0;
+    for (uint64_t i = first; i < tune_log_count; ++i)
+    {
+        const struct tune_decision *d = &tune_log[i % TUNE_LOG_SIZE];
+        fprintf(fp, "[tune] %s: rtt %.2fms, %.2fMB/s, bdp %" PRIu64 " bytes -> chunk %zu, %s %d, lowat %" PRIu32 "%s.\n",
+            d->sending ? "send" : "receive", d->rtt_us / 1000.0, d->rate / 1.0E6, d->bdp, d->chunk,
+            d->sending ? "sndbuf" : "rcvbuf", d->buffer, d->lowat, d->capped ? " (capped)" : "");
+    }
+    pthread_mutex_unlock(&tune_lock);
+}
@@ -0,0 +1,80 @@
+#ifndef __TCPTUNE_H
+#define __TCPTUNE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/* configurations */
+#define ENV_TCP_AUTOTUNE "NFH_TCP_AUTOTUNE" /* "0" keeps the fixed chunk size and the kernel's buffers */
+#define ENV_TCP_CC "NFH_TCP_CC"             /* congestion control the client asks for its sessions, e.g. "bbr" */
+#define TUNE_INTERVAL_NS 100000000L         /* 100ms, how often TCP_INFO is read during a transfer */
+#define TUNE_MIN_CHUNK 262144U              /* 256KB */
+#define TUNE_MAX_CHUNK 4194304U             /* 4MB, no more than SEND_BUFFER_SIZE and RECV_BUFFER_SIZE */
+#define TUNE_LOWAT_US 2000                  /* unsent data may wait this long behind what is in flight */
+#define TUNE_MIN_LOWAT 131072U              /* 128KB */
+#define TUNE_MAX_LOWAT 16777216U            /* 16MB */
+#define TUNE_MAX_BUFFER (256 * 1024 * 1024) /* never ask for larger socket buffers */
+#define TUNE_BUFFER_BDP 2                   /* socket buffers hold this many bandwidth-delay products */
+#define TUNE_LOG_SIZE 16                    /* recent decisions kept for the statistics */
+
+/*
+
+TCP Auto-tuning:
+    The bytes a TCP connection must keep in flight to fill the link are its
+    bandwidth-delay product (BDP). While a file is moved, the tuner reads
+    TCP_INFO every TUNE_INTERVAL_NS:
+        RTT: tcpi_min_rtt on the sender, tcpi_rcv_rtt on the receiver.
+        Bandwidth: tcpi_delivery_rate on the sender, or cwnd * MSS / RTT
+        before the kernel has measured it. The receiver uses the rate it
+        reads at.
+    and then:
+        1. The application chunk (bytes read, granted and written at once)
+           is the BDP rounded up to a power of 2, within
+           [TUNE_MIN_CHUNK, TUNE_MAX_CHUNK].
+        2. The socket buffer of the direction is raised to TUNE_BUFFER_BDP
+           times the BDP when the kernel's own tuning hasn't got there,
+           which it can't beyond net.ipv4.tcp_wmem/tcp_rmem. Buffers are
+           never shrunk, as setting one stops the kernel from tuning it.
+           Without CAP_NET_ADMIN the raise is capped by net.core.wmem_max
+           and rmem_max, which is recorded.
+        3. The sender sets TCP_NOTSENT_LOWAT to what the link moves in
+           TUNE_LOWAT_US, within [TUNE_MIN_LOWAT, TUNE_MAX_LOWAT], so the
+           data queued behind what is in flight, and the latency of
+           everything else on the connection, stays bounded, while the
+           writer still has time to refill the queue.
+    Decisions are counted, and the recent ones are printed with the
+    statistics (SIGUSR1 on the server).
+    The congestion control (TCP_CONGESTION) is chosen per session: the
+    client names one in env NFH_TCP_CC, e.g. "bbr" for lossy long links,
+    uses it on its end and asks the server with `MODESW.CONGCT` (see nfh.h)
+    to use it on its end of the same connection. Other sessions keep the
+    system's default. A name must be listed in
+    net.ipv4.tcp_available_congestion_control (or allowed, if not root).
+    Sockets without TCP_INFO, e.g. the TLS relay and local sockets, are not
+    tuned.
+
+*/
+
+typedef struct tcp_tuner tcp_tuner;
+
+struct tcp_tuner
+{
+    int socket;
+    int sending;       // 1 on the sender, 0 on the receiver
+    int enabled;       // 0 if the socket is not TCP, or tuning is off
+    size_t chunk;      // current application chunk
+    uint32_t lowat;    // current TCP_NOTSENT_LOWAT, 0 if not set
+    int buffer;        // current SO_SNDBUF or SO_RCVBUF
+    uint64_t next_ns;  // when to sample again
+    uint64_t last_ns;  // time of the last sample
+    uint64_t last_bytes; // bytes moved at the last sample
+};
+
+void tcp_tune_begin(tcp_tuner *t, int socket, int sending);
+size_t tcp_tune_update(tcp_tuner *t, uint64_t bytes);
+void tcp_tune_end(tcp_tuner *t);
+int tcp_set_congestion(int socket, const char *cc);
+void tcp_tune_print_stats(FILE *fp);
+
+#endif
@@ -0,0 +1,384 @@
+/*************************************
+ *  TLS and Kernel TLS Transport     *
+ *************************************/
+
+#include "tls.h"
+#include "util.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+struct tls_relay
+{
+    SSL *ssl;
+    int net;  // the TCP socket, owned by `ssl`
+    int app;  // our end of the socketpair
+    char *to_net, *to_app; // TLS_RELAY_BUFFER_SIZE bytes each
+};
+
+// process-wide, set up once before any connection
+static SSL_CTX *server_ctx = NULL;
+static SSL_CTX *client_ctx = NULL;
+
+static void tls_print_errors(const char *what)
+{
+    fprintf(stderr, "%s: ", what);
+    unsigned long e = ERR_get_error();
+    if (!e)
+        fprintf(stderr, "%s\n", errno ? strerror(errno) : "connection closed");
+    for (; e; e = ERR_get_error())
+    {
+        char buf[256];
+        ERR_error_string_n(e, buf, sizeof(buf));
+        fprintf(stderr, "%s%s", buf, ERR_peek_error() ? "; " : "\n");
+    }
+}
+
+/**
+ * @brief Common settings of both sides.
+ *
+ * @param ctx the context.
+ */
+static void tls_ctx_setup(SSL_CTX *ctx)
+{
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    const char *ktls = getenv(ENV_TLS_KTLS);
+    if (ktls && !strcmp(ktls, "0"))
+        return;
+    // nothing but application data may come once the kernel has the keys
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+#if OPENSSL_VERSION_NUMBER < 0x30200000L
+    // older OpenSSL can't hand TLS 1.3 receive keys to the kernel
+    SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+#endif
+}
+
+/**
+ * @brief Enable TLS on the server side, before accepting clients. Replaces an earlier setup.
+ *
+ * @param cert_file the certificate chain (PEM).
+ * @param key_file the private key (PEM).
+ * @return int 0 if success, non-zero if failed.
+ */
+int tls_server_init(const char *cert_file, const char *key_file)
+{
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx)
+        goto FAILED;
+    tls_ctx_setup(ctx);
+    // a ticket would be the first record after the handshake, and the kernel can't handle it
+    SSL_CTX_set_num_tickets(ctx, 0);
+    SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1
+        || SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(ctx) != 1)
+        goto FAILED;
+    SSL_CTX_free(server_ctx);
+    server_ctx = ctx;
+    return 0;
+
+FAILED:
+    tls_print_errors("Cannot set up TLS");
+    SSL_CTX_free(ctx);
+    return -1;
+}
+
+/**
+ * @brief Enable TLS on the client side, before connecting. Replaces an earlier setup.
+ *
+ * @param ca_file the trusted certificates (PEM), or NULL for the system defaults.
+ * @return int 0 if success, non-zero if failed.
+ */
+int tls_client_init(const char *ca_file)
+{
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (!ctx)
+        goto FAILED;
+    tls_ctx_setup(ctx);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    if ((ca_file ? SSL_CTX_load_verify_locations(ctx, ca_file, NULL) : SSL_CTX_set_default_verify_paths(ctx)) != 1)
+        goto FAILED;
+    SSL_CTX_free(client_ctx);
+    client_ctx = ctx;
+    return 0;
+
+FAILED:
+    tls_print_errors("Cannot set up TLS");
+    SSL_CTX_free(ctx);
+    return -1;
+}
+
+int tls_server_enabled(void)
+{
+    return server_ctx != NULL;
+}
+
+int tls_client_enabled(void)
+{
+    return client_ctx != NULL;
+}
+
+static int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    return flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * @brief Move bytes between the TLS connection and the socketpair until both are done.
+ *
+ * @param arg the relay, freed on return.
+ */
+static void *tls_relay_thread(void *arg)
+{
+    struct tls_relay *r = arg;
+    // a closed peer must give EPIPE here, not kill the process
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    // bytes in `to_net`, `to_app`, and how many of them are already passed on
+    size_t net_len = 0, app_len = 0, net_off = 0, app_off = 0;
+    int net_eof = 0, app_eof = 0;
+    for (;;)
+    {
+        short net_events = 0, app_events = 0;
+        int progress = 0;
+
+        // TLS -> app
+        while (!net_eof && app_len < TLS_RELAY_BUFFER_SIZE)
+        {
+            int n = SSL_read(r->ssl, r->to_app + app_len, TLS_RELAY_BUFFER_SIZE - app_len);
+            if (n > 0)
+            {
+                app_len += n;
+                progress = 1;
+                continue;
+            }
+            int err = SSL_get_error(r->ssl, n);
+            if (err == SSL_ERROR_WANT_READ)
+                net_events |= POLLIN;
+            else if (err == SSL_ERROR_WANT_WRITE)
+                net_events |= POLLOUT;
+            else
+            {
+                // close_notify, or the peer is gone: the handler reads EOF once it has everything
+                if (err != SSL_ERROR_ZERO_RETURN && !app_eof)
+                    tls_print_errors("TLS receive failed");
+                net_eof = progress = 1;
+            }
+            break;
+        }
+        while (app_off < app_len)
+        {
+            ssize_t n = send(r->app, r->to_app + app_off, app_len - app_off, MSG_NOSIGNAL);
+            if (n > 0)
+            {
+                if ((app_off += n) == app_len)
+                    app_off = app_len = 0;
+                progress = 1;
+                continue;
+            }
+            if (n < 0 && errno == EAGAIN)
+                app_events |= POLLOUT;
+            else if (n < 0 && errno != EINTR)
+                goto STOP; // the handler is gone
+            break;
+        }
+        if (net_eof && !app_len)
+            shutdown(r->app, SHUT_WR);
+
+        // app -> TLS
+        while (!app_eof && net_len < TLS_RELAY_BUFFER_SIZE)
+        {
+            ssize_t n = read(r->app, r->to_net + net_len, TLS_RELAY_BUFFER_SIZE - net_len);
+            if (n > 0)
+            {
+                net_len += n;
+                progress = 1;
+                continue;
+            }
+            if (n < 0 && errno == EAGAIN)
+                app_events |= POLLIN;
+            else if (n < 0 && errno == EINTR)
+                continue;
+            else
+                app_eof = progress = 1; // the handler closed the socket, or it broke
+            break;
+        }
+        while (net_off < net_len)
+        {
+            int n = SSL_write(r->ssl, r->to_net + net_off, net_len - net_off);
+            if (n > 0)
+            {
+                if ((net_off += n) == net_len)
+                    net_off = net_len = 0;
+                progress = 1;
+                continue;
+            }
+            int err = SSL_get_error(r->ssl, n);
+            if (err == SSL_ERROR_WANT_READ)
+                net_events |= POLLIN;
+            else if (err == SSL_ERROR_WANT_WRITE)
+                net_events |= POLLOUT;
+            else
+            {
+                tls_print_errors("TLS send failed");
+                goto STOP;
+            }
+            break;
+        }
+
+        // the handlers never half-close: once ours is done, say goodbye and stop
+        if (app_eof && !net_len)
+        {
+            SSL_shutdown(r->ssl);
+            goto STOP;
+        }
+
+        if (progress)
+            continue;
+        struct pollfd fds[2] = {
+            { .fd = r->net, .events = net_events },
+            { .fd = r->app, .events = app_events },
+        };
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
+        {
+            perror("poll");
+            goto STOP;
+        }
+    }
+
+STOP:
+    SSL_free(r->ssl);
+    close(r->net);
+    close(r->app);
+    free(r->to_net);
+    free(r->to_app);
+    free(r);
+    return NULL;
+}
+
+/**
+ * @brief Hand a connection, handshake finished, over to the kernel or to a relay thread.
+ *
+ * @param ssl the connection.
+ * @param s the TCP socket under it.
+ * @return int the socket to use from now on, or -1 if failed. `ssl` is taken, `s` is not closed if failed.
+ */
+static int tls_finish(SSL *ssl, int s)
+{
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl)))
+    {
+        // the kernel has the keys both ways, the socket is used as it is (SSL_free doesn't close it)
+        DEBUGS(fprintf(stderr, "Kernel TLS enabled on socket %d.\n", s));
+        SSL_free(ssl);
+        return s;
+    }
+
+    int pair[2] = {-1, -1};
+    struct tls_relay *r = calloc(1, sizeof(*r));
+    if (!r || !(r->to_net = malloc(TLS_RELAY_BUFFER_SIZE)) || !(r->to_app = malloc(TLS_RELAY_BUFFER_SIZE)))
+    {
+        fprintf(stderr, "Cannot allocate TLS relay.\n");
+        goto FAILED;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) || set_nonblocking(s) || set_nonblocking(pair[0]))
+    {
+        perror("Cannot create TLS relay");
+        goto FAILED;
+    }
+    r->ssl = ssl;
+    r->net = s;
+    r->app = pair[0];
+
+    pthread_t tid;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&tid, &attr, &tls_relay_thread, r);
+    pthread_attr_destroy(&attr);
+    if (err)
+    {
+        fprintf(stderr, "Failed to create TLS relay thread [errno %d]: %s\n", err, strerror(err));
+        goto FAILED;
+    }
+    return pair[1];
+
+FAILED:
+    if (pair[0] >= 0)
+    {
+        close(pair[0]);
+        close(pair[1]);
+    }
+    if (r)
+    {
+        free(r->to_net);
+        free(r->to_app);
+        free(r);
+    }
+    SSL_free(ssl);
+    return -1;
+}
+
+/**
+ * @brief Make the server side TLS handshake on a newly accepted client.
+ *
+ * @param s the client socket, blocking.
+ * @return int the socket to use from now on, or -1 if failed. `s` is not closed if failed.
+ */
+int tls_accept(int s)
+{
+    ASSERT2(server_ctx != NULL, "TLS is not set up");
+    SSL *ssl = SSL_new(server_ctx);
+    if (!ssl || !SSL_set_fd(ssl, s) || SSL_accept(ssl) != 1)
+    {
+        tls_print_errors("TLS handshake failed");
+        SSL_free(ssl);
+        return -1;
+    }
+    return tls_finish(ssl, s);
+}
+
+/**
+ * @brief Make the client side TLS handshake on a connected socket, and verify the server.
+ *
+ * @param s the socket, blocking.
+ * @param host the server name or IP address, which the certificate must be issued to.
+ * @return int the socket to use from now on, or -1 if failed. `s` is not closed if failed.
+ */
+int tls_connect(int s, const char *host)
+{
+    ASSERT2(client_ctx != NULL, "TLS is not set up");
+    SSL *ssl = SSL_new(client_ctx);
+    struct in6_addr addr;
+    const int is_ip = inet_pton(AF_INET, host, &addr) == 1 || inet_pton(AF_INET6, host, &addr) == 1;
+    if (!ssl || !SSL_set_fd(ssl, s))
+        goto FAILED;
+    if (is_ip ? X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host) != 1
+        : SSL_set_tlsext_host_name(ssl, host) != 1 || SSL_set1_host(ssl, host) != 1)
+        goto FAILED;
+    if (SSL_connect(ssl) != 1)
+    {
+        long v = SSL_get_verify_result(ssl);
+        if (v != X509_V_OK)
+            fprintf(stderr, "Cannot verify server: %s\n", X509_verify_cert_error_string(v));
+        goto FAILED;
+    }
+    return tls_finish(ssl, s);
+
+FAILED:
+    tls_print_errors("TLS handshake failed");
+    SSL_free(ssl);
+    return -1;
+}
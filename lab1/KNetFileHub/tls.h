@@ -0,0 +1,44 @@
+#ifndef __TLS_H
+#define __TLS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/* configurations */
+#define ENV_TLS_CERT "NFH_TLS_CERT"   /* server: certificate chain (PEM), enables TLS */
+#define ENV_TLS_KEY "NFH_TLS_KEY"     /* server: private key (PEM) */
+#define ENV_TLS "NFH_TLS"             /* client: "1" to connect with TLS */
+#define ENV_TLS_CA "NFH_TLS_CA"       /* client: trusted certificates (PEM), system defaults if not set */
+#define ENV_TLS_KTLS "NFH_TLS_KTLS"   /* "0" to keep TLS in user space, e.g. to compare */
+#define TLS_RELAY_BUFFER_SIZE (256 * 1024) /* plaintext buffered per direction by a relay */
+
+/*
+
+Encrypted Transport:
+    With TLS enabled, the TLS handshake is made right after TCP
+    connect/accept, before NFH.HELLO, and everything after it is encrypted.
+    The server only speaks TLS then, to TCP clients. Same-host clients on
+    the local socket are not encrypted.
+    Kernel TLS:
+        OpenSSL is asked to install the session keys into the socket
+        (TCP_ULP "tls"). If it can in both directions, the socket is used
+        as it is: read/write/sendfile go through the kernel, which encrypts
+        records, so `send_file` stays zero-copy. No session tickets are
+        sent, as a plain read() can only handle application data records.
+    User space:
+        If the kernel can't (no tls module, or the cipher isn't supported),
+        a relay thread owns the TLS connection, and the handlers get one
+        end of a socketpair, whose other end the relay encrypts and
+        decrypts.
+
+*/
+
+int tls_server_init(const char *cert_file, const char *key_file);
+int tls_client_init(const char *ca_file);
+int tls_server_enabled(void);
+int tls_client_enabled(void);
+int tls_accept(int s);
+int tls_connect(int s, const char *host);
+
+#endif
@@ -0,0 +1,447 @@
+/*************************************
+ *          Session Trace            *
+ *************************************/
+
+#include "trace.h"
+#include "nfh.h"
+#include "util.h"
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+struct trace_writer
+{
+    pthread_mutex_t lock;
+    int fd;
+    uint64_t ts_start;     // CLOCK_MONOTONIC, nanoseconds
+    uint32_t sessions;     // numbers given so far
+    size_t used;
+    struct trace_record buf[TRACE_BUFFER_SIZE / sizeof(struct trace_record)];
+};
+
+// the modes by their number in a trace, which must not change: add new ones at the end
+static const struct trace_mode
+{
+    const char *modesw;
+    const char *allow;
+    const char *name;
+} trace_modes[] = {
+    {NULL, NULL, "UNKNOWN"},
+    {NFHC_MODE_UPLOAD, NFHS_ALLOW_UPLOAD, "UPLOAD"},
+    {NFHC_MODE_DOWNLOAD, NFHS_ALLOW_DOWNLOAD, "DOWNLOAD"},
+    {NFHC_MODE_TREE, NFHS_ALLOW_TREE, "TREE"},
+    {NFHC_MODE_FETCH, NFHS_ALLOW_FETCH, "FETCH"},
+    {NFHC_MODE_ARCHIVE_UPLOAD, NFHS_ALLOW_ARCHIVE_UPLOAD, "AGGREGATE UPLOAD"},
+    {NFHC_MODE_ARCHIVE_DOWNLOAD, NFHS_ALLOW_ARCHIVE_DOWNLOAD, "AGGREGATE DOWNLOAD"},
+    {NFHC_MODE_DIGEST, NFHS_ALLOW_DIGEST, "DIGEST"},
+    {NFHC_MODE_UDP_UPLOAD, NFHS_ALLOW_UDP_UPLOAD, "UDP UPLOAD"},
+    {NFHC_MODE_UDP_DOWNLOAD, NFHS_ALLOW_UDP_DOWNLOAD, "UDP DOWNLOAD"},
+    {NFHC_MODE_SUBSCRIBE, NFHS_ALLOW_SUBSCRIBE, "SUBSCRIBE"},
+};
+#define TRACE_MODES ((int)(sizeof(trace_modes) / sizeof(trace_modes[0])))
+
+static trace_writer *server_trace = NULL; // the server's trace, NULL if not recording
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int __writer_flush(trace_writer *w)
+{
+    // called with the lock held
+    if (w->used && write_exactly(w->fd, w->buf, w->used * sizeof(struct trace_record)) < 0)
+    {
+        perror("Failed to write trace");
+        w->used = 0;
+        return -1;
+    }
+    w->used = 0;
+    return 0;
+}
+
+/**
+ * @brief Create a trace file, replacing an old one.
+ *
+ * @param path the trace file.
+ * @return trace_writer* the writer, NULL if failed.
+ */
+trace_writer *trace_writer_open(const char *path)
+{
+    trace_writer *w = malloc(sizeof(trace_writer));
+    if (!w)
+    {
+        fprintf(stderr, "Failed to malloc.\n");
+        return NULL;
+    }
+    if ((w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+    {
+        int errsv = errno;
+        fprintf(stderr, "Cannot create trace %s [errno %d]: %s\n", path, errsv, strerror(errsv));
+        free(w);
+        return NULL;
+    }
+    struct trace_header h;
+    struct timespec ts;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+    h.version = TRACE_VERSION;
+    h.record_size = sizeof(struct trace_record);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    h.ts_start = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    if (write_exactly(w->fd, &h, sizeof(h)) < 0)
+    {
+        perror("Failed to write trace");
+        close(w->fd);
+        free(w);
+        return NULL;
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    w->ts_start = now_ns();
+    w->sessions = 0;
+    w->used = 0;
+    return w;
+}
+
+/**
+ * @brief Record an event. Thread-safe.
+ *
+ * @param w the writer.
+ * @param session the session number.
+ * @param event TRACE_* event.
+ * @param size the size of the event, see trace.h.
+ */
+void trace_writer_event(trace_writer *w, uint32_t session, int event, uint64_t size)
+{
+    const uint64_t ts = now_ns();
+    pthread_mutex_lock(&w->lock);
+    struct trace_record *r = &w->buf[w->used++];
+    memset(r, 0, sizeof(*r));
+    r->ts = ts - w->ts_start;
+    r->size = size;
+    r->session = session;
+    r->event = event;
+    // a trace is only read after the server is stopped, so it is written once a session ends
+    if (event == TRACE_CLOSE || w->used == sizeof(w->buf) / sizeof(w->buf[0]))
+        __writer_flush(w);
+    pthread_mutex_unlock(&w->lock);
+}
+
+void trace_writer_close(trace_writer *w)
+{
+    if (!w)
+        return;
+    pthread_mutex_lock(&w->lock);
+    __writer_flush(w);
+    pthread_mutex_unlock(&w->lock);
+    pthread_mutex_destroy(&w->lock);
+    close(w->fd);
+    free(w);
+}
+
+/**
+ * @brief Start recording the server's sessions.
+ *
+ * @param path the trace file.
+ * @return int 0 if success, non-zero if failed.
+ */
+int trace_start(const char *path)
+{
+    if (!(server_trace = trace_writer_open(path)))
+        return -1;
+    printf("Recording sessions to %s.\n", path);
+    return 0;
+}
+
+/**
+ * @brief Give a new session its number in the server's trace.
+ *
+ * @return uint32_t the number, 0 if not recording.
+ */
+uint32_t trace_session_open(void)
+{
+    if (!server_trace)
+        return 0;
+    return __atomic_add_fetch(&server_trace->sessions, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Record an event of a session in the server's trace.
+ *
+ * @param session the number from `trace_session_open`, nothing is recorded if 0.
+ * @param event TRACE_* event.
+ * @param size the size of the event, see trace.h.
+ */
+void trace_event(uint32_t session, int event, uint64_t size)
+{
+    if (session)
+        trace_writer_event(server_trace, session, event, size);
+}
+
+/**
+ * @brief Find the number of a mode in traces.
+ *
+ * @param modesw the ModeSwitch instruction.
+ * @return int the number, 0 if unknown.
+ */
+int trace_mode_index(const char *modesw)
+{
+    for (int i = 1; i < TRACE_MODES; ++i)
+    {
+        if (!strcmp(modesw, trace_modes[i].modesw))
+            return i;
+    }
+    return 0;
+}
+
+const char *trace_mode_name(int index)
+{
+    return trace_modes[index > 0 && index < TRACE_MODES ? index : 0].name;
+}
+
+/**
+ * @brief Get the ModeSwitch instruction of a mode in traces.
+ *
+ * @param index the number of the mode.
+ * @return const char* the instruction, NULL if unknown.
+ */
+const char *trace_mode_modesw(int index)
+{
+    return index > 0 && index < TRACE_MODES ? trace_modes[index].modesw : NULL;
+}
+
+const char *trace_mode_allow(int index)
+{
+    return index > 0 && index < TRACE_MODES ? trace_modes[index].allow : NULL;
+}
+
+/**
+ * @brief Read a trace and put its sessions together.
+ *
+ * @param path the trace file.
+ * @param count set to the number of sessions.
+ * @return trace_session* the sessions that were accepted, by number, NULL if failed. Free it with free().
+ */
+trace_session *trace_load(const char *path, size_t *count)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+    {
+        int errsv = errno;
+        fprintf(stderr, "Cannot open trace %s [errno %d]: %s\n", path, errsv, strerror(errsv));
+        return NULL;
+    }
+    struct trace_header h;
+    if (fread(&h, sizeof(h), 1, fp) != 1 || memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic))
+        || h.version != TRACE_VERSION || h.record_size != sizeof(struct trace_record))
+    {
+        fprintf(stderr, "%s is not a trace of this version.\n", path);
+        fclose(fp);
+        return NULL;
+    }
+
+    // session numbers are dense, so they index the array
+    trace_session *s = NULL;
+    size_t capacity = 0;
+    uint32_t max_id = 0;
+    struct trace_record r;
+    while (fread(&r, sizeof(r), 1, fp) == 1)
+    {
+        if (!r.session || r.event >= TRACE_EVENTS)
+            continue;
+        if (r.session >= capacity)
+        {
+            size_t n = capacity ? capacity : 1024;
+            while (n <= r.session)
+                n *= 2;
+            trace_session *p = realloc(s, n * sizeof(trace_session));
+            if (!p)
+            {
+                fprintf(stderr, "Failed to malloc.\n");
+                free(s);
+                fclose(fp);
+                return NULL;
+            }
+            memset(p + capacity, 0, (n - capacity) * sizeof(trace_session));
+            s = p;
+            capacity = n;
+        }
+        trace_session *t = &s[r.session];
+        t->id = r.session;
+        t->seen |= 1U << r.event;
+        t->ts[r.event] = r.ts;
+        t->size[r.event] = r.size;
+        if (r.session > max_id)
+            max_id = r.session;
+    }
+    fclose(fp);
+
+    // keep the sessions that were seen from the start
+    size_t n = 0;
+    for (uint32_t i = 1; i <= max_id; ++i)
+    {
+        if (s[i].seen & (1U << TRACE_CONNECT))
+            s[n++] = s[i];
+    }
+    *count = n;
+    return s ? s : calloc(1, sizeof(trace_session));
+}
+
+// the spread of one figure over the sessions, in nanoseconds
+struct trace_figure
+{
+    size_t n;
+    uint64_t p50, p90, p99, max;
+};
+
+static int __compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void __figure(const trace_session *s, size_t n, int from, int to, struct trace_figure *f)
+{
+    memset(f, 0, sizeof(*f));
+    uint64_t *v = malloc((n ? n : 1) * sizeof(uint64_t));
+    if (!v)
+        return;
+    const uint32_t mask = (1U << from) | (1U << to);
+    for (size_t i = 0; i < n; ++i)
+    {
+        if ((s[i].seen & mask) == mask && s[i].ts[to] >= s[i].ts[from])
+            v[f->n++] = s[i].ts[to] - s[i].ts[from];
+    }
+    if (f->n)
+    {
+        qsort(v, f->n, sizeof(uint64_t), &__compare_u64);
+        f->p50 = v[(f->n - 1) / 2];
+        f->p90 = v[(f->n - 1) * 90 / 100];
+        f->p99 = v[(f->n - 1) * 99 / 100];
+        f->max = v[f->n - 1];
+    }
+    free(v);
+}
+
+// what a trace says, to print or compare
+struct trace_summary
+{
+    size_t sessions;
+    size_t completed;              // BYE was exchanged
+    size_t modes[TRACE_MODES];
+    uint64_t bytes;                // moved in transfers that ended
+    uint64_t transfer_ns;          // their total time
+    struct trace_figure handshake, first_byte, transfer, session;
+};
+
+static void __summarize(const trace_session *s, size_t n, struct trace_summary *sum)
+{
+    memset(sum, 0, sizeof(*sum));
+    sum->sessions = n;
+    const uint32_t data = (1U << TRACE_DATA_BEGIN) | (1U << TRACE_DATA_END);
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (s[i].seen & (1U << TRACE_BYE))
+            ++sum->completed;
+        const int mode = s[i].seen & (1U << TRACE_MODE) ? (int)s[i].size[TRACE_MODE] : 0;
+        ++sum->modes[mode > 0 && mode < TRACE_MODES ? mode : 0];
+        if ((s[i].seen & data) == data)
+        {
+            sum->bytes += s[i].size[TRACE_DATA_END];
+            sum->transfer_ns += s[i].ts[TRACE_DATA_END] - s[i].ts[TRACE_DATA_BEGIN];
+        }
+    }
+    __figure(s, n, TRACE_CONNECT, TRACE_HELLO, &sum->handshake);
+    __figure(s, n, TRACE_REQUEST, TRACE_DATA_BEGIN, &sum->first_byte);
+    __figure(s, n, TRACE_DATA_BEGIN, TRACE_DATA_END, &sum->transfer);
+    __figure(s, n, TRACE_CONNECT, TRACE_CLOSE, &sum->session);
+}
+
+static double __throughput(const struct trace_summary *sum)
+{
+    // MB/s over the time spent in transfers
+    return sum->transfer_ns ? sum->bytes * 1000.0 / sum->transfer_ns : 0;
+}
+
+static void __print_figure(FILE *fp, const char *name, const struct trace_figure *f)
+{
+    fprintf(fp, "  %-12s %8zu %10.3f %10.3f %10.3f %10.3f\n", name, f->n,
+        f->p50 / 1.0E6, f->p90 / 1.0E6, f->p99 / 1.0E6, f->max / 1.0E6);
+}
+
+/**
+ * @brief Print the sessions of a trace by mode, and the spread of their latencies.
+ *
+ * @param fp where to print.
+ * @param title what the trace is.
+ * @param s the sessions.
+ * @param n the number of sessions.
+ */
+void trace_print_summary(FILE *fp, const char *title, const trace_session *s, size_t n)
+{
+    struct trace_summary sum;
+    __summarize(s, n, &sum);
+    fprintf(fp, "%s: %zu sessions, %zu completed.\n", title, sum.sessions, sum.completed);
+    for (int i = 0; i < TRACE_MODES; ++i)
+    {
+        if (sum.modes[i])
+            fprintf(fp, "  %-20s %8zu\n", trace_modes[i].name, sum.modes[i]);
+    }
+    fprintf(fp, "  %-12s %8s %10s %10s %10s %10s\n", "(ms)", "count", "p50", "p90", "p99", "max");
+    __print_figure(fp, "handshake", &sum.handshake);
+    __print_figure(fp, "first byte", &sum.first_byte);
+    __print_figure(fp, "transfer", &sum.transfer);
+    __print_figure(fp, "session", &sum.session);
+    fprintf(fp, "  %" PRIu64 " bytes moved at %.2fMB/s.\n", sum.bytes, __throughput(&sum));
+}
+
+static void __compare_row(FILE *fp, const char *name, double a, double b)
+{
+    if (a > 0)
+        fprintf(fp, "  %-20s %12.3f %12.3f %+9.1f%%\n", name, a, b, (b - a) * 100 / a);
+    else
+        fprintf(fp, "  %-20s %12.3f %12.3f %10s\n", name, a, b, "-");
+}
+
+/**
+ * @brief Print how the latencies and the throughput of two traces of the same load differ.
+ *
+ * @param fp where to print.
+ * @param a the sessions of the first trace, the baseline.
+ * @param na the number of them.
+ * @param b the sessions of the second trace.
+ * @param nb the number of them.
+ */
+void trace_print_comparison(FILE *fp, const trace_session *a, size_t na, const trace_session *b, size_t nb)
+{
+    struct trace_summary x, y;
+    __summarize(a, na, &x);
+    __summarize(b, nb, &y);
+    fprintf(fp, "  %-20s %12s %12s %10s\n", "", "A", "B", "B vs A");
+    __compare_row(fp, "sessions", x.sessions, y.sessions);
+    __compare_row(fp, "completed", x.completed, y.completed);
+    const struct
+    {
+        const char *name;
+        const struct trace_figure *a, *b;
+    } rows[] = {
+        {"handshake", &x.handshake, &y.handshake},
+        {"first byte", &x.first_byte, &y.first_byte},
+        {"transfer", &x.transfer, &y.transfer},
+        {"session", &x.session, &y.session},
+    };
+    char name[32];
+    for (size_t i = 0; i < sizeof(rows) / sizeof(rows[0]); ++i)
+    {
+        snprintf(name, sizeof(name), "%s p50 (ms)", rows[i].name);
+        __compare_row(fp, name, rows[i].a->p50 / 1.0E6, rows[i].b->p50 / 1.0E6);
+        snprintf(name, sizeof(name), "%s p99 (ms)", rows[i].name);
+        __compare_row(fp, name, rows[i].a->p99 / 1.0E6, rows[i].b->p99 / 1.0E6);
+    }
+    __compare_row(fp, "throughput (MB/s)", __throughput(&x), __throughput(&y));
+}
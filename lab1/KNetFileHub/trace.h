@@ -0,0 +1,103 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/* configurations */
+#define ENV_TRACE "NFH_TRACE"          /* the server records every session to this file */
+#define TRACE_BUFFER_SIZE 65536U       /* records are written out when this is full, or a session ends */
+#define TRACE_MAGIC "NFHTRACE"
+#define TRACE_VERSION 1
+
+/*
+
+Session Trace:
+    With env NFH_TRACE set, the server records the shape of every session to
+    a binary trace: which messages came and went, when, and how large they
+    were, but no names and no file contents. `nfh_replay` plays a trace back
+    against a server with synthetic files, to compare builds under the same
+    load (see replay.c).
+    Format:
+        A `struct trace_header`, then `struct trace_record`s in the order
+        they happened. Sessions are numbered from 1 on, and their records
+        interleave. Times are nanoseconds since the trace started.
+    Events (the size of the record):
+        TRACE_CONNECT: the connection was accepted (0).
+        TRACE_HELLO: the handshake is done (0).
+        TRACE_MODE: the client switched mode (its number in trace.c).
+        TRACE_LIST: the file list was sent (entries).
+        TRACE_REQUEST: the client asked for a file, or announced one (file size).
+        TRACE_DATA_BEGIN, TRACE_DATA_END: the file content moved (bytes). DIGEST
+        hashes the file in between, and gives its size at the end only.
+        TRACE_BYE: BYE was exchanged (0).
+        TRACE_CLOSE: the connection was closed (0).
+    Only the plain and UDP uploads and downloads, and DIGEST, record their
+    requests and data; the other modes record the rest.
+    Comparing:
+        The same figures are computed from any trace: how long the handshake
+        took (CONNECT to HELLO), the first byte (REQUEST to DATA_BEGIN), the
+        transfer (DATA_BEGIN to DATA_END) and the session, and the throughput.
+        `nfh_replay` records what it measures as a client in the same format,
+        so two replays of one trace against two builds can be compared, as
+        can two server traces.
+
+*/
+
+#define TRACE_CONNECT 1
+#define TRACE_HELLO 2
+#define TRACE_MODE 3
+#define TRACE_LIST 4
+#define TRACE_REQUEST 5
+#define TRACE_DATA_BEGIN 6
+#define TRACE_DATA_END 7
+#define TRACE_BYE 8
+#define TRACE_CLOSE 9
+#define TRACE_EVENTS 10
+
+struct trace_header
+{
+    char magic[8];         // TRACE_MAGIC, without '\0'
+    uint32_t version;
+    uint32_t record_size;  // sizeof(struct trace_record)
+    uint64_t ts_start;     // Unix epoch (UTC), nanoseconds
+};
+
+struct trace_record
+{
+    uint64_t ts;           // nanoseconds since ts_start
+    uint64_t size;
+    uint32_t session;
+    uint8_t event;
+    uint8_t reserved[3];
+};
+
+// a session put together from its records
+typedef struct trace_session trace_session;
+
+struct trace_session
+{
+    uint32_t id;
+    uint32_t seen;                 // bit n is set if event n was recorded
+    uint64_t ts[TRACE_EVENTS];     // by event
+    uint64_t size[TRACE_EVENTS];
+};
+
+typedef struct trace_writer trace_writer;
+
+int trace_start(const char *path);
+uint32_t trace_session_open(void);
+void trace_event(uint32_t session, int event, uint64_t size);
+trace_writer *trace_writer_open(const char *path);
+void trace_writer_event(trace_writer *w, uint32_t session, int event, uint64_t size);
+void trace_writer_close(trace_writer *w);
+int trace_mode_index(const char *modesw);
+const char *trace_mode_name(int index);
+const char *trace_mode_modesw(int index);
+const char *trace_mode_allow(int index);
+trace_session *trace_load(const char *path, size_t *count);
+void trace_print_summary(FILE *fp, const char *title, const trace_session *s, size_t n);
+void trace_print_comparison(FILE *fp, const trace_session *a, size_t na, const trace_session *b, size_t nb);
+
+#endif
@@ -0,0 +1,573 @@
+/*************************************
+ *      TCP and Local Transports      *
+ *************************************/
+
+#define _GNU_SOURCE
+#include "transport.h"
+#include "nfh.h"
+#include "util.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <limits.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+const transport transport_tcp = {
+    .name = "tcp",
+    .vf_send_file = &stream_send_file,
+    .vf_receive_file = &stream_receive_file,
+};
+
+/**
+ * @brief Find the transport of a connected socket.
+ *
+ * @param socket the socket.
+ * @return const transport* the transport.
+ */
+const transport *transport_of(int socket)
+{
+    int domain;
+    socklen_t len = sizeof(domain);
+    if (getsockopt(socket, SOL_SOCKET, SO_DOMAIN, &domain, &len) || domain != AF_UNIX)
+        return &transport_tcp;
+    // a connection to a socket path has a name on one end, a socketpair (e.g. the TLS relay) has none
+    struct sockaddr_un addr;
+    len = sizeof(addr);
+    if (!getsockname(socket, (struct sockaddr *)&addr, &len) && len > sizeof(sa_family_t))
+        return &transport_local;
+    len = sizeof(addr);
+    if (!getpeername(socket, (struct sockaddr *)&addr, &len) && len > sizeof(sa_family_t))
+        return &transport_local;
+    return &transport_tcp;
+}
+
+/**
+ * @brief Connect to a server.
+ *
+ * @param host an inet4 address, or TRANSPORT_UNIX_PREFIX and the path of a UNIX domain socket.
+ * @param port the server port, ignored for UNIX domain sockets.
+ * @return int the socket, -1 if failed.
+ */
+int transport_connect(const char *host, uint16_t port)
+{
+    struct sockaddr_storage ss;
+    socklen_t ss_len;
+    memset(&ss, 0, sizeof(ss));
+    if (!strncmp(host, TRANSPORT_UNIX_PREFIX, strlen(TRANSPORT_UNIX_PREFIX)))
+    {
+        struct sockaddr_un *addr = (struct sockaddr_un *)&ss;
+        const char *path = host + strlen(TRANSPORT_UNIX_PREFIX);
+        if (strlen(path) >= sizeof(addr->sun_path))
+        {
+            fprintf(stderr, "Socket path is too long: %s\n", path);
+            return -1;
+        }
+        addr->sun_family = AF_UNIX;
+        strcpy(addr->sun_path, path);
+        ss_len = sizeof(struct sockaddr_un);
+    }
+    else
+    {
+        struct sockaddr_in *addr = (struct sockaddr_in *)&ss;
+        if ((addr->sin_addr.s_addr = inet_addr(host)) == INADDR_NONE)
+        {
+            fprintf(stderr, "Invalid inet4 address: %s\n", host);
+            return -1;
+        }
+        addr->sin_family = AF_INET;
+        addr->sin_port = htons(port);
+        ss_len = sizeof(struct sockaddr_in);
+    }
+
+    int s = socket(ss.ss_family, SOCK_STREAM, 0);
+    if (s < 0)
+    {
+        int errsv = errno;
+        fprintf(stderr, "Failed to create socket: [errno %d] %s\n", errsv, strerror(errsv));
+        return -1;
+    }
+    if (connect(s, (struct sockaddr *)&ss, ss_len))
+    {
+        perror("Failed to connect to server");
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+/**
+ * @brief Listen on a UNIX domain socket, replacing a stale one.
+ *
+ * @param path the socket path.
+ * @return int the listening socket, -1 if failed.
+ */
+int transport_listen_local(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path is too long: %s\n", path);
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s < 0)
+    {
+        perror("Failed to create socket");
+        return -1;
+    }
+    // a socket file left by a server which is gone
+    struct stat st;
+    if (!stat(path, &st) && S_ISSOCK(st.st_mode))
+        unlink(path);
+    if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) || listen(s, SERVER_LISTEN_BACKLOG))
+    {
+        int errsv = errno;
+        fprintf(stderr, "Failed to listen on %s [errno %d]: %s\n", path, errsv, strerror(errsv));
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+/* ---------------- local ---------------- */
+
+static int __local_send_header(int s, const struct local_transfer *t, int fd)
+{
+    struct iovec iov = { .iov_base = (void *)t, .iov_len = sizeof(struct local_transfer) };
+    union
+    {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    if (fd >= 0)
+    {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(c), &fd, sizeof(int));
+    }
+    ssize_t n;
+    while ((n = sendmsg(s, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+    if (n != sizeof(struct local_transfer))
+    {
+        perror("Failed to send transfer header");
+        return -1;
+    }
+    return 0;
+}
+
+static int __local_receive_header(int s, struct local_transfer *t, int *fd)
+{
+    struct iovec iov = { .iov_base = t, .iov_len = sizeof(struct local_transfer) };
+    union
+    {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf) };
+    *fd = -1;
+    ssize_t n;
+    while ((n = recvmsg(s, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+        ;
+    if (n <= 0)
+    {
+        fprintf(stderr, "Failed to receive transfer header.\n");
+        return -1;
+    }
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+    {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+            memcpy(fd, CMSG_DATA(c), sizeof(int));
+    }
+    // the descriptor comes with the first byte, the rest of the header may come later
+    if (n < sizeof(struct local_transfer)
+        && read_exactly(s, (char *)t + n, sizeof(struct local_transfer) - n) != sizeof(struct local_transfer) - n)
+    {
+        fprintf(stderr, "Failed to receive transfer header.\n");
+        goto HEADER_FAIL;
+    }
+    if ((t->method == LOCAL_STREAM) != (*fd < 0))
+    {
+        fprintf(stderr, "Bad transfer header: method %" PRIu32 ".\n", t->method);
+        goto HEADER_FAIL;
+    }
+    return 0;
+
+HEADER_FAIL:
+    if (*fd >= 0)
+        close(*fd);
+    *fd = -1;
+    return -1;
+}
+
+static void __local_report(const char *method, uint64_t size, const struct timespec *ts_start, int flags)
+{
+    struct timespec ts_end;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts_end);
+    uint64_t delta_us = (ts_end.tv_sec - ts_start->tv_sec) * 1000000 + (ts_end.tv_nsec - ts_start->tv_nsec) / 1000;
+    if (!delta_us)
+        delta_us = 1;
+    // 0.95367431640625 == (1000 / 1024) * (1000 / 1024)
+    if (!(flags & TRANSFER_QUIET))
+        printf("Time elapsed: %.2fs. Average speed: %.2fMB/s (local, %s).\n",
+            delta_us / 1.0E6, size * 0.95367431640625 / delta_us, method);
+}
+
+static void __futex_wait(uint32_t *word, uint32_t value)
+{
+    struct timespec timeout = { .tv_sec = 0, .tv_nsec = LOCAL_RING_POLL_MS * 1000000L };
+    syscall(SYS_futex, word, FUTEX_WAIT, value, &timeout, NULL, 0);
+}
+
+static void __futex_wake(uint32_t *word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// 1 if the peer has closed the socket
+static int __peer_gone(int s)
+{
+    struct pollfd p = { .fd = s, .events = POLLRDHUP };
+    return poll(&p, 1, 0) > 0 && (p.revents & (POLLRDHUP | POLLHUP | POLLERR));
+}
+
+static struct local_ring *__ring_map(int fd)
+{
+    void *p = mmap(NULL, sizeof(struct local_ring) + LOCAL_RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+static void __ring_unmap(struct local_ring *ring)
+{
+    munmap(ring, sizeof(struct local_ring) + LOCAL_RING_SIZE);
+}
+
+static void __ring_done(uint32_t *done, uint32_t *seq)
+{
+    __atomic_store_n(done, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(seq, 1, __ATOMIC_RELEASE);
+    __futex_wake(seq);
+}
+
+static int __local_send_shm(int s, FILE *fp, uint64_t size, int flags)
+{
+    int fd = memfd_create("nfh-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    struct local_ring *ring = NULL;
+    // sealed at its size, so the receiver can map it without fearing SIGBUS
+    if (fd < 0 || ftruncate(fd, sizeof(struct local_ring) + LOCAL_RING_SIZE)
+        || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) || !(ring = __ring_map(fd)))
+    {
+        perror("Cannot create shared memory ring");
+        if (fd >= 0)
+            close(fd);
+        return CLIENT_ERR_MALLOC_FAILURE;
+    }
+    struct local_transfer t = { .method = LOCAL_SHM, .size = size == SEND_UNTIL_EOF ? 0 : size };
+    int r = __local_send_header(s, &t, fd);
+    close(fd);
+    if (r || fseek(fp, 0L, SEEK_SET))
+    {
+        __ring_unmap(ring);
+        return CLIENT_ERR_SOCKET_ERROR;
+    }
+
+    struct timespec ts_start;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts_start);
+    char *data = (char *)(ring + 1);
+    uint64_t head = 0;
+    r = CLIENT_ERR_SUCCESS;
+    while (head < size)
+    {
+        const uint32_t seq = __atomic_load_n(&ring->tail_seq, __ATOMIC_ACQUIRE);
+        const uint64_t used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (used == LOCAL_RING_SIZE)
+        {
+            // full, wait for the receiver, unless it has all it wants
+            if (__atomic_load_n(&ring->consumer_done, __ATOMIC_ACQUIRE))
+            {
+                fprintf(stderr, "Receiver stopped after %" PRIu64 " bytes.\n", head - used);
+                r = CLIENT_ERR_SEND_SIZE_MISMATCH;
+                break;
+            }
+            __futex_wait(&ring->tail_seq, seq);
+            if (__peer_gone(s))
+            {
+                r = CLIENT_ERR_SOCKET_ERROR;
+                break;
+            }
+            continue;
+        }
+        // the file is read right into the ring
+        const size_t pos = head % LOCAL_RING_SIZE;
+        size_t k = LOCAL_RING_SIZE - used;
+        if (k > LOCAL_RING_SIZE - pos)
+            k = LOCAL_RING_SIZE - pos;
+        if (k > LOCAL_RING_SEGMENT)
+            k = LOCAL_RING_SEGMENT;
+        if (k > size - head)
+            k = size - head;
+        const size_t n = fread(data + pos, 1, k, fp);
+        if (n)
+        {
+            head += n;
+            __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+            __atomic_add_fetch(&ring->head_seq, 1, __ATOMIC_RELEASE);
+            __futex_wake(&ring->head_seq);
+        }
+        if (n < k)
+        {
+            if (ferror(fp))
+            {
+                perror("An error occurred while reading file");
+                r = CLIENT_ERR_FAILED_TO_READ_FILE;
+            }
+            else if (size != SEND_UNTIL_EOF)
+            {
+                fprintf(stderr, "File ended after %" PRIu64 " bytes of %" PRIu64 " bytes.\n", head, size);
+                r = CLIENT_ERR_SEND_SIZE_MISMATCH;
+            }
+            break; // end of file
+        }
+    }
+    __ring_done(&ring->producer_done, &ring->head_seq);
+    __ring_unmap(ring);
+    if (!r)
+        __local_report("shm", head, &ts_start, flags);
+    return r;
+}
+
+static int __local_receive_shm(int s, int fd, FILE *fp, uint64_t size, int flags)
+{
+    // a ring the peer could shrink, or one too short, would fault on access and kill the process
+    struct stat st;
+    const int seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || !(seals & F_SEAL_SHRINK) || fstat(fd, &st)
+        || (uint64_t)st.st_size < sizeof(struct local_ring) + LOCAL_RING_SIZE)
+    {
+        fprintf(stderr, "Rejected a shared memory ring that is not sealed at its size.\n");
+        close(fd);
+        return CLIENT_ERR_SOCKET_ERROR;
+    }
+    struct local_ring *ring = __ring_map(fd);
+    close(fd);
+    if (!ring)
+    {
+        perror("Cannot map shared memory ring");
+        return CLIENT_ERR_MALLOC_FAILURE;
+    }
+    struct io_cursor cur;
+    if (io_write_begin(&cur, fp, size))
+    {
+        fprintf(stderr, "Failed to prepare file for writing.\n");
+        __ring_done(&ring->consumer_done, &ring->tail_seq);
+        __ring_unmap(ring);
+        return CLIENT_ERR_MALLOC_FAILURE;
+    }
+
+    struct timespec ts_start;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts_start);
+    const char *data = (const char *)(ring + 1);
+    uint64_t tail = 0;
+    int r = CLIENT_ERR_SUCCESS;
+    while (tail < size)
+    {
+        const uint32_t seq = __atomic_load_n(&ring->head_seq, __ATOMIC_ACQUIRE);
+        const int done = __atomic_load_n(&ring->producer_done, __ATOMIC_ACQUIRE);
+        const uint64_t avail = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+        if (!avail)
+        {
+            if (done)
+            {
+                fprintf(stderr, "Unexpected EOF: received %" PRIu64 " bytes of %" PRIu64 " bytes.\n", tail, size);
+                r = CLIENT_ERR_SEND_SIZE_MISMATCH;
+                break;
+            }
+            // empty, wait for the sender
+            __futex_wait(&ring->head_seq, seq);
+            if (__atomic_load_n(&ring->head_seq, __ATOMIC_ACQUIRE) == seq && __peer_gone(s))
+            {
+                fprintf(stderr, "Unexpected EOF: received %" PRIu64 " bytes of %" PRIu64 " bytes.\n", tail, size);
+                r = CLIENT_ERR_SOCKET_ERROR;
+                break;
+            }
+            continue;
+        }
+        const size_t pos = tail % LOCAL_RING_SIZE;
+        size_t k = avail < LOCAL_RING_SIZE - pos ? avail : LOCAL_RING_SIZE - pos;
+        if (k > LOCAL_RING_SEGMENT)
+            k = LOCAL_RING_SEGMENT;
+        if (k > size - tail)
+            k = size - tail;
+        if (io_write(&cur, data + pos, k))
+        {
+            perror("An I/O error occurred while writing file");
+            r = CLIENT_ERR_FAILED_TO_WRITE_FILE;
+            break;
+        }
+        tail += k;
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&ring->tail_seq, 1, __ATOMIC_RELEASE);
+        __futex_wake(&ring->tail_seq);
+    }
+    __ring_done(&ring->consumer_done, &ring->tail_seq);
+    __ring_unmap(ring);
+    if (io_write_end(&cur) && !r)
+    {
+        perror("An I/O error occurred while writing file");
+        r = CLIENT_ERR_FAILED_TO_WRITE_FILE;
+    }
+    if (!r)
+        __local_report("shm", size, &ts_start, flags);
+    return r;
+}
+
+static int __local_receive_fd(int in, FILE *fp, uint64_t size, int flags)
+{
+    struct stat st;
+    if (fstat(in, &st))
+    {
+        perror("Cannot stat received file");
+        close(in);
+        return CLIENT_ERR_SOCKET_ERROR;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size != size)
+    {
+        fprintf(stderr, "Received file has %" PRIu64 " bytes, but %" PRIu64 " bytes expected.\n",
+            (uint64_t)st.st_size, size);
+        close(in);
+        return CLIENT_ERR_SEND_SIZE_MISMATCH;
+    }
+    struct timespec ts_start;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts_start);
+    const int out = fflush(fp) ? -1 : fileno(fp);
+    loff_t off = 0;
+    // the offset of the sender's file is shared, so only positioned reads are used
+    while (out >= 0 && off < size)
+    {
+        ssize_t n = copy_file_range(in, &off, out, NULL, size - off < LOCAL_COPY_CHUNK ? size - off : LOCAL_COPY_CHUNK, 0);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+                continue;
+            break; // e.g. EXDEV on old kernels, copy it by hand
+        }
+    }
+    if (off < size)
+    {
+        // no descriptor to write to (a storage stream), or no kernel copy
+        char *buf = malloc(RECV_BUFFER_SIZE);
+        struct io_cursor cur;
+        if (!buf || io_write_begin(&cur, fp, size))
+        {
+            free(buf);
+            close(in);
+            return CLIENT_ERR_MALLOC_FAILURE;
+        }
+        int r = 0;
+        while (!r && off < size)
+        {
+            ssize_t n = pread(in, buf, size - off < RECV_BUFFER_SIZE ? size - off : RECV_BUFFER_SIZE, off);
+            if (n <= 0)
+                r = n < 0 && errno == EINTR ? 0 : CLIENT_ERR_FAILED_TO_READ_FILE;
+            else if (io_write(&cur, buf, n))
+                r = CLIENT_ERR_FAILED_TO_WRITE_FILE;
+            else
+                off += n;
+        }
+        if (io_write_end(&cur) && !r)
+            r = CLIENT_ERR_FAILED_TO_WRITE_FILE;
+        free(buf);
+        if (r)
+        {
+            perror("Failed to copy received file");
+            close(in);
+            return r;
+        }
+    }
+    close(in);
+    __local_report("fd", size, &ts_start, flags);
+    return CLIENT_ERR_SUCCESS;
+}
+
+static int __local_send_file(int socket, FILE *fp, uint64_t size, bw_session *bw, int flags)
+{
+    const char *forced = getenv(ENV_LOCAL_TRANSPORT);
+    struct stat st;
+    const int fd = fileno(fp);
+    if (fflush(fp))
+        return CLIENT_ERR_FAILED_TO_READ_FILE;
+
+    const int regular = fd >= 0 && !fstat(fd, &st) && S_ISREG(st.st_mode);
+    const int stream = forced && !strcmp(forced, "stream"), shm = forced && !strcmp(forced, "shm");
+
+    // hand over the file itself, if there is one and it has the announced size
+    if (regular && !stream && !shm && (size == SEND_UNTIL_EOF || (uint64_t)st.st_size == size))
+    {
+        struct local_transfer t = { .method = LOCAL_FD, .size = st.st_size };
+        if (__local_send_header(socket, &t, fd))
+            return CLIENT_ERR_SOCKET_ERROR;
+        if (!(flags & TRANSFER_QUIET))
+            printf("Handed over %" PRIu64 " bytes (local, fd).\n", (uint64_t)st.st_size);
+        return CLIENT_ERR_SUCCESS;
+    }
+    if (size == SEND_UNTIL_EOF && regular)
+        size = st.st_size;
+    // a stream without a file goes through the ring, its size is only known at the end
+    if (!stream)
+        return __local_send_shm(socket, fp, size, flags);
+
+    struct local_transfer t = { .method = LOCAL_STREAM, .size = size == SEND_UNTIL_EOF ? 0 : size };
+    if (__local_send_header(socket, &t, -1))
+        return CLIENT_ERR_SOCKET_ERROR;
+    return stream_send_file(socket, fp, size, NULL, flags);
+}
+
+static int __local_receive_file(int socket, FILE *fp, uint64_t file_size, bw_session *bw, int flags)
+{
+    struct local_transfer t;
+    int fd;
+    if (__local_receive_header(socket, &t, &fd))
+        return CLIENT_ERR_SOCKET_ERROR;
+    switch (t.method)
+    {
+        case LOCAL_FD:
+            return __local_receive_fd(fd, fp, file_size, flags);
+        case LOCAL_SHM:
+            if (t.size && t.size != file_size)
+            {
+                fprintf(stderr, "Peer sends %" PRIu64 " bytes, but %" PRIu64 " bytes expected.\n", t.size, file_size);
+                close(fd);
+                return CLIENT_ERR_SEND_SIZE_MISMATCH;
+            }
+            return __local_receive_shm(socket, fd, fp, file_size, flags);
+        case LOCAL_STREAM:
+            return stream_receive_file(socket, fp, file_size, NULL, flags);
+    }
+    fprintf(stderr, "Unknown transfer method %" PRIu32 ".\n", t.method);
+    close(fd);
+    return CLIENT_ERR_SOCKET_ERROR;
+}
+
+const transport transport_local = {
+    .name = "local",
+    .vf_send_file = &__local_send_file,
+    .vf_receive_file = &__local_receive_file,
+};
@@ -0,0 +1,93 @@
+#ifndef __TRANSPORT_H
+#define __TRANSPORT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "bwsched.h"
+
+/* configurations */
+#define TRANSPORT_UNIX_PREFIX "unix:"         /* a host of "unix:<path>" is a UNIX domain socket */
+#define ENV_LOCAL_TRANSPORT "NFH_LOCAL_TRANSPORT" /* force "fd", "shm" or "stream" on local sockets */
+#define LOCAL_RING_SIZE (4 * 1024 * 1024)    /* data bytes of a shared memory ring */
+#define LOCAL_RING_SEGMENT (256 * 1024)      /* produced or consumed at once */
+#define LOCAL_RING_POLL_MS 100               /* how often a waiting side checks that its peer is alive */
+#define LOCAL_COPY_CHUNK (64 * 1024 * 1024)  /* bytes copied by the kernel per call */
+
+/* methods of a local transfer */
+#define LOCAL_STREAM 1 /* the bytes follow on the socket, like over TCP */
+#define LOCAL_FD 2     /* the open file is attached (SCM_RIGHTS), the receiver copies it */
+#define LOCAL_SHM 3    /* a memfd ring is attached, the bytes go through it */
+
+/*
+
+Transport:
+    File content is moved by `send_file` and `receive_file`, which hand it
+    to the transport of the socket, so the FSM handlers never see which one
+    is used. Control messages always go over the socket.
+    TCP:
+        The bytes are written to the socket, throttled by the bandwidth
+        scheduler.
+    Local (AF_UNIX):
+        Used when the client connects to "unix:<path>", and the server
+        listens on that path (env NFH_UNIX_SOCKET). Every file starts with
+        a `struct local_transfer` chosen by the sender:
+            LOCAL_FD: the sender attaches its open file. The receiver copies
+            it in the kernel (copy_file_range), no byte passes the socket.
+            Not used for a file whose size changed since it was announced.
+            LOCAL_SHM: for streams without a file behind them, e.g. the
+            chunk store. The sender attaches a memfd holding a
+            `struct local_ring` and LOCAL_RING_SIZE bytes of data, and fills
+            it until the end of the stream while the receiver drains it.
+            Both wait on futexes in the ring, and check that the socket is
+            still open every LOCAL_RING_POLL_MS.
+            LOCAL_STREAM: the bytes follow on the socket, only if forced.
+        Env NFH_LOCAL_TRANSPORT forces a method, e.g. to compare them.
+        Local transfers are not throttled.
+
+*/
+
+typedef struct transport transport;
+
+typedef int vfunc_transport_send_file(int socket, FILE *fp, uint64_t size, bw_session *bw, int flags);
+typedef int vfunc_transport_receive_file(int socket, FILE *fp, uint64_t file_size, bw_session *bw, int flags);
+
+struct transport
+{
+    const char *name;
+    // methods
+    vfunc_transport_send_file *vf_send_file;
+    vfunc_transport_receive_file *vf_receive_file;
+};
+
+struct local_transfer
+{
+    uint32_t method;   // LOCAL_*
+    uint32_t reserved;
+    uint64_t size;     // bytes of the file, 0 if a LOCAL_SHM sender doesn't know
+};
+
+struct local_ring
+{
+    // producer
+    uint64_t head;          // bytes written
+    uint32_t head_seq;      // futex, bumped after writing
+    uint32_t producer_done; // no more bytes will be written: end of file, or an error
+    char pad1[48];
+    // consumer
+    uint64_t tail;          // bytes read
+    uint32_t tail_seq;      // futex, bumped after reading
+    uint32_t consumer_done; // no more bytes will be read
+    char pad2[48];
+    // followed by LOCAL_RING_SIZE bytes of data
+};
+
+extern const transport transport_tcp;
+extern const transport transport_local;
+
+const transport *transport_of(int socket);
+int transport_connect(const char *host, uint16_t port);
+int transport_listen_local(const char *path);
+
+#endif
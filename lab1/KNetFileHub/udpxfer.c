@@ -0,0 +1,990 @@
+/*************************************
+ *       UDP Bulk Transfer           *
+ *************************************/
+
+#define _GNU_SOURCE
+#include "udpxfer.h"
+#include "nfh.h"
+#include "util.h"
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#define UDP_IOV_MAX 1024            /* packets read or written with one preadv()/pwritev() */
+#define UDP_RING_SLOTS 512U         /* packets between the pacer and the socket, without delay injection */
+#define UDP_RECV_BUFFER 65536U      /* one coalesced receive */
+
+// a range of packets, with the time it was retransmitted
+struct udp_range
+{
+    uint64_t first;
+    uint64_t count;
+    uint64_t ns;
+};
+
+// a FIFO of ranges
+struct udp_list
+{
+    struct udp_range *v;
+    size_t head;
+    size_t count; // including the consumed ones before head
+    size_t cap;
+};
+
+struct udp_sender
+{
+    udp_channel *ch;
+    int ctrl;
+    int fd;
+    uint64_t size;
+    uint64_t packets;
+    bw_session *bw;
+    int gso;
+
+    // injection
+    double loss;             // probability of dropping a packet
+    uint64_t delay_ns;
+    uint64_t rng;
+    char *discard;           // the payload of dropped packets is read here
+
+    // packets composed but not handed to the kernel yet, a ring of slots
+    char *slots;
+    uint32_t *slot_len;
+    uint64_t *slot_release;  // not before this time (delay injection)
+    uint64_t cap;
+    uint64_t head;           // next slot to send
+    uint64_t tail;           // next slot to fill
+
+    uint64_t next_new;       // the first packet never sent
+    struct udp_list retx;    // ranges to retransmit, before new data
+    struct udp_list recent;  // ranges retransmitted lately
+
+    // congestion control
+    double rate;             // bytes per second
+    double tokens;           // bytes the pacer allows now
+    uint64_t last_ns;
+    double bw_window[UDP_BW_WINDOW];
+    unsigned bw_index;
+    double btlbw;            // bandwidth estimate
+    int startup;
+    double startup_best;
+    int no_growth;
+    unsigned phase;
+    uint32_t srtt_us;
+    uint32_t min_rtt_us;
+    struct udp_report last;  // the latest report
+    int have_last;
+
+    // statistics
+    uint64_t sent;
+    uint64_t retransmitted;
+    uint64_t dropped;
+};
+
+struct udp_receiver
+{
+    udp_channel *ch;
+    int fd;
+    uint64_t size;
+    uint64_t packets;
+    uint64_t *bitmap;
+    uint64_t received;
+    uint64_t next_missing;
+    uint64_t highest;
+    uint32_t echo_ts_us;
+    uint64_t echo_ns;        // when the latest packet came
+    uint64_t duplicates;
+
+    // consecutive packets waiting to be written
+    struct iovec run[UDP_IOV_MAX];
+    size_t run_count;
+    size_t run_bytes;
+    uint64_t run_first;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t udp_payload_length(uint64_t size, uint64_t seq)
+{
+    const uint64_t offset = seq * UDP_PAYLOAD_SIZE;
+    return size - offset < UDP_PAYLOAD_SIZE ? size - offset : UDP_PAYLOAD_SIZE;
+}
+
+// bytes of the packets [first, first + count)
+static size_t udp_range_bytes(uint64_t size, uint64_t first, uint64_t count)
+{
+    const uint64_t end = (first + count) * UDP_PAYLOAD_SIZE;
+    return (end < size ? end : size) - first * UDP_PAYLOAD_SIZE;
+}
+
+// xorshift64*, for the loss injection
+static double udp_random(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (*state * 0x2545F4914F6CDD1DULL >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int udp_list_push(struct udp_list *l, uint64_t first, uint64_t count, uint64_t ns)
+{
+    if (l->head && l->head * 2 >= l->count)
+    {
+        // drop the consumed ones
+        memmove(l->v, l->v + l->head, (l->count - l->head) * sizeof(*l->v));
+        l->count -= l->head;
+        l->head = 0;
+    }
+    if (l->count == l->cap)
+    {
+        const size_t cap = l->cap ? l->cap * 2 : 64;
+        struct udp_range *v = realloc(l->v, cap * sizeof(*v));
+        if (!v)
+        {
+            perror("realloc() failed");
+            return -1;
+        }
+        l->v = v;
+        l->cap = cap;
+    }
+    l->v[l->count++] = (struct udp_range){first, count, ns};
+    return 0;
+}
+
+/**
+ * @brief Find the range of a list that holds a packet.
+ *
+ * @param l the list.
+ * @param seq the packet.
+ * @param next lowered to the first range starting above seq.
+ * @return uint64_t the end of the range holding seq, 0 if none.
+ */
+static uint64_t udp_list_covers(const struct udp_list *l, uint64_t seq, uint64_t *next)
+{
+    for (size_t i = l->head; i < l->count; ++i)
+    {
+        const struct udp_range *r = &l->v[i];
+        if (r->first <= seq && seq < r->first + r->count)
+            return r->first + r->count;
+        if (r->first > seq && r->first < *next)
+            *next = r->first;
+    }
+    return 0;
+}
+
+/**
+ * @brief Open a UDP channel for the file and offer it to the client. Server side.
+ *
+ * @param ctrl the TCP connection.
+ * @param usable 0 if the file must come on the TCP connection anyway.
+ * @param ch the channel.
+ * @return int 0 if the file goes over UDP, 1 if over the TCP connection, -1 if failed.
+ */
+int udp_channel_offer(int ctrl, int usable, udp_channel *ch)
+{
+    struct udp_offer offer;
+    memset(&offer, 0, sizeof(offer));
+    offer.packet_size = UDP_PACKET_SIZE;
+    ch->socket = -1;
+    ch->token = 0;
+    ch->connected = 0;
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (usable && !getsockname(ctrl, (struct sockaddr *)&addr, &len)
+        && (addr.ss_family == AF_INET || addr.ss_family == AF_INET6))
+    {
+        // the address the client reached us at, any free port
+        in_port_t *port = addr.ss_family == AF_INET ? &((struct sockaddr_in *)&addr)->sin_port
+            : &((struct sockaddr_in6 *)&addr)->sin6_port;
+        *port = 0;
+        if ((ch->socket = socket(addr.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0
+            || bind(ch->socket, (struct sockaddr *)&addr, len)
+            || getsockname(ch->socket, (struct sockaddr *)&addr, &len)
+            || getrandom(&ch->token, sizeof(ch->token), 0) != sizeof(ch->token))
+        {
+            perror("Cannot open a UDP channel, using TCP");
+            udp_channel_close(ch);
+        }
+        else
+        {
+            offer.port = *port;
+            offer.token = ch->token;
+        }
+    }
+    if (write_exactly(ctrl, &offer, sizeof(offer)) != sizeof(offer))
+    {
+        perror("Failed to send the UDP offer");
+        udp_channel_close(ch);
+        return -1;
+    }
+    return ch->socket < 0;
+}
+
+/**
+ * @brief Read the server's offer and connect to its UDP channel. Client side.
+ *
+ * @param ctrl the TCP connection.
+ * @param ch the channel.
+ * @return int 0 if the file goes over UDP, 1 if over the TCP connection, -1 if failed.
+ */
+int udp_channel_accept(int ctrl, udp_channel *ch)
+{
+    struct udp_offer offer;
+    ch->socket = -1;
+    ch->token = 0;
+    ch->connected = 0;
+    if (read_exactly(ctrl, &offer, sizeof(offer)) != sizeof(offer))
+    {
+        fprintf(stderr, "Failed to read the UDP offer.\n");
+        return -1;
+    }
+    if (!offer.port)
+        return 1;
+    if (offer.packet_size != UDP_PACKET_SIZE)
+    {
+        fprintf(stderr, "Unsupported UDP packet size %u.\n", offer.packet_size);
+        return -1;
+    }
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (getpeername(ctrl, (struct sockaddr *)&addr, &len)
+        || (addr.ss_family != AF_INET && addr.ss_family != AF_INET6))
+    {
+        fprintf(stderr, "The server offered UDP on a connection that is not IP.\n");
+        return -1;
+    }
+    if (addr.ss_family == AF_INET)
+        ((struct sockaddr_in *)&addr)->sin_port = offer.port;
+    else
+        ((struct sockaddr_in6 *)&addr)->sin6_port = offer.port;
+    if ((ch->socket = socket(addr.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0
+        || connect(ch->socket, (struct sockaddr *)&addr, len))
+    {
+        perror("Cannot open the UDP channel");
+        udp_channel_close(ch);
+        return -1;
+    }
+    ch->token = offer.token;
+    ch->connected = 1;
+    return 0;
+}
+
+void udp_channel_close(udp_channel *ch)
+{
+    if (ch->socket >= 0)
+        close(ch->socket);
+    ch->socket = -1;
+    ch->connected = 0;
+}
+
+/* ---------------- sender ---------------- */
+
+// new packets may be sent below this
+static uint64_t udp_inflight_limit(const struct udp_sender *u)
+{
+    // what is in flight, as far as the reports tell, which are up to an interval old
+    const double rtt_s = (u->srtt_us + UDP_REPORT_INTERVAL_NS / 1000) / 1E6;
+    uint64_t limit = 2 * u->btlbw * rtt_s / UDP_PAYLOAD_SIZE;
+    if (limit < UDP_MIN_INFLIGHT)
+        limit = UDP_MIN_INFLIGHT;
+    return u->last.highest + limit;
+}
+
+static int udp_has_work(const struct udp_sender *u)
+{
+    return u->retx.head < u->retx.count
+        || (u->next_new < u->packets && u->next_new < udp_inflight_limit(u));
+}
+
+/**
+ * @brief Read up to `max` packets into free slots: retransmissions first, then new data.
+ *
+ * @return ssize_t packets taken, including the dropped ones, -1 if failed.
+ */
+static ssize_t udp_compose(struct udp_sender *u, uint64_t now, size_t max)
+{
+    size_t n = 0;
+    while (n < max && u->tail - u->head < u->cap)
+    {
+        struct udp_range *r = NULL;
+        uint64_t first, count;
+        if (u->retx.head < u->retx.count)
+        {
+            r = &u->retx.v[u->retx.head];
+            first = r->first;
+            count = r->count;
+        }
+        else if (u->next_new < u->packets && u->next_new < udp_inflight_limit(u))
+        {
+            const uint64_t limit = udp_inflight_limit(u);
+            first = u->next_new;
+            count = (limit < u->packets ? limit : u->packets) - first;
+        }
+        else
+            break;
+        // a run of slots up to the end of the ring
+        uint64_t room = u->cap - u->tail % u->cap;
+        if (room > u->cap - (u->tail - u->head))
+            room = u->cap - (u->tail - u->head);
+        if (count > room)
+            count = room;
+        if (count > max - n)
+            count = max - n;
+        if (count > UDP_IOV_MAX)
+            count = UDP_IOV_MAX;
+
+        struct iovec iov[UDP_IOV_MAX];
+        uint64_t kept = 0;
+        for (uint64_t i = 0; i < count; ++i)
+        {
+            const uint64_t seq = first + i;
+            const size_t len = udp_payload_length(u->size, seq);
+            if (u->loss > 0 && udp_random(&u->rng) < u->loss)
+            {
+                iov[i] = (struct iovec){u->discard, len};
+                ++u->dropped;
+                continue;
+            }
+            const uint64_t slot = (u->tail + kept++) % u->cap;
+            char *p = u->slots + slot * UDP_PACKET_SIZE;
+            const struct udp_data_header h = {u->ch->token, seq, (uint32_t)(now / 1000), 0};
+            memcpy(p, &h, sizeof(h));
+            iov[i] = (struct iovec){p + sizeof(h), len};
+            u->slot_len[slot] = sizeof(h) + len;
+            u->slot_release[slot] = now + u->delay_ns;
+        }
+        const ssize_t bytes = udp_range_bytes(u->size, first, count);
+        const ssize_t read_sz = preadv(u->fd, iov, count, first * UDP_PAYLOAD_SIZE);
+        if (read_sz != bytes)
+        {
+            if (read_sz < 0)
+                perror("Failed to read the file");
+            else
+                fprintf(stderr, "The file is shorter than expected.\n");
+            return -1;
+        }
+        u->tail += kept;
+        u->sent += count;
+        n += count;
+        if (r)
+        {
+            r->first += count;
+            r->count -= count;
+            if (!r->count)
+                ++u->retx.head;
+            u->retransmitted += count;
+            if (udp_list_push(&u->recent, first, count, now))
+                return -1;
+        }
+        else
+            u->next_new += count;
+    }
+    return n;
+}
+
+/**
+ * @brief Hand the slots due by now to the kernel, up to UDP_GSO_SEGMENTS in one buffer.
+ *
+ * @param blocked set to 1 if the socket buffer is full.
+ * @return int 0 if success, -1 if failed.
+ */
+static int udp_flush(struct udp_sender *u, uint64_t now, int *blocked)
+{
+    *blocked = 0;
+    while (u->head < u->tail && u->slot_release[u->head % u->cap] <= now)
+    {
+        struct mmsghdr msgs[UDP_SEND_MSGS];
+        struct iovec iov[UDP_SEND_MSGS];
+        int segs[UDP_SEND_MSGS];
+        int m = 0;
+        uint64_t h = u->head;
+        memset(msgs, 0, sizeof(msgs));
+        while (m < UDP_SEND_MSGS && h < u->tail && u->slot_release[h % u->cap] <= now)
+        {
+            // consecutive slots, every one full but the last
+            const uint64_t start = h;
+            size_t bytes = 0;
+            segs[m] = 0;
+            do
+            {
+                bytes += u->slot_len[h % u->cap];
+                ++segs[m];
+                ++h;
+            } while (u->gso && segs[m] < UDP_GSO_SEGMENTS && h < u->tail && h % u->cap
+                && u->slot_release[h % u->cap] <= now && u->slot_len[(h - 1) % u->cap] == UDP_PACKET_SIZE);
+            iov[m] = (struct iovec){u->slots + start % u->cap * UDP_PACKET_SIZE, bytes};
+            msgs[m].msg_hdr.msg_iov = &iov[m];
+            msgs[m].msg_hdr.msg_iovlen = 1;
+            ++m;
+        }
+        int sent = sendmmsg(u->ch->socket, msgs, m, MSG_DONTWAIT);
+        if (sent < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+            {
+                *blocked = 1;
+                return 0;
+            }
+            if (errno != ECONNREFUSED && errno != EINTR)
+            {
+                perror("sendmmsg() failed");
+                return -1;
+            }
+            // the receiver has gone, or is going once it has everything: its report tells
+            sent = errno == ECONNREFUSED;
+        }
+        for (int i = 0; i < sent; ++i)
+            u->head += segs[i];
+        if (sent < m)
+        {
+            *blocked = 1;
+            return 0;
+        }
+    }
+    return 0;
+}
+
+static void udp_update_rate(struct udp_sender *u, double delivered)
+{
+    static const double gains[8] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+    u->bw_window[u->bw_index++ % UDP_BW_WINDOW] = delivered;
+    u->btlbw = 0;
+    for (int i = 0; i < UDP_BW_WINDOW; ++i)
+        if (u->bw_window[i] > u->btlbw)
+            u->btlbw = u->bw_window[i];
+    if (u->startup)
+    {
+        if (u->btlbw > u->startup_best * 1.25)
+        {
+            u->startup_best = u->btlbw;
+            u->no_growth = 0;
+        }
+        else if (++u->no_growth >= UDP_STARTUP_ROUNDS)
+            u->startup = 0;
+        if (2 * u->btlbw > u->rate)
+            u->rate = 2 * u->btlbw;
+    }
+    if (!u->startup)
+        u->rate = u->btlbw * gains[u->phase++ % 8];
+    if (u->rate < UDP_MIN_RATE)
+        u->rate = UDP_MIN_RATE;
+    if (u->rate > UDP_MAX_RATE)
+        u->rate = UDP_MAX_RATE;
+}
+
+// queue the parts of a missing range that are not queued or retransmitted within a round trip
+static int udp_queue_retransmit(struct udp_sender *u, uint64_t first, uint64_t count, uint64_t now)
+{
+    if (first >= u->next_new)
+        return 0;
+    uint64_t seq = first;
+    const uint64_t end = first + count < u->next_new ? first + count : u->next_new;
+    while (seq < end)
+    {
+        uint64_t next = end;
+        const uint64_t queued = udp_list_covers(&u->retx, seq, &next);
+        const uint64_t recent = udp_list_covers(&u->recent, seq, &next);
+        if (queued || recent)
+        {
+            seq = queued > recent ? queued : recent;
+            continue;
+        }
+        if (udp_list_push(&u->retx, seq, next - seq, 0))
+            return -1;
+        seq = next;
+    }
+    return 0;
+}
+
+/**
+ * @brief Read a report of the receiver.
+ *
+ * @return int 1 if the receiver has everything, 0 if not, -1 if failed.
+ */
+static int udp_on_report(struct udp_sender *u, uint64_t now)
+{
+    struct udp_report rep;
+    struct udp_nack nacks[UDP_MAX_NACKS];
+    if (read_exactly(u->ctrl, &rep, sizeof(rep)) != sizeof(rep)
+        || rep.nack_count > UDP_MAX_NACKS
+        || read_exactly(u->ctrl, nacks, rep.nack_count * sizeof(*nacks)) != rep.nack_count * sizeof(*nacks))
+    {
+        fprintf(stderr, "Lost the reports of the receiver.\n");
+        return -1;
+    }
+    if (rep.done)
+        return 1;
+
+    if (rep.received)
+    {
+        const uint32_t rtt_us = (uint32_t)(now / 1000) - rep.echo_ts_us - rep.echo_hold_us;
+        if ((int32_t)rtt_us > 0)
+        {
+            u->srtt_us = u->srtt_us ? (7 * (uint64_t)u->srtt_us + rtt_us) / 8 : rtt_us;
+            if (!u->min_rtt_us || rtt_us < u->min_rtt_us)
+                u->min_rtt_us = rtt_us;
+        }
+    }
+    if (u->have_last && rep.ts_us != u->last.ts_us && rep.received >= u->last.received)
+        udp_update_rate(u, (rep.received - u->last.received) * (double)UDP_PAYLOAD_SIZE * 1E6
+            / (uint32_t)(rep.ts_us - u->last.ts_us));
+    u->last = rep;
+    u->have_last = 1;
+
+    // forget retransmissions older than a round trip, so they may be retransmitted again
+    const uint64_t holdoff = u->srtt_us * 1000ULL + 2 * UDP_REPORT_INTERVAL_NS;
+    while (u->recent.head < u->recent.count && u->recent.v[u->recent.head].ns + holdoff < now)
+        ++u->recent.head;
+    for (int i = 0; i < rep.nack_count; ++i)
+        if (udp_queue_retransmit(u, nacks[i].first, nacks[i].count, now))
+            return -1;
+    return 0;
+}
+
+// the receiver's address, from its first packet
+static void udp_on_hello(struct udp_sender *u)
+{
+    struct udp_data_header h;
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    ssize_t n;
+    while ((n = recvfrom(u->ch->socket, &h, sizeof(h), MSG_DONTWAIT, (struct sockaddr *)&addr, &len)) >= 0)
+    {
+        if (n == sizeof(h) && h.token == u->ch->token && h.seq == UDP_SEQ_HELLO
+            && !connect(u->ch->socket, (struct sockaddr *)&addr, len))
+        {
+            u->ch->connected = 1;
+            return;
+        }
+        len = sizeof(addr);
+    }
+}
+
+/**
+ * @brief Send a file over a UDP channel. The receiver reports on the TCP connection.
+ *
+ * @param ch the channel.
+ * @param ctrl the TCP connection.
+ * @param fd the file, read with preadv().
+ * @param size bytes to send.
+ * @param bw bandwidth scheduler session, NULL if not throttled.
+ * @param flags TRANSFER_QUIET or 0.
+ * @return int 0 if success, non-zero if failed.
+ */
+int udp_send_file(udp_channel *ch, int ctrl, int fd, uint64_t size, bw_session *bw, int flags)
+{
+    struct udp_sender u;
+    memset(&u, 0, sizeof(u));
+    u.ch = ch;
+    u.ctrl = ctrl;
+    u.fd = fd;
+    u.size = size;
+    u.packets = (size + UDP_PAYLOAD_SIZE - 1) / UDP_PAYLOAD_SIZE;
+    u.bw = bw;
+    u.rate = UDP_INITIAL_RATE;
+    u.startup = 1;
+    u.rng = ch->token | 1;
+    const char *env = getenv(ENV_UDP_LOSS);
+    u.loss = env ? atof(env) / 100 : 0;
+    env = getenv(ENV_UDP_DELAY);
+    u.delay_ns = env ? atof(env) * 1E6 : 0;
+    u.cap = u.delay_ns ? UDP_DELAY_SLOTS : UDP_RING_SLOTS;
+    int r = -1;
+    u.slots = malloc(u.cap * UDP_PACKET_SIZE);
+    u.slot_len = malloc(u.cap * sizeof(*u.slot_len));
+    u.slot_release = malloc(u.cap * sizeof(*u.slot_release));
+    u.discard = malloc(UDP_PAYLOAD_SIZE);
+    if (!u.slots || !u.slot_len || !u.slot_release || !u.discard)
+    {
+        perror("malloc() failed");
+        goto UDP_SEND_DONE;
+    }
+    const int gso_size = UDP_PACKET_SIZE;
+    u.gso = !setsockopt(ch->socket, SOL_UDP, UDP_SEGMENT, &gso_size, sizeof(gso_size));
+    int sndbuf = UDP_SOCKET_BUFFER / 2; // the kernel doubles it
+    if (setsockopt(ch->socket, SOL_SOCKET, SO_SNDBUFFORCE, &sndbuf, sizeof(sndbuf)))
+        setsockopt(ch->socket, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+    const uint64_t start = now_ns();
+    uint64_t last_report = start;
+    u.last_ns = start;
+    while (1)
+    {
+        uint64_t now = now_ns();
+        if (now - last_report > UDP_TIMEOUT_NS)
+        {
+            fprintf(stderr, "The receiver stopped reporting.\n");
+            goto UDP_SEND_DONE;
+        }
+        int blocked = 0;
+        uint64_t wait_ns = UDP_REPORT_INTERVAL_NS;
+        if (ch->connected)
+        {
+            // refill the pacer, up to a burst
+            double burst = u.rate * UDP_PACE_QUANTUM_NS / 1E9;
+            if (burst < UDP_GSO_SEGMENTS * UDP_PACKET_SIZE)
+                burst = UDP_GSO_SEGMENTS * UDP_PACKET_SIZE;
+            u.tokens += (now - u.last_ns) * u.rate / 1E9;
+            if (u.tokens > burst)
+                u.tokens = burst;
+            u.last_ns = now;
+            size_t want = u.tokens / UDP_PACKET_SIZE;
+            if (want && udp_has_work(&u))
+            {
+                const size_t grant = bw_acquire(bw, want * UDP_PAYLOAD_SIZE);
+                const ssize_t n = udp_compose(&u, now, grant / UDP_PAYLOAD_SIZE);
+                if (n < 0)
+                    goto UDP_SEND_DONE;
+                if (grant > n * UDP_PAYLOAD_SIZE)
+                    bw_refund(bw, grant - n * UDP_PAYLOAD_SIZE);
+                u.tokens -= n * UDP_PACKET_SIZE;
+            }
+            now = now_ns();
+            if (udp_flush(&u, now, &blocked))
+                goto UDP_SEND_DONE;
+            // sleep until a GSO buffer is due, a delayed packet is, or a report comes
+            if (udp_has_work(&u))
+            {
+                const double missing = UDP_GSO_SEGMENTS * UDP_PACKET_SIZE - u.tokens;
+                const uint64_t pace_ns = missing > 0 ? missing * 1E9 / u.rate : 0;
+                if (pace_ns < wait_ns)
+                    wait_ns = pace_ns;
+            }
+            if (!blocked && u.head < u.tail)
+            {
+                const uint64_t release = u.slot_release[u.head % u.cap];
+                const uint64_t due_ns = release > now ? release - now : 0;
+                if (due_ns < wait_ns)
+                    wait_ns = due_ns;
+            }
+        }
+        struct pollfd pfd[2] = {
+            {ctrl, POLLIN, 0},
+            {ch->socket, !ch->connected ? POLLIN : blocked ? POLLOUT : 0, 0},
+        };
+        const struct timespec ts = {wait_ns / 1000000000, wait_ns % 1000000000};
+        if (ppoll(pfd, 2, &ts, NULL) < 0 && errno != EINTR)
+        {
+            perror("ppoll() failed");
+            goto UDP_SEND_DONE;
+        }
+        if (pfd[0].revents)
+        {
+            const int done = udp_on_report(&u, now_ns());
+            if (done < 0)
+                goto UDP_SEND_DONE;
+            if (done)
+                break;
+            last_report = now_ns();
+        }
+        if (!ch->connected && (pfd[1].revents & POLLIN))
+        {
+            udp_on_hello(&u);
+            u.last_ns = now_ns();
+        }
+    }
+    r = 0;
+    if (!(flags & TRANSFER_QUIET))
+    {
+        const uint64_t delta_us = (now_ns() - start) / 1000 + 1;
+        printf("Time elapsed: %.2fs. Average speed: %.2fMB/s.\n", delta_us / 1.0E6, size * 0.95367431640625 / delta_us);
+        printf("UDP: %" PRIu64 " packets sent, %" PRIu64 " retransmitted, %" PRIu64 " dropped on purpose, "
+            "bandwidth estimate %.2fMB/s, rtt %.2fms (min %.2fms)%s.\n", u.sent, u.retransmitted, u.dropped,
+            u.btlbw / 1048576, u.srtt_us / 1000.0, u.min_rtt_us / 1000.0, u.gso ? "" : ", no GSO");
+    }
+UDP_SEND_DONE:
+    free(u.slots);
+    free(u.slot_len);
+    free(u.slot_release);
+    free(u.discard);
+    free(u.retx.v);
+    free(u.recent.v);
+    return r;
+}
+
+/* ---------------- receiver ---------------- */
+
+static int udp_bit(const uint64_t *bitmap, uint64_t i)
+{
+    return bitmap[i / 64] >> (i % 64) & 1;
+}
+
+// the first packet in [from, limit) with the bit `set`, limit if none
+static uint64_t udp_find(const uint64_t *bitmap, uint64_t from, uint64_t limit, int set)
+{
+    uint64_t i = from;
+    while (i < limit)
+    {
+        uint64_t word = set ? bitmap[i / 64] : ~bitmap[i / 64];
+        word &= ~0ULL << (i % 64);
+        if (word)
+        {
+            i = i / 64 * 64 + __builtin_ctzll(word);
+            break;
+        }
+        i = (i / 64 + 1) * 64;
+    }
+    return i < limit ? i : limit;
+}
+
+static int udp_write_run(struct udp_receiver *r)
+{
+    if (!r->run_count)
+        return 0;
+    const ssize_t written = pwritev(r->fd, r->run, r->run_count, r->run_first * UDP_PAYLOAD_SIZE);
+    r->run_count = 0;
+    if (written != (ssize_t)r->run_bytes)
+    {
+        if (written < 0)
+            perror("Failed to write the file");
+        else
+            fprintf(stderr, "Short write: %zd of %zu bytes.\n", written, r->run_bytes);
+        return -1;
+    }
+    return 0;
+}
+
+static int udp_accept_packet(struct udp_receiver *r, char *p, size_t len, uint64_t now)
+{
+    struct udp_data_header h;
+    if (len < sizeof(h))
+        return 0;
+    memcpy(&h, p, sizeof(h));
+    if (h.token != r->ch->token || h.seq >= r->packets
+        || len - sizeof(h) != udp_payload_length(r->size, h.seq))
+        return 0;
+    r->echo_ts_us = h.ts_us;
+    r->echo_ns = now;
+    if (udp_bit(r->bitmap, h.seq))
+    {
+        ++r->duplicates;
+        return 0;
+    }
+    r->bitmap[h.seq / 64] |= 1ULL << (h.seq % 64);
+    ++r->received;
+    if (h.seq >= r->highest)
+        r->highest = h.seq + 1;
+    // consecutive packets are written at once
+    if (r->run_count && (h.seq != r->run_first + r->run_count || r->run_count == UDP_IOV_MAX))
+        if (udp_write_run(r))
+            return -1;
+    if (!r->run_count)
+    {
+        r->run_first = h.seq;
+        r->run_bytes = 0;
+    }
+    r->run[r->run_count++] = (struct iovec){p + sizeof(h), len - sizeof(h)};
+    r->run_bytes += len - sizeof(h);
+    return 0;
+}
+
+/**
+ * @brief Receive what has come, up to UDP_RECV_MSGS buffers, and write it.
+ *
+ * @return int buffers received, -1 if failed.
+ */
+static int udp_receive_batch(struct udp_receiver *r, char *bufs)
+{
+    struct mmsghdr msgs[UDP_RECV_MSGS];
+    struct iovec iov[UDP_RECV_MSGS];
+    char control[UDP_RECV_MSGS][CMSG_SPACE(sizeof(int))];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < UDP_RECV_MSGS; ++i)
+    {
+        iov[i] = (struct iovec){bufs + (size_t)i * UDP_RECV_BUFFER, UDP_RECV_BUFFER};
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = control[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+    }
+    const int n = recvmmsg(r->ch->socket, msgs, UDP_RECV_MSGS, MSG_DONTWAIT, NULL);
+    if (n < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNREFUSED)
+            return 0;
+        perror("recvmmsg() failed");
+        return -1;
+    }
+    const uint64_t now = now_ns();
+    for (int i = 0; i < n; ++i)
+    {
+        // coalesced datagrams come as one buffer, cut at the segment size
+        size_t seg = msgs[i].msg_len;
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&msgs[i].msg_hdr); c; c = CMSG_NXTHDR(&msgs[i].msg_hdr, c))
+            if (c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_GRO)
+                seg = *(int *)CMSG_DATA(c);
+        if (!seg)
+            continue;
+        for (size_t off = 0; off < msgs[i].msg_len; off += seg)
+        {
+            const size_t len = msgs[i].msg_len - off < seg ? msgs[i].msg_len - off : seg;
+            if (udp_accept_packet(r, (char *)iov[i].iov_base + off, len, now))
+                return -1;
+        }
+    }
+    // the buffers are reused by the next call
+    if (udp_write_run(r))
+        return -1;
+    r->next_missing = udp_find(r->bitmap, r->next_missing, r->packets, 0);
+    return n;
+}
+
+// report progress, and the missing ranges below `limit`
+static int udp_send_report(struct udp_receiver *r, int ctrl, uint64_t now, uint64_t limit, int done)
+{
+    struct
+    {
+        struct udp_report rep;
+        struct udp_nack nacks[UDP_MAX_NACKS];
+    } m;
+    memset(&m.rep, 0, sizeof(m.rep));
+    m.rep.received = r->received;
+    m.rep.next_missing = r->next_missing;
+    m.rep.highest = r->highest;
+    m.rep.ts_us = now / 1000;
+    m.rep.echo_ts_us = r->echo_ts_us;
+    m.rep.echo_hold_us = (now - r->echo_ns) / 1000;
+    m.rep.done = done;
+    uint64_t seq = r->next_missing;
+    while (!done && seq < limit && m.rep.nack_count < UDP_MAX_NACKS)
+    {
+        const uint64_t first = udp_find(r->bitmap, seq, limit, 0);
+        if (first >= limit)
+            break;
+        seq = udp_find(r->bitmap, first, limit, 1);
+        m.nacks[m.rep.nack_count++] = (struct udp_nack){first, seq - first};
+    }
+    const size_t n = sizeof(m.rep) + m.rep.nack_count * sizeof(struct udp_nack);
+    if (write_exactly(ctrl, &m, n) != n)
+    {
+        perror("Failed to send a report");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Receive a file over a UDP channel, reporting on the TCP connection.
+ *
+ * @param ch the channel.
+ * @param ctrl the TCP connection.
+ * @param fd the file, written with pwritev() wherever the packets belong.
+ * @param size bytes to receive.
+ * @param flags TRANSFER_QUIET or 0.
+ * @return int 0 if success, non-zero if failed.
+ */
+int udp_receive_file(udp_channel *ch, int ctrl, int fd, uint64_t size, int flags)
+{
+    struct udp_receiver *r = calloc(1, sizeof(struct udp_receiver));
+    char *bufs = malloc((size_t)UDP_RECV_MSGS * UDP_RECV_BUFFER);
+    int ret = -1;
+    if (!r || !bufs)
+    {
+        perror("malloc() failed");
+        goto UDP_RECEIVE_DONE;
+    }
+    r->ch = ch;
+    r->fd = fd;
+    r->size = size;
+    r->packets = (size + UDP_PAYLOAD_SIZE - 1) / UDP_PAYLOAD_SIZE;
+    if (!(r->bitmap = calloc(r->packets / 64 + 1, sizeof(uint64_t))))
+    {
+        perror("calloc() failed");
+        goto UDP_RECEIVE_DONE;
+    }
+    if (ftruncate(fd, size))
+    {
+        perror("Cannot size the file");
+        goto UDP_RECEIVE_DONE;
+    }
+    int gro = 1;
+    gro = !setsockopt(ch->socket, SOL_UDP, UDP_GRO, &gro, sizeof(gro));
+    int rcvbuf = UDP_SOCKET_BUFFER / 2; // the kernel doubles it
+    if (setsockopt(ch->socket, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)))
+        setsockopt(ch->socket, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    const uint64_t start = now_ns();
+    uint64_t last_data = start, next_report = start + UDP_REPORT_INTERVAL_NS, next_hello = start;
+    r->echo_ns = start;
+    while (r->received < r->packets)
+    {
+        uint64_t now = now_ns();
+        if (ch->connected && !r->received && now >= next_hello)
+        {
+            // tell the sender where to send, until it does
+            const struct udp_data_header hello = {ch->token, UDP_SEQ_HELLO, 0, 0};
+            send(ch->socket, &hello, sizeof(hello), MSG_DONTWAIT);
+            next_hello = now + UDP_HELLO_INTERVAL_NS;
+        }
+        if (now >= next_report)
+        {
+            // once nothing comes, the tail is missing as well
+            const int idle = now - last_data > 2 * UDP_REPORT_INTERVAL_NS;
+            if (udp_send_report(r, ctrl, now, idle ? r->packets : r->highest, 0))
+                goto UDP_RECEIVE_DONE;
+            next_report = now + UDP_REPORT_INTERVAL_NS;
+        }
+        if (now - last_data > UDP_TIMEOUT_NS)
+        {
+            fprintf(stderr, "Nothing came over UDP for %lds.\n", UDP_TIMEOUT_NS / 1000000000);
+            goto UDP_RECEIVE_DONE;
+        }
+        uint64_t wake = next_report;
+        if (ch->connected && !r->received && next_hello < wake)
+            wake = next_hello;
+        const uint64_t wait_ns = wake > now ? wake - now : 0;
+        const struct timespec ts = {wait_ns / 1000000000, wait_ns % 1000000000};
+        struct pollfd pfd[2] = {{ch->socket, POLLIN, 0}, {ctrl, POLLIN, 0}};
+        if (ppoll(pfd, 2, &ts, NULL) < 0 && errno != EINTR)
+        {
+            perror("ppoll() failed");
+            goto UDP_RECEIVE_DONE;
+        }
+        if (pfd[1].revents)
+        {
+            // the sender says nothing on the connection before it is done
+            fprintf(stderr, "The sender closed the connection.\n");
+            goto UDP_RECEIVE_DONE;
+        }
+        if (pfd[0].revents & POLLIN)
+        {
+            // drain the socket, but report in time
+            int n;
+            const uint64_t received = r->received;
+            do
+            {
+                if ((n = udp_receive_batch(r, bufs)) < 0)
+                    goto UDP_RECEIVE_DONE;
+            } while (n == UDP_RECV_MSGS && r->received < r->packets && now_ns() < next_report);
+            if (r->received > received)
+                last_data = now_ns();
+        }
+    }
+    if (udp_send_report(r, ctrl, now_ns(), 0, 1))
+        goto UDP_RECEIVE_DONE;
+    ret = 0;
+    if (!(flags & TRANSFER_QUIET))
+    {
+        const uint64_t delta_us = (now_ns() - start) / 1000 + 1;
+        printf("Time elapsed: %.2fs. Average speed: %.2fMB/s.\n", delta_us / 1.0E6, size * 0.95367431640625 / delta_us);
+        printf("UDP: %" PRIu64 " packets, %" PRIu64 " duplicates%s.\n", r->packets, r->duplicates, gro ? "" : ", no GRO");
+    }
+UDP_RECEIVE_DONE:
+    if (r)
+        free(r->bitmap);
+    free(r);
+    free(bufs);
+    return ret;
+}
@@ -0,0 +1,135 @@
+#ifndef __UDPXFER_H
+#define __UDPXFER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "bwsched.h"
+
+/* configurations */
+#define UDP_PACKET_SIZE 1472U               /* one datagram per 1500 byte Ethernet frame */
+#define UDP_GSO_SEGMENTS 40                 /* datagrams the kernel cuts one send into (UDP_SEGMENT), below 64KB */
+#define UDP_SEND_MSGS 8                     /* sends per sendmmsg() */
+#define UDP_RECV_MSGS 16                    /* receives per recvmmsg(), each one up to 64KB with UDP_GRO */
+#define UDP_REPORT_INTERVAL_NS 10000000L    /* 10ms, how often the receiver reports */
+#define UDP_HELLO_INTERVAL_NS 50000000L     /* 50ms, until the sender knows where to send */
+#define UDP_TIMEOUT_NS 10000000000L         /* 10s without any progress fails the transfer */
+#define UDP_MAX_NACKS 256                   /* missing ranges per report */
+#define UDP_INITIAL_RATE (8 * 1024 * 1024)  /* bytes per second, before anything is measured */
+#define UDP_MIN_RATE (1024 * 1024)
+#define UDP_MAX_RATE (4ULL << 30)
+#define UDP_BW_WINDOW 10                    /* reports the bandwidth estimate is the maximum of */
+#define UDP_STARTUP_ROUNDS 3                /* reports without growth that end the startup */
+#define UDP_MIN_INFLIGHT 1024U              /* packets, even if the bandwidth-delay product is less */
+#define UDP_PACE_QUANTUM_NS 1000000L        /* 1ms, the largest burst of the pacer */
+#define UDP_SOCKET_BUFFER (8 * 1024 * 1024)
+#define UDP_DELAY_SLOTS 32768U              /* packets the delay injector holds, a power of 2 */
+#define ENV_UDP_LOSS "NFH_UDP_LOSS"         /* the sender drops this percentage of its packets, e.g. "1" */
+#define ENV_UDP_DELAY "NFH_UDP_DELAY"       /* the sender holds every packet this many milliseconds */
+
+/*
+
+UDP Bulk Transfer:
+    TCP takes every loss as congestion, so on a long link with random loss it
+    never opens its window. In the UDP modes (`MODESW.UDPDNL`, `MODESW.UDPUPL`)
+    the file goes over UDP instead, while the request, the reply and BYE stay
+    on the TCP connection. After the request, the server binds a UDP port on
+    the address the client reached it at and sends a `struct udp_offer`. A port
+    of 0 means the file comes on the TCP connection as usual, e.g. over a local
+    socket, with TLS (UDP would not be encrypted), or from a store that does
+    not keep plain files. The server's bandwidth limits (bwsched.h) apply
+    to what it sends.
+    Data:
+        The file is cut into packets of UDP_PACKET_SIZE, a `struct udp_data_header`
+        plus UDP_PAYLOAD_SIZE bytes (less for the last one). Packet `seq` holds
+        the bytes from seq * UDP_PAYLOAD_SIZE on, so the receiver writes it
+        where it belongs (pwrite) whatever order it comes in, and keeps a bitmap
+        of what it has. A header with the wrong token is ignored. The client
+        sends `seq` UDP_SEQ_HELLO packets on a download until the data comes,
+        so the server learns its address through any NAT.
+    Feedback:
+        Every UDP_REPORT_INTERVAL_NS the receiver sends a `struct udp_report`
+        on the TCP connection, followed by up to UDP_MAX_NACKS `struct udp_nack`s,
+        the ranges it is missing below the highest packet it has seen (and the
+        rest of the file once nothing has come for two intervals). The sender
+        retransmits those first, but not a range it has retransmitted within
+        a round trip. A report with `done` set ends the transfer.
+    Congestion control:
+        Rate based, after BBR: the sender paces its packets at a rate, and
+        measures what the receiver gets per report. The bandwidth estimate is
+        the maximum of the last UDP_BW_WINDOW measurements. It starts by
+        doubling the rate until the measurements stop growing, then sends at
+        the estimate, probing 25% above it and draining 25% below it in turn.
+        Loss alone does not slow it down; a full bottleneck does, as its
+        measurements fall and the old maximum expires. Packets in flight are
+        capped at twice the bandwidth-delay product. The round trip is
+        measured by the receiver echoing the sender's timestamps.
+    Batching:
+        The sender reads the packets of a range with one preadv() into a ring
+        of packet slots, and hands up to UDP_GSO_SEGMENTS of them to the kernel
+        as one buffer (UDP_SEGMENT), UDP_SEND_MSGS buffers per sendmmsg(). The
+        receiver gets them coalesced back (UDP_GRO), UDP_RECV_MSGS per
+        recvmmsg(), and writes every run of consecutive packets with one
+        pwritev(). Kernels without GSO/GRO get one datagram per message.
+    Testing:
+        Env NFH_UDP_LOSS and NFH_UDP_DELAY make the sender drop and hold its
+        packets, so a lossy long link can be tried on loopback.
+
+*/
+
+#define UDP_SEQ_HELLO UINT64_MAX
+
+struct udp_offer
+{
+    uint16_t port;        // network byte order, 0 if the file comes on the TCP connection
+    uint16_t packet_size;
+    uint32_t reserved;
+    uint64_t token;       // in every packet of the transfer
+};
+
+struct udp_data_header
+{
+    uint64_t token;
+    uint64_t seq;
+    uint32_t ts_us;       // sender's clock, microseconds, echoed in the reports
+    uint32_t reserved;
+};
+
+#define UDP_PAYLOAD_SIZE (UDP_PACKET_SIZE - sizeof(struct udp_data_header))
+
+struct udp_report
+{
+    uint64_t received;     // packets received, each one counted once
+    uint64_t next_missing; // every packet before it has been received
+    uint64_t highest;      // the highest packet received, plus one
+    uint32_t ts_us;        // receiver's clock, microseconds
+    uint32_t echo_ts_us;   // ts_us of the latest packet
+    uint32_t echo_hold_us; // how long ago the latest packet came
+    uint16_t nack_count;   // followed by this many struct udp_nack
+    uint8_t done;          // all packets received
+    uint8_t reserved;
+};
+
+struct udp_nack
+{
+    uint64_t first;
+    uint64_t count;
+};
+
+typedef struct udp_channel udp_channel;
+
+struct udp_channel
+{
+    int socket;       // the UDP socket
+    uint64_t token;
+    int connected;    // the socket knows its peer: the client at once, the server after a packet from it
+};
+
+int udp_channel_offer(int ctrl, int usable, udp_channel *ch);
+int udp_channel_accept(int ctrl, udp_channel *ch);
+void udp_channel_close(udp_channel *ch);
+int udp_send_file(udp_channel *ch, int ctrl, int fd, uint64_t size, bw_session *bw, int flags);
+int udp_receive_file(udp_channel *ch, int ctrl, int fd, uint64_t size, int flags);
+
+#endif
@@ -1,4 +1,8 @@
+#define _GNU_SOURCE
 #include "util.h"
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 /**
  * @brief Check if a string ends in specific length.
@@ -35,6 +39,111 @@ int is_valid_file_name(char *s)
     return 1;
 }
 
+/**
+ * @brief Check if a relative path is safe to use under a root directory:
+ *        not absolute, no `.` or `..` or empty components, no backslashes or control characters.
+ * 
+ * @param s a valid C string.
+ * @return int 1 if safe, 0 if not.
+ */
+int is_safe_relative_path(const char *s)
+{
+    if (!*s || *s == '/' || strlen(s) > MAX_PATH_LENGTH)
+        return 0;
+    const char *comp = s;
+    while (1)
+    {
+        const char *end = strchrnul(comp, '/');
+        const size_t len = end - comp;
+        if (!len || (len == 1 && comp[0] == '.') || (len == 2 && comp[0] == '.' && comp[1] == '.'))
+            return 0;
+        for (const char *p = comp; p != end; ++p)
+        {
+            if (*p == '\\' || (unsigned char)*p < 32U || *p == 127)
+                return 0;
+        }
+        if (!*end)
+            return 1;
+        comp = end + 1;
+    }
+}
+
+/**
+ * @brief Open a file under a directory, without following any symbolic link.
+ *        The path must have passed `is_safe_relative_path`.
+ * 
+ * @param dirfd the root directory, or AT_FDCWD.
+ * @param path the relative path.
+ * @param flags flags of open(), O_NOFOLLOW is always added.
+ * @param mode mode of open(), used with O_CREAT.
+ * @param make_dirs create missing parent directories.
+ * @return int the file discriptor, -1 if failed.
+ */
+int open_beneath(int dirfd, const char *path, int flags, mode_t mode, int make_dirs)
+{
+    char comp[MAX_PATH_LENGTH + 1];
+    int fd = dirfd;
+    const char *p = path;
+    const char *slash;
+    // walk the parents one by one, so no symbolic link can take us out
+    while ((slash = strchr(p, '/')))
+    {
+        memcpy(comp, p, slash - p);
+        comp[slash - p] = '\0';
+        if (make_dirs && mkdirat(fd, comp, 0755) && errno != EEXIST)
+            goto OPEN_BENEATH_FAIL;
+        int next = openat(fd, comp, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (next < 0)
+            goto OPEN_BENEATH_FAIL;
+        if (fd != dirfd)
+            close(fd);
+        fd = next;
+        p = slash + 1;
+    }
+    int r = openat(fd, p, flags | O_NOFOLLOW | O_CLOEXEC, mode);
+    if (r < 0 && make_dirs && (flags & O_DIRECTORY) && errno == ENOENT
+        && !mkdirat(fd, p, 0755))
+        r = openat(fd, p, flags | O_NOFOLLOW | O_CLOEXEC, mode);
+    int errsv = errno;
+    if (fd != dirfd)
+        close(fd);
+    errno = errsv;
+    return r;
+OPEN_BENEATH_FAIL:
+    errsv = errno;
+    if (fd != dirfd)
+        close(fd);
+    errno = errsv;
+    return -1;
+}
+
+/**
+ * @brief Write exactly n bytes to a file. This function has the same signature with write().
+ * 
+ * @param fd the file discriptor to write.
+ * @param buf the data.
+ * @param n bytes to write.
+ * @return n if success, -1 if failed.
+ */
+ssize_t write_exactly(const int fd, const void *__buf, const size_t n)
+{
+    const char *buf = __buf;
+    size_t bytes_remaining = n;
+    ssize_t sz_written;
+    while (bytes_remaining)
+    {
+        if ((sz_written = write(fd, buf, bytes_remaining)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        bytes_remaining -= sz_written;
+        buf += sz_written;
+    }
+    return n;
+}
+
 /**
  * @brief Read exactly n bytes from a file. This function has the same signature with read().
  * 
@@ -43,7 +152,7 @@ int is_valid_file_name(char *s)
  * @param n bytes to read. Exactly n bytes will be read.
  * @return n if success, -1 if failed.
  */
-ssize_t read_exactly(const int fd, const void *__buf, const size_t n)
+ssize_t read_exactly(const int fd, void *__buf, const size_t n)
 {
     if (n < 0 || !fd || !__buf)
         return -1;
@@ -7,6 +7,8 @@
 #include <unistd.h>
 #include <errno.h>
 
+#define MAX_PATH_LENGTH 4095 /* relative paths in tree mode */
+
 // #define DEBUGON
 #ifdef DEBUGON
 #define ASSERT(s) __assertion((s), __FILE__, __LINE__, NULL)
@@ -24,6 +26,9 @@ void __debug(const char *s, const char *f, const char* func, const int l);
 void __assertion(int s, char *f, int l, char *m);
 int is_string_buf_valid(char *buf, unsigned max_length);
 int is_valid_file_name(char *s);
-ssize_t read_exactly(const int fd, const void *__buf, const size_t n);
+int is_safe_relative_path(const char *s);
+int open_beneath(int dirfd, const char *path, int flags, mode_t mode, int make_dirs);
+ssize_t read_exactly(const int fd, void *__buf, const size_t n);
+ssize_t write_exactly(const int fd, const void *__buf, const size_t n);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,306 @@
+/*************************************
+ *   Parallel File System Walker      *
+ *************************************/
+
+#define _GNU_SOURCE
+#include "walker.h"
+#include "util.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+struct linux_dirent64
+{
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct walk_dir
+{
+    char *path; // relative to the root, "" is the root itself
+    size_t len;
+};
+
+struct walk_deque
+{
+    pthread_mutex_t lock;
+    struct walk_dir *items; // items[head, tail)
+    size_t head, tail, cap;
+};
+
+struct walker
+{
+    int root_fd;
+    int threads;
+    struct walk_deque *queues;
+    long pending;           // directories queued or being scanned
+    int stop;               // set when a visit fails
+    walker_visit *visit;
+    void *arg;
+};
+
+struct walk_worker
+{
+    struct walker *w;
+    int id;
+};
+
+/**
+ * @brief Get a reasonable walker thread count for this machine.
+ *
+ * @return int the thread count.
+ */
+int walker_default_threads(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 2)
+        n = 2; // overlap I/O waits even on one core
+    return n > WALKER_MAX_THREADS ? WALKER_MAX_THREADS : (int)n;
+}
+
+static int __walk_push(struct walk_deque *q, char *path, size_t len)
+{
+    pthread_mutex_lock(&q->lock);
+    if (q->tail == q->cap)
+    {
+        if (q->head)
+        {
+            // reuse the space stolen from the top
+            memmove(q->items, q->items + q->head, sizeof(struct walk_dir) * (q->tail - q->head));
+            q->tail -= q->head;
+            q->head = 0;
+        }
+        if (q->tail == q->cap)
+        {
+            size_t cap = q->cap ? q->cap * 2 : 64;
+            struct walk_dir *p = realloc(q->items, sizeof(struct walk_dir) * cap);
+            if (!p)
+            {
+                pthread_mutex_unlock(&q->lock);
+                return -1;
+            }
+            q->items = p;
+            q->cap = cap;
+        }
+    }
+    q->items[q->tail].path = path;
+    q->items[q->tail++].len = len;
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+static int __walk_pop_bottom(struct walk_deque *q, struct walk_dir *d)
+{
+    int r = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail > q->head)
+    {
+        *d = q->items[--q->tail];
+        r = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return r;
+}
+
+static int __walk_steal_top(struct walk_deque *q, struct walk_dir *d)
+{
+    int r = 0;
+    if (pthread_mutex_trylock(&q->lock))
+        return 0; // busy, try someone else
+    if (q->tail > q->head)
+    {
+        *d = q->items[q->head++];
+        r = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return r;
+}
+
+static void __walk_scan(struct walk_worker *ww, struct walk_dir *d, char *dents)
+{
+    struct walker *w = ww->w;
+    int fd = openat(w->root_fd, d->len ? d->path : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+    {
+        int errsv = errno;
+        fprintf(stderr, "Cannot open directory `%s` [errno %d]: %s. Skip.\n", d->path, errsv, strerror(errsv));
+        return;
+    }
+
+    long n;
+    char path[MAX_PATH_LENGTH + 1];
+    memcpy(path, d->path, d->len);
+    while (!__atomic_load_n(&w->stop, __ATOMIC_RELAXED)
+        && (n = syscall(SYS_getdents64, fd, dents, WALKER_DENTS_BUFFER_SIZE)) > 0)
+    {
+        for (long off = 0; off < n; )
+        {
+            struct linux_dirent64 *e = (struct linux_dirent64 *)(dents + off);
+            off += e->d_reclen;
+            const char *name = e->d_name;
+            if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+                continue;
+
+            // child path = parent + "/" + name
+            const size_t name_len = strlen(name);
+            const size_t len = d->len ? d->len + 1 + name_len : name_len;
+            if (len > MAX_PATH_LENGTH)
+            {
+                fprintf(stderr, "Path is too long: %s/%s. Skip.\n", d->path, name);
+                continue;
+            }
+            size_t p = d->len;
+            if (d->len)
+                path[p++] = '/';
+            memcpy(path + p, name, name_len + 1);
+
+            int type = e->d_type;
+            struct stat st;
+            if (type == DT_UNKNOWN || type == DT_REG)
+            {
+                // some file systems don't fill d_type
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW))
+                    continue; // gone
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            if (type == DT_REG)
+            {
+                if (w->visit(w->arg, ww->id, path, len, WALK_FILE, &st))
+                    goto WALK_SCAN_STOP;
+            }
+            else if (type == DT_DIR)
+            {
+                char *child = malloc(len + 1);
+                if (!child)
+                {
+                    fprintf(stderr, "Failed to malloc.\n");
+                    goto WALK_SCAN_STOP;
+                }
+                memcpy(child, path, len + 1);
+                if (w->visit(w->arg, ww->id, path, len, WALK_DIR, NULL))
+                {
+                    free(child);
+                    goto WALK_SCAN_STOP;
+                }
+                __atomic_fetch_add(&w->pending, 1, __ATOMIC_SEQ_CST);
+                if (__walk_push(&w->queues[ww->id], child, len))
+                {
+                    __atomic_fetch_sub(&w->pending, 1, __ATOMIC_SEQ_CST);
+                    free(child);
+                    fprintf(stderr, "Failed to malloc.\n");
+                    goto WALK_SCAN_STOP;
+                }
+            }
+        }
+    }
+    close(fd);
+    return;
+WALK_SCAN_STOP:
+    __atomic_store_n(&w->stop, 1, __ATOMIC_SEQ_CST);
+    close(fd);
+}
+
+static void *__walk_worker_main(void *arg)
+{
+    struct walk_worker *ww = arg;
+    struct walker *w = ww->w;
+    char *dents = malloc(WALKER_DENTS_BUFFER_SIZE);
+    if (!dents)
+    {
+        __atomic_store_n(&w->stop, 1, __ATOMIC_SEQ_CST);
+        return NULL;
+    }
+    struct walk_dir d;
+    while (__atomic_load_n(&w->pending, __ATOMIC_SEQ_CST))
+    {
+        int found = __walk_pop_bottom(&w->queues[ww->id], &d);
+        for (int i = 1; !found && i < w->threads; ++i)
+            found = __walk_steal_top(&w->queues[(ww->id + i) % w->threads], &d);
+        if (!found)
+        {
+            // someone is still scanning, and may find more work
+            sched_yield();
+            continue;
+        }
+        if (!__atomic_load_n(&w->stop, __ATOMIC_RELAXED))
+            __walk_scan(ww, &d, dents);
+        free(d.path);
+        __atomic_fetch_sub(&w->pending, 1, __ATOMIC_SEQ_CST);
+    }
+    free(dents);
+    return NULL;
+}
+
+/**
+ * @brief Walk a directory tree with several threads. The root itself is not visited.
+ *
+ * @param root_fd the root directory.
+ * @param threads thread count, 1 to WALKER_MAX_THREADS.
+ * @param visit called for every directory and regular file, concurrently.
+ * @param arg passed to visit.
+ * @return int 0 if the whole tree is walked, non-zero if failed or stopped by visit.
+ */
+int walk_tree(int root_fd, int threads, walker_visit *visit, void *arg)
+{
+    if (threads < 1)
+        threads = 1;
+    if (threads > WALKER_MAX_THREADS)
+        threads = WALKER_MAX_THREADS;
+
+    struct walker w;
+    memset(&w, 0, sizeof(w));
+    w.root_fd = root_fd;
+    w.threads = threads;
+    w.visit = visit;
+    w.arg = arg;
+    struct walk_deque queues[WALKER_MAX_THREADS];
+    struct walk_worker workers[WALKER_MAX_THREADS];
+    pthread_t tids[WALKER_MAX_THREADS];
+    memset(queues, 0, sizeof(queues));
+    w.queues = queues;
+    for (int i = 0; i < threads; ++i)
+        pthread_mutex_init(&queues[i].lock, NULL);
+
+    char *root = strdup("");
+    w.pending = 1;
+    if (!root || __walk_push(&queues[0], root, 0))
+    {
+        free(root);
+        return -1;
+    }
+
+    int started = 0;
+    for (; started < threads; ++started)
+    {
+        workers[started].w = &w;
+        workers[started].id = started;
+        if (pthread_create(&tids[started], NULL, &__walk_worker_main, &workers[started]))
+            break;
+    }
+    if (!started)
+    {
+        // no thread at all, walk in this one
+        workers[0].w = &w;
+        workers[0].id = 0;
+        __walk_worker_main(&workers[0]);
+    }
+    for (int i = 0; i < started; ++i)
+        pthread_join(tids[i], NULL);
+
+    for (int i = 0; i < threads; ++i)
+    {
+        // leftovers if stopped early
+        for (size_t j = queues[i].head; j < queues[i].tail; ++j)
+            free(queues[i].items[j].path);
+        free(queues[i].items);
+        pthread_mutex_destroy(&queues[i].lock);
+    }
+    return w.stop ? -1 : 0;
+}
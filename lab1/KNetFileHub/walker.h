@@ -0,0 +1,42 @@
+#ifndef __WALKER_H
+#define __WALKER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* configurations */
+#define WALKER_MAX_THREADS 16
+#define WALKER_DENTS_BUFFER_SIZE 65536 /* getdents64 buffer per thread */
+
+#define WALK_DIR 1
+#define WALK_FILE 2
+
+/*
+
+Parallel File System Walker:
+    Every thread owns a deque of directories to scan. A thread scans the
+    directory on the bottom of its own deque, pushing subdirectories it
+    finds back to the bottom (depth first, good locality). A thread with
+    nothing to do steals from the top of the other threads' deques, which
+    are the directories closest to the root, i.e. the largest chunks of
+    work. The walk ends when no directory is queued or being scanned.
+    Directories are read with getdents64 into a large buffer, and only
+    regular files are fstatat'ed. Symbolic links and special files are
+    skipped, so the walk never leaves the root.
+
+*/
+
+/**
+ * @brief Called for every directory and regular file found. Called from
+ *        several threads at the same time, `worker` tells which one.
+ *
+ * @return int 0 to continue, non-zero to stop the walk.
+ */
+typedef int (walker_visit)(void *arg, int worker, const char *path, size_t path_len, int type, const struct stat *st);
+
+int walker_default_threads(void);
+int walk_tree(int root_fd, int threads, walker_visit *visit, void *arg);
+
+#endif
@@ -0,0 +1,416 @@
+/*
+ * Times every stage of SuperPcap on capture files: reading them (libpcap,
+ * through the file backend of capture.h), decoding the headers
+ * (decode_packet()), rendering the text (format_frame()), and the whole
+ * pipeline with its decoder threads writing to /dev/null, writing the
+ * packets to a pcap file on /dev/null (see dump.h), and counting them into
+ * flows (see flow.h). A pcap file is then
+ * read again by the parallel offline reader (see offline.h), for its header
+ * statistics, and for its text.
+ * The file is read once into memory, then every later stage runs over those
+ * packets as many times as it takes BENCH_MIN_TIME, so the disk is timed by
+ * the first stage only. A BPF filter (-f) and a match filter (-m, see
+ * filter.h) are timed over the packets too, if given.
+ * Usage: sp_bench [-j decoder threads] [-f expression] [-m match] <file>...
+ * `make bench` writes synthetic files with sp_synthpcap (see synthpcap.c) and
+ * runs this on them.
+ */
+
+#include "util.h"
+#include "capture.h"
+#include "decode.h"
+#include "format.h"
+#include "pipeline.h"
+#include "offline.h"
+#include "dump.h"
+#include "filter.h"
+#include "flow.h"
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_MIN_TIME 500000000ULL /* ns, the least a stage runs */
+
+// the packets of a file, a pcap header then the data, 8-aligned, one after another
+struct corpus
+{
+    uint8_t *buf;
+    size_t len;
+    size_t cap;
+    uint64_t packets;
+    uint64_t bytes;         // captured
+    int failed;
+};
+
+static void print_usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-j decoder threads] [-f expression] [-m match] <file>...\n", name);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void keep(u_char *user, const struct pcap_pkthdr *h, const u_char *packet)
+{
+    struct corpus *c = (struct corpus *)user;
+    const size_t need = (sizeof(*h) + h->caplen + 7) & ~(size_t)7;
+    if (c->len + need > c->cap)
+    {
+        const size_t cap = c->cap ? c->cap * 2 : 1U << 24;
+        uint8_t *buf = realloc(c->buf, cap);
+        if (!buf)
+        {
+            c->failed = 1;
+            return;
+        }
+        c->buf = buf;
+        c->cap = cap;
+    }
+    memcpy(c->buf + c->len, h, sizeof(*h));
+    memcpy(c->buf + c->len + sizeof(*h), packet, h->caplen);
+    c->len += need;
+    ++c->packets;
+    c->bytes += h->caplen;
+}
+
+#define FOR_EACH_PACKET(c, h, packet) \
+    for (size_t __off = 0; __off < (c)->len \
+        && ((h) = (const struct pcap_pkthdr *)((c)->buf + __off), (packet) = (const u_char *)((h) + 1), 1); \
+        __off += (sizeof(*(h)) + (h)->caplen + 7) & ~(size_t)7)
+
+static void print_stage(const char *name, uint64_t packets, uint64_t bytes, uint64_t ns)
+{
+    const double seconds = ns / 1.0E9;
+    printf("  %-9s %12.0f packets/s %10.1f MB/s %9.1f ns/packet\n",
+        name, packets / seconds, bytes / seconds / 1.0E6, (double)ns / packets);
+}
+
+static int read_file(const char *file, struct corpus *c)
+{
+    char errbuf[PCAP_ERRBUF_SIZE];
+    struct capture_config cfg;
+    capture_default_config(&cfg);
+    cfg.backend = BACKEND_FILE;
+    cfg.file = file;
+    cfg.stats_interval = 0;
+    capture *cap = capture_open(&cfg, errbuf);
+    if (!cap)
+    {
+        fprintf(stderr, "Cannot read file %s: %s\n", file, errbuf);
+        return -1;
+    }
+    if (capture_datalink(cap) != DLT_EN10MB)
+    {
+        fprintf(stderr, "%s: unsupported link-layer protocol: %d.\n", file, capture_datalink(cap));
+        capture_close(cap);
+        return -1;
+    }
+    const uint64_t start = now_ns();
+    const int failed = capture_loop(cap, keep, NULL, (u_char *)c);
+    const uint64_t ns = now_ns() - start;
+    capture_close(cap);
+    if (failed || c->failed || !c->packets)
+    {
+        fprintf(stderr, "%s: %s\n", file, c->failed ? "out of memory" : failed ? "cannot read" : "no packets");
+        return -1;
+    }
+    print_stage("read", c->packets, c->bytes, ns);
+    return 0;
+}
+
+static void bench_decode(const struct corpus *c)
+{
+    const struct pcap_pkthdr *h;
+    const u_char *packet;
+    struct decoded_packet d;
+    uint64_t layers[8] = {0};
+    uint64_t passes = 0;
+    const uint64_t start = now_ns();
+    uint64_t ns;
+    do
+    {
+        FOR_EACH_PACKET(c, h, packet)
+        {
+            const int decoded = decode_packet(packet, h->caplen, h->len, &d);
+            for (int j = 0; j != 8; ++j)
+                layers[j] += decoded >> j & 1;
+        }
+        ++passes;
+    } while ((ns = now_ns() - start) < BENCH_MIN_TIME);
+    print_stage("decode", c->packets * passes, c->bytes * passes, ns);
+    printf("            %" PRIu64 " IPv4, %" PRIu64 " IPv6, %" PRIu64 " TCP, %" PRIu64 " UDP, %" PRIu64
+        " ICMP, %" PRIu64 " truncated per pass\n", layers[1] / passes, layers[2] / passes, layers[3] / passes,
+        layers[4] / passes, layers[5] / passes, layers[7] / passes);
+}
+
+static int bench_format(const struct corpus *c, FILE *null)
+{
+    const struct pcap_pkthdr *h;
+    const u_char *packet;
+    struct text t;
+    memset(&t, 0, sizeof(t));
+    uint64_t passes = 0;
+    uint64_t text = 0;
+    const uint64_t start = now_ns();
+    uint64_t ns;
+    do
+    {
+        FOR_EACH_PACKET(c, h, packet)
+        {
+            if (format_frame(&t, h, packet))
+            {
+                perror("Failed to malloc");
+                text_free(&t);
+                return -1;
+            }
+            if (t.len >= FORMAT_FLUSH_SIZE << 10)
+            {
+                fwrite(t.buf, 1, t.len, null);
+                text += t.len;
+                t.len = 0;
+            }
+        }
+        ++passes;
+    } while ((ns = now_ns() - start) < BENCH_MIN_TIME);
+    fwrite(t.buf, 1, t.len, null);
+    text += t.len;
+    ns = now_ns() - start;
+    print_stage("format", c->packets * passes, c->bytes * passes, ns);
+    printf("            %.1f MB/s of text\n", text / (ns / 1.0E9) / 1.0E6);
+    text_free(&t);
+    return 0;
+}
+
+static int bench_pipeline(const struct corpus *c, int workers, FILE *null)
+{
+    const struct pcap_pkthdr *h;
+    const u_char *packet;
+    struct pipeline_config cfg;
+    pipeline_default_config(&cfg);
+    if (workers >= 0)
+        cfg.workers = workers;
+    cfg.decode = format_frame;
+    cfg.out = null;
+    pipeline *p = pipeline_start(&cfg);
+    if (!p)
+        return -1;
+    uint64_t passes = 0;
+    const uint64_t start = now_ns();
+    do
+    {
+        FOR_EACH_PACKET(c, h, packet)
+            pipeline_handler((u_char *)p, h, packet);
+        ++passes;
+    } while (now_ns() - start < BENCH_MIN_TIME);
+    const int failed = pipeline_stop(p);
+    const uint64_t ns = now_ns() - start;
+    print_stage("pipeline", c->packets * passes, c->bytes * passes, ns);
+    printf("            %d decoder threads\n", cfg.workers);
+    pipeline_free(p);
+    return failed;
+}
+
+static int bench_dump(const struct corpus *c)
+{
+    const struct pcap_pkthdr *h;
+    const u_char *packet;
+    char errbuf[PCAP_ERRBUF_SIZE];
+    struct dump_config cfg;
+    dump_default_config(&cfg);
+    cfg.file = "/dev/null";
+    dump *d = dump_open(&cfg, errbuf);
+    if (!d)
+    {
+        fprintf(stderr, "%s\n", errbuf);
+        return -1;
+    }
+    uint64_t passes = 0;
+    const uint64_t start = now_ns();
+    do
+    {
+        FOR_EACH_PACKET(c, h, packet)
+            dump_handler((u_char *)d, h, packet);
+        ++passes;
+    } while (now_ns() - start < BENCH_MIN_TIME);
+    const int failed = dump_close(d);
+    const uint64_t ns = now_ns() - start;
+    struct dump_stats st;
+    dump_get_stats(d, &st);
+    dump_free(d);
+    print_stage("dump", c->packets * passes, c->bytes * passes, ns);
+    printf("            %.1f MB/s of pcap file, %" PRIu64 " writes\n", st.bytes / (ns / 1.0E9) / 1.0E6, st.writes);
+    return failed;
+}
+
+static int bench_flows(const struct corpus *c, FILE *null)
+{
+    const struct pcap_pkthdr *h;
+    const u_char *packet;
+    char errbuf[PCAP_ERRBUF_SIZE];
+    struct flow_config cfg;
+    flow_default_config(&cfg);
+    cfg.out = null;
+    flows *f = flow_open(&cfg, errbuf);
+    if (!f)
+    {
+        fprintf(stderr, "%s\n", errbuf);
+        return -1;
+    }
+    uint64_t passes = 0;
+    const uint64_t start = now_ns();
+    uint64_t ns;
+    do
+    {
+        FOR_EACH_PACKET(c, h, packet)
+            flow_handler((u_char *)f, h, packet);
+        ++passes;
+    } while ((ns = now_ns() - start) < BENCH_MIN_TIME);
+    const int failed = flow_close(f);
+    struct flow_stats st;
+    flow_get_stats(f, &st);
+    flow_free(f);
+    // the same packets again are the same flows, only the first pass starts any
+    print_stage("flows", c->packets * passes, c->bytes * passes, ns);
+    printf("            %" PRIu64 " flows, %" PRIu64 " records\n", st.flows, st.records);
+    return failed;
+}
+
+static int bench_filter(const struct corpus *c, const char *bpf, const char *match)
+{
+    const struct pcap_pkthdr *h;
+    const u_char *packet;
+    char errbuf[PCAP_ERRBUF_SIZE];
+    struct bpf_program prog;
+    filter *f = NULL;
+    if (bpf && filter_compile(bpf, DLT_EN10MB, CAPTURE_SNAPLEN, &prog, errbuf))
+    {
+        fprintf(stderr, "%s\n", errbuf);
+        return -1;
+    }
+    if (match && !(f = filter_open(match, errbuf)))
+    {
+        fprintf(stderr, "%s\n", errbuf);
+        if (bpf)
+            pcap_freecode(&prog);
+        return -1;
+    }
+    for (int stage = 0; stage != 2; ++stage)
+    {
+        if (stage ? !f : !bpf)
+            continue;
+        uint64_t passes = 0, matched = 0;
+        const uint64_t start = now_ns();
+        uint64_t ns;
+        do
+        {
+            FOR_EACH_PACKET(c, h, packet)
+            {
+                const int m = stage ? filter_match(f, h, packet) : pcap_offline_filter(&prog, h, packet) != 0;
+                if (!passes)
+                    matched += m;
+            }
+            ++passes;
+        } while ((ns = now_ns() - start) < BENCH_MIN_TIME);
+        // the flows of a match filter go on from one pass to the next, the first pass is the file
+        print_stage(stage ? "match" : "bpf", c->packets * passes, c->bytes * passes, ns);
+        printf("            `%s`: %" PRIu64 " of %" PRIu64 " packets matched\n", stage ? match : bpf, matched, c->packets);
+    }
+    if (bpf)
+        pcap_freecode(&prog);
+    filter_free(f);
+    return 0;
+}
+
+static int bench_offline(const char *file, int headers_only, int workers, FILE *null)
+{
+    char errbuf[PCAP_ERRBUF_SIZE];
+    struct offline_config cfg;
+    offline_default_config(&cfg);
+    cfg.file = file;
+    if (workers >= 0)
+        cfg.workers = workers;
+    cfg.headers_only = headers_only;
+    cfg.decode = format_frame;
+    cfg.out = null;
+    offline *o = offline_open(&cfg, errbuf);
+    if (!o)
+    {
+        fprintf(stderr, "Cannot read file %s: %s\n", file, errbuf);
+        return -1;
+    }
+    const int failed = offline_run(o);
+    struct offline_stats st;
+    offline_get_stats(o, &st);
+    offline_close(o);
+    if (!failed && st.packets)
+        print_stage(headers_only ? "mmap hdrs" : "mmap text", st.packets, st.captured, st.ns);
+    return failed;
+}
+
+int main(int argc, char **argv)
+{
+    int workers = -1;
+    const char *bpf = NULL;
+    const char *match = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:f:m:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'j':
+                workers = atoi(optarg);
+                break;
+            case 'f':
+                bpf = optarg;
+                break;
+            case 'm':
+                match = optarg;
+                break;
+            default:
+                print_usage(argv[0]);
+                return -1;
+        }
+    }
+    if (optind >= argc)
+    {
+        print_usage(argv[0]);
+        return -1;
+    }
+    FILE *null = fopen("/dev/null", "w");
+    if (!null)
+    {
+        perror("Cannot open /dev/null");
+        return -1;
+    }
+
+    int failed = 0;
+    for (int i = optind; !failed && i != argc; ++i)
+    {
+        struct corpus c;
+        memset(&c, 0, sizeof(c));
+        printf("%s:\n", argv[i]);
+        failed = read_file(argv[i], &c);
+        if (!failed)
+        {
+            printf("            %" PRIu64 " packets, %.1f MB, %.0f bytes/packet\n",
+                c.packets, c.bytes / 1.0E6, (double)c.bytes / c.packets);
+            bench_decode(&c);
+            failed = bench_format(&c, null) || bench_pipeline(&c, workers, null) || bench_dump(&c)
+                || bench_flows(&c, null) || bench_filter(&c, bpf, match);
+        }
+        if (!failed && offline_probe(argv[i]))
+        {
+            failed = bench_offline(argv[i], 1, workers, null) || bench_offline(argv[i], 0, workers, null);
+            printf("            read from the page cache, by the parallel offline reader\n");
+        }
+        free(c.buf);
+    }
+    fclose(null);
+    return failed ? -1 : 0;
+}
@@ -0,0 +1,161 @@
+/*
+ * Sends synthetic UDP frames on an interface at a given rate, to see if a
+ * capture keeps up. Frames go out through a packet socket, many per
+ * sendmmsg(), around the qdisc, from 256 source ports (so 256 flows).
+ * Usage: sp_blast <interface> <packets per second> <seconds> [frame size]
+ * A test rig without a NIC, as root:
+ *     ip link add sp0 type veth peer name sp1
+ *     ip link set sp0 up; ip link set sp1 up
+ *     ./spcap -R -S 1 ... (capture on sp1)     ./sp_blast sp0 1000000 10
+ * The kernel's drop counters are printed by SuperPcap every second.
+ */
+
+#define _GNU_SOURCE
+#include "util.h"
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <linux/if_packet.h>
+
+#define BATCH 64           /* frames per sendmmsg() */
+#define FLOWS 256
+#define MIN_FRAME 60
+#define MAX_FRAME 1514
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint16_t ip_checksum(const void *p, size_t n)
+{
+    const uint16_t *w = p;
+    uint32_t sum = 0;
+    for (; n > 1; n -= 2)
+        sum += *w++;
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    return ~sum;
+}
+
+// an Ethernet frame with an IPv4 UDP datagram from 10.0.0.1:<port> to 10.0.0.2:9
+static void make_frame(uint8_t *f, size_t size, uint16_t sport)
+{
+    memset(f, 0, size);
+    struct ether_header *eth = (struct ether_header *)f;
+    memset(eth->ether_dhost, 0xFF, ETH_ALEN);
+    const uint8_t src[ETH_ALEN] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+    memcpy(eth->ether_shost, src, ETH_ALEN);
+    eth->ether_type = htons(ETHERTYPE_IP);
+    struct iphdr *ip = (struct iphdr *)(f + sizeof(*eth));
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->tot_len = htons(size - sizeof(*eth));
+    ip->ttl = 64;
+    ip->protocol = IPPROTO_UDP;
+    ip->saddr = htonl(0x0A000001);
+    ip->daddr = htonl(0x0A000002);
+    ip->check = ip_checksum(ip, sizeof(*ip));
+    struct udphdr *udp = (struct udphdr *)(ip + 1);
+    udp->uh_sport = htons(sport);
+    udp->uh_dport = htons(9);
+    udp->uh_ulen = htons(size - sizeof(*eth) - sizeof(*ip));
+    for (size_t i = sizeof(*eth) + sizeof(*ip) + sizeof(*udp); i < size; ++i)
+        f[i] = (uint8_t)i;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 4 || argc > 5)
+    {
+        fprintf(stderr, "Usage: %s <interface> <packets per second> <seconds> [frame size]\n", argv[0]);
+        return -1;
+    }
+    const unsigned int ifindex = if_nametoindex(argv[1]);
+    const double rate = atof(argv[2]);
+    const double seconds = atof(argv[3]);
+    const size_t size = argc == 5 ? (size_t)atoi(argv[4]) : MIN_FRAME;
+    if (!ifindex || rate <= 0 || seconds <= 0 || size < MIN_FRAME || size > MAX_FRAME)
+    {
+        fprintf(stderr, "Bad interface, rate, duration or frame size (%d to %d bytes).\n", MIN_FRAME, MAX_FRAME);
+        return -1;
+    }
+
+    int s = socket(AF_PACKET, SOCK_RAW, 0);
+    if (s < 0)
+    {
+        perror("socket(AF_PACKET)");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(s, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+    struct sockaddr_ll sll;
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_ifindex = ifindex;
+    sll.sll_halen = ETH_ALEN;
+    memset(sll.sll_addr, 0xFF, ETH_ALEN);
+
+    static uint8_t frames[FLOWS][MAX_FRAME];
+    for (int i = 0; i < FLOWS; ++i)
+        make_frame(frames[i], size, 10000 + i);
+    struct iovec iov[BATCH];
+    struct mmsghdr msgs[BATCH];
+    memset(msgs, 0, sizeof(msgs));
+
+    const uint64_t start = now_ns();
+    const uint64_t total = (uint64_t)(rate * seconds);
+    uint64_t sent = 0, failed = 0;
+    while (sent < total)
+    {
+        // pace: the batch may go once its last frame is due
+        const int n = total - sent < BATCH ? (int)(total - sent) : BATCH;
+        const uint64_t due = start + (uint64_t)((sent + n) * 1.0E9 / rate);
+        uint64_t now;
+        while ((now = now_ns()) < due)
+        {
+            if (due - now > 100000)
+            {
+                struct timespec ts = {0, (due - now) / 2};
+                nanosleep(&ts, NULL);
+            }
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            iov[i].iov_base = frames[(sent + i) % FLOWS];
+            iov[i].iov_len = size;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &sll;
+            msgs[i].msg_hdr.msg_namelen = sizeof(sll);
+        }
+        int r = sendmmsg(s, msgs, n, 0);
+        if (r < 0)
+        {
+            if (errno != ENOBUFS && errno != EAGAIN && errno != EINTR)
+            {
+                perror("sendmmsg() failed");
+                break;
+            }
+            // the device queue is full, the frames are lost like on a wire
+            failed += n;
+            r = n;
+        }
+        sent += r;
+    }
+    const double elapsed = (now_ns() - start) / 1.0E9;
+    printf("Sent %" PRIu64 " frames of %zu bytes in %.2fs (%.0f packets/s), %" PRIu64 " refused by the device.\n",
+        sent - failed, size, elapsed, (sent - failed) / elapsed, failed);
+    close(s);
+    return 0;
+}
@@ -0,0 +1,584 @@
+#include "capture.h"
+#include "util.h"
+
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <net/ethernet.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+
+#define POLL_TIMEOUT 100 /* ms, how often a waiting capture checks for a stop or a report */
+
+struct capture
+{
+    struct capture_config cfg;
+    volatile sig_atomic_t stop;
+    pcap_t *pcap;               // BACKEND_PCAP
+    int fd;                     // BACKEND_RING, the packet socket
+    uint8_t *ring;
+    unsigned int block_count;
+    unsigned int block;         // the next block to read
+    uint8_t *frame;             // a packet with its VLAN tag put back
+    struct bpf_program prog;    // BACKEND_FILE, run by __filter_file()
+    struct filter_stats filter;
+    uint64_t if_packets;        // of the interface when opened, 0 if not known
+    pcap_handler handler;       // BACKEND_FILE with a filter, for the packets that match
+    u_char *user;
+    struct capture_stats total;
+    // the last report
+    uint64_t report_ns;
+    struct capture_stats reported;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Fill in the defaults of a capture configuration.
+ *
+ * @param cfg the configuration.
+ */
+void capture_default_config(struct capture_config *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->backend = BACKEND_PCAP;
+    cfg->ring_size = (size_t)CAPTURE_RING_SIZE << 20;
+    cfg->block_size = (size_t)CAPTURE_BLOCK_SIZE << 10;
+    cfg->timeout = CAPTURE_TIMEOUT;
+    cfg->snaplen = CAPTURE_SNAPLEN;
+    cfg->stats_interval = CAPTURE_STATS_INTERVAL;
+}
+
+// share the packets of the interface with the other sockets of the group
+static int __join_fanout(capture *c, int fd, char *errbuf)
+{
+    if (!c->cfg.fanout_group)
+        return 0;
+    const int mode = c->cfg.fanout_mode == FANOUT_CPU ? PACKET_FANOUT_CPU : PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG;
+    const int arg = (c->cfg.fanout_group & 0xFFFF) | mode << 16;
+    if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)))
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "Cannot join fanout group %d: %s", c->cfg.fanout_group, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// packets the interface received and sent, which a packet socket sees, 0 if not known
+static uint64_t __interface_packets(const char *iface)
+{
+    static const char *const directions[2] = {"rx", "tx"};
+    uint64_t sum = 0;
+    for (int i = 0; i != 2; ++i)
+    {
+        char path[96];
+        unsigned long long n;
+        snprintf(path, sizeof(path), "/sys/class/net/%.*s/statistics/%s_packets", IFNAMSIZ, iface, directions[i]);
+        FILE *fp = fopen(path, "r");
+        if (!fp)
+            return 0;
+        const int read = fscanf(fp, "%llu", &n) == 1;
+        fclose(fp);
+        if (!read)
+            return 0;
+        sum += n;
+    }
+    return sum;
+}
+
+static int __open_pcap(capture *c, char *errbuf)
+{
+    const struct capture_config *cfg = &c->cfg;
+    if (!(c->pcap = pcap_create(cfg->iface, errbuf)))
+        return -1;
+    pcap_set_snaplen(c->pcap, cfg->snaplen);
+    pcap_set_timeout(c->pcap, cfg->timeout);
+    pcap_set_buffer_size(c->pcap, cfg->ring_size > INT32_MAX ? INT32_MAX : (int)cfg->ring_size);
+    pcap_set_immediate_mode(c->pcap, cfg->immediate);
+    int err = pcap_activate(c->pcap);
+    if (err < 0)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s: %s", pcap_statustostr(err), pcap_geterr(c->pcap));
+        pcap_close(c->pcap);
+        c->pcap = NULL;
+        return -1;
+    }
+    if (err > 0)
+        fprintf(stderr, "Warning: %s: %s\n", pcap_statustostr(err), pcap_geterr(c->pcap));
+    if (cfg->filter)
+    {
+        // libpcap attaches the program to its socket, and keeps a copy
+        struct bpf_program prog;
+        if (pcap_compile(c->pcap, &prog, cfg->filter, 1, PCAP_NETMASK_UNKNOWN))
+        {
+            snprintf(errbuf, PCAP_ERRBUF_SIZE, "Bad filter: %s", pcap_geterr(c->pcap));
+            goto PCAP_FAILED;
+        }
+        c->filter.instructions = prog.bf_len;
+        err = pcap_setfilter(c->pcap, &prog);
+        pcap_freecode(&prog);
+        if (err)
+        {
+            snprintf(errbuf, PCAP_ERRBUF_SIZE, "Cannot set the filter: %s", pcap_geterr(c->pcap));
+            goto PCAP_FAILED;
+        }
+    }
+    if (__join_fanout(c, pcap_fileno(c->pcap), errbuf))
+        goto PCAP_FAILED;
+    return 0;
+
+PCAP_FAILED:
+    pcap_close(c->pcap);
+    c->pcap = NULL;
+    return -1;
+}
+
+static int __open_file(capture *c, char *errbuf)
+{
+    if (c->cfg.fanout_group)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "A file cannot be read by a fanout group.");
+        return -1;
+    }
+    if (!(c->pcap = pcap_open_offline(c->cfg.file, errbuf)))
+        return -1;
+    // run here rather than by pcap_setfilter(), to count what it drops and time it
+    if (c->cfg.filter && filter_compile(c->cfg.filter, pcap_datalink(c->pcap), pcap_snapshot(c->pcap), &c->prog, errbuf))
+    {
+        pcap_close(c->pcap);
+        c->pcap = NULL;
+        return -1;
+    }
+    c->filter.instructions = c->prog.bf_len;
+    return 0;
+}
+
+static int __open_ring(capture *c, char *errbuf)
+{
+    const struct capture_config *cfg = &c->cfg;
+    const long page = sysconf(_SC_PAGESIZE);
+    if (cfg->block_size < (size_t)page || cfg->block_size & (cfg->block_size - 1)
+        || cfg->block_size < (size_t)cfg->snaplen + TPACKET3_HDRLEN + 64 || cfg->ring_size < cfg->block_size)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "The block size must be a power of 2, at least a page and "
+            "the snapshot length, and no more than the ring.");
+        return -1;
+    }
+    const unsigned int ifindex = if_nametoindex(cfg->iface);
+    if (!ifindex)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "No such interface: %s", cfg->iface);
+        return -1;
+    }
+    if ((c->fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, htons(ETH_P_ALL))) < 0)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "socket(AF_PACKET): %s", strerror(errno));
+        return -1;
+    }
+
+    // the kernel copies no more than the snapshot length into the ring, the filter returns it for a match
+    struct sock_filter snap = BPF_STMT(BPF_RET | BPF_K, cfg->snaplen);
+    struct sock_fprog prog = {1, &snap};
+    struct bpf_program bp;
+    memset(&bp, 0, sizeof(bp));
+    if (cfg->filter)
+    {
+        if (filter_compile(cfg->filter, DLT_EN10MB, cfg->snaplen, &bp, errbuf))
+        {
+            close(c->fd);
+            c->fd = -1;
+            return -1;
+        }
+        // struct bpf_insn is laid out like struct sock_filter
+        prog.len = bp.bf_len;
+        prog.filter = (struct sock_filter *)bp.bf_insns;
+        c->filter.instructions = bp.bf_len;
+    }
+    int version = TPACKET_V3;
+    struct tpacket_req3 req;
+    memset(&req, 0, sizeof(req));
+    c->block_count = cfg->ring_size / cfg->block_size;
+    req.tp_block_size = cfg->block_size;
+    req.tp_block_nr = c->block_count;
+    req.tp_frame_size = cfg->block_size; // frames mean nothing in TPACKET_V3, but must fit in the blocks
+    req.tp_frame_nr = c->block_count;
+    req.tp_retire_blk_tov = cfg->immediate ? 1 : cfg->timeout;
+    const int attached = setsockopt(c->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+    if (cfg->filter)
+        pcap_freecode(&bp);
+    if (attached)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "Cannot attach the filter: %s", strerror(errno));
+        goto RING_FAILED;
+    }
+    if (setsockopt(c->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version))
+        || setsockopt(c->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)))
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "Cannot set up a TPACKET_V3 ring of %u blocks of %zu bytes: %s",
+            c->block_count, cfg->block_size, strerror(errno));
+        goto RING_FAILED;
+    }
+    if ((c->ring = mmap(NULL, (size_t)c->block_count * cfg->block_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, c->fd, 0)) == MAP_FAILED)
+    {
+        c->ring = NULL;
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "Cannot map the ring: %s", strerror(errno));
+        goto RING_FAILED;
+    }
+    // bound last, so no packet comes before the ring is there
+    struct sockaddr_ll sll;
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = ifindex;
+    if (bind(c->fd, (struct sockaddr *)&sll, sizeof(sll)))
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "Cannot bind to %s: %s", cfg->iface, strerror(errno));
+        goto RING_FAILED;
+    }
+    if (__join_fanout(c, c->fd, errbuf))
+        goto RING_FAILED;
+    if (!(c->frame = malloc(cfg->snaplen + 4)))
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "Failed to malloc.");
+        goto RING_FAILED;
+    }
+    return 0;
+
+RING_FAILED:
+    if (c->ring)
+        munmap(c->ring, (size_t)c->block_count * cfg->block_size);
+    c->ring = NULL;
+    close(c->fd);
+    c->fd = -1;
+    return -1;
+}
+
+/**
+ * @brief Open an interface to capture on, or a file to read.
+ *
+ * @param cfg the configuration, copied.
+ * @param errbuf PCAP_ERRBUF_SIZE bytes, to tell what failed.
+ * @return capture* the capture, NULL if failed.
+ */
+capture *capture_open(const struct capture_config *cfg, char *errbuf)
+{
+    capture *c = calloc(1, sizeof(capture));
+    if (!c)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "Failed to malloc.");
+        return NULL;
+    }
+    c->cfg = *cfg;
+    c->fd = -1;
+    const int err = cfg->backend == BACKEND_RING ? __open_ring(c, errbuf)
+        : cfg->backend == BACKEND_FILE ? __open_file(c, errbuf) : __open_pcap(c, errbuf);
+    if (err)
+    {
+        free(c);
+        return NULL;
+    }
+    if (cfg->filter && cfg->backend != BACKEND_FILE)
+        c->if_packets = __interface_packets(cfg->iface);
+    c->report_ns = now_ns();
+    return c;
+}
+
+/**
+ * @brief Get the link-layer type of a capture.
+ *
+ * @param c the capture.
+ * @return int DLT_* type, -1 if it is not known.
+ */
+int capture_datalink(capture *c)
+{
+    if (c->pcap)
+        return pcap_datalink(c->pcap);
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, c->cfg.iface, IFNAMSIZ - 1);
+    if (ioctl(c->fd, SIOCGIFHWADDR, &ifr))
+        return -1;
+    // a loopback interface has Ethernet headers of zeros
+    const int type = ifr.ifr_hwaddr.sa_family;
+    return type == ARPHRD_ETHER || type == ARPHRD_LOOPBACK ? DLT_EN10MB : -1;
+}
+
+static int __dispatch_ring(capture *c, pcap_handler handler, u_char *user)
+{
+    struct tpacket_block_desc *bd = (struct tpacket_block_desc *)(c->ring + (size_t)c->block * c->cfg.block_size);
+    if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+    {
+        struct pollfd pfd = {c->fd, POLLIN | POLLERR, 0};
+        if (poll(&pfd, 1, POLL_TIMEOUT) < 0 && errno != EINTR)
+        {
+            perror("poll() failed");
+            return -1;
+        }
+        return 0;
+    }
+
+    // walk the packets of the block in place
+    const uint32_t count = bd->hdr.bh1.num_pkts;
+    const struct tpacket3_hdr *h = (const struct tpacket3_hdr *)((uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        struct pcap_pkthdr ph;
+        ph.ts.tv_sec = h->tp_sec;
+        ph.ts.tv_usec = h->tp_nsec / 1000;
+        ph.caplen = h->tp_snaplen;
+        ph.len = h->tp_len;
+        const u_char *data = (const u_char *)h + h->tp_mac;
+        if (h->tp_status & TP_STATUS_VLAN_VALID && ph.caplen >= 2 * ETH_ALEN)
+        {
+            // the NIC took the VLAN tag off, put it back like libpcap does
+            const uint16_t tpid = htons(h->tp_status & TP_STATUS_VLAN_TPID_VALID ? h->hv1.tp_vlan_tpid : ETH_P_8021Q);
+            const uint16_t tci = htons(h->hv1.tp_vlan_tci);
+            const uint32_t caplen = ph.caplen + 4 > (uint32_t)c->cfg.snaplen ? c->cfg.snaplen - 4 : ph.caplen;
+            memcpy(c->frame, data, 2 * ETH_ALEN);
+            memcpy(c->frame + 2 * ETH_ALEN, &tpid, 2);
+            memcpy(c->frame + 2 * ETH_ALEN + 2, &tci, 2);
+            memcpy(c->frame + 2 * ETH_ALEN + 4, data + 2 * ETH_ALEN, caplen - 2 * ETH_ALEN);
+            ph.caplen = caplen + 4;
+            ph.len += 4;
+            data = c->frame;
+        }
+        handler(user, &ph, data);
+        h = (const struct tpacket3_hdr *)((const uint8_t *)h + h->tp_next_offset);
+    }
+
+    // give the block back
+    __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+    c->block = (c->block + 1) % c->block_count;
+    return count;
+}
+
+// a packet of a file, handed over if it matches the filter
+static void __filter_file(u_char *user, const struct pcap_pkthdr *h, const u_char *packet)
+{
+    capture *c = (capture *)user;
+    if (filter_bpf(&c->prog, &c->filter, h, packet))
+        c->handler(c->user, h, packet);
+}
+
+/**
+ * @brief Hand the packets that are ready to a handler, waiting a while if there are none.
+ *
+ * @param c the capture.
+ * @param handler called for each packet.
+ * @param user passed to the handler.
+ * @return int the number of packets, -1 if failed, -2 if stopped or at the end of the file.
+ */
+int capture_dispatch(capture *c, pcap_handler handler, u_char *user)
+{
+    if (c->stop)
+        return -2;
+    // -1 reads a whole file at once, with no report and no stop until its end
+    const int count = c->cfg.backend == BACKEND_FILE ? CAPTURE_FILE_BATCH : -1;
+    const uint64_t matched = c->filter.matched;
+    int n;
+    if (c->prog.bf_insns)
+    {
+        c->handler = handler;
+        c->user = user;
+        n = pcap_dispatch(c->pcap, count, __filter_file, (u_char *)c);
+    }
+    else
+        n = c->pcap ? pcap_dispatch(c->pcap, count, handler, user) : __dispatch_ring(c, handler, user);
+    if (n == -1 && c->pcap)
+        fprintf(stderr, "Capture failed: %s\n", pcap_geterr(c->pcap));
+    if (n == 0 && c->cfg.backend == BACKEND_FILE)
+        c->stop = 1;
+    // the packets of a file that do not match were read, not captured
+    if (n > 0 && c->prog.bf_insns)
+        n = c->filter.matched - matched;
+    if (n > 0)
+        __atomic_add_fetch(&c->total.captured, n, __ATOMIC_RELAXED); // read by the statistics of a group
+    return c->stop ? -2 : n;
+}
+
+/**
+ * @brief Capture until stopped or failed, and print the statistics every `stats_interval` seconds.
+ *
+ * @param c the capture.
+ * @param handler called for each packet.
+ * @param idle called after each dispatch, even with no packets, may be NULL.
+ * @param user passed to the handler and to `idle`.
+ * @return int 0 if stopped or at the end of the file, -1 if failed.
+ */
+int capture_loop(capture *c, pcap_handler handler, void (*idle)(u_char *), u_char *user)
+{
+    const uint64_t interval = c->cfg.stats_interval * 1000000000ULL;
+    int n;
+    while ((n = capture_dispatch(c, handler, user)) >= 0)
+    {
+        if (idle)
+            idle(user);
+        if (interval && now_ns() - c->report_ns >= interval)
+            capture_print_stats(c, stderr);
+    }
+    return n == -2 ? 0 : -1;
+}
+
+/**
+ * @brief Stop capturing. Safe to call from a signal handler.
+ *
+ * @param c the capture.
+ */
+void capture_break(capture *c)
+{
+    c->stop = 1;
+    if (c->pcap)
+        pcap_breakloop(c->pcap);
+}
+
+/**
+ * @brief Get the statistics of a capture since it was opened.
+ * Safe to call from another thread than the one capturing, but from one thread only.
+ *
+ * @param c the capture.
+ * @param st the statistics.
+ * @return int 0 if success, -1 if the kernel's counters cannot be read.
+ */
+int capture_stats(capture *c, struct capture_stats *st)
+{
+    if (c->cfg.backend == BACKEND_FILE)
+    {
+        // a file has no kernel counters, every packet in it was seen
+        c->total.received = c->prog.bf_insns ? c->filter.packets : __atomic_load_n(&c->total.captured, __ATOMIC_RELAXED);
+    }
+    else if (c->pcap)
+    {
+        // 32-bit counters, which wrap on a long capture at a high rate
+        struct pcap_stat ps;
+        if (pcap_stats(c->pcap, &ps))
+            return -1;
+        c->total.received = ps.ps_recv;
+        c->total.dropped = ps.ps_drop;
+        c->total.if_dropped = ps.ps_ifdrop;
+    }
+    else
+    {
+        // the kernel clears its counters when they are read
+        struct tpacket_stats_v3 ks;
+        socklen_t len = sizeof(ks);
+        if (getsockopt(c->fd, SOL_PACKET, PACKET_STATISTICS, &ks, &len))
+            return -1;
+        c->total.received += ks.tp_packets;
+        c->total.dropped += ks.tp_drops;
+    }
+    *st = c->total;
+    st->captured = __atomic_load_n(&c->total.captured, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * @brief Get how many packets the filter of a capture let through, of how many, and what it cost in user space.
+ * Call it when the capture is stopped.
+ *
+ * @param c the capture.
+ * @param st the statistics of the filter, `packets` 0 if the interface does not tell.
+ * @return int 0 if success, -1 if the capture has no filter.
+ */
+int capture_filter_stats(capture *c, struct filter_stats *st)
+{
+    if (!c->cfg.filter)
+        return -1;
+    *st = c->filter;
+    if (c->cfg.backend == BACKEND_FILE)
+        return 0;
+    // the kernel counts only the packets its filter let through
+    struct capture_stats cs;
+    if (!capture_stats(c, &cs))
+        st->matched = cs.received;
+    const uint64_t now = __interface_packets(c->cfg.iface);
+    st->packets = c->if_packets && now > c->if_packets ? now - c->if_packets : 0;
+    return 0;
+}
+
+static void __print_stats(FILE *fp, const char *label, const struct capture_stats *st,
+    const struct capture_stats *reported, double seconds)
+{
+    fprintf(fp, "[%s] %" PRIu64 " packets captured, %" PRIu64 " received, %" PRIu64 " dropped (%.3f%%)",
+        label, st->captured, st->received, st->dropped, st->received ? st->dropped * 100.0 / st->received : 0);
+    if (st->if_dropped)
+        fprintf(fp, ", %" PRIu64 " dropped by the interface", st->if_dropped);
+    fprintf(fp, "; last %.1fs: %.0f packets/s, %" PRIu64 " dropped\n", seconds,
+        seconds > 0 ? (st->captured - reported->captured) / seconds : 0, st->dropped - reported->dropped);
+}
+
+/**
+ * @brief Print what was captured and dropped since the capture was opened, and since the last report.
+ *
+ * @param c the capture.
+ * @param fp where to print.
+ */
+void capture_print_stats(capture *c, FILE *fp)
+{
+    capture_print_group_stats(&c, 1, "stats", fp);
+}
+
+/**
+ * @brief Print the statistics of several captures added up, like capture_print_stats() does for one.
+ *
+ * @param cs the captures, a fanout group.
+ * @param n how many.
+ * @param label printed in brackets before the statistics.
+ * @param fp where to print.
+ */
+void capture_print_group_stats(capture **cs, int n, const char *label, FILE *fp)
+{
+    struct capture_stats sum, reported;
+    memset(&sum, 0, sizeof(sum));
+    memset(&reported, 0, sizeof(reported));
+    const uint64_t now = now_ns();
+    for (int i = 0; i != n; ++i)
+    {
+        struct capture_stats st;
+        if (capture_stats(cs[i], &st))
+        {
+            fprintf(fp, "[%s] Cannot read the kernel's counters: %s\n", label, strerror(errno));
+            return;
+        }
+        sum.captured += st.captured;
+        sum.received += st.received;
+        sum.dropped += st.dropped;
+        if (st.if_dropped > sum.if_dropped)
+            sum.if_dropped = st.if_dropped; // the same interface, counted once
+        reported.captured += cs[i]->reported.captured;
+        reported.dropped += cs[i]->reported.dropped;
+        cs[i]->reported = st;
+    }
+    __print_stats(fp, label, &sum, &reported, (now - cs[0]->report_ns) / 1.0E9);
+    for (int i = 0; i != n; ++i)
+        cs[i]->report_ns = now;
+}
+
+void capture_close(capture *c)
+{
+    if (!c)
+        return;
+    if (c->pcap)
+        pcap_close(c->pcap);
+    if (c->ring)
+        munmap(c->ring, (size_t)c->block_count * c->cfg.block_size);
+    if (c->fd >= 0)
+        close(c->fd);
+    if (c->prog.bf_insns)
+        pcap_freecode(&c->prog);
+    free(c->frame);
+    free(c);
+}
@@ -0,0 +1,105 @@
+#ifndef __CAPTURE_H
+#define __CAPTURE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <signal.h>
+#include <pcap/pcap.h>
+
+#include "filter.h"
+
+/* configurations */
+#define CAPTURE_RING_SIZE 256U      /* MB, the kernel ring (or the libpcap buffer) */
+#define CAPTURE_BLOCK_SIZE 4096U    /* KB, a block of the ring, a power of 2 times the page size */
+#define CAPTURE_TIMEOUT 10          /* ms, a block that is not full is handed over after this */
+#define CAPTURE_SNAPLEN 65535       /* bytes kept of every packet */
+#define CAPTURE_STATS_INTERVAL 1    /* seconds between two statistics reports, 0 for none */
+#define CAPTURE_FILE_BATCH 4096     /* packets read from a file at a time */
+
+/*
+
+Capture Backends:
+    BACKEND_PCAP: libpcap, with a buffer of `ring_size` instead of a few KB.
+        libpcap picks the block size of its ring itself.
+    BACKEND_RING: a packet socket with a TPACKET_V3 ring of `ring_size`,
+        memory-mapped, cut into blocks of `block_size`. The kernel fills one
+        block with as many packets as fit, and hands it over when it is full
+        or `timeout` ms after its first packet. The packets are read in place,
+        then the whole block is given back. One poll() per block instead of
+        one system call per packet.
+    BACKEND_FILE: a pcap or pcapng file (pcap_open_offline()), read as fast
+        as the handler takes the packets, CAPTURE_FILE_BATCH at a time. The
+        capture stops by itself at the end of the file. It needs no
+        privilege, and the same file gives the same packets every time, so
+        it is what the benchmarks read (see bench.c). No fanout, and nothing
+        is dropped.
+    Immediate mode hands every packet over at once: libpcap then uses a ring
+    of single packets, and the ring backend hands a block over after 1ms.
+    Fanout: captures on the same interface with the same `fanout_group` join
+    a PACKET_FANOUT group, and the kernel shares the packets out between
+    them instead of copying every packet to each. FANOUT_HASH keeps a flow
+    (both directions, the kernel's flow hash is symmetric) on one capture,
+    FANOUT_CPU sends a packet to capture (CPU % captures) of the CPU that
+    received it, which follows the RSS queues of the NIC. Both backends.
+    Filter: a pcap filter expression (see filter.h). libpcap attaches it to
+    its socket, the ring backend compiles it for Ethernet and attaches it
+    to its own, in place of the snapshot filter, so the kernel drops what
+    does not match before it reaches the ring. The kernel takes the VLAN
+    tag off before the filter runs, so `vlan` matches nothing on the ring
+    backend, use libpcap for it. A file is filtered in user space, and the
+    filter is timed. What the kernel let through is told against the
+    packets of the interface since it was opened (its counters in sysfs,
+    received and sent, what a packet socket sees).
+    Statistics: every `stats_interval` seconds the packets seen, and the
+    packets the kernel dropped because the ring was full, are printed to
+    stderr (pcap_stats(), or PACKET_STATISTICS).
+
+*/
+
+#define BACKEND_PCAP 0
+#define BACKEND_RING 1
+#define BACKEND_FILE 2
+
+#define FANOUT_HASH 0
+#define FANOUT_CPU 1
+
+struct capture_config
+{
+    const char *iface;
+    const char *file;       // BACKEND_FILE only
+    int backend;            // BACKEND_*
+    size_t ring_size;       // bytes
+    size_t block_size;      // bytes, BACKEND_RING only
+    int timeout;            // ms
+    int immediate;          // 1 to hand every packet over at once
+    int snaplen;
+    int stats_interval;     // seconds, 0 for no reports
+    int fanout_group;       // 1 to 65535, 0 to get every packet
+    int fanout_mode;        // FANOUT_*
+    const char *filter;     // a pcap filter expression, NULL for every packet
+};
+
+struct capture_stats
+{
+    uint64_t captured;      // handed to the handler
+    uint64_t received;      // seen by the kernel
+    uint64_t dropped;       // dropped by the kernel, the ring was full
+    uint64_t if_dropped;    // dropped by the interface, if it tells
+};
+
+typedef struct capture capture;
+
+void capture_default_config(struct capture_config *cfg);
+capture *capture_open(const struct capture_config *cfg, char *errbuf);
+int capture_datalink(capture *c);
+int capture_dispatch(capture *c, pcap_handler handler, u_char *user);
+int capture_loop(capture *c, pcap_handler handler, void (*idle)(u_char *), u_char *user);
+void capture_break(capture *c);
+int capture_stats(capture *c, struct capture_stats *st);
+int capture_filter_stats(capture *c, struct filter_stats *st);
+void capture_print_stats(capture *c, FILE *fp);
+void capture_print_group_stats(capture **cs, int n, const char *label, FILE *fp);
+void capture_close(capture *c);
+
+#endif
@@ -0,0 +1,190 @@
+#include "decode.h"
+#include "util.h"
+
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <net/ethernet.h>
+
+#define ETHERNET_HEADER 14
+#define IPV4_HEADER 20
+#define IPV6_HEADER 40
+#define TCP_HEADER 20
+#define UDP_HEADER 8
+#define ICMP_HEADER 4
+
+static inline uint16_t read16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void decode_l4(const uint8_t *p, struct decoded_packet *d)
+{
+    const uint32_t left = d->caplen - d->l4_offset;
+    const uint8_t *l4 = p + d->l4_offset;
+    switch (d->l4_proto)
+    {
+        case IPPROTO_TCP:
+            if (left < TCP_HEADER)
+                break;
+            d->layers |= DECODED_TCP;
+            d->sport = read16(l4);
+            d->dport = read16(l4 + 2);
+            d->seq = read32(l4 + 4);
+            d->ack = read32(l4 + 8);
+            d->tcp_flags = l4[13];
+            d->window = read16(l4 + 14);
+            d->l4_check = read16(l4 + 16);
+            // the options are skipped, as far as they were captured
+            uint32_t header = (l4[12] >> 4) * 4U;
+            if (header < TCP_HEADER)
+                header = TCP_HEADER;
+            d->payload_offset = d->l4_offset + (header < left ? header : left);
+            return;
+        case IPPROTO_UDP:
+            if (left < UDP_HEADER)
+                break;
+            d->layers |= DECODED_UDP;
+            d->sport = read16(l4);
+            d->dport = read16(l4 + 2);
+            d->udp_len = read16(l4 + 4);
+            d->l4_check = read16(l4 + 6);
+            d->payload_offset = d->l4_offset + UDP_HEADER;
+            return;
+        case IPPROTO_ICMP:
+        case IPPROTO_ICMPV6:
+            if (left < ICMP_HEADER)
+                break;
+            d->layers |= DECODED_ICMP;
+            d->icmp_type = l4[0];
+            d->icmp_code = l4[1];
+            d->l4_check = read16(l4 + 2);
+            d->payload_offset = d->l4_offset + ICMP_HEADER;
+            return;
+        default:
+            // unknown, all of it is payload
+            d->payload_offset = d->l4_offset;
+            return;
+    }
+    d->layers |= DECODED_TRUNCATED;
+    d->payload_offset = d->caplen;
+}
+
+/**
+ * @brief Decode the headers of an Ethernet frame, reading no more than `caplen` bytes.
+ *
+ * @param packet the frame.
+ * @param caplen bytes captured.
+ * @param len bytes of the frame on the wire.
+ * @param d the decoded packet, all of it is written.
+ * @return int DECODED_* of the layers decoded.
+ */
+int decode_packet(const uint8_t *packet, uint32_t caplen, uint32_t len, struct decoded_packet *d)
+{
+    const uint8_t *p = packet;
+    memset(d, 0, sizeof(*d));
+    d->caplen = caplen;
+    d->len = len;
+    if (caplen < ETHERNET_HEADER)
+    {
+        d->layers = DECODED_TRUNCATED;
+        return d->layers;
+    }
+    // offsets are 16-bit, a larger (jumbo-jumbo) frame is decoded in its first 64 KB
+    if (caplen > UINT16_MAX)
+        d->caplen = caplen = UINT16_MAX;
+    d->layers = DECODED_ETHERNET;
+    d->ether_type = read16(p + 12);
+    d->l3_offset = ETHERNET_HEADER;
+    d->payload_offset = ETHERNET_HEADER;
+    const uint8_t *l3 = p + ETHERNET_HEADER;
+    const uint32_t left = caplen - ETHERNET_HEADER;
+
+    switch (d->ether_type)
+    {
+        case ETHERTYPE_IP:
+            if (left < IPV4_HEADER)
+                break;
+            d->layers |= DECODED_IPV4;
+            d->version = l3[0] >> 4;
+            d->ihl = l3[0] & 0x0F;
+            d->ip_len = read16(l3 + 2);
+            d->ip_id = read16(l3 + 4);
+            d->frag_off = read16(l3 + 6);
+            d->ttl = l3[8];
+            d->l4_proto = l3[9];
+            d->ip_check = read16(l3 + 10);
+            memcpy(d->src, l3 + 12, 4);
+            memcpy(d->dst, l3 + 16, 4);
+            d->payload_offset = ETHERNET_HEADER + IPV4_HEADER;
+            if (d->ihl < 5 || d->ihl * 4U > left)
+                break;
+            d->l4_offset = d->payload_offset = ETHERNET_HEADER + d->ihl * 4U;
+            if (d->frag_off & IP_OFFMASK)
+            {
+                d->layers |= DECODED_FRAGMENT;
+                return d->layers;
+            }
+            decode_l4(p, d);
+            return d->layers;
+        case ETHERTYPE_IPV6:
+            if (left < IPV6_HEADER)
+                break;
+            d->layers |= DECODED_IPV6;
+            d->version = l3[0] >> 4;
+            d->ip_len = read16(l3 + 4);
+            d->l4_proto = l3[6];
+            d->ttl = l3[7];
+            memcpy(d->src, l3 + 8, 16);
+            memcpy(d->dst, l3 + 24, 16);
+            d->l4_offset = d->payload_offset = ETHERNET_HEADER + IPV6_HEADER;
+            if (d->l4_proto == IPPROTO_FRAGMENT)
+            {
+                d->layers |= DECODED_FRAGMENT;
+                return d->layers;
+            }
+            decode_l4(p, d);
+            return d->layers;
+        default:
+            // not decoded, all of it is payload
+            return d->layers;
+    }
+    d->layers |= DECODED_TRUNCATED;
+    d->payload_offset = caplen;
+    return d->layers;
+}
+
+/**
+ * @brief The 5-tuple of an IP packet, the same for both directions. Padding and unused bytes are 0,
+ * so tuples can be hashed and compared as bytes.
+ *
+ * @param d the decoded packet, IPv4 or IPv6.
+ * @param t the tuple, all of it is written.
+ * @return int 1 if the packet goes from the tuple's dst to its src, 0 if from src to dst.
+ */
+int decode_tuple(const struct decoded_packet *d, struct decoded_tuple *t)
+{
+    memset(t, 0, sizeof(*t));
+    const size_t addr_len = d->layers & DECODED_IPV4 ? 4 : 16;
+    // the fields of a layer that was not decoded are not set
+    const int has_ports = d->layers & (DECODED_TCP | DECODED_UDP);
+    const uint16_t sport = has_ports ? d->sport : 0, dport = has_ports ? d->dport : 0;
+    const int c = memcmp(d->src, d->dst, addr_len);
+    const int swap = c > 0 || (c == 0 && sport > dport);
+    memcpy(t->src, swap ? d->dst : d->src, addr_len);
+    memcpy(t->dst, swap ? d->src : d->dst, addr_len);
+    t->sport = swap ? dport : sport;
+    t->dport = swap ? sport : dport;
+    t->proto = d->l4_proto;
+    t->version = d->layers & DECODED_IPV4 ? 4 : 6;
+    return swap;
+}
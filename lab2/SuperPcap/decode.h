@@ -0,0 +1,86 @@
+#ifndef __DECODE_H
+#define __DECODE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pcap/pcap.h>
+
+/*
+
+Decoded Packet:
+    decode_packet() parses the headers of an Ethernet frame once, into a
+    struct decoded_packet of less than two cache lines: where each layer
+    starts, which protocols they are, and the fields of their headers, in host
+    byte order (addresses stay in network byte order).
+    Whatever wants to know about a packet (the text formatters, statistics,
+    filters, flows) reads the struct instead of parsing again.
+    Nothing is read past `caplen`: a header that is not all captured is not
+    decoded, and DECODED_TRUNCATED tells so. Layer 4 of an IP fragment that is
+    not the first one is not decoded either (DECODED_FRAGMENT).
+    Decoded: Ethernet II, IPv4 (with options), IPv6 (its fixed header), and
+    TCP, UDP, ICMP and ICMPv6 over them.
+    decode_tuple() gives the 5-tuple of an IP packet the same way in both
+    directions, which is what filters and flow tables key their flows by.
+
+*/
+
+#define DECODED_ETHERNET    0x01
+#define DECODED_IPV4        0x02
+#define DECODED_IPV6        0x04
+#define DECODED_TCP         0x08
+#define DECODED_UDP         0x10
+#define DECODED_ICMP        0x20    // ICMP or ICMPv6
+#define DECODED_FRAGMENT    0x40    // an IP fragment with no layer-4 header
+#define DECODED_TRUNCATED   0x80    // a header did not fit in the capture
+
+#define DECODED_IP (DECODED_IPV4 | DECODED_IPV6)
+#define DECODED_L4 (DECODED_TCP | DECODED_UDP | DECODED_ICMP)
+
+struct decoded_packet
+{
+    uint32_t caplen;
+    uint32_t len;
+    uint8_t layers;             // DECODED_*
+    uint8_t l4_proto;           // IPPROTO_*, the protocol (IPv4) or next header (IPv6)
+    uint8_t ttl;                // or hop limit
+    uint8_t ihl;                // IPv4 header length, 32-bit words
+    uint16_t ether_type;
+    uint16_t l3_offset;         // from the start of the frame
+    uint16_t l4_offset;
+    uint16_t payload_offset;    // of the layer-7 payload
+    uint16_t ip_len;            // total length (IPv4) or payload length (IPv6)
+    uint16_t ip_id;
+    uint16_t frag_off;          // flags and fragment offset
+    uint16_t ip_check;
+    uint16_t sport;             // TCP and UDP
+    uint16_t dport;
+    uint8_t tcp_flags;
+    uint8_t icmp_type;
+    uint8_t icmp_code;
+    uint8_t version;            // of IP, 4 or 6, as the header says
+    uint16_t window;
+    uint16_t l4_check;
+    uint16_t udp_len;
+    uint32_t seq;
+    uint32_t ack;
+    uint8_t src[16];            // IPv4 in the first 4 bytes, in network byte order
+    uint8_t dst[16];
+};
+
+// the lower address (and port, between equal addresses) first, so both directions are one tuple
+struct decoded_tuple
+{
+    uint8_t src[16];            // IPv4 in the first 4 bytes, the rest 0
+    uint8_t dst[16];
+    uint16_t sport;             // 0 if the packet is not TCP or UDP
+    uint16_t dport;
+    uint8_t proto;
+    uint8_t version;
+    uint8_t pad[2];
+};
+
+int decode_packet(const uint8_t *packet, uint32_t caplen, uint32_t len, struct decoded_packet *d);
+int decode_tuple(const struct decoded_packet *d, struct decoded_tuple *t);
+
+#endif
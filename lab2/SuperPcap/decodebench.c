@@ -0,0 +1,90 @@
+/*
+ * Times decode_packet() alone on synthetic frames (see synth.h), in millions
+ * of packets per second, next to decoding and rendering them as text.
+ * Usage: sp_decodebench [packets]
+ */
+
+#include "util.h"
+#include "decode.h"
+#include "format.h"
+#include "synth.h"
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+
+#define CORPUS 4096
+
+struct corpus_frame
+{
+    struct pcap_pkthdr h;
+    uint8_t *data;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+    const uint64_t packets = argc > 1 ? strtoull(argv[1], NULL, 10) : 20000000;
+    if (!packets)
+    {
+        fprintf(stderr, "Usage: %s [packets]\n", argv[0]);
+        return -1;
+    }
+    static struct corpus_frame corpus[CORPUS];
+    struct synth s;
+    synth_init(&s, 3);
+    for (int i = 0; i != CORPUS; ++i)
+    {
+        if (!(corpus[i].data = malloc(SYNTH_MAX_FRAME)))
+        {
+            perror("Failed to malloc");
+            return -1;
+        }
+        synth_frame(&s, corpus[i].data, &corpus[i].h);
+    }
+
+    // decode only, something of every packet is kept so the work is not optimized away
+    struct decoded_packet d;
+    uint64_t layers[8] = {0};
+    uint64_t ports = 0;
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i != packets; ++i)
+    {
+        const struct corpus_frame *f = &corpus[i % CORPUS];
+        const int decoded = decode_packet(f->data, f->h.caplen, f->h.len, &d);
+        for (int j = 0; j != 8; ++j)
+            layers[j] += decoded >> j & 1;
+        ports += d.sport;
+    }
+    const double decode_s = (now_ns() - start) / 1.0E9;
+    printf("decode_packet(): %" PRIu64 " packets in %.3fs, %.2f Mpps, %.1f ns/packet\n",
+        packets, decode_s, packets / decode_s / 1.0E6, decode_s * 1.0E9 / packets);
+    printf("  %" PRIu64 " IPv4, %" PRIu64 " IPv6, %" PRIu64 " TCP, %" PRIu64 " UDP, %" PRIu64 " ICMP (port sum %" PRIu64 ")\n",
+        layers[1], layers[2], layers[3], layers[4], layers[5], ports);
+
+    // decode and render, for comparison
+    const uint64_t rendered = packets / 20 ? packets / 20 : 1;
+    struct text t;
+    memset(&t, 0, sizeof(t));
+    start = now_ns();
+    for (uint64_t i = 0; i != rendered; ++i)
+    {
+        const struct corpus_frame *f = &corpus[i % CORPUS];
+        format_frame(&t, &f->h, f->data);
+        t.len = 0;
+    }
+    const double format_s = (now_ns() - start) / 1.0E9;
+    printf("format_frame():  %" PRIu64 " packets in %.3fs, %.2f Mpps, %.1f ns/packet\n",
+        rendered, format_s, rendered / format_s / 1.0E6, format_s * 1.0E9 / rendered);
+
+    text_free(&t);
+    for (int i = 0; i != CORPUS; ++i)
+        free(corpus[i].data);
+    return 0;
+}
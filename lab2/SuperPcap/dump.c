@@ -0,0 +1,411 @@
+#define _GNU_SOURCE
+#include "dump.h"
+#include "util.h"
+
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define PCAP_MAGIC_USEC 0xA1B2C3D4U
+#define PCAPNG_SHB 0x0A0D0D0AU
+#define PCAPNG_IDB 0x00000001U
+#define PCAPNG_EPB 0x00000006U
+#define PCAPNG_BYTE_ORDER 0x1A2B3C4DU
+
+#define PCAP_HEADER_SIZE 24
+#define PCAPNG_HEADER_SIZE (28 + 20)    /* a section header block and an interface description block */
+#define MAX_HEADER_SIZE PCAPNG_HEADER_SIZE
+#define MAX_RECORD_SIZE(snaplen) (32 + (((size_t)(snaplen) + 3) & ~(size_t)3))
+
+struct dump_buffer
+{
+    uint8_t *data;          // DUMP_ALIGN-aligned
+    size_t len;
+    int busy;               // with the writer
+    int new_file;           // the writer opens the next file before writing it
+    int last;               // the writer stops after it
+};
+
+struct dump
+{
+    struct dump_config cfg;
+    struct dump_buffer buffers[2];
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t writer;
+    int writer_started;
+    // the capture thread
+    int cur;                // the buffer being filled
+    uint64_t offset;        // of the buffer in the file
+    uint64_t file_bytes;    // in the file, with what is not written yet
+    uint64_t file_packets;
+    time_t file_start;      // the timestamp of the first packet of the file
+    uint64_t first_ns;      // when the oldest packet not handed to the writer came, 0 if none
+    // the writer thread
+    int fd;
+    unsigned int file_index;
+    uint64_t written;       // to the current file
+    int failed;
+    struct dump_stats stats;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Fill in the defaults of a capture file configuration.
+ *
+ * @param cfg the configuration.
+ */
+void dump_default_config(struct dump_config *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->format = DUMP_PCAP;
+    cfg->linktype = DLT_EN10MB;
+    cfg->snaplen = 65535;
+    cfg->buffer_size = (size_t)DUMP_BUFFER_SIZE << 10;
+}
+
+static size_t __put_header(const dump *d, uint8_t *p)
+{
+    const uint32_t snaplen = d->cfg.snaplen, linktype = d->cfg.linktype;
+    if (d->cfg.format == DUMP_PCAP)
+    {
+        // version 2.4, microseconds, no time zone
+        const uint32_t magic = PCAP_MAGIC_USEC, zero = 0;
+        const uint16_t version[2] = {2, 4};
+        memcpy(p, &magic, 4);
+        memcpy(p + 4, version, 4);
+        memcpy(p + 8, &zero, 4);
+        memcpy(p + 12, &zero, 4);
+        memcpy(p + 16, &snaplen, 4);
+        memcpy(p + 20, &linktype, 4);
+        return PCAP_HEADER_SIZE;
+    }
+    // version 1.0, no section length, microseconds (no if_tsresol)
+    const uint32_t shb[3] = {PCAPNG_SHB, 28, PCAPNG_BYTE_ORDER};
+    const uint16_t version[2] = {1, 0};
+    const uint32_t shb_tail[3] = {0xFFFFFFFFU, 0xFFFFFFFFU, 28};
+    const uint32_t idb[5] = {PCAPNG_IDB, 20, linktype, snaplen, 20};
+    memcpy(p, shb, 12);
+    memcpy(p + 12, version, 4);
+    memcpy(p + 16, shb_tail, 12);
+    memcpy(p + 28, idb, 20);
+    return PCAPNG_HEADER_SIZE;
+}
+
+static inline size_t __record_size(const dump *d, uint32_t caplen)
+{
+    return d->cfg.format == DUMP_PCAP ? 16 + caplen : 32 + ((caplen + 3) & ~3U);
+}
+
+static inline void __put_record(const dump *d, uint8_t *p, const struct pcap_pkthdr *h, uint32_t caplen,
+    const u_char *packet)
+{
+    if (d->cfg.format == DUMP_PCAP)
+    {
+        const uint32_t r[4] = {(uint32_t)h->ts.tv_sec, (uint32_t)h->ts.tv_usec, caplen, h->len};
+        memcpy(p, r, 16);
+        memcpy(p + 16, packet, caplen);
+        return;
+    }
+    const uint32_t padded = (caplen + 3) & ~3U, total = 32 + padded;
+    const uint64_t ts = (uint64_t)h->ts.tv_sec * 1000000 + h->ts.tv_usec;
+    const uint32_t epb[7] = {PCAPNG_EPB, total, 0, (uint32_t)(ts >> 32), (uint32_t)ts, caplen, h->len};
+    memcpy(p, epb, 28);
+    memcpy(p + 28, packet, caplen);
+    memset(p + 28 + caplen, 0, padded - caplen);
+    memcpy(p + 28 + padded, &total, 4);
+}
+
+// open the next file, the writer's
+static int __open_file(dump *d, char *errbuf)
+{
+    char name[PATH_MAX];
+    if (d->cfg.rotate_size || d->cfg.rotate_seconds)
+        snprintf(name, sizeof(name), "%s.%u", d->cfg.file, d->file_index);
+    else
+        snprintf(name, sizeof(name), "%s", d->cfg.file);
+    if ((d->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "Cannot open `%.200s`: %s", name, strerror(errno));
+        return -1;
+    }
+    uint64_t prealloc = d->cfg.preallocate;
+    if (d->cfg.rotate_size && d->cfg.rotate_size < prealloc)
+        prealloc = d->cfg.rotate_size;
+    // the size stays 0 until written, a reader never sees the blocks that are not
+    if (prealloc && fallocate(d->fd, FALLOC_FL_KEEP_SIZE, 0, prealloc) && d->file_index == 0)
+        fprintf(stderr, "Warning: cannot preallocate `%s`: %s\n", name, strerror(errno));
+    ++d->file_index;
+    ++d->stats.files;
+    d->written = 0;
+    return 0;
+}
+
+static void __close_file(dump *d)
+{
+    if (d->fd < 0)
+        return;
+    // give back the blocks preallocated and not used
+    if (d->cfg.preallocate && ftruncate(d->fd, d->written))
+        perror("Cannot truncate the capture file");
+    if (close(d->fd) && !d->failed)
+    {
+        perror("Cannot write the capture file");
+        d->failed = 1;
+    }
+    d->fd = -1;
+}
+
+static void __write_all(dump *d, const uint8_t *p, size_t n)
+{
+    while (n && !d->failed)
+    {
+        const ssize_t w = write(d->fd, p, n);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+        {
+            perror("Cannot write the capture file");
+            d->failed = 1;
+            return;
+        }
+        ++d->stats.writes;
+        d->stats.bytes += w;
+        d->written += w;
+        p += w;
+        n -= w;
+    }
+}
+
+static void *__writer(void *arg)
+{
+    dump *d = arg;
+    for (int i = 0; ; i ^= 1)
+    {
+        struct dump_buffer *b = &d->buffers[i];
+        pthread_mutex_lock(&d->lock);
+        while (!b->busy)
+            pthread_cond_wait(&d->cond, &d->lock);
+        pthread_mutex_unlock(&d->lock);
+        if (b->new_file && !d->failed)
+        {
+            char errbuf[PCAP_ERRBUF_SIZE];
+            __close_file(d);
+            if (__open_file(d, errbuf))
+            {
+                fprintf(stderr, "%s\n", errbuf);
+                d->failed = 1;
+            }
+        }
+        __write_all(d, b->data, b->len);
+        const int last = b->last;
+        pthread_mutex_lock(&d->lock);
+        b->busy = 0;
+        pthread_cond_broadcast(&d->cond);
+        pthread_mutex_unlock(&d->lock);
+        if (last)
+            break;
+    }
+    __close_file(d);
+    return NULL;
+}
+
+// hand the first n bytes of the buffer to the writer, and carry the rest to the other buffer
+static void __handoff(dump *d, size_t n, int last)
+{
+    struct dump_buffer *b = &d->buffers[d->cur];
+    struct dump_buffer *next = &d->buffers[d->cur ^ 1];
+    pthread_mutex_lock(&d->lock);
+    if (next->busy)
+    {
+        ++d->stats.waits;
+        while (next->busy)
+            pthread_cond_wait(&d->cond, &d->lock);
+    }
+    next->len = b->len - n;
+    memcpy(next->data, b->data + n, next->len);
+    next->new_file = 0;
+    b->len = n;
+    b->last = last;
+    b->busy = 1;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+    d->cur ^= 1;
+    d->offset += n;
+    if (!next->len)
+        d->first_ns = 0;
+}
+
+// start a new file with the next buffer
+static void __rotate(dump *d)
+{
+    __handoff(d, d->buffers[d->cur].len, 0);
+    struct dump_buffer *b = &d->buffers[d->cur];
+    b->new_file = 1;
+    b->len = __put_header(d, b->data);
+    d->offset = 0;
+    d->file_bytes = b->len;
+    d->file_packets = 0;
+}
+
+/**
+ * @brief Open the first capture file, and start the writer thread.
+ *
+ * @param cfg the configuration, copied.
+ * @param errbuf PCAP_ERRBUF_SIZE bytes, to tell what failed.
+ * @return dump* the writer, NULL if failed.
+ */
+dump *dump_open(const struct dump_config *cfg, char *errbuf)
+{
+    if (!cfg->file || cfg->snaplen <= 0
+        || cfg->buffer_size < 2 * MAX_RECORD_SIZE(cfg->snaplen) + DUMP_ALIGN + MAX_HEADER_SIZE)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "The buffers must hold two packets of the snapshot length.");
+        return NULL;
+    }
+    dump *d = calloc(1, sizeof(dump));
+    if (!d)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "Failed to malloc.");
+        return NULL;
+    }
+    d->cfg = *cfg;
+    d->cfg.buffer_size = (cfg->buffer_size + DUMP_ALIGN - 1) & ~(size_t)(DUMP_ALIGN - 1);
+    d->fd = -1;
+    for (int i = 0; i != 2; ++i)
+    {
+        if (!(d->buffers[i].data = aligned_alloc(DUMP_ALIGN, d->cfg.buffer_size)))
+        {
+            snprintf(errbuf, PCAP_ERRBUF_SIZE, "Failed to malloc.");
+            goto DUMP_FAILED;
+        }
+    }
+    // the first file is opened here, so a bad path fails now
+    if (__open_file(d, errbuf))
+        goto DUMP_FAILED;
+    d->buffers[0].len = __put_header(d, d->buffers[0].data);
+    d->file_bytes = d->buffers[0].len;
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->cond, NULL);
+    const int err = pthread_create(&d->writer, NULL, __writer, d);
+    if (err)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "Cannot start the writer thread: %s", strerror(err));
+        pthread_cond_destroy(&d->cond);
+        pthread_mutex_destroy(&d->lock);
+        __close_file(d);
+        goto DUMP_FAILED;
+    }
+    d->writer_started = 1;
+    return d;
+
+DUMP_FAILED:
+    free(d->buffers[0].data);
+    free(d->buffers[1].data);
+    free(d);
+    return NULL;
+}
+
+/**
+ * @brief Append a packet to the capture file, a pcap_handler. Never blocks unless the writer is behind.
+ *
+ * @param user the dump.
+ * @param h the pcap header of the packet.
+ * @param packet the packet.
+ */
+void dump_handler(u_char *user, const struct pcap_pkthdr *h, const u_char *packet)
+{
+    dump *d = (dump *)user;
+    const uint32_t caplen = h->caplen > (uint32_t)d->cfg.snaplen ? (uint32_t)d->cfg.snaplen : h->caplen;
+    const size_t size = __record_size(d, caplen);
+    if (d->file_packets && ((d->cfg.rotate_size && d->file_bytes + size > d->cfg.rotate_size)
+        || (d->cfg.rotate_seconds && h->ts.tv_sec - d->file_start >= d->cfg.rotate_seconds)))
+        __rotate(d);
+    struct dump_buffer *b = &d->buffers[d->cur];
+    if (b->len + size > d->cfg.buffer_size)
+    {
+        // up to the last whole multiple of DUMP_ALIGN in the file
+        __handoff(d, ((d->offset + b->len) & ~(uint64_t)(DUMP_ALIGN - 1)) - d->offset, 0);
+        b = &d->buffers[d->cur];
+    }
+    if (!d->file_packets)
+        d->file_start = h->ts.tv_sec;
+    if (!d->first_ns)
+        d->first_ns = now_ns();
+    __put_record(d, b->data + b->len, h, caplen, packet);
+    b->len += size;
+    d->file_bytes += size;
+    ++d->file_packets;
+    ++d->stats.packets;
+}
+
+/**
+ * @brief Hand the packets to the writer if the oldest came DUMP_FLUSH_TIMEOUT ms ago. Called when the capture is idle.
+ *
+ * @param user the dump.
+ */
+void dump_flush(u_char *user)
+{
+    dump *d = (dump *)user;
+    if (d->first_ns && now_ns() - d->first_ns >= DUMP_FLUSH_TIMEOUT * 1000000ULL)
+        __handoff(d, d->buffers[d->cur].len, 0);
+}
+
+/**
+ * @brief Write what is left, stop the writer thread and close the file.
+ *
+ * @param d the dump.
+ * @return int 0 if success, -1 if a write failed.
+ */
+int dump_close(dump *d)
+{
+    if (d->writer_started)
+    {
+        __handoff(d, d->buffers[d->cur].len, 1);
+        pthread_join(d->writer, NULL);
+        d->writer_started = 0;
+    }
+    return d->failed ? -1 : 0;
+}
+
+/**
+ * @brief Get the statistics of a dump.
+ *
+ * @param d the dump, closed.
+ * @param st the statistics.
+ */
+void dump_get_stats(dump *d, struct dump_stats *st)
+{
+    *st = d->stats;
+}
+
+void dump_print_stats(dump *d, FILE *fp)
+{
+    const struct dump_stats *st = &d->stats;
+    fprintf(fp, "[dump] %" PRIu64 " packets, %" PRIu64 " bytes in %" PRIu64 " files by %" PRIu64
+        " writes, the capture waited %" PRIu64 " times for the disk\n",
+        st->packets, st->bytes, st->files, st->writes, st->waits);
+}
+
+void dump_free(dump *d)
+{
+    if (!d)
+        return;
+    dump_close(d);
+    pthread_cond_destroy(&d->cond);
+    pthread_mutex_destroy(&d->lock);
+    free(d->buffers[0].data);
+    free(d->buffers[1].data);
+    free(d);
+}
@@ -0,0 +1,75 @@
+#ifndef __DUMP_H
+#define __DUMP_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pcap/pcap.h>
+
+/* configurations */
+#define DUMP_BUFFER_SIZE 4096U      /* KB, each of the two buffers */
+#define DUMP_ALIGN 4096U            /* bytes, the file is written in multiples of this */
+#define DUMP_FLUSH_TIMEOUT 1000     /* ms, packets are in the file after this at most */
+
+/*
+
+Capture File Writer:
+    Writes the packets as they are, in a pcap or a pcapng file, for
+    Wireshark, tcpdump, or `spcap -r` to decode later. A packet costs a copy
+    into a buffer, so a capture that writes a file keeps up with a rate that
+    the text (5 times as large as the packets, see format.h) cannot.
+    capture thread --full buffer--> writer thread --free buffer--> capture thread
+    There are two buffers: the capture thread fills one while the writer
+    thread writes the other with one write(). The file is written in whole
+    multiples of DUMP_ALIGN from aligned buffers, the few bytes after the
+    last multiple are carried to the next buffer, so the page cache gets
+    whole pages and never reads a page back to change part of it. A buffer
+    that is not full is written when its oldest packet is DUMP_FLUSH_TIMEOUT
+    ms old, and when the file is closed.
+    Rotation: a new file is started when the next packet would make the file
+    larger than `rotate_size`, or when a packet comes `rotate_seconds` after
+    the first packet of the file (by the packet timestamps). The files are
+    then `file.0`, `file.1`, ... every one with its own file header.
+    Preallocation: the blocks of a file are reserved with fallocate() when
+    it is opened (`preallocate` bytes, no more than `rotate_size`), so the
+    file system does not allocate as the file grows, and keeps the file in
+    one piece. What is not used is given back when the file is closed.
+
+*/
+
+#define DUMP_PCAP 0
+#define DUMP_PCAPNG 1
+
+struct dump_config
+{
+    const char *file;
+    int format;                 // DUMP_*
+    int linktype;               // DLT_*
+    int snaplen;
+    size_t buffer_size;         // bytes
+    uint64_t rotate_size;       // bytes, 0 for no rotation by size
+    int rotate_seconds;         // 0 for no rotation by time
+    uint64_t preallocate;       // bytes, 0 for none, the rotation size if it is less
+};
+
+struct dump_stats
+{
+    uint64_t packets;
+    uint64_t bytes;             // written to the files
+    uint64_t files;
+    uint64_t writes;            // write() calls
+    uint64_t waits;             // times the capture waited for the writer
+};
+
+typedef struct dump dump;
+
+void dump_default_config(struct dump_config *cfg);
+dump *dump_open(const struct dump_config *cfg, char *errbuf);
+void dump_handler(u_char *user, const struct pcap_pkthdr *h, const u_char *packet);
+void dump_flush(u_char *user);
+int dump_close(dump *d);
+void dump_get_stats(dump *d, struct dump_stats *st);
+void dump_print_stats(dump *d, FILE *fp);
+void dump_free(dump *d);
+
+#endif
@@ -0,0 +1,341 @@
+#define _GNU_SOURCE
+#include "filter.h"
+#include "util.h"
+
+#include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <time.h>
+#include <netinet/tcp.h>
+
+#define TERM_CONTAINS 0
+#define TERM_ESTABLISHED 1
+#define TERM_FIRST 2
+
+#define SEEN_SYN 0x01           // a SYN with no ACK was seen
+#define SEEN_SYN_ACK 0x02       // then a SYN-ACK
+
+struct term
+{
+    int type;                   // TERM_*
+    int negate;
+    uint32_t n;                 // TERM_FIRST
+    size_t len;                 // TERM_CONTAINS
+    uint8_t string[FILTER_MAX_STRING];
+};
+
+struct flow
+{
+    uint64_t key;               // a hash of the 5-tuple, the same both ways, 0 for a free slot
+    uint32_t packets;
+    uint32_t state;             // SEEN_*
+};
+
+struct filter
+{
+    struct term terms[FILTER_MAX_TERMS];
+    int term_count;
+    struct flow *flows;         // FILTER_FLOWS, NULL if no term needs them
+    struct filter_stats stats;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// the time a sampled packet starts at, 0 if this packet is not timed
+static inline uint64_t __start(struct filter_stats *st)
+{
+    return st->packets++ % FILTER_SAMPLE ? 0 : now_ns();
+}
+
+static inline void __done(struct filter_stats *st, uint64_t start, int match)
+{
+    if (start)
+    {
+        st->ns += now_ns() - start;
+        ++st->timed;
+    }
+    st->matched += match;
+}
+
+/**
+ * @brief Compile a pcap filter expression for packets of a link-layer type, not bound to a capture.
+ *
+ * @param expr the expression, see pcap-filter(7).
+ * @param linktype DLT_* type of the packets.
+ * @param snaplen what the program returns for a packet that matches.
+ * @param prog the program, to free with pcap_freecode().
+ * @param errbuf PCAP_ERRBUF_SIZE bytes, to tell what failed.
+ * @return int 0 if success, -1 if failed.
+ */
+int filter_compile(const char *expr, int linktype, int snaplen, struct bpf_program *prog, char *errbuf)
+{
+    pcap_t *dead = pcap_open_dead(linktype, snaplen);
+    if (!dead)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "Failed to malloc.");
+        return -1;
+    }
+    if (pcap_compile(dead, prog, expr, 1, PCAP_NETMASK_UNKNOWN))
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "Bad filter: %s", pcap_geterr(dead));
+        pcap_close(dead);
+        return -1;
+    }
+    pcap_close(dead);
+    return 0;
+}
+
+/**
+ * @brief Run a BPF program over a packet in user space, counting and timing it.
+ *
+ * @param prog the program.
+ * @param st the statistics of the program.
+ * @param h the header of the packet.
+ * @param packet the packet.
+ * @return int 1 if the packet matches, 0 if not.
+ */
+int filter_bpf(const struct bpf_program *prog, struct filter_stats *st, const struct pcap_pkthdr *h, const u_char *packet)
+{
+    const uint64_t start = __start(st);
+    const int match = pcap_offline_filter(prog, h, packet) != 0;
+    __done(st, start, match);
+    return match;
+}
+
+// read the string of `contains`, with \xHH and \\ escapes
+static int __parse_string(const char *s, struct term *t)
+{
+    t->len = 0;
+    while (*s)
+    {
+        if (t->len == FILTER_MAX_STRING)
+            return -1;
+        if (s[0] == '\\' && s[1] == '\\')
+        {
+            t->string[t->len++] = '\\';
+            s += 2;
+        }
+        else if (s[0] == '\\' && s[1] == 'x' && isxdigit((unsigned char)s[2]) && isxdigit((unsigned char)s[3]))
+        {
+            const char hex[3] = {s[2], s[3], '\0'};
+            t->string[t->len++] = (uint8_t)strtoul(hex, NULL, 16);
+            s += 4;
+        }
+        else if (s[0] == '\\')
+            return -1;
+        else
+            t->string[t->len++] = (uint8_t)*s++;
+    }
+    return t->len ? 0 : -1;
+}
+
+/**
+ * @brief Parse a match filter, see filter.h.
+ *
+ * @param expr the terms.
+ * @param errbuf PCAP_ERRBUF_SIZE bytes, to tell what failed.
+ * @return filter* the filter, NULL if failed.
+ */
+filter *filter_open(const char *expr, char *errbuf)
+{
+    filter *f = calloc(1, sizeof(filter));
+    char *copy = strdup(expr);
+    if (!f || !copy)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "Failed to malloc.");
+        goto FILTER_FAILED;
+    }
+    int negate = 0;
+    char *save = NULL;
+    for (char *tok = strtok_r(copy, " \t", &save); tok; tok = strtok_r(NULL, " \t", &save))
+    {
+        if (!strcmp(tok, "and"))
+            continue;
+        if (!strcmp(tok, "not"))
+        {
+            negate = !negate;
+            continue;
+        }
+        if (f->term_count == FILTER_MAX_TERMS)
+        {
+            snprintf(errbuf, PCAP_ERRBUF_SIZE, "A match filter has %d terms at most.", FILTER_MAX_TERMS);
+            goto FILTER_FAILED;
+        }
+        struct term *t = &f->terms[f->term_count++];
+        t->negate = negate;
+        negate = 0;
+        if (!strcmp(tok, "contains"))
+        {
+            t->type = TERM_CONTAINS;
+            const char *arg = strtok_r(NULL, " \t", &save);
+            if (!arg || __parse_string(arg, t))
+            {
+                snprintf(errbuf, PCAP_ERRBUF_SIZE, "`contains` takes 1 to %d bytes, \\xHH for any byte.",
+                    FILTER_MAX_STRING);
+                goto FILTER_FAILED;
+            }
+        }
+        else if (!strcmp(tok, "established"))
+            t->type = TERM_ESTABLISHED;
+        else if (!strcmp(tok, "first"))
+        {
+            t->type = TERM_FIRST;
+            const char *arg = strtok_r(NULL, " \t", &save);
+            char *end;
+            const unsigned long n = arg ? strtoul(arg, &end, 10) : 0;
+            if (!arg || *end || !n || n > UINT32_MAX)
+            {
+                snprintf(errbuf, PCAP_ERRBUF_SIZE, "`first` takes a number of packets.");
+                goto FILTER_FAILED;
+            }
+            t->n = (uint32_t)n;
+        }
+        else
+        {
+            snprintf(errbuf, PCAP_ERRBUF_SIZE, "Unknown term in the match filter: %.64s", tok);
+            goto FILTER_FAILED;
+        }
+        if (t->type != TERM_CONTAINS && !f->flows && !(f->flows = calloc(FILTER_FLOWS, sizeof(struct flow))))
+        {
+            snprintf(errbuf, PCAP_ERRBUF_SIZE, "Failed to malloc.");
+            goto FILTER_FAILED;
+        }
+    }
+    if (!f->term_count || negate)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "The match filter has no terms, or ends with `not`.");
+        goto FILTER_FAILED;
+    }
+    free(copy);
+    return f;
+
+FILTER_FAILED:
+    free(copy);
+    filter_free(f);
+    return NULL;
+}
+
+// FNV-1a of the 5-tuple, the same both ways (see decode.h)
+static uint64_t __flow_key(const struct decoded_packet *d)
+{
+    struct decoded_tuple t;
+    decode_tuple(d, &t);
+    const uint8_t *p = (const uint8_t *)&t;
+    uint64_t h = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i != sizeof(t); ++i)
+        h = (h ^ p[i]) * 0x100000001B3ULL;
+    return h ? h : 1;
+}
+
+// find the flow of a packet, or take a slot for it, and count the packet
+static const struct flow *__track(filter *f, const struct decoded_packet *d)
+{
+    if (!(d->layers & DECODED_IP))
+        return NULL;
+    const uint64_t key = __flow_key(d);
+    struct flow *fl = NULL;
+    // nothing is ever freed, so a flow is before the first free slot
+    for (unsigned int i = 0; i != FILTER_PROBES; ++i)
+    {
+        fl = &f->flows[(key + i) & (FILTER_FLOWS - 1)];
+        if (fl->key == key || !fl->key)
+            break;
+        fl = NULL;
+    }
+    if (!fl)
+        fl = &f->flows[key & (FILTER_FLOWS - 1)];
+    const int syn = d->layers & DECODED_TCP && d->tcp_flags & TH_SYN;
+    const int ack = d->layers & DECODED_TCP && d->tcp_flags & TH_ACK;
+    // a new flow, or a new connection over the same 5-tuple
+    if (fl->key != key || (syn && !ack && fl->state & SEEN_SYN_ACK))
+    {
+        fl->key = key;
+        fl->packets = 0;
+        fl->state = 0;
+    }
+    if (fl->packets != UINT32_MAX)
+        ++fl->packets;
+    if (syn && !ack)
+        fl->state |= SEEN_SYN;
+    else if (syn && fl->state & SEEN_SYN)
+        fl->state |= SEEN_SYN_ACK;
+    return fl;
+}
+
+static int __term(const struct term *t, const struct decoded_packet *d, const u_char *packet, const struct flow *fl)
+{
+    switch (t->type)
+    {
+        case TERM_CONTAINS:
+            return memmem(packet + d->payload_offset, d->caplen - d->payload_offset, t->string, t->len) != NULL;
+        case TERM_ESTABLISHED:
+            return fl && d->layers & DECODED_TCP && fl->state & SEEN_SYN_ACK && !(d->tcp_flags & TH_SYN);
+        case TERM_FIRST:
+            return fl && fl->packets <= t->n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Decode a packet and tell whether it matches a match filter, counting and timing it.
+ * The flows are kept per filter: one filter is run by one thread, see shard.h.
+ *
+ * @param f the filter.
+ * @param h the header of the packet.
+ * @param packet the packet.
+ * @return int 1 if the packet matches, 0 if not.
+ */
+int filter_match(filter *f, const struct pcap_pkthdr *h, const u_char *packet)
+{
+    const uint64_t start = __start(&f->stats);
+    struct decoded_packet d;
+    decode_packet(packet, h->caplen, h->len, &d);
+    // every packet counts for its flow, whatever the terms before a flow term say
+    const struct flow *fl = f->flows ? __track(f, &d) : NULL;
+    int match = 1;
+    for (int i = 0; match && i != f->term_count; ++i)
+        match = __term(&f->terms[i], &d, packet, fl) != f->terms[i].negate;
+    __done(&f->stats, start, match);
+    return match;
+}
+
+void filter_get_stats(filter *f, struct filter_stats *st)
+{
+    *st = f->stats;
+}
+
+/**
+ * @brief Print how many packets a filter let through, and what it cost.
+ *
+ * @param st the statistics of the filter.
+ * @param label printed in brackets before them.
+ * @param expr the filter.
+ * @param fp where to print.
+ */
+void filter_print_stats(const struct filter_stats *st, const char *label, const char *expr, FILE *fp)
+{
+    fprintf(fp, "[%s] `%s`", label, expr);
+    if (st->instructions)
+        fprintf(fp, " (%u BPF instructions%s)", st->instructions, st->timed ? "" : ", in the kernel");
+    if (st->packets)
+        fprintf(fp, ": %" PRIu64 " of %" PRIu64 " packets matched (%.3f%%)",
+            st->matched, st->packets, st->matched * 100.0 / st->packets);
+    else
+        fprintf(fp, ": %" PRIu64 " packets matched", st->matched);
+    if (st->timed)
+        fprintf(fp, ", %.1f ns/packet", (double)st->ns / st->timed);
+    fprintf(fp, "\n");
+}
+
+void filter_free(filter *f)
+{
+    if (!f)
+        return;
+    free(f->flows);
+    free(f);
+}
@@ -0,0 +1,68 @@
+#ifndef __FILTER_H
+#define __FILTER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pcap/pcap.h>
+
+#include "decode.h"
+
+/* configurations */
+#define FILTER_FLOWS 65536U         /* flows remembered by a match filter, a power of 2 */
+#define FILTER_PROBES 8U            /* slots looked at for a flow before one is taken over */
+#define FILTER_MAX_TERMS 16         /* terms of a match filter */
+#define FILTER_MAX_STRING 256       /* bytes looked for by `contains` */
+#define FILTER_SAMPLE 64U           /* one packet in this many is timed */
+
+/*
+
+Packet Filters:
+    BPF filter: a pcap filter expression (`tcp port 80`, see pcap-filter(7)),
+        compiled with pcap_compile(). On an interface the kernel runs it
+        before the packet is copied into the ring, so a packet that does
+        not match costs neither the copy nor a wake-up (see capture.h). The
+        program returns the snapshot length for a match, so it takes the
+        place of the snapshot filter of the ring backend. A file is filtered
+        in user space, by filter_bpf().
+    Match filter: what BPF cannot say, run over the decoded packet (see
+        decode.h) after it came out of the capture, before it is decoded
+        into text or written to a capture file. Terms, all of which must
+        hold, `and` between them may be left out, `not` before one turns it
+        around:
+            contains STRING   the payload has these bytes, \xHH for any byte
+            established       TCP of a connection whose SYN and SYN-ACK were seen
+            first N           one of the first N packets of its flow
+        The payload is what comes after the last header that was decoded.
+        A flow is the 5-tuple (the addresses, the protocol, and the ports of
+        TCP and UDP) in either direction. The flows are kept in a table of
+        FILTER_FLOWS slots, allocated once: a flow with no slot free near
+        its own takes one over, so when there are many more flows than
+        that, some are forgotten and start over. A packet that is not IP
+        has no flow, and matches no flow term.
+    The cost of a filter is timed on one packet in FILTER_SAMPLE, and
+    printed with how many packets it let through. The time of the kernel's
+    BPF is not known, its length in instructions is printed instead.
+
+*/
+
+struct filter_stats
+{
+    uint64_t packets;           // given to the filter
+    uint64_t matched;
+    uint64_t timed;             // packets the filter was timed on
+    uint64_t ns;                // spent on them
+    unsigned int instructions;  // of a BPF program, 0 for a match filter
+};
+
+typedef struct filter filter;
+
+int filter_compile(const char *expr, int linktype, int snaplen, struct bpf_program *prog, char *errbuf);
+int filter_bpf(const struct bpf_program *prog, struct filter_stats *st, const struct pcap_pkthdr *h, const u_char *packet);
+filter *filter_open(const char *expr, char *errbuf);
+int filter_match(filter *f, const struct pcap_pkthdr *h, const u_char *packet);
+void filter_get_stats(filter *f, struct filter_stats *st);
+void filter_print_stats(const struct filter_stats *st, const char *label, const char *expr, FILE *fp);
+void filter_free(filter *f);
+
+#endif
@@ -0,0 +1,442 @@
+#include "flow.h"
+#include "util.h"
+
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define GROUP 16                /* slots whose bytes are compared at once */
+#define SLOT_FREE 0x80          /* never used, ends a lookup */
+#define SLOT_DELETED 0xFE       /* used once, a lookup goes on past it */
+#define NONE UINT32_MAX
+
+#define STATE_OTHER 0           // not TCP
+#define STATE_MIDSTREAM 1
+#define STATE_SYN 2
+#define STATE_ESTABLISHED 3
+#define STATE_CLOSING 4
+#define STATE_CLOSED 5
+
+static const char *const state_names[] = {"-", "midstream", "syn", "established", "closing", "closed"};
+
+struct flow_record
+{
+    // the first cache line, all a lookup reads
+    struct decoded_tuple key;
+    uint64_t packets[2];        // sent by the key's src (0) and dst (1)
+    uint32_t next;              // in the wheel, NONE at the end of the list
+    uint8_t source;             // the end that sent the first packet
+    uint8_t state;              // STATE_*
+    uint8_t flags[2];           // TCP flags sent by each end, ORed
+    // the second
+    uint64_t bytes[2];
+    uint64_t first;             // us, of the first packet since the last record
+    uint64_t last;
+    uint64_t exported;          // s, when the counts started, for the active timeout
+} __attribute__((aligned(64)));
+
+struct flows
+{
+    struct flow_config cfg;
+    uint8_t *tags;              // a byte per slot, SLOT_* or 7 bits of the hash
+    struct flow_record *records;
+    size_t group_mask;
+    uint32_t wheel[FLOW_WHEEL_SLOTS];
+    uint64_t now;               // s, the wheel is done up to here
+    int failed;                 // a record could not be written
+    struct flow_stats stats;
+};
+
+/**
+ * @brief Fill in the defaults of a flow table configuration.
+ *
+ * @param cfg the configuration.
+ */
+void flow_default_config(struct flow_config *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->out = stdout;
+    cfg->format = FLOW_CSV;
+    cfg->header = 1;
+    cfg->capacity = FLOW_TABLE_SIZE;
+    cfg->idle_timeout = FLOW_IDLE_TIMEOUT;
+    cfg->closed_timeout = FLOW_CLOSED_TIMEOUT;
+    cfg->active_timeout = FLOW_ACTIVE_TIMEOUT;
+}
+
+/**
+ * @brief Allocate a flow table, and write the CSV header if asked to.
+ *
+ * @param cfg the configuration, copied.
+ * @param errbuf PCAP_ERRBUF_SIZE bytes, to tell what failed.
+ * @return flows* the table, NULL if failed.
+ */
+flows *flow_open(const struct flow_config *cfg, char *errbuf)
+{
+    if (!cfg->out || cfg->capacity < GROUP || cfg->capacity > 1U << 31 || cfg->idle_timeout <= 0
+        || cfg->closed_timeout <= 0 || cfg->active_timeout < 0)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "The table must hold %d to 2^31 flows, and the timeouts be positive.", GROUP);
+        return NULL;
+    }
+    flows *f = calloc(1, sizeof(flows));
+    if (!f)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "Failed to malloc.");
+        return NULL;
+    }
+    f->cfg = *cfg;
+    size_t capacity = 64; // aligned_alloc() takes multiples of the alignment
+    while (capacity < cfg->capacity)
+        capacity <<= 1;
+    f->cfg.capacity = capacity;
+    f->group_mask = capacity / GROUP - 1;
+    // the records are touched as flows come, only the tags are written now
+    f->tags = aligned_alloc(64, capacity);
+    f->records = aligned_alloc(64, capacity * sizeof(struct flow_record));
+    if (!f->tags || !f->records)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "Cannot allocate a table of %zu flows (%zu MB).",
+            capacity, capacity * (sizeof(struct flow_record) + 1) >> 20);
+        flow_free(f);
+        return NULL;
+    }
+    memset(f->tags, SLOT_FREE, capacity);
+    for (unsigned int i = 0; i != FLOW_WHEEL_SLOTS; ++i)
+        f->wheel[i] = NONE;
+    f->stats.capacity = capacity;
+    f->stats.tables = 1;
+    if (cfg->header && cfg->format == FLOW_CSV)
+        fprintf(cfg->out, "first,last,proto,src,sport,dst,dport,packets,bytes,rpackets,rbytes,flags,state,end\n");
+    return f;
+}
+
+// the slots of a group that hold this byte, a bit each
+static inline uint32_t __match(const uint8_t *group, uint8_t tag)
+{
+#ifdef __SSE2__
+    const __m128i g = _mm_load_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char)tag)));
+#else
+    uint32_t m = 0;
+    for (int i = 0; i != GROUP; ++i)
+        m |= (uint32_t)(group[i] == tag) << i;
+    return m;
+#endif
+}
+
+// the key 8 bytes at a time, multiplied and folded; a product only carries upwards, so
+// the high bits are folded down before each multiply, or the group would hang on the low ones
+static inline uint64_t __hash(const struct decoded_tuple *k)
+{
+    uint64_t w[sizeof(*k) / 8];
+    memcpy(w, k, sizeof(w));
+    uint64_t h = 0x9E3779B97F4A7C15ULL;
+    for (size_t i = 0; i != sizeof(w) / sizeof(w[0]); ++i)
+    {
+        h = (h ^ w[i]) * 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 33;
+    }
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    return h ^ h >> 33;
+}
+
+// the slot of a flow, or the one it would go to (NONE if there is none), `found` tells which
+static uint32_t __find(const flows *f, const struct decoded_tuple *k, uint64_t hash, int *found)
+{
+    const uint8_t tag = hash >> 57;
+    size_t g = hash & f->group_mask;
+    uint32_t free_slot = NONE;
+    for (unsigned int i = 0; i != FLOW_MAX_PROBES; ++i)
+    {
+        const uint8_t *group = f->tags + g * GROUP;
+        for (uint32_t m = __match(group, tag); m; m &= m - 1)
+        {
+            const uint32_t slot = g * GROUP + __builtin_ctz(m);
+            if (!memcmp(&f->records[slot].key, k, sizeof(*k)))
+            {
+                *found = 1;
+                return slot;
+            }
+        }
+        const uint32_t empty = __match(group, SLOT_FREE);
+        const uint32_t usable = empty | __match(group, SLOT_DELETED);
+        if (free_slot == NONE && usable)
+            free_slot = g * GROUP + __builtin_ctz(usable);
+        // a flow goes to the first group with room, so it is not after one that never was full
+        if (empty)
+            break;
+        g = (g + i + 1) & f->group_mask;
+    }
+    *found = 0;
+    return free_slot;
+}
+
+static void __remove(flows *f, uint32_t slot)
+{
+    // a slot of a group that was never full is free again, else lookups must go on past it
+    f->tags[slot] = __match(f->tags + (slot & ~(uint32_t)(GROUP - 1)), SLOT_FREE) ? SLOT_FREE : SLOT_DELETED;
+    --f->stats.active;
+}
+
+static void __format_flags(uint8_t flags, char *s)
+{
+    static const char letters[8] = {'F', 'S', 'R', 'P', 'A', 'U', 'E', 'C'};
+    for (int i = 0; i != 8; ++i)
+    {
+        if (flags & 1 << i)
+            *s++ = letters[i];
+    }
+    *s = '\0';
+}
+
+// write a record of a flow, of its counts since the last one
+static void __export(flows *f, const struct flow_record *r, const char *end)
+{
+    if (!(r->packets[0] + r->packets[1]))
+        return;
+    const int s = r->source, d = !r->source;
+    const int family = r->key.version == 4 ? AF_INET : AF_INET6;
+    char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN], flags[9];
+    inet_ntop(family, s ? r->key.dst : r->key.src, src, sizeof(src));
+    inet_ntop(family, s ? r->key.src : r->key.dst, dst, sizeof(dst));
+    __format_flags(r->flags[0] | r->flags[1], flags);
+    const uint16_t sport = s ? r->key.dport : r->key.sport, dport = s ? r->key.sport : r->key.dport;
+    const char *fmt = f->cfg.format == FLOW_JSON
+        ? "{\"first\":%" PRIu64 ".%06" PRIu64 ",\"last\":%" PRIu64 ".%06" PRIu64 ",\"proto\":%u,\"src\":\"%s\","
+            "\"sport\":%u,\"dst\":\"%s\",\"dport\":%u,\"packets\":%" PRIu64 ",\"bytes\":%" PRIu64 ",\"rpackets\":%"
+            PRIu64 ",\"rbytes\":%" PRIu64 ",\"flags\":\"%s\",\"state\":\"%s\",\"end\":\"%s\"}\n"
+        : "%" PRIu64 ".%06" PRIu64 ",%" PRIu64 ".%06" PRIu64 ",%u,%s,%u,%s,%u,%" PRIu64 ",%" PRIu64 ",%" PRIu64
+            ",%" PRIu64 ",%s,%s,%s\n";
+    if (fprintf(f->cfg.out, fmt, r->first / 1000000, r->first % 1000000, r->last / 1000000, r->last % 1000000,
+        r->key.proto, src, sport, dst, dport, r->packets[s], r->bytes[s], r->packets[d], r->bytes[d], flags,
+        state_names[r->state], end) < 0)
+        f->failed = 1;
+    ++f->stats.records;
+}
+
+static void __schedule(flows *f, uint32_t slot, uint64_t due)
+{
+    // no further than a turn of the wheel, the flow is looked at again then
+    if (due <= f->now)
+        due = f->now + 1;
+    if (due > f->now + FLOW_WHEEL_SLOTS - 1)
+        due = f->now + FLOW_WHEEL_SLOTS - 1;
+    uint32_t *head = &f->wheel[due % FLOW_WHEEL_SLOTS];
+    f->records[slot].next = *head;
+    *head = slot;
+}
+
+// what the wheel does with a flow whose second came
+static void __expire(flows *f, uint32_t slot)
+{
+    struct flow_record *r = &f->records[slot];
+    const uint64_t last = r->last / 1000000;
+    const uint64_t timeout = r->state == STATE_CLOSED ? f->cfg.closed_timeout : f->cfg.idle_timeout;
+    if (last + timeout <= f->now)
+    {
+        __export(f, r, r->state == STATE_CLOSED ? "closed" : "idle");
+        __remove(f, slot);
+        return;
+    }
+    const uint64_t active = f->cfg.active_timeout;
+    // a closed connection is about to be exported anyway
+    if (active && r->state != STATE_CLOSED && f->now - r->exported >= active)
+    {
+        __export(f, r, "active");
+        memset(r->packets, 0, sizeof(r->packets));
+        memset(r->bytes, 0, sizeof(r->bytes));
+        r->exported = f->now;
+    }
+    const uint64_t due = last + timeout;
+    __schedule(f, slot, active && r->exported + active < due ? r->exported + active : due);
+}
+
+// turn the wheel to a second
+static void __advance(flows *f, uint64_t now)
+{
+    if (!f->now)
+    {
+        f->now = now;
+        return;
+    }
+    // a whole turn looks at every flow, however long it was
+    const uint64_t steps = now - f->now < FLOW_WHEEL_SLOTS ? now - f->now : FLOW_WHEEL_SLOTS;
+    const uint64_t from = f->now;
+    f->now = now;
+    for (uint64_t i = 1; i <= steps; ++i)
+    {
+        const unsigned int w = (from + i) % FLOW_WHEEL_SLOTS;
+        // what is put back goes to a new list
+        uint32_t slot = f->wheel[w];
+        f->wheel[w] = NONE;
+        while (slot != NONE)
+        {
+            const uint32_t next = f->records[slot].next;
+            __expire(f, slot);
+            slot = next;
+        }
+    }
+}
+
+static void __start(struct flow_record *r, const struct decoded_tuple *k, int dir, uint64_t us, const struct decoded_packet *d)
+{
+    memcpy(&r->key, k, sizeof(*k));
+    memset(r->packets, 0, sizeof(r->packets));
+    memset(r->bytes, 0, sizeof(r->bytes));
+    r->source = dir;
+    r->flags[0] = r->flags[1] = 0;
+    r->first = us;
+    r->exported = us / 1000000;
+    if (!(d->layers & DECODED_TCP))
+        r->state = STATE_OTHER;
+    else
+        r->state = (d->tcp_flags & (TH_SYN | TH_ACK)) == TH_SYN ? STATE_SYN : STATE_MIDSTREAM;
+}
+
+static void __tcp(struct flow_record *r, int dir, uint8_t flags)
+{
+    r->flags[dir] |= flags;
+    if (r->state == STATE_CLOSED)
+        return;
+    if (flags & TH_RST || r->flags[0] & r->flags[1] & TH_FIN)
+        r->state = STATE_CLOSED;
+    else if (flags & TH_FIN)
+        r->state = STATE_CLOSING;
+    else if (r->state == STATE_SYN && dir != r->source && (flags & (TH_SYN | TH_ACK)) == (TH_SYN | TH_ACK))
+        r->state = STATE_ESTABLISHED;
+}
+
+/**
+ * @brief Count a packet into its flow, a pcap_handler. Exports the flows that timed out by its timestamp.
+ *
+ * @param user the flow table.
+ * @param h the pcap header of the packet.
+ * @param packet the packet.
+ */
+void flow_handler(u_char *user, const struct pcap_pkthdr *h, const u_char *packet)
+{
+    flows *f = (flows *)user;
+    if ((uint64_t)h->ts.tv_sec > f->now)
+        __advance(f, h->ts.tv_sec);
+    struct decoded_packet d;
+    decode_packet(packet, h->caplen, h->len, &d);
+    if (!(d.layers & DECODED_IP))
+    {
+        ++f->stats.untracked;
+        return;
+    }
+    struct decoded_tuple k;
+    const int dir = decode_tuple(&d, &k);
+    const uint64_t hash = __hash(&k);
+    int found;
+    const uint32_t slot = __find(f, &k, hash, &found);
+    if (slot == NONE)
+    {
+        ++f->stats.untracked;
+        ++f->stats.full;
+        return;
+    }
+    struct flow_record *r = &f->records[slot];
+    const uint64_t us = (uint64_t)h->ts.tv_sec * 1000000 + h->ts.tv_usec;
+    if (!found)
+    {
+        f->tags[slot] = hash >> 57;
+        __start(r, &k, dir, us, &d);
+        __schedule(f, slot, f->now + (f->cfg.idle_timeout < f->cfg.active_timeout || !f->cfg.active_timeout
+            ? f->cfg.idle_timeout : f->cfg.active_timeout));
+        ++f->stats.flows;
+        if (++f->stats.active > f->stats.peak)
+            f->stats.peak = f->stats.active;
+    }
+    else if (r->state == STATE_CLOSED && d.layers & DECODED_TCP && (d.tcp_flags & (TH_SYN | TH_ACK)) == TH_SYN)
+    {
+        // a new connection over the 5-tuple of a closed one, in its slot and its place in the wheel
+        __export(f, r, "closed");
+        __start(r, &k, dir, us, &d);
+        ++f->stats.flows;
+    }
+    // the first packet since the last record, if the flow went on
+    if (!r->packets[0] && !r->packets[1])
+        r->first = us;
+    ++r->packets[dir];
+    r->bytes[dir] += h->len;
+    r->last = us;
+    if (d.layers & DECODED_TCP)
+        __tcp(r, dir, d.tcp_flags);
+    ++f->stats.packets;
+}
+
+/**
+ * @brief Turn the wheel to the clock when no packet comes, for a `live` table. Called between packets.
+ *
+ * @param user the flow table.
+ */
+void flow_idle(u_char *user)
+{
+    flows *f = (flows *)user;
+    if (!f->cfg.live || !f->now)
+        return;
+    const time_t now = time(NULL);
+    if ((uint64_t)now > f->now)
+        __advance(f, now);
+}
+
+/**
+ * @brief Export every flow left in the table, and flush the output.
+ *
+ * @param f the flow table.
+ * @return int 0 if success, -1 if a record could not be written.
+ */
+int flow_close(flows *f)
+{
+    for (size_t slot = 0; slot != f->cfg.capacity; ++slot)
+    {
+        if (f->tags[slot] & 0x80)
+            continue;
+        __export(f, &f->records[slot], "exit");
+        __remove(f, slot);
+    }
+    for (unsigned int i = 0; i != FLOW_WHEEL_SLOTS; ++i)
+        f->wheel[i] = NONE;
+    if (fflush(f->cfg.out))
+        f->failed = 1;
+    return f->failed ? -1 : 0;
+}
+
+/**
+ * @brief Get the statistics of a flow table.
+ *
+ * @param f the flow table.
+ * @param st the statistics.
+ */
+void flow_get_stats(flows *f, struct flow_stats *st)
+{
+    *st = f->stats;
+}
+
+void flow_print_stats(const struct flow_stats *st, FILE *fp)
+{
+    fprintf(fp, "[flows] %" PRIu64 " packets in %" PRIu64 " flows, %" PRIu64 " records, %" PRIu64 " at most at once in ",
+        st->packets, st->flows, st->records, st->peak);
+    if (st->tables > 1)
+        fprintf(fp, "one of %" PRIu64 " tables", st->tables);
+    else
+        fprintf(fp, "a table");
+    fprintf(fp, " of %" PRIu64 " (%" PRIu64 " MB); %" PRIu64 " packets not tracked, %" PRIu64 " for want of room\n",
+        st->capacity, st->tables * st->capacity * (sizeof(struct flow_record) + 1) >> 20, st->untracked, st->full);
+}
+
+void flow_free(flows *f)
+{
+    if (!f)
+        return;
+    free(f->tags);
+    free(f->records);
+    free(f);
+}
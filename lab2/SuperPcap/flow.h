@@ -0,0 +1,94 @@
+#ifndef __FLOW_H
+#define __FLOW_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pcap/pcap.h>
+
+#include "decode.h"
+
+/* configurations */
+#define FLOW_TABLE_SIZE 1048576U    /* flows in the table, a power of 2, 128 bytes each */
+#define FLOW_MAX_PROBES 8U          /* groups of 16 slots looked at for a flow, then it is not tracked */
+#define FLOW_IDLE_TIMEOUT 30        /* seconds with no packet, then a flow is exported and removed */
+#define FLOW_CLOSED_TIMEOUT 5       /* the same, for a TCP connection that was reset or closed both ways */
+#define FLOW_ACTIVE_TIMEOUT 300     /* seconds between two records of a flow that goes on, 0 for one record */
+#define FLOW_WHEEL_SLOTS 512U       /* seconds the timer wheel goes round in */
+
+/*
+
+Flow Table:
+    Who talks to whom, how much, and with which TCP flags, instead of every
+    packet: the packets are decoded (see decode.h) and counted into flows,
+    and a flow is written out as one line, CSV or JSON, when it ends.
+    A flow is the 5-tuple (the addresses, the protocol, and the ports of
+    TCP and UDP) in both directions, the end that sent the first packet is
+    its source. For each end: packets, bytes (on the wire), and the TCP
+    flags it sent, ORed. A TCP flow goes from `syn` (or `midstream` if the
+    SYN was not seen) to `established` at the SYN-ACK, to `closing` at the
+    first FIN, and to `closed` at the second, or at a RST.
+    Table: open addressing over `capacity` slots, allocated once, so memory
+    is bounded and no packet allocates. The slots are in groups of 16 with
+    a byte each: free, or 7 bits of the hash of its flow. A lookup compares
+    the 16 bytes of a group at once (SSE2), and compares only the flows
+    whose byte matches, so it reads one cache line of bytes and, mostly,
+    one record. A group with a free slot ends a lookup; a flow goes to the
+    first free slot of FLOW_MAX_PROBES groups, or is not tracked if there
+    is none (counted as `full`). The records are 128 bytes: the key and
+    the packet counts in the first cache line, so a lookup reads no more.
+    Timer wheel: FLOW_WHEEL_SLOTS lists of flows, one per second of packet
+    time. A flow is put in the list of the second it would time out at,
+    and is not moved as its packets come, so a packet costs no list work.
+    When the wheel comes to a list, every flow in it is either timed out
+    (exported and removed), or put again where its last packet says. A
+    flow that lasts longer than `active_timeout` is exported every that
+    many seconds, with its counts since the last record. The wheel follows
+    the timestamps of the packets, and the clock when no packet comes on
+    an interface (`live`). At the end every flow is exported.
+    A record is `first,last,proto,src,sport,dst,dport,packets,bytes,
+    rpackets,rbytes,flags,state,end`: r for the packets of the other end,
+    `end` is idle, closed, active (the flow goes on) or exit.
+
+*/
+
+#define FLOW_CSV 0
+#define FLOW_JSON 1
+
+struct flow_config
+{
+    FILE *out;                  // where the records go
+    int format;                 // FLOW_*
+    int header;                 // 1 to write the CSV header first
+    uint32_t capacity;          // flows, rounded up to a power of 2
+    int idle_timeout;           // seconds
+    int closed_timeout;
+    int active_timeout;         // 0 for one record per flow
+    int live;                   // 1 to follow the clock when no packet comes
+};
+
+struct flow_stats
+{
+    uint64_t packets;           // counted into a flow
+    uint64_t untracked;         // not IP, or with no room in the table
+    uint64_t full;              // no room in the table
+    uint64_t flows;             // started
+    uint64_t records;           // exported
+    uint64_t active;            // in the table
+    uint64_t peak;              // in one table at once, at most
+    uint64_t capacity;          // of one table
+    uint64_t tables;
+};
+
+typedef struct flows flows;
+
+void flow_default_config(struct flow_config *cfg);
+flows *flow_open(const struct flow_config *cfg, char *errbuf);
+void flow_handler(u_char *user, const struct pcap_pkthdr *h, const u_char *packet);
+void flow_idle(u_char *user);
+int flow_close(flows *f);
+void flow_get_stats(flows *f, struct flow_stats *st);
+void flow_print_stats(const struct flow_stats *st, FILE *fp);
+void flow_free(flows *f);
+
+#endif
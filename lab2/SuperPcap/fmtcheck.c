@@ -0,0 +1,135 @@
+/*
+ * Checks that format_frame() renders frames byte for byte like print_frame(),
+ * and times the two. The frames are synthetic (see synth.h), some cut short
+ * of their length, with every byte value in their payload, over several
+ * seconds of timestamps.
+ * Usage: sp_fmtcheck [packets]
+ * Returns 0 if the texts are the same. print_frame() is timed into a buffered
+ * FILE on /dev/null, which is faster than the unbuffered stdout it had.
+ */
+
+#include "util.h"
+#include "packet.h"
+#include "format.h"
+#include "synth.h"
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+
+#define CORPUS 4096
+
+struct corpus_frame
+{
+    struct pcap_pkthdr h;
+    uint8_t *data;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+    const uint64_t packets = argc > 1 ? strtoull(argv[1], NULL, 10) : 200000;
+    if (!packets)
+    {
+        fprintf(stderr, "Usage: %s [packets]\n", argv[0]);
+        return -1;
+    }
+
+    static struct corpus_frame corpus[CORPUS];
+    struct synth s;
+    synth_init(&s, 2);
+    for (int i = 0; i != CORPUS; ++i)
+    {
+        struct corpus_frame *f = &corpus[i];
+        if (!(f->data = malloc(SYNTH_MAX_FRAME)))
+        {
+            perror("Failed to malloc");
+            return -1;
+        }
+        synth_frame(&s, f->data, &f->h);
+        if (i % 7 == 0)
+        {
+            // every byte value, and a tail of any length in the dump
+            for (uint32_t j = 54; j < f->h.caplen; ++j)
+                f->data[j] = (uint8_t)(j * 37 + i);
+            f->h.caplen -= i % 16;
+            f->h.len = f->h.caplen;
+        }
+        if (i % 11 == 0 && f->h.caplen > 64)
+            f->h.caplen = 54 + i % 40; // cut short, like a snapshot length
+        if (i % 13 == 0)
+            f->h.ts.tv_sec += i; // new seconds for the time stamp cache
+    }
+
+    // the same?
+    char *ref = NULL;
+    size_t ref_len = 0;
+    FILE *fp = open_memstream(&ref, &ref_len);
+    struct text t;
+    memset(&t, 0, sizeof(t));
+    for (int i = 0; i != CORPUS; ++i)
+    {
+        print_frame(fp, &corpus[i].h, corpus[i].data);
+        if (format_frame(&t, &corpus[i].h, corpus[i].data))
+        {
+            perror("Failed to malloc");
+            return -1;
+        }
+    }
+    fclose(fp);
+    int failed = 0;
+    if (t.len != ref_len || memcmp(t.buf, ref, ref_len))
+    {
+        size_t i = 0;
+        while (i < ref_len && i < t.len && t.buf[i] == ref[i])
+            ++i;
+        fprintf(stderr, "format_frame() differs from print_frame() at byte %zu of %zu (%zu rendered):\n"
+            "expected: %.60s\n     got: %.60s\n", i, ref_len, t.len, ref + i, t.buf + i);
+        failed = 1;
+    }
+    else
+        printf("format_frame() and print_frame() agree on %d frames (%zu bytes of text).\n", CORPUS, ref_len);
+    free(ref);
+
+    // how fast?
+    FILE *null = fopen("/dev/null", "w");
+    if (!null)
+    {
+        perror("Cannot open /dev/null");
+        return -1;
+    }
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i != packets; ++i)
+        print_frame(null, &corpus[i % CORPUS].h, corpus[i % CORPUS].data);
+    fflush(null);
+    const double ref_ns = (double)(now_ns() - start) / packets;
+    start = now_ns();
+    t.len = 0;
+    for (uint64_t i = 0; i != packets; ++i)
+    {
+        format_frame(&t, &corpus[i % CORPUS].h, corpus[i % CORPUS].data);
+        if (t.len >= FORMAT_FLUSH_SIZE << 10)
+        {
+            fwrite(t.buf, 1, t.len, null);
+            t.len = 0;
+        }
+    }
+    fwrite(t.buf, 1, t.len, null);
+    fflush(null);
+    const double fmt_ns = (double)(now_ns() - start) / packets;
+    printf("print_frame():  %8.0f ns/packet, %10.0f packets/s\n", ref_ns, 1.0E9 / ref_ns);
+    printf("format_frame(): %8.0f ns/packet, %10.0f packets/s, %.1f times as fast\n",
+        fmt_ns, 1.0E9 / fmt_ns, ref_ns / fmt_ns);
+
+    fclose(null);
+    text_free(&t);
+    for (int i = 0; i != CORPUS; ++i)
+        free(corpus[i].data);
+    return failed;
+}
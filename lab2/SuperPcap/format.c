@@ -0,0 +1,503 @@
+#include "format.h"
+#include "util.h"
+
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <net/ethernet.h>
+
+#define FRAME_TEXT 2048     /* bytes, the most a frame takes without its hex dump */
+#define LINE_TEXT 72        /* bytes, a line of the hex dump (16 bytes of the frame) */
+#define DUMP_WIDTH 52       /* bytes, the hex part of a line of the dump */
+
+// copy a string literal
+#define PUT(o, s) (memcpy((o), (s), sizeof(s) - 1), (o) += sizeof(s) - 1)
+
+static char hex3[256][4];       // "XX "
+static char ascii[256];         // the byte, or '.' if it cannot be seen
+static char digits2[100][2];    // "00" to "99"
+static const char hex_digits[] = "0123456789ABCDEF";
+
+__attribute__((constructor)) static void __init_tables(void)
+{
+    for (int i = 0; i != 256; ++i)
+    {
+        hex3[i][0] = hex_digits[i >> 4];
+        hex3[i][1] = hex_digits[i & 15];
+        hex3[i][2] = ' ';
+        hex3[i][3] = ' ';
+        // like safe_print() in util.c, 127 passes
+        ascii[i] = (i < 32 || i > 127) ? '.' : (char)i;
+    }
+    for (int i = 0; i != 100; ++i)
+    {
+        digits2[i][0] = '0' + i / 10;
+        digits2[i][1] = '0' + i % 10;
+    }
+}
+
+/**
+ * @brief Make room for n more bytes of text.
+ *
+ * @param t the text.
+ * @param n bytes.
+ * @return int 0 if success, -1 if out of memory.
+ */
+int text_reserve(struct text *t, size_t n)
+{
+    if (t->len + n <= t->cap)
+        return 0;
+    size_t cap = t->cap ? t->cap : FORMAT_TEXT_SIZE << 10;
+    while (cap < t->len + n)
+        cap <<= 1;
+    char *buf = realloc(t->buf, cap);
+    if (!buf)
+        return -1;
+    t->buf = buf;
+    t->cap = cap;
+    return 0;
+}
+
+void text_free(struct text *t)
+{
+    free(t->buf);
+    memset(t, 0, sizeof(*t));
+}
+
+// %u
+static char *put_u32(char *o, uint32_t v)
+{
+    char tmp[10];
+    char *const end = tmp + sizeof(tmp);
+    char *p = end;
+    while (v >= 100)
+    {
+        p -= 2;
+        memcpy(p, digits2[v % 100], 2);
+        v /= 100;
+    }
+    if (v >= 10)
+    {
+        p -= 2;
+        memcpy(p, digits2[v], 2);
+    }
+    else
+        *--p = '0' + v;
+    memcpy(o, p, end - p);
+    return o + (end - p);
+}
+
+// %ld
+static char *put_long(char *o, long v)
+{
+    char tmp[20];
+    char *const end = tmp + sizeof(tmp);
+    char *p = end;
+    unsigned long u = v < 0 ? 0UL - (unsigned long)v : (unsigned long)v;
+    do
+    {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (v < 0)
+        *--p = '-';
+    memcpy(o, p, end - p);
+    return o + (end - p);
+}
+
+// %06ld, microseconds
+static char *put_usec(char *o, long v)
+{
+    if (v < 0 || v > 999999)
+        return o + sprintf(o, "%06ld", v);
+    memcpy(o, digits2[v / 10000], 2);
+    memcpy(o + 2, digits2[v / 100 % 100], 2);
+    memcpy(o + 4, digits2[v % 100], 2);
+    return o + 6;
+}
+
+// %02X
+static inline char *put_hex2(char *o, uint8_t v)
+{
+    memcpy(o, hex3[v], 2);
+    return o + 2;
+}
+
+// %04X of a 16-bit value
+static char *put_hex4(char *o, uint16_t v)
+{
+    memcpy(o, hex3[v >> 8], 2);
+    memcpy(o + 2, hex3[v & 0xFF], 2);
+    return o + 4;
+}
+
+// %4X of a 16-bit value, padded with spaces
+static char *put_hex4_padded(char *o, uint16_t v)
+{
+    for (int i = 3; i >= 0; --i)
+    {
+        o[i] = hex_digits[v & 15];
+        v >>= 4;
+        if (!v)
+        {
+            while (i--)
+                o[i] = ' ';
+            break;
+        }
+    }
+    return o + 4;
+}
+
+// "XX:XX:XX:XX:XX:XX\n"
+static char *put_mac(char *o, const uint8_t *m)
+{
+    for (int i = 0; i != 6; ++i)
+    {
+        memcpy(o, hex3[m[i]], 2);
+        o[2] = i == 5 ? '\n' : ':';
+        o += 3;
+    }
+    return o;
+}
+
+// "a.b.c.d\n"
+static char *put_ipv4(char *o, const uint8_t *a)
+{
+    for (int i = 0; i != 4; ++i)
+    {
+        o = put_u32(o, a[i]);
+        *o++ = i == 3 ? '\n' : '.';
+    }
+    return o;
+}
+
+static char *format_tcp(char *o, const struct decoded_packet *d)
+{
+    if (!(d->layers & DECODED_TCP))
+    {
+        PUT(o, "<Truncated layer-4 header>\n");
+        return o;
+    }
+    PUT(o, "Source Port: ");
+    o = put_u32(o, d->sport);
+    PUT(o, "\nDest. Port: ");
+    o = put_u32(o, d->dport);
+    PUT(o, "\nSequence Num.: ");
+    o = put_u32(o, d->seq);
+    PUT(o, "\nFlags: ");
+    const uint8_t flg = d->tcp_flags;
+    if (flg & TH_FIN)
+        PUT(o, "FIN ");
+    if (flg & TH_SYN)
+        PUT(o, "SYN ");
+    if (flg & TH_RST)
+        PUT(o, "RST ");
+    if (flg & TH_PUSH)
+        PUT(o, "PSH ");
+    if (flg & TH_ACK)
+        PUT(o, "ACK ");
+    if (flg & TH_URG)
+        PUT(o, "URG ");
+    *o++ = '\n';
+    // the acknowledgment number, window and checksum in network byte order, like l4_tcp()
+    if (flg & TH_ACK)
+    {
+        PUT(o, "ACK Num.: ");
+        o = put_u32(o, htonl(d->ack));
+        *o++ = '\n';
+    }
+    PUT(o, "Window Size: ");
+    o = put_u32(o, htons(d->window));
+    PUT(o, "\nChecksum: 0x");
+    o = put_hex4_padded(o, htons(d->l4_check));
+    *o++ = '\n';
+    return o;
+}
+
+static char *format_udp(char *o, const struct decoded_packet *d)
+{
+    if (!(d->layers & DECODED_UDP))
+    {
+        PUT(o, "<Truncated layer-4 header>\n");
+        return o;
+    }
+    PUT(o, "Source Port: ");
+    o = put_u32(o, d->sport);
+    PUT(o, "\nDest. Port: ");
+    o = put_u32(o, d->dport);
+    const uint16_t length = d->udp_len;
+    PUT(o, "\nLength: ");
+    o = put_u32(o, length);
+    PUT(o, " bytes (");
+    o = put_u32(o, length - 8U);
+    PUT(o, " bytes of layer-7 payload)\nChecksum: 0x");
+    o = put_hex4_padded(o, htons(d->l4_check));
+    *o++ = '\n';
+    return o;
+}
+
+static char *format_ipv4(char *o, const struct decoded_packet *d)
+{
+    if (!(d->layers & DECODED_IPV4))
+    {
+        PUT(o, "<Truncated layer-3 header>\n");
+        return o;
+    }
+    PUT(o, "Version: 0x");
+    *o++ = hex_digits[d->version];
+    const unsigned int ihl = d->ihl;
+    PUT(o, "\nIHL (Internet Header Length): ");
+    o = put_u32(o, ihl);
+    PUT(o, " (");
+    o = put_u32(o, ihl * 4U);
+    PUT(o, " bytes)\nPayload size: ");
+    o = put_u32(o, d->ip_len);
+    PUT(o, " bytes\nIdentification: 0x");
+    o = put_hex4(o, d->ip_id);
+    // the flags and the fragment offset come from frag_off in network byte order, like l3_ip()
+    const uint16_t frag_off = htons(d->frag_off);
+    const unsigned int flags = frag_off >> 13U;
+    PUT(o, "\nFlags: ");
+    *o++ = flags & 4 ? '1' : '0';
+    *o++ = flags & 2 ? '1' : '0';
+    *o++ = flags & 1 ? '1' : '0';
+    PUT(o, "\nFragment Offset: ");
+    o = put_u32(o, ntohs(frag_off & 0x1FFFU));
+    PUT(o, "\nTTL: ");
+    o = put_u32(o, d->ttl);
+    PUT(o, "\nLayer-4 Protocol: ");
+    o = put_u32(o, d->l4_proto);
+    const char *name;
+    size_t name_len;
+    switch (d->l4_proto)
+    {
+        case IPPROTO_TCP:
+            name = " (TCP)\n";
+            break;
+        case IPPROTO_UDP:
+            name = " (UDP)\n";
+            break;
+        case IPPROTO_ICMP:
+            name = " (ICMP)\n";
+            break;
+        default:
+            name = " (<Unknown>)\n";
+            break;
+    }
+    name_len = strlen(name);
+    memcpy(o, name, name_len);
+    o += name_len;
+    PUT(o, "Checksum: 0x");
+    o = put_hex4_padded(o, htons(d->ip_check));
+    PUT(o, "\nSource Address: ");
+    o = put_ipv4(o, d->src);
+    PUT(o, "Dest. Address: ");
+    o = put_ipv4(o, d->dst);
+
+    PUT(o, "\n+ Layer 4 ");
+    memcpy(o, name + 1, name_len - 1);
+    o += name_len - 2;
+    PUT(o, ":\n");
+    if (d->layers & DECODED_FRAGMENT)
+    {
+        PUT(o, "<Layer-4 fragment>\n");
+        return o;
+    }
+    if (!d->l4_offset)
+    {
+        PUT(o, "<Truncated layer-4 header>\n");
+        return o;
+    }
+    switch (d->l4_proto)
+    {
+        case IPPROTO_TCP:
+            return format_tcp(o, d);
+        case IPPROTO_UDP:
+            return format_udp(o, d);
+        case IPPROTO_ICMP:
+            PUT(o, "<ICMP datagram>\n");
+            return o;
+        default:
+            PUT(o, "<Unknown layer-4 payload>\n");
+            return o;
+    }
+}
+
+static char *format_decoded(char *o, const uint8_t *p, const struct decoded_packet *d)
+{
+    PUT(o, "+ Layer 2 (Ethernet):\n");
+    if (!(d->layers & DECODED_ETHERNET))
+    {
+        PUT(o, "<Truncated layer-2 header>\n");
+        return o;
+    }
+    PUT(o, "Src: ");
+    o = put_mac(o, p);
+    PUT(o, "Dst: ");
+    o = put_mac(o, p + 6);
+    const uint16_t type = d->ether_type;
+    const char *name;
+    switch (type)
+    {
+        case ETHERTYPE_IP:
+            name = "IP";
+            break;
+        case ETHERTYPE_ARP:
+            name = "ARP";
+            break;
+        case ETHERTYPE_REVARP:
+            name = "Reverse ARP";
+            break;
+        case ETHERTYPE_IPV6:
+            name = "IPv6";
+            break;
+        case ETHERTYPE_LOOPBACK:
+            name = "Loopback";
+            break;
+        default:
+            name = "<Unknown>";
+            break;
+    }
+    const size_t name_len = strlen(name);
+    PUT(o, "Layer-3 protocol: 0x");
+    o = put_hex4(o, type);
+    PUT(o, " (");
+    memcpy(o, name, name_len);
+    o += name_len;
+    PUT(o, ")\n\n+ Layer 3 (");
+    memcpy(o, name, name_len);
+    o += name_len;
+    PUT(o, "):\n");
+    switch (type)
+    {
+        case ETHERTYPE_IP:
+            return format_ipv4(o, d);
+        case ETHERTYPE_IPV6:
+            PUT(o, "<IPv6 fragment>\n");
+            return o;
+        default:
+            PUT(o, "<Unknown layer-3 payload>\n");
+            return o;
+    }
+}
+
+// like binary_write() in util.c
+static char *format_dump(char *o, const uint8_t *b, size_t n)
+{
+    for (; n >= 16; n -= 16, b += 16)
+    {
+        for (int i = 0; i != 16; i += 4)
+        {
+            // 4 bytes are copied for each "XX ", the last one is overwritten next
+            memcpy(o, hex3[b[i]], 4);
+            memcpy(o + 3, hex3[b[i + 1]], 4);
+            memcpy(o + 6, hex3[b[i + 2]], 4);
+            memcpy(o + 9, hex3[b[i + 3]], 4);
+            o[12] = ' ';
+            o += 13;
+        }
+        PUT(o, "|  ");
+        for (int i = 0; i != 16; ++i)
+            o[i] = ascii[b[i]];
+        o[16] = '\n';
+        o += 17;
+    }
+    if (n)
+    {
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            memcpy(o, hex3[b[i]], 4);
+            memcpy(o + 3, hex3[b[i + 1]], 4);
+            memcpy(o + 6, hex3[b[i + 2]], 4);
+            memcpy(o + 9, hex3[b[i + 3]], 4);
+            o[12] = ' ';
+            o += 13;
+        }
+        for (; i != n; ++i)
+        {
+            memcpy(o, hex3[b[i]], 4);
+            o += 3;
+        }
+        const size_t pad = DUMP_WIDTH - (n / 4 + n * 3);
+        memset(o, ' ', pad);
+        o += pad;
+        PUT(o, "|  ");
+        for (i = 0; i != n; ++i)
+            o[i] = ascii[b[i]];
+        o[n] = '\n';
+        o += n + 1;
+    }
+    return o;
+}
+
+/**
+ * @brief Render a frame like print_frame() does, at the end of a text.
+ * Safe to call from several threads at once, on different texts.
+ *
+ * @param t the text.
+ * @param h the pcap header of the frame.
+ * @param packet the frame.
+ * @return int 0 if success, -1 if out of memory.
+ */
+int format_frame(struct text *t, const struct pcap_pkthdr *h, const u_char *packet)
+{
+    struct decoded_packet d;
+    decode_packet(packet, h->caplen, h->len, &d);
+    return format_decoded_frame(t, h, packet, &d);
+}
+
+/**
+ * @brief Render a frame that is already decoded, like format_frame().
+ *
+ * @param t the text.
+ * @param h the pcap header of the frame.
+ * @param packet the frame.
+ * @param d the frame, decoded by decode_packet().
+ * @return int 0 if success, -1 if out of memory.
+ */
+int format_decoded_frame(struct text *t, const struct pcap_pkthdr *h, const u_char *packet, const struct decoded_packet *d)
+{
+    if (text_reserve(t, FRAME_TEXT + (h->caplen / 16 + 1) * LINE_TEXT))
+        return -1;
+    char *o = t->buf + t->len;
+    PUT(o, "======== FRAME START ========\n[Frame] time=");
+    o = put_long(o, h->ts.tv_sec);
+    *o++ = '.';
+    o = put_usec(o, h->ts.tv_usec);
+
+    // the local time changes once a second
+    if (!t->stamp_len || t->stamp_sec != h->ts.tv_sec)
+    {
+        struct tm tm;
+        const time_t sec = h->ts.tv_sec;
+        t->stamp_len = localtime_r(&sec, &tm) ? strftime(t->stamp, sizeof(t->stamp), "%Y-%m-%d %H:%M:%S", &tm) : 0;
+        t->stamp_sec = sec;
+    }
+    PUT(o, " [");
+    memcpy(o, t->stamp, t->stamp_len);
+    o += t->stamp_len;
+    *o++ = '.';
+    o = put_usec(o, h->ts.tv_usec);
+    PUT(o, "], ");
+
+    o = put_u32(o, h->caplen != h->len ? h->caplen : h->len);
+    if (h->caplen != h->len)
+    {
+        PUT(o, " bytes captured (");
+        o = put_u32(o, h->len);
+        PUT(o, " bytes in total) ");
+    }
+    else
+        PUT(o, " bytes ");
+    PUT(o, "\n\n");
+
+    o = format_decoded(o, packet, d);
+    PUT(o, "\nLink-layer frame data:\n");
+    o = format_dump(o, packet, h->caplen);
+    PUT(o, "========  FRAME END  ========\n\n");
+    t->len = o - t->buf;
+    return 0;
+}
@@ -0,0 +1,50 @@
+#ifndef __FORMAT_H
+#define __FORMAT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pcap/pcap.h>
+
+#include "decode.h"
+
+/* configurations */
+#define FORMAT_TEXT_SIZE 1024U      /* KB, the first size of a text buffer, it grows when needed */
+#define FORMAT_FLUSH_SIZE 256U      /* KB, text written at once when decoding without a pipeline */
+
+/*
+
+Text Formatter:
+    format_frame() renders a frame exactly as print_frame() prints it (see
+    packet.c), byte for byte, but into a memory buffer instead of through
+    ~100 fprintf() calls and one fputc() per byte:
+    - The room a frame needs at most is reserved once, then the text is
+      copied in with no more checks.
+    - Hex and ASCII come from 256-entry tables, a 16-byte line of the dump
+      is built with fixed copies.
+    - Integers are formatted two digits at a time from a table.
+    - The local time is rendered by strftime() once per second, and the
+      string is kept in the buffer for the next frames of that second.
+    The text is written out by the caller, in large pieces (see pipeline.h).
+    print_frame() stays as the reference; `make format-check` compares the two
+    on synthetic traffic and times them.
+
+*/
+
+struct text
+{
+    char *buf;
+    size_t len;
+    size_t cap;
+    time_t stamp_sec;       // the second `stamp` is for
+    char stamp[32];         // its local time, "YYYY-mm-dd HH:MM:SS"
+    size_t stamp_len;
+};
+
+int text_reserve(struct text *t, size_t n);
+void text_free(struct text *t);
+int format_frame(struct text *t, const struct pcap_pkthdr *h, const u_char *packet);
+int format_decoded_frame(struct text *t, const struct pcap_pkthdr *h, const u_char *packet, const struct decoded_packet *d);
+
+#endif
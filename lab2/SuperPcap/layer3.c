@@ -26,39 +26,51 @@ static const char *ipv4_get_next_protocol(int s)
     }
 }
 
-void l3_default(FILE *fp, const void *buf, size_t size)
+void l3_default(FILE *fp, const struct decoded_packet *d)
 {
     fprintf(fp, "<Unknown layer-3 payload>\n");
 }
 
-void l3_ip(FILE *fp, const void *buf, size_t size)
+void l3_ip(FILE *fp, const struct decoded_packet *d)
 {
     #define BINARY(x) ((x)?1:0)
-    #define BYTE1(x) (((uint32_t)x) & 0xFFU)
-    #define BYTE2(x) ((((uint32_t)x) & 0xFF00U) >> 8)
-    #define BYTE3(x) ((((uint32_t)x) & 0xFF0000U) >> 16)
-    #define BYTE4(x) ((((uint32_t)x) & 0xFF000000U) >> 24)
+    if (!(d->layers & DECODED_IPV4))
+    {
+        fprintf(fp, "<Truncated layer-3 header>\n");
+        return;
+    }
     // fprintf(fp, "IP Datagram:\n");
-    fprintf(fp, "Version: 0x%X\n", IPV4(buf)->version); // FIX THIS
-    const unsigned int ihl = IPV4(buf)->ihl & 0x0FU;
+    fprintf(fp, "Version: 0x%X\n", d->version);
+    const unsigned int ihl = d->ihl;
     const uint32_t ipv4_header_bytes = ihl * 4U;
     fprintf(fp, "IHL (Internet Header Length): %d (%d bytes)\n", ihl, ipv4_header_bytes);
-    fprintf(fp, "Payload size: %" PRIu16 " bytes\n", ntohs(IPV4(buf)->tot_len));
-    fprintf(fp, "Identification: 0x%04X\n", ntohs(IPV4(buf)->id));
-    unsigned int flags = IPV4(buf)->frag_off >> 13U;
+    fprintf(fp, "Payload size: %" PRIu16 " bytes\n", d->ip_len);
+    fprintf(fp, "Identification: 0x%04X\n", d->ip_id);
+    // the flags and the offset were always taken from frag_off in network byte order
+    const uint16_t frag_off = htons(d->frag_off);
+    unsigned int flags = frag_off >> 13U;
     fprintf(fp, "Flags: %d%d%d\n", BINARY(flags&4), BINARY(flags&2), BINARY(flags&1));
-    fprintf(fp, "Fragment Offset: %u\n",  ntohs(IPV4(buf)->frag_off & 0x1FFFU));
-    fprintf(fp, "TTL: %d\n", IPV4(buf)->ttl);
-    const uint8_t l4_proto = IPV4(buf)->protocol;
+    fprintf(fp, "Fragment Offset: %u\n",  ntohs(frag_off & 0x1FFFU));
+    fprintf(fp, "TTL: %d\n", d->ttl);
+    const uint8_t l4_proto = d->l4_proto;
     const char *l4_proto_str = ipv4_get_next_protocol(l4_proto);
     fprintf(fp, "Layer-4 Protocol: %u (%s)\n", l4_proto, l4_proto_str);
-    fprintf(fp, "Checksum: 0x%4X\n", IPV4(buf)->check);
-    int s = IPV4(buf)->saddr, d = IPV4(buf)->daddr;
-    fprintf(fp, "Source Address: %d.%d.%d.%d\n", BYTE1(s), BYTE2(s), BYTE3(s), BYTE4(s));
-    fprintf(fp, "Dest. Address: %d.%d.%d.%d\n", BYTE1(d), BYTE2(d), BYTE3(d), BYTE4(d));
+    fprintf(fp, "Checksum: 0x%4X\n", htons(d->ip_check));
+    fprintf(fp, "Source Address: %d.%d.%d.%d\n", d->src[0], d->src[1], d->src[2], d->src[3]);
+    fprintf(fp, "Dest. Address: %d.%d.%d.%d\n", d->dst[0], d->dst[1], d->dst[2], d->dst[3]);
 
     fprintf(fp, "\n");
     fprintf(fp, "+ Layer 4 (%s):\n", l4_proto_str);
+    if (d->layers & DECODED_FRAGMENT)
+    {
+        fprintf(fp, "<Layer-4 fragment>\n");
+        return;
+    }
+    if (!d->l4_offset)
+    {
+        fprintf(fp, "<Truncated layer-4 header>\n");
+        return;
+    }
     layer4_handler *handler;
     switch(l4_proto)
     {
@@ -75,15 +87,11 @@ void l3_ip(FILE *fp, const void *buf, size_t size)
             handler = &l4_default;
             break;
     }
-    handler(fp, buf+ipv4_header_bytes, size - ipv4_header_bytes);
+    handler(fp, d);
     #undef BINARY
-    #undef BYTE1
-    #undef BYTE2
-    #undef BYTE3
-    #undef BYTE4
 }
 
-void l3_ipv6(FILE *fp, const void *buf, size_t size)
+void l3_ipv6(FILE *fp, const struct decoded_packet *d)
 {
     fprintf(fp, "<IPv6 fragment>\n");
 }
\ No newline at end of file
@@ -14,12 +14,10 @@
 
 #include "layer4.h"
 
-void l3_default(FILE *fp, const void *buf, size_t size);
-void l3_ip(FILE *fp, const void *buf, size_t size);
-void l3_ipv6(FILE *fp, const void *buf, size_t size);
+void l3_default(FILE *fp, const struct decoded_packet *d);
+void l3_ip(FILE *fp, const struct decoded_packet *d);
+void l3_ipv6(FILE *fp, const struct decoded_packet *d);
 
-#define IPV4(x) ((struct iphdr*)(x))
-
-typedef void (layer3_handler)(FILE *, const void*, size_t);
+typedef void (layer3_handler)(FILE *, const struct decoded_packet *);
 
 #endif
\ No newline at end of file
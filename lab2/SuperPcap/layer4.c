@@ -1,6 +1,6 @@
 #include "layer4.h"
 
-void l4_tcp(FILE *fp, const void *buf, size_t n)
+void l4_tcp(FILE *fp, const struct decoded_packet *d)
 {
     #define BINARY(x) ((x)?1:0)
     #define CWR(x) BINARY(x&128)
@@ -11,13 +11,17 @@ void l4_tcp(FILE *fp, const void *buf, size_t n)
     #define RST(x) BINARY(x&4)
     #define SYN(x) BINARY(x&2)
     #define FIN(x) BINARY(x&1)
-    const struct tcphdr* tcp = buf;
-    fprintf(fp, "Source Port: %u\n", ntohs(tcp->th_sport));
-    fprintf(fp, "Dest. Port: %u\n", ntohs(tcp->th_dport));
-    fprintf(fp, "Sequence Num.: %u\n", ntohl(tcp->th_seq));
+    if (!(d->layers & DECODED_TCP))
+    {
+        fprintf(fp, "<Truncated layer-4 header>\n");
+        return;
+    }
+    fprintf(fp, "Source Port: %u\n", d->sport);
+    fprintf(fp, "Dest. Port: %u\n", d->dport);
+    fprintf(fp, "Sequence Num.: %u\n", d->seq);
 
     fprintf(fp, "Flags: ");
-    const uint8_t flg = tcp->th_flags;
+    const uint8_t flg = d->tcp_flags;
     if (FIN(flg))
         fprintf(fp, "FIN ");
     if (SYN(flg))
@@ -32,13 +36,14 @@ void l4_tcp(FILE *fp, const void *buf, size_t n)
         fprintf(fp, "URG ");
     fprintf(fp, "\n");
 
+    // these were always printed in network byte order
     if (ACK(flg))
     {
-        fprintf(fp, "ACK Num.: %u\n", tcp->th_ack);
+        fprintf(fp, "ACK Num.: %u\n", htonl(d->ack));
     }
     
-    fprintf(fp, "Window Size: %u\n", tcp->th_win);
-    fprintf(fp, "Checksum: 0x%4X\n", tcp->th_sum);
+    fprintf(fp, "Window Size: %u\n", htons(d->window));
+    fprintf(fp, "Checksum: 0x%4X\n", htons(d->l4_check));
 
     #undef BINARY
     #undef CWR
@@ -51,22 +56,26 @@ void l4_tcp(FILE *fp, const void *buf, size_t n)
     #undef FIN
 }
 
-void l4_udp(FILE *fp, const void *buf, size_t n)
+void l4_udp(FILE *fp, const struct decoded_packet *d)
 {
-    const struct udphdr *udp = buf;
-    fprintf(fp, "Source Port: %u\n", ntohs(udp->uh_sport));
-    fprintf(fp, "Dest. Port: %u\n", ntohs(udp->uh_dport));
-    uint16_t length = ntohs(udp->uh_ulen);
+    if (!(d->layers & DECODED_UDP))
+    {
+        fprintf(fp, "<Truncated layer-4 header>\n");
+        return;
+    }
+    fprintf(fp, "Source Port: %u\n", d->sport);
+    fprintf(fp, "Dest. Port: %u\n", d->dport);
+    uint16_t length = d->udp_len;
     fprintf(fp, "Length: %u bytes (%u bytes of layer-7 payload)\n", length, length - 8U);
-    fprintf(fp, "Checksum: 0x%4X\n", udp->uh_sum);
+    fprintf(fp, "Checksum: 0x%4X\n", htons(d->l4_check));
 }
 
-void l4_icmp(FILE *fp, const void *buf, size_t n)
+void l4_icmp(FILE *fp, const struct decoded_packet *d)
 {
     fprintf(fp, "<ICMP datagram>\n");
 }
 
-void l4_default(FILE *fp, const void *buf, size_t n)
+void l4_default(FILE *fp, const struct decoded_packet *d)
 {
     fprintf(fp, "<Unknown layer-4 payload>\n");
 }
\ No newline at end of file
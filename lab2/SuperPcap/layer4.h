@@ -14,11 +14,13 @@
 #include <netinet/udp.h>
 #include <net/ethernet.h>
 
-typedef void (layer4_handler)(FILE *, const void*, size_t);
+#include "decode.h"
 
-void l4_tcp(FILE *fp, const void *buf, size_t n);
-void l4_udp(FILE *fp, const void *buf, size_t n);
-void l4_icmp(FILE *fp, const void *buf, size_t n);
-void l4_default(FILE *fp, const void *buf, size_t n);
+typedef void (layer4_handler)(FILE *, const struct decoded_packet *);
+
+void l4_tcp(FILE *fp, const struct decoded_packet *d);
+void l4_udp(FILE *fp, const struct decoded_packet *d);
+void l4_icmp(FILE *fp, const struct decoded_packet *d);
+void l4_default(FILE *fp, const struct decoded_packet *d);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,496 @@
+#include "offline.h"
+#include "util.h"
+
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <byteswap.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#define PCAP_MAGIC_USEC 0xA1B2C3D4U
+#define PCAP_MAGIC_NSEC 0xA1B23C4DU
+#define PCAPNG_MAGIC 0x0A0D0D0AU
+#define FILE_HEADER_SIZE 24
+#define RECORD_HEADER_SIZE 16
+
+#define CHUNK_FREE 0
+#define CHUNK_SCANNED 1     // waits for a decoder
+#define CHUNK_TAKEN 2       // being decoded
+#define CHUNK_DONE 3        // waits to be written
+
+struct chunk
+{
+    uint64_t seq;
+    size_t begin;           // offsets in the file, on records
+    size_t end;
+    int state;              // CHUNK_*
+    struct text text;
+};
+
+struct offline
+{
+    struct offline_config cfg;
+    int fd;
+    uint8_t *map;
+    size_t mapped;
+    size_t size;            // of the file, or up to its last whole record
+    size_t page;
+    int swapped;            // the other byte order
+    int nsec;               // nanosecond timestamps
+    int linktype;
+    volatile sig_atomic_t stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct chunk *chunks;
+    unsigned int chunk_count;
+    uint64_t scanned;       // chunks scanned, the next sequence number
+    uint64_t taken;         // by the decoders
+    uint64_t written;       // in order
+    int scan_done;
+    int writing;            // a thread is writing, the others leave their chunks to it
+    size_t dropped;         // the mapping is dropped below this
+    int failed;
+    pthread_t *threads;
+    int started;
+    struct offline_stats stats;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint32_t __u32(const offline *o, const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return o->swapped ? bswap_32(v) : v;
+}
+
+// the pcap header of the record at `off`, and its packet
+static inline const uint8_t *__record(const offline *o, size_t off, struct pcap_pkthdr *h)
+{
+    const uint8_t *r = o->map + off;
+    h->ts.tv_sec = __u32(o, r);
+    h->ts.tv_usec = o->nsec ? __u32(o, r + 4) / 1000 : __u32(o, r + 4);
+    h->caplen = __u32(o, r + 8);
+    h->len = __u32(o, r + 12);
+    return r + RECORD_HEADER_SIZE;
+}
+
+/**
+ * @brief Tell if a file is a pcap file, that offline_open() reads.
+ *
+ * @param file the path.
+ * @return int 1 if it is, 0 if not or it cannot be read.
+ */
+int offline_probe(const char *file)
+{
+    uint32_t magic;
+    const int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    const int n = read(fd, &magic, sizeof(magic));
+    close(fd);
+    return n == sizeof(magic) && (magic == PCAP_MAGIC_USEC || magic == PCAP_MAGIC_NSEC
+        || magic == bswap_32(PCAP_MAGIC_USEC) || magic == bswap_32(PCAP_MAGIC_NSEC));
+}
+
+/**
+ * @brief Fill in the defaults of an offline reader configuration.
+ *
+ * @param cfg the configuration.
+ */
+void offline_default_config(struct offline_config *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cfg->workers = cpus > 0 ? (int)cpus : 1;
+    cfg->chunk_size = (size_t)OFFLINE_CHUNK_SIZE << 10;
+    cfg->chunks = OFFLINE_CHUNKS;
+    cfg->out = stdout;
+}
+
+/**
+ * @brief Map a pcap file to read it.
+ *
+ * @param cfg the configuration, copied.
+ * @param errbuf PCAP_ERRBUF_SIZE bytes, to tell what failed.
+ * @return offline* the reader, NULL if failed.
+ */
+offline *offline_open(const struct offline_config *cfg, char *errbuf)
+{
+    if (!cfg->chunk_size || (!cfg->headers_only && (!cfg->decode || !cfg->out)) || cfg->workers < 0)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "Bad offline reader configuration.");
+        return NULL;
+    }
+    offline *o = calloc(1, sizeof(offline));
+    if (!o)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "Failed to malloc.");
+        return NULL;
+    }
+    o->cfg = *cfg;
+    o->page = sysconf(_SC_PAGESIZE);
+    if ((o->fd = open(cfg->file, O_RDONLY | O_CLOEXEC)) < 0)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s", strerror(errno));
+        goto OPEN_FAILED;
+    }
+    struct stat st;
+    if (fstat(o->fd, &st))
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s", strerror(errno));
+        goto OPEN_FAILED;
+    }
+    if ((size_t)st.st_size < FILE_HEADER_SIZE)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "Too short for a pcap file.");
+        goto OPEN_FAILED;
+    }
+    o->size = o->mapped = st.st_size;
+    if ((o->map = mmap(NULL, o->mapped, PROT_READ, MAP_SHARED, o->fd, 0)) == MAP_FAILED)
+    {
+        o->map = NULL;
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "Cannot map the file: %s", strerror(errno));
+        goto OPEN_FAILED;
+    }
+    // read once, from the first byte to the last
+    madvise(o->map, o->mapped, MADV_SEQUENTIAL);
+
+    uint32_t magic;
+    memcpy(&magic, o->map, sizeof(magic));
+    o->swapped = magic == bswap_32(PCAP_MAGIC_USEC) || magic == bswap_32(PCAP_MAGIC_NSEC);
+    o->nsec = magic == PCAP_MAGIC_NSEC || magic == bswap_32(PCAP_MAGIC_NSEC);
+    if (!o->swapped && !o->nsec && magic != PCAP_MAGIC_USEC)
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, magic == PCAPNG_MAGIC ? "A pcapng file, not a pcap file."
+            : "Not a pcap file.");
+        goto OPEN_FAILED;
+    }
+    o->linktype = __u32(o, o->map + 20) & 0xFFFF; // the upper bits tell the FCS length, if any
+
+    o->chunk_count = cfg->workers ? cfg->workers * (cfg->chunks ? cfg->chunks : 1) : 1;
+    if (!(o->chunks = calloc(o->chunk_count, sizeof(struct chunk))))
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "Failed to malloc.");
+        goto OPEN_FAILED;
+    }
+    if (cfg->workers && !(o->threads = calloc(cfg->workers, sizeof(pthread_t))))
+    {
+        snprintf(errbuf, PCAP_ERRBUF_SIZE, "Failed to malloc.");
+        goto OPEN_FAILED;
+    }
+    pthread_mutex_init(&o->lock, NULL);
+    pthread_cond_init(&o->cond, NULL);
+    return o;
+
+OPEN_FAILED:
+    if (o->map)
+        munmap(o->map, o->mapped);
+    if (o->fd >= 0)
+        close(o->fd);
+    free(o->chunks);
+    free(o);
+    return NULL;
+}
+
+/**
+ * @brief Get the link-layer type of the packets of the file.
+ *
+ * @param o the reader.
+ * @return int DLT_* type.
+ */
+int offline_datalink(offline *o)
+{
+    return o->linktype;
+}
+
+// cut a chunk of about `chunk_size` bytes from `begin`, reading the record headers only
+// return 1 if there is one, 0 at the end of the file, -1 if the file is corrupt
+static int __scan(offline *o, size_t begin, size_t *end)
+{
+    const size_t limit = begin + o->cfg.chunk_size;
+    size_t off = begin;
+    while (off < limit && off + RECORD_HEADER_SIZE <= o->size)
+    {
+        const uint32_t caplen = __u32(o, o->map + off + 8);
+        if (caplen > OFFLINE_MAX_RECORD)
+        {
+            fprintf(stderr, "%s: a corrupt record at byte %zu, %" PRIu32 " bytes long.\n", o->cfg.file, off, caplen);
+            return -1;
+        }
+        if (off + RECORD_HEADER_SIZE + caplen > o->size)
+            break;
+        off += RECORD_HEADER_SIZE + caplen;
+    }
+    if (off < limit && off != o->size)
+    {
+        // like libpcap, the packets before are read
+        fprintf(stderr, "%s: the file ends in the middle of a record, at byte %zu.\n", o->cfg.file, off);
+        o->size = off;
+    }
+    *end = off;
+    return off > begin;
+}
+
+static void __add_stats(struct offline_stats *sum, const struct offline_stats *st)
+{
+    if (!st->packets)
+        return;
+    if (!sum->packets || timercmp(&st->first, &sum->first, <))
+        sum->first = st->first;
+    if (!sum->packets || timercmp(&st->last, &sum->last, >))
+        sum->last = st->last;
+    sum->packets += st->packets;
+    sum->bytes += st->bytes;
+    sum->captured += st->captured;
+    for (int i = 0; i != 8; ++i)
+        sum->layers[i] += st->layers[i];
+}
+
+static int __decode_chunk(offline *o, struct chunk *c, struct offline_stats *st)
+{
+    memset(st, 0, sizeof(*st));
+    c->text.len = 0;
+    for (size_t off = c->begin; off < c->end; )
+    {
+        struct pcap_pkthdr h;
+        const uint8_t *packet = __record(o, off, &h);
+        off += RECORD_HEADER_SIZE + h.caplen;
+        if (!st->packets || timercmp(&h.ts, &st->first, <))
+            st->first = h.ts;
+        if (!st->packets || timercmp(&h.ts, &st->last, >))
+            st->last = h.ts;
+        ++st->packets;
+        st->bytes += h.len;
+        st->captured += h.caplen;
+        if (o->cfg.headers_only)
+        {
+            // nothing past the headers is read
+            struct decoded_packet d;
+            const int layers = decode_packet(packet, h.caplen, h.len, &d);
+            for (int i = 0; i != 8; ++i)
+                st->layers[i] += layers >> i & 1;
+        }
+        else if (o->cfg.decode(&c->text, &h, packet))
+        {
+            fprintf(stderr, "Out of memory, the chunk at byte %zu is not decoded.\n", c->begin);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// write the chunks that are done in file order (not timestamp order, see offline.h),
+// called and returns with the lock held
+static void __write_done(offline *o)
+{
+    if (o->writing)
+        return;
+    o->writing = 1;
+    for (;;)
+    {
+        struct chunk *c = &o->chunks[o->written % o->chunk_count];
+        if (c->state != CHUNK_DONE || c->seq != o->written)
+            break;
+        pthread_mutex_unlock(&o->lock);
+        if (!o->cfg.headers_only && c->text.len && !o->failed
+            && fwrite(c->text.buf, 1, c->text.len, o->cfg.out) != c->text.len)
+        {
+            perror("Cannot write the capture log");
+            o->failed = 1;
+        }
+        // the chunk is not read again, neither is anything before it
+        const size_t drop = c->end & ~(o->page - 1);
+        if (drop > o->dropped)
+        {
+            madvise(o->map + o->dropped, drop - o->dropped, MADV_DONTNEED);
+            o->dropped = drop;
+        }
+        pthread_mutex_lock(&o->lock);
+        o->stats.text += c->text.len;
+        c->state = CHUNK_FREE;
+        ++o->written;
+        pthread_cond_broadcast(&o->cond);
+    }
+    o->writing = 0;
+}
+
+// decode a taken chunk, then write what is in order, called and returns with the lock held
+static void __process(offline *o, struct chunk *c)
+{
+    struct offline_stats st;
+    pthread_mutex_unlock(&o->lock);
+    const int err = __decode_chunk(o, c, &st);
+    pthread_mutex_lock(&o->lock);
+    if (err)
+    {
+        o->failed = 1;
+        o->stop = 1;
+    }
+    __add_stats(&o->stats, &st);
+    c->state = CHUNK_DONE;
+    __write_done(o);
+}
+
+static void *__decoder(void *arg)
+{
+    offline *o = arg;
+    pthread_mutex_lock(&o->lock);
+    for (;;)
+    {
+        while (o->taken == o->scanned && !o->scan_done && !o->stop)
+            pthread_cond_wait(&o->cond, &o->lock);
+        if (o->taken == o->scanned || o->stop)
+            break;
+        struct chunk *c = &o->chunks[o->taken++ % o->chunk_count];
+        c->state = CHUNK_TAKEN;
+        __process(o, c);
+    }
+    // the scan may wait for a chunk no one takes now
+    pthread_cond_broadcast(&o->cond);
+    pthread_mutex_unlock(&o->lock);
+    return NULL;
+}
+
+/**
+ * @brief Read the whole file, decode its packets with the decoder threads and write them in order.
+ * Returns when the file is read, or when stopped.
+ *
+ * @param o the reader.
+ * @return int 0 if success or stopped, -1 if failed.
+ */
+int offline_run(offline *o)
+{
+    const uint64_t start = now_ns();
+    for (int i = 0; i != o->cfg.workers; ++i)
+    {
+        const int err = pthread_create(&o->threads[i], NULL, __decoder, o);
+        if (err)
+        {
+            fprintf(stderr, "Cannot start a decoder thread: %s\n", strerror(err));
+            o->failed = 1;
+            o->stop = 1;
+            break;
+        }
+        ++o->started;
+    }
+
+    // cut the file into chunks, as far ahead of the decoders as there are chunks
+    size_t off = FILE_HEADER_SIZE;
+    size_t end;
+    int scanned = 0;
+    while (!o->stop && (scanned = __scan(o, off, &end)) > 0)
+    {
+        pthread_mutex_lock(&o->lock);
+        while (o->scanned - o->written >= o->chunk_count && !o->stop)
+            pthread_cond_wait(&o->cond, &o->lock);
+        if (o->stop)
+        {
+            pthread_mutex_unlock(&o->lock);
+            break;
+        }
+        struct chunk *c = &o->chunks[o->scanned % o->chunk_count];
+        c->seq = o->scanned++;
+        c->begin = off;
+        c->end = end;
+        c->state = CHUNK_SCANNED;
+        ++o->stats.chunks;
+        if (!o->cfg.workers)
+        {
+            // decoded here
+            ++o->taken;
+            c->state = CHUNK_TAKEN;
+            __process(o, c);
+        }
+        pthread_cond_broadcast(&o->cond);
+        pthread_mutex_unlock(&o->lock);
+        off = end;
+    }
+
+    pthread_mutex_lock(&o->lock);
+    o->scan_done = 1;
+    if (scanned < 0)
+        o->failed = 1;
+    pthread_cond_broadcast(&o->cond);
+    pthread_mutex_unlock(&o->lock);
+    for (int i = 0; i != o->started; ++i)
+        pthread_join(o->threads[i], NULL);
+    o->started = 0;
+    if (!o->cfg.headers_only)
+        fflush(o->cfg.out);
+    o->stats.ns = now_ns() - start;
+    return o->failed ? -1 : 0;
+}
+
+/**
+ * @brief Stop reading. Safe to call from a signal handler.
+ *
+ * @param o the reader.
+ */
+void offline_break(offline *o)
+{
+    o->stop = 1;
+}
+
+/**
+ * @brief Get the statistics of what was read.
+ *
+ * @param o the reader, stopped.
+ * @param st the statistics.
+ */
+void offline_get_stats(offline *o, struct offline_stats *st)
+{
+    *st = o->stats;
+}
+
+/**
+ * @brief Print what was read, how fast, and with headers only, what the packets are.
+ *
+ * @param o the reader, stopped.
+ * @param fp where to print.
+ */
+void offline_print_stats(offline *o, FILE *fp)
+{
+    const struct offline_stats *st = &o->stats;
+    const double seconds = st->ns / 1.0E9;
+    fprintf(fp, "[offline] %" PRIu64 " packets, %" PRIu64 " bytes (%" PRIu64 " captured) in %" PRIu64
+        " chunks by %d decoder threads, in %.3fs: %.0f packets/s, %.1f MB/s of file\n",
+        st->packets, st->bytes, st->captured, st->chunks, o->cfg.workers, seconds,
+        seconds > 0 ? st->packets / seconds : 0, seconds > 0 ? (st->captured + st->packets * RECORD_HEADER_SIZE) / seconds / 1.0E6 : 0);
+    if (st->packets)
+        fprintf(fp, "[offline] from %ld.%06ld to %ld.%06ld, %.3fs of traffic\n",
+            (long)st->first.tv_sec, (long)st->first.tv_usec, (long)st->last.tv_sec, (long)st->last.tv_usec,
+            (st->last.tv_sec - st->first.tv_sec) + (st->last.tv_usec - st->first.tv_usec) / 1.0E6);
+    if (o->cfg.headers_only)
+        fprintf(fp, "[offline] %" PRIu64 " Ethernet, %" PRIu64 " IPv4, %" PRIu64 " IPv6, %" PRIu64 " TCP, %" PRIu64
+            " UDP, %" PRIu64 " ICMP, %" PRIu64 " fragments, %" PRIu64 " truncated\n", st->layers[0], st->layers[1],
+            st->layers[2], st->layers[3], st->layers[4], st->layers[5], st->layers[6], st->layers[7]);
+    else
+        fprintf(fp, "[offline] %" PRIu64 " bytes written\n", st->text);
+}
+
+void offline_close(offline *o)
+{
+    if (!o)
+        return;
+    for (unsigned int i = 0; i != o->chunk_count; ++i)
+        text_free(&o->chunks[i].text);
+    pthread_cond_destroy(&o->cond);
+    pthread_mutex_destroy(&o->lock);
+    munmap(o->map, o->mapped);
+    close(o->fd);
+    free(o->chunks);
+    free(o->threads);
+    free(o);
+}
@@ -0,0 +1,88 @@
+#ifndef __OFFLINE_H
+#define __OFFLINE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <signal.h>
+#include <pcap/pcap.h>
+
+#include "decode.h"
+#include "pipeline.h"
+
+/* configurations */
+#define OFFLINE_CHUNK_SIZE 1024U    /* KB of records decoded by a thread at once */
+#define OFFLINE_CHUNKS 4U           /* chunks in flight per decoder thread, the scan waits when all are taken */
+#define OFFLINE_MAX_RECORD 262144U  /* bytes, a record longer than this is taken for a corrupt file */
+
+/*
+
+Parallel Offline Reader:
+    Reads a pcap file (not pcapng, which goes through libpcap, see capture.h)
+    without stdio and without libpcap: the file is mmap()ed, and the packets
+    are decoded where they lie, never copied.
+    scan (calling thread) --chunks--> decoder threads --in order--> output
+    The calling thread walks the record headers only, jumping from one to
+    the next, and cuts the file into chunks of about `chunk_size` bytes that
+    start and end on a record. A chunk is handed to the decoder threads as
+    soon as it is scanned, so the scan reads ahead of them and the page
+    cache is warm when they come.
+    A decoder thread renders every packet of its chunk into the chunk's
+    text (see format.h). The text of the chunks is written in file order,
+    so the output is the same as reading the file with one thread: the
+    thread that finishes the oldest chunk writes it, and every finished
+    chunk after it. A chunk is a few hundred packets at least, so the queue
+    is a mutex and a condition variable.
+    The output follows the order of the records in the file, not of their
+    timestamps, as libpcap and tcpdump -r print them. A file appended from
+    several captures, or written from several interfaces, may hold packets
+    out of time order, and they are printed as they were stored: sorting
+    them would need a merge over single packets, not whole chunks, and
+    would print a different log than the one-thread reader.
+    Headers only: the packets are decoded (see decode.h) into statistics,
+    and no text is made. Nothing past the headers of a packet is read, so
+    the file is read about as fast as the disk gives it.
+    The pages of the chunks that are written are dropped from the mapping,
+    so a file larger than the memory can be read.
+    Timestamps of nanosecond files are cut to microseconds, the packets of
+    a file of the other byte order are swapped.
+
+*/
+
+struct offline_config
+{
+    const char *file;
+    int workers;                // decoder threads, 0 to decode in the calling thread
+    size_t chunk_size;          // bytes
+    unsigned int chunks;        // in flight per decoder thread
+    int headers_only;           // 1 for statistics and no text
+    pipeline_decoder *decode;   // not needed with `headers_only`
+    FILE *out;                  // not needed with `headers_only`
+};
+
+struct offline_stats
+{
+    uint64_t packets;
+    uint64_t bytes;             // on the wire
+    uint64_t captured;          // bytes in the file
+    uint64_t chunks;
+    uint64_t text;              // bytes written
+    uint64_t layers[8];         // packets with every DECODED_* bit, headers only
+    struct timeval first;
+    struct timeval last;
+    uint64_t ns;                // to read the file
+};
+
+typedef struct offline offline;
+
+int offline_probe(const char *file);
+void offline_default_config(struct offline_config *cfg);
+offline *offline_open(const struct offline_config *cfg, char *errbuf);
+int offline_datalink(offline *o);
+int offline_run(offline *o);
+void offline_break(offline *o);
+void offline_get_stats(offline *o, struct offline_stats *st);
+void offline_print_stats(offline *o, FILE *fp);
+void offline_close(offline *o);
+
+#endif
@@ -25,13 +25,18 @@ static inline char *get_net_layer_type(int ether_type)
     }
 }
 
-void print_decoded_packet(FILE *fp, const uint8_t *p, size_t size)
+void print_decoded_packet(FILE *fp, const uint8_t *p, const struct decoded_packet *d)
 {
     // Ethernet frame header
     fprintf(fp, "+ Layer 2 (Ethernet):\n");
+    if (!(d->layers & DECODED_ETHERNET))
+    {
+        fprintf(fp, "<Truncated layer-2 header>\n");
+        return;
+    }
     fprintf(fp, "Src: %02X:%02X:%02X:%02X:%02X:%02X\n", p[0], p[1], p[2], p[3], p[4], p[5]);
     fprintf(fp, "Dst: %02X:%02X:%02X:%02X:%02X:%02X\n", p[6], p[7], p[8], p[9], p[10], p[11]);
-    const uint16_t layer3_type = ETHERNET(p)->ether_type;
+    const uint16_t layer3_type = htons(d->ether_type);
     const char *layer3_type_str = get_net_layer_type(layer3_type);
     fprintf(fp, "Layer-3 protocol: 0x%04X (%s)\n\n", ntohs(layer3_type), layer3_type_str);
 
@@ -49,9 +54,52 @@ void print_decoded_packet(FILE *fp, const uint8_t *p, size_t size)
             handler = &l3_default;
             break;
     }
-    handler(fp, p+14, size-14); // 14: ethernet header size
+    handler(fp, d);
 
     // char *net_layer_type = get_net_layer_type(ETHERNET(p)->ether_type);
     // DEBUGS(printf("Network access layer protocol: %" PRIu8 "\n", ETHERNET(p)->ether_type));
     // return net_layer_type;
 }
+
+/**
+ * @brief Print a captured frame: its time and size, the decoded headers and a hex dump.
+ * Safe to call from several threads at once, on different files.
+ *
+ * @param fp where to print.
+ * @param packet_header the pcap header of the frame.
+ * @param packet the frame.
+ */
+void print_frame(FILE *fp, const struct pcap_pkthdr *packet_header, const u_char *packet)
+{
+    // print capture time
+    fprintf(fp, "======== FRAME START ========\n");
+    fprintf(fp, "[Frame] time=%ld.%06ld", packet_header->ts.tv_sec, packet_header->ts.tv_usec);
+
+    char tmbuf[64];
+    struct tm tm;
+    strftime(tmbuf, sizeof(tmbuf), "%Y-%m-%d %H:%M:%S", localtime_r(&packet_header->ts.tv_sec, &tm));
+    fprintf(fp, " [%s.%06ld], ", tmbuf, packet_header->ts.tv_usec);
+
+    // print packet size
+    if (packet_header->len != packet_header->caplen)
+    {
+        fprintf(fp, "%" PRIu32 " bytes captured (%" PRIu32 " bytes in total) ",
+            packet_header->caplen, packet_header->len);
+    }
+    else
+    {
+        fprintf(fp, "%" PRIu32 " bytes ", packet_header->len);
+    }
+
+    // print packet data
+    fprintf(fp, "\n\n");
+    // fprintf(fp, "Decoded information:\n");
+    struct decoded_packet d;
+    decode_packet(packet, packet_header->caplen, packet_header->len, &d);
+    print_decoded_packet(fp, (const u_int8_t*)packet, &d);
+
+    fprintf(fp, "\n");
+    fprintf(fp, "Link-layer frame data:\n");
+    binary_write(fp, (void *const)packet, packet_header->caplen);
+    fputs("========  FRAME END  ========\n\n", fp);
+}
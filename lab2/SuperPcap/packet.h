@@ -15,9 +15,12 @@
 #include <netinet/ip_icmp.h>
 #include <netinet/icmp6.h>
 #include <net/ethernet.h>
+#include <time.h>
+#include <pcap/pcap.h>
 
 #include "layer3.h"
 
-void print_decoded_packet(FILE *fp, const uint8_t *packet, size_t size);
+void print_decoded_packet(FILE *fp, const uint8_t *packet, const struct decoded_packet *d);
+void print_frame(FILE *fp, const struct pcap_pkthdr *packet_header, const u_char *packet);
 
 #endif
\ No newline at end of file
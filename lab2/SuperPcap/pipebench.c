@@ -0,0 +1,101 @@
+/*
+ * Replays synthetic frames through the capture pipeline, with no capture, to
+ * see how decoding scales with decoder threads. The text goes to /dev/null.
+ * Usage: sp_pipebench [packets] [max decoder threads]
+ * Runs with 0 threads (decoding in the feeding thread), then 1, 2, 4, ... up
+ * to the given number (default one per CPU).
+ */
+
+#include "util.h"
+#include "format.h"
+#include "pipeline.h"
+#include "synth.h"
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CORPUS 4096         /* frames made once, then replayed */
+
+struct corpus_frame
+{
+    struct pcap_pkthdr h;
+    uint8_t *data;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int run(const struct corpus_frame *corpus, uint64_t packets, int workers, FILE *out)
+{
+    struct pipeline_config cfg;
+    pipeline_default_config(&cfg);
+    cfg.workers = workers;
+    cfg.decode = format_frame;
+    cfg.out = out;
+    pipeline *p = pipeline_start(&cfg);
+    if (!p)
+        return -1;
+    uint64_t bytes = 0;
+    const uint64_t start = now_ns();
+    for (uint64_t i = 0; i != packets; ++i)
+    {
+        const struct corpus_frame *f = &corpus[i % CORPUS];
+        pipeline_handler((u_char *)p, &f->h, f->data);
+        bytes += f->h.caplen;
+    }
+    const int failed = pipeline_stop(p);
+    const double seconds = (now_ns() - start) / 1.0E9;
+    struct pipeline_stats st;
+    pipeline_get_stats(p, &st);
+    pipeline_free(p);
+    printf("%3d decoder threads: %.3fs, %10.0f packets/s, %8.1f MB/s of packets, %8.1f MB/s of text, %6.0f ns/packet\n",
+        workers, seconds, packets / seconds, bytes / seconds / 1.0E6,
+        st.bytes / seconds / 1.0E6, seconds * 1.0E9 / packets);
+    return failed;
+}
+
+int main(int argc, char **argv)
+{
+    const uint64_t packets = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    const int max_workers = argc > 2 ? atoi(argv[2]) : cpus > 0 ? (int)cpus : 1;
+    if (!packets || max_workers < 0)
+    {
+        fprintf(stderr, "Usage: %s [packets] [max decoder threads]\n", argv[0]);
+        return -1;
+    }
+    FILE *out = fopen("/dev/null", "w");
+    if (!out)
+    {
+        perror("Cannot open /dev/null");
+        return -1;
+    }
+
+    static struct corpus_frame corpus[CORPUS];
+    struct synth s;
+    synth_init(&s, 1);
+    for (int i = 0; i != CORPUS; ++i)
+    {
+        if (!(corpus[i].data = malloc(SYNTH_MAX_FRAME)))
+        {
+            perror("Failed to malloc");
+            return -1;
+        }
+        synth_frame(&s, corpus[i].data, &corpus[i].h);
+    }
+
+    printf("Decoding %" PRIu64 " synthetic packets, %ld CPUs.\n", packets, cpus);
+    int failed = run(corpus, packets, 0, out);
+    for (int workers = 1; !failed && workers <= max_workers; workers <<= 1)
+        failed = run(corpus, packets, workers, out);
+    for (int i = 0; i != CORPUS; ++i)
+        free(corpus[i].data);
+    fclose(out);
+    return failed;
+}
@@ -0,0 +1,457 @@
+#include "pipeline.h"
+#include "util.h"
+
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#define RECORD_ALIGN 8
+#define RECORD_SIZE(caplen) ((sizeof(struct pcap_pkthdr) + (caplen) + RECORD_ALIGN - 1) & ~(size_t)(RECORD_ALIGN - 1))
+#define MIN_BATCH_SIZE RECORD_SIZE(65536U)
+
+struct batch
+{
+    uint64_t seq;
+    uint64_t first_ns;      // when the first packet came
+    uint32_t count;         // packets
+    size_t used;            // bytes of packets
+    struct text text;       // the rendered packets
+    uint8_t *data;          // records: a struct pcap_pkthdr, then the packet, aligned
+};
+
+// a bounded MPMC ring of batch pointers (Dmitry Vyukov's), its size a power of 2
+struct queue_cell
+{
+    uint64_t seq;
+    struct batch *b;
+};
+
+struct queue
+{
+    struct queue_cell *cells;
+    uint64_t mask;
+    sem_t items;
+    uint64_t head __attribute__((aligned(64)));     // the next cell to push to
+    uint64_t tail __attribute__((aligned(64)));     // the next cell to pop from
+};
+
+struct worker
+{
+    pipeline *p;
+    pthread_t thread;
+};
+
+struct pipeline
+{
+    struct pipeline_config cfg;
+    struct batch *batches;
+    struct queue full;      // capture -> decoders
+    struct queue done;      // decoders -> writer
+    struct queue free;      // writer -> capture
+    struct worker *workers;
+    pthread_t writer;
+    int writer_started;
+    int started;            // decoder threads
+    struct batch *cur;      // the batch being filled by the capture thread
+    struct text text;       // decoded in the capture thread, with no decoder threads
+    uint64_t seq;
+    int write_failed;
+    struct pipeline_stats stats;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int queue_init(struct queue *q, size_t capacity)
+{
+    size_t size = 2;
+    while (size < capacity)
+        size <<= 1;
+    if (!(q->cells = calloc(size, sizeof(struct queue_cell))))
+        return -1;
+    for (size_t i = 0; i != size; ++i)
+        q->cells[i].seq = i;
+    q->mask = size - 1;
+    q->head = q->tail = 0;
+    sem_init(&q->items, 0, 0);
+    return 0;
+}
+
+static void queue_destroy(struct queue *q)
+{
+    if (!q->cells)
+        return;
+    sem_destroy(&q->items);
+    free(q->cells);
+    q->cells = NULL;
+}
+
+/**
+ * @brief Push a batch, NULL to tell a consumer to stop.
+ * The queues are sized for every batch and stop mark, so they are never full for long.
+ */
+static void queue_push(struct queue *q, struct batch *b)
+{
+    uint64_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        struct queue_cell *cell = &q->cells[pos & q->mask];
+        const int64_t dif = (int64_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+        if (!dif)
+        {
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                cell->b = b;
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+                sem_post(&q->items);
+                return;
+            }
+        }
+        else
+        {
+            if (dif < 0)
+                sched_yield(); // full, a consumer has not given the cell back yet
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * @brief Pop a batch, sleeping until there is one if `wait`.
+ *
+ * @return int 0 if popped, -1 if the queue is empty and not `wait`.
+ */
+static int queue_pop(struct queue *q, struct batch **b, int wait)
+{
+    if (wait)
+    {
+        while (sem_wait(&q->items) && errno == EINTR);
+    }
+    else if (sem_trywait(&q->items))
+        return -1;
+    // the semaphore holds a batch for us, it may not be published yet
+    uint64_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        struct queue_cell *cell = &q->cells[pos & q->mask];
+        const int64_t dif = (int64_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (!dif)
+        {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                *b = cell->b;
+                __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+                return 0;
+            }
+        }
+        else
+        {
+            if (dif < 0)
+                sched_yield();
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// write a text out in one piece, and empty it
+static void __write_text(pipeline *p, struct text *t)
+{
+    if (!p->write_failed && t->len && fwrite(t->buf, 1, t->len, p->cfg.out) != t->len)
+    {
+        perror("Cannot write the capture log");
+        p->write_failed = 1;
+    }
+    p->stats.bytes += t->len;
+    t->len = 0;
+}
+
+static void *__decoder(void *arg)
+{
+    struct worker *w = arg;
+    pipeline *p = w->p;
+    struct batch *b;
+    while (!queue_pop(&p->full, &b, 1) && b)
+    {
+        b->text.len = 0;
+        uint32_t i = 0;
+        for (const uint8_t *r = b->data; r < b->data + b->used; ++i)
+        {
+            const struct pcap_pkthdr *h = (const struct pcap_pkthdr *)r;
+            if (p->cfg.decode(&b->text, h, r + sizeof(struct pcap_pkthdr)))
+            {
+                fprintf(stderr, "Out of memory: the text of a batch cannot grow past %zu bytes, "
+                    "%" PRIu32 " of its %" PRIu32 " packets are not decoded.\n", b->text.cap, b->count - i, b->count);
+                break;
+            }
+            r += RECORD_SIZE(h->caplen);
+        }
+        queue_push(&p->done, b);
+    }
+    return NULL;
+}
+
+static void *__writer(void *arg)
+{
+    pipeline *p = arg;
+    const unsigned int n = p->cfg.batches;
+    // no more than `batches` are out, so their sequence numbers differ modulo `batches`
+    struct batch **pending = calloc(n, sizeof(struct batch *));
+    uint64_t next = 0;
+    struct batch *b;
+    if (!pending)
+    {
+        perror("Failed to malloc");
+        exit(-1);
+    }
+    while (!queue_pop(&p->done, &b, 1) && b)
+    {
+        pending[b->seq % n] = b;
+        while ((b = pending[next % n]) && b->seq == next)
+        {
+            pending[next % n] = NULL;
+            __write_text(p, &b->text);
+            b->count = 0;
+            b->used = 0;
+            ++next;
+            queue_push(&p->free, b);
+        }
+    }
+    if (fflush(p->cfg.out) && !p->write_failed)
+    {
+        perror("Cannot write the capture log");
+        p->write_failed = 1;
+    }
+    free(pending);
+    return NULL;
+}
+
+/**
+ * @brief Fill in the defaults of a pipeline configuration, one decoder thread per CPU.
+ *
+ * @param cfg the configuration.
+ */
+void pipeline_default_config(struct pipeline_config *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cfg->workers = cpus > 0 ? (int)cpus : 1;
+    cfg->batch_size = (size_t)PIPELINE_BATCH_SIZE << 10;
+    cfg->batches = PIPELINE_BATCHES;
+    cfg->flush_timeout = PIPELINE_FLUSH_TIMEOUT;
+    cfg->out = stdout;
+}
+
+/**
+ * @brief Allocate the batches and start the decoder and writer threads.
+ *
+ * @param cfg the configuration, copied. `decode` and `out` must be set.
+ * @return pipeline* the pipeline, NULL if failed.
+ */
+pipeline *pipeline_start(const struct pipeline_config *cfg)
+{
+    pipeline *p = calloc(1, sizeof(pipeline));
+    if (!p)
+    {
+        perror("Failed to malloc");
+        return NULL;
+    }
+    p->cfg = *cfg;
+    if (!p->cfg.workers)
+        return p;
+    if (p->cfg.batch_size < MIN_BATCH_SIZE)
+        p->cfg.batch_size = MIN_BATCH_SIZE;
+    if (p->cfg.batches < 2)
+        p->cfg.batches = 2;
+
+    // every batch, and a stop mark for every thread, fits in every queue
+    const size_t capacity = p->cfg.batches + p->cfg.workers + 1;
+    if (!(p->batches = calloc(p->cfg.batches, sizeof(struct batch))) || !(p->workers = calloc(p->cfg.workers, sizeof(struct worker)))
+        || queue_init(&p->full, capacity) || queue_init(&p->done, capacity) || queue_init(&p->free, capacity))
+    {
+        perror("Failed to malloc");
+        goto START_FAILED;
+    }
+    for (unsigned int i = 0; i != p->cfg.batches; ++i)
+    {
+        if (!(p->batches[i].data = malloc(p->cfg.batch_size)))
+        {
+            perror("Failed to malloc");
+            goto START_FAILED;
+        }
+        queue_push(&p->free, &p->batches[i]);
+    }
+    for (int i = 0; i != p->cfg.workers; ++i)
+        p->workers[i].p = p;
+    if (pthread_create(&p->writer, NULL, __writer, p))
+    {
+        perror("Cannot start the writer thread");
+        goto START_FAILED;
+    }
+    p->writer_started = 1;
+    for (; p->started != p->cfg.workers; ++p->started)
+    {
+        if (pthread_create(&p->workers[p->started].thread, NULL, __decoder, &p->workers[p->started]))
+        {
+            perror("Cannot start a decoder thread");
+            goto START_FAILED;
+        }
+    }
+    return p;
+
+START_FAILED:
+    pipeline_stop(p);
+    pipeline_free(p);
+    return NULL;
+}
+
+static void __hand_over(pipeline *p)
+{
+    p->cur->seq = p->seq++;
+    ++p->stats.batches;
+    queue_push(&p->full, p->cur);
+    p->cur = NULL;
+}
+
+/**
+ * @brief A pcap_handler that feeds a packet into the pipeline. Call it from one thread only.
+ *
+ * @param user the pipeline.
+ * @param h the pcap header of the packet.
+ * @param packet the packet, copied.
+ */
+void pipeline_handler(u_char *user, const struct pcap_pkthdr *h, const u_char *packet)
+{
+    pipeline *p = (pipeline *)user;
+    ++p->stats.packets;
+    if (!p->cfg.workers)
+    {
+        if (p->cfg.decode(&p->text, h, packet))
+            fprintf(stderr, "Out of memory, a packet is not decoded.\n");
+        if (p->text.len >= FORMAT_FLUSH_SIZE << 10)
+            __write_text(p, &p->text);
+        return;
+    }
+
+    struct pcap_pkthdr ph = *h;
+    if (RECORD_SIZE(ph.caplen) > p->cfg.batch_size)
+        ph.caplen = p->cfg.batch_size - RECORD_SIZE(0);
+    const size_t size = RECORD_SIZE(ph.caplen);
+    if (p->cur && p->cur->used + size > p->cfg.batch_size)
+        __hand_over(p);
+    if (!p->cur)
+    {
+        if (queue_pop(&p->free, &p->cur, 0))
+        {
+            // every batch is out, the decoders are behind
+            ++p->stats.waits;
+            queue_pop(&p->free, &p->cur, 1);
+        }
+        p->cur->first_ns = now_ns();
+    }
+    uint8_t *r = p->cur->data + p->cur->used;
+    memcpy(r, &ph, sizeof(ph));
+    memcpy(r + sizeof(ph), packet, ph.caplen);
+    p->cur->used += size;
+    ++p->cur->count;
+}
+
+/**
+ * @brief Hand over the batch being filled if it waited for `flush_timeout` ms,
+ * or with no decoder threads, write what was decoded.
+ * Call it between two captures, from the thread that calls the handler.
+ *
+ * @param user the pipeline.
+ */
+void pipeline_flush(u_char *user)
+{
+    pipeline *p = (pipeline *)user;
+    if (!p->cfg.workers)
+        __write_text(p, &p->text);
+    else if (p->cur && now_ns() - p->cur->first_ns >= p->cfg.flush_timeout * 1000000ULL)
+        __hand_over(p);
+}
+
+/**
+ * @brief Decode and write everything that was fed in, then stop the threads.
+ *
+ * @param p the pipeline.
+ * @return int 0 if success, -1 if the output could not be written.
+ */
+int pipeline_stop(pipeline *p)
+{
+    if (!p->cfg.workers)
+    {
+        __write_text(p, &p->text);
+        return fflush(p->cfg.out) || p->write_failed ? -1 : 0;
+    }
+    if (p->cur)
+        __hand_over(p);
+    for (int i = 0; i != p->started; ++i)
+        queue_push(&p->full, NULL);
+    for (int i = 0; i != p->started; ++i)
+        pthread_join(p->workers[i].thread, NULL);
+    p->started = 0;
+    if (p->writer_started)
+    {
+        queue_push(&p->done, NULL);
+        pthread_join(p->writer, NULL);
+        p->writer_started = 0;
+    }
+    return p->write_failed ? -1 : 0;
+}
+
+/**
+ * @brief Get the statistics of a pipeline, complete once it is stopped.
+ *
+ * @param p the pipeline.
+ * @param st the statistics.
+ */
+void pipeline_get_stats(pipeline *p, struct pipeline_stats *st)
+{
+    *st = p->stats;
+}
+
+/**
+ * @brief Print how many packets went through the pipeline, and how often the capture had to wait.
+ *
+ * @param p the pipeline.
+ * @param fp where to print.
+ */
+void pipeline_print_stats(pipeline *p, FILE *fp)
+{
+    if (!p->cfg.workers)
+        return;
+    fprintf(fp, "[pipeline] %" PRIu64 " packets in %" PRIu64 " batches by %d decoder threads, %" PRIu64
+        " bytes written, the capture waited %" PRIu64 " times for a free batch\n",
+        p->stats.packets, p->stats.batches, p->cfg.workers, p->stats.bytes, p->stats.waits);
+}
+
+void pipeline_free(pipeline *p)
+{
+    if (!p)
+        return;
+    free(p->workers);
+    if (p->batches)
+    {
+        for (unsigned int i = 0; i != p->cfg.batches; ++i)
+        {
+            free(p->batches[i].data);
+            text_free(&p->batches[i].text);
+        }
+        free(p->batches);
+    }
+    text_free(&p->text);
+    queue_destroy(&p->full);
+    queue_destroy(&p->done);
+    queue_destroy(&p->free);
+    free(p);
+}
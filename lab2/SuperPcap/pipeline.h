@@ -0,0 +1,78 @@
+#ifndef __PIPELINE_H
+#define __PIPELINE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pcap/pcap.h>
+
+#include "format.h"
+
+/* configurations */
+#define PIPELINE_BATCH_SIZE 256U    /* KB of packets handed to a decoder at once */
+#define PIPELINE_BATCHES 64U        /* batches in flight, the capture waits when all are taken */
+#define PIPELINE_FLUSH_TIMEOUT 50   /* ms, a batch that is not full is handed over after this */
+
+/*
+
+Capture Pipeline:
+    capture thread --full--> decoder threads --done--> writer thread --free--> capture thread
+    The capture thread only copies packets (pcap header and data) into a
+    batch, and hands the batch over when it is full, or when it waited for
+    `flush_timeout` ms. It never decodes, so it comes back to the kernel ring
+    quickly.
+    A decoder thread takes a batch and renders all its packets into the text
+    buffer of the batch (see format.h). Decoders work on several batches at
+    once, and finish them in any order.
+    The writer thread puts the batches back in capture order by their
+    sequence numbers, writes their text to the output in one piece, and gives
+    the batches back to the capture thread.
+    The three queues are bounded lock-free rings of batch pointers. A
+    semaphore counts the batches in each, so an idle thread sleeps rather
+    than spins. There are `batches` batches, allocated once.
+    With no decoder threads, every packet is decoded in the capture thread
+    as it comes, into a buffer written every FORMAT_FLUSH_SIZE KB and
+    whenever the capture is idle.
+
+*/
+
+/**
+ * @brief Render a packet at the end of a text, like format_frame().
+ *
+ * @param t the text.
+ * @param h the pcap header of the packet.
+ * @param packet the packet.
+ * @return int 0 if success, -1 if out of memory.
+ */
+typedef int (pipeline_decoder)(struct text *t, const struct pcap_pkthdr *h, const u_char *packet);
+
+struct pipeline_config
+{
+    int workers;                // decoder threads, 0 to decode in the capture thread
+    size_t batch_size;          // bytes
+    unsigned int batches;
+    int flush_timeout;          // ms
+    pipeline_decoder *decode;
+    FILE *out;
+};
+
+struct pipeline_stats
+{
+    uint64_t packets;
+    uint64_t batches;           // handed to the decoders
+    uint64_t bytes;             // text written
+    uint64_t waits;             // times the capture waited for a free batch
+};
+
+typedef struct pipeline pipeline;
+
+void pipeline_default_config(struct pipeline_config *cfg);
+pipeline *pipeline_start(const struct pipeline_config *cfg);
+void pipeline_handler(u_char *user, const struct pcap_pkthdr *h, const u_char *packet);
+void pipeline_flush(u_char *user);
+int pipeline_stop(pipeline *p);
+void pipeline_get_stats(pipeline *p, struct pipeline_stats *st);
+void pipeline_print_stats(pipeline *p, FILE *fp);
+void pipeline_free(pipeline *p);
+
+#endif
@@ -0,0 +1,409 @@
+#define _GNU_SOURCE
+#include "shard.h"
+#include "util.h"
+
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+
+#define WAIT_INTERVAL 100 /* ms, how often the statistics and the shards are checked */
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Open N captures on an interface, in a fanout group of their own if N > 1.
+ * The caller may then set `cpu` and `of` of every shard.
+ *
+ * @param shards N shards.
+ * @param n how many, 1 to SHARD_MAX.
+ * @param cfg the capture configuration, `fanout_group` is chosen here.
+ * @param errbuf PCAP_ERRBUF_SIZE bytes, to tell what failed.
+ * @return int 0 if success, -1 if failed, and no capture is left open.
+ */
+int shard_open(struct shard *shards, int n, const struct capture_config *cfg, char *errbuf)
+{
+    struct capture_config shard_cfg = *cfg;
+    if (n > 1)
+    {
+        // a group per process, so two SuperPcaps on one interface both get every packet
+        shard_cfg.fanout_group = getpid() & 0xFFFF ? getpid() & 0xFFFF : 1;
+        shard_cfg.stats_interval = 0; // reported added up, by shard_wait()
+    }
+    memset(shards, 0, n * sizeof(struct shard));
+    for (int i = 0; i != n; ++i)
+    {
+        shards[i].id = i;
+        shards[i].cpu = -1;
+        shards[i].bpf = cfg->filter;
+        if (!(shards[i].cap = capture_open(&shard_cfg, errbuf)))
+        {
+            for (int j = 0; j != i; ++j)
+                capture_close(shards[j].cap);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// a packet filtered, or given to more than one output
+static void __shard_handler(u_char *user, const struct pcap_pkthdr *h, const u_char *packet)
+{
+    struct shard *s = (struct shard *)user;
+    if (s->match && !filter_match(s->match, h, packet))
+        return;
+    if (s->dump)
+        dump_handler((u_char *)s->dump, h, packet);
+    if (s->pipe)
+        pipeline_handler((u_char *)s->pipe, h, packet);
+    if (s->flows)
+        flow_handler((u_char *)s->flows, h, packet);
+}
+
+static void __shard_idle(u_char *user)
+{
+    struct shard *s = (struct shard *)user;
+    if (s->dump)
+        dump_flush((u_char *)s->dump);
+    if (s->pipe)
+        pipeline_flush((u_char *)s->pipe);
+    if (s->flows)
+        flow_idle((u_char *)s->flows);
+}
+
+static void *__shard_main(void *arg)
+{
+    struct shard *s = arg;
+    // the pipeline and writer threads are started from here, on the same CPU
+    char errbuf[PCAP_ERRBUF_SIZE];
+    if (s->match_expr && !(s->match = filter_open(s->match_expr, errbuf)))
+    {
+        fprintf(stderr, "Shard %d cannot filter: %s\n", s->id, errbuf);
+        s->failed = 1;
+        goto SHARD_DONE;
+    }
+    if (s->dump_cfg.file && !(s->dump = dump_open(&s->dump_cfg, errbuf)))
+    {
+        fprintf(stderr, "Shard %d cannot write a capture file: %s\n", s->id, errbuf);
+        s->failed = 1;
+        goto SHARD_DONE;
+    }
+    if (s->flow_cfg.out && !(s->flows = flow_open(&s->flow_cfg, errbuf)))
+    {
+        fprintf(stderr, "Shard %d cannot track flows: %s\n", s->id, errbuf);
+        s->failed = 1;
+        goto SHARD_DONE;
+    }
+    if (s->pipe_cfg.decode && !(s->pipe = pipeline_start(&s->pipe_cfg)))
+    {
+        s->failed = 1;
+        goto SHARD_DONE;
+    }
+    pcap_handler handler = __shard_handler;
+    void (*idle)(u_char *) = __shard_idle;
+    u_char *user = (u_char *)s;
+    // one output with no filter is called directly
+    if (!s->match && !!s->dump + !!s->pipe + !!s->flows == 1)
+    {
+        handler = s->dump ? dump_handler : s->flows ? flow_handler : pipeline_handler;
+        idle = s->dump ? dump_flush : s->flows ? flow_idle : pipeline_flush;
+        user = s->dump ? (u_char *)s->dump : s->flows ? (u_char *)s->flows : (u_char *)s->pipe;
+    }
+    if (capture_loop(s->cap, handler, idle, user))
+        s->failed = 1;
+    if (s->pipe && pipeline_stop(s->pipe))
+        s->failed = 1;
+    if (s->flows && flow_close(s->flows))
+        s->failed = 1;
+    if (s->dump && dump_close(s->dump))
+        s->failed = 1;
+
+SHARD_DONE:
+    __atomic_store_n(&s->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/**
+ * @brief Start capturing on every shard, each in a thread of its own, pinned to its CPU if it has one.
+ *
+ * @param shards the shards, `of` set if they decode.
+ * @param n how many.
+ * @param pipe_cfg the pipeline configuration of a shard, its `out` is the shard's `of`, NULL for no text.
+ * @param dump_cfg the capture file configuration, shard i > 0 writes to `file.i`, NULL for no capture file.
+ * @param flow_cfg the flow table configuration of a shard, its `out` is the shard's `of`, NULL for no flow table.
+ * @param match a match filter (see filter.h), every shard runs its own, NULL for every packet.
+ * @return int 0 if success, -1 if a thread could not be started (the others are stopped).
+ */
+int shard_start(struct shard *shards, int n, const struct pipeline_config *pipe_cfg, const struct dump_config *dump_cfg,
+    const struct flow_config *flow_cfg, const char *match)
+{
+    for (int i = 0; i != n; ++i)
+    {
+        struct shard *s = &shards[i];
+        s->match_expr = match;
+        memset(&s->pipe_cfg, 0, sizeof(s->pipe_cfg));
+        memset(&s->dump_cfg, 0, sizeof(s->dump_cfg));
+        memset(&s->flow_cfg, 0, sizeof(s->flow_cfg));
+        if (pipe_cfg)
+        {
+            s->pipe_cfg = *pipe_cfg;
+            s->pipe_cfg.out = s->of;
+        }
+        if (dump_cfg)
+        {
+            s->dump_cfg = *dump_cfg;
+            if (i)
+                snprintf(s->dump_file, sizeof(s->dump_file), "%s.%d", dump_cfg->file, i);
+            else
+                snprintf(s->dump_file, sizeof(s->dump_file), "%s", dump_cfg->file);
+            s->dump_cfg.file = s->dump_file;
+        }
+        if (flow_cfg)
+        {
+            s->flow_cfg = *flow_cfg;
+            s->flow_cfg.out = s->of;
+            // shards that share an output share the header too
+            s->flow_cfg.header = flow_cfg->header && (!i || s->of != shards[0].of);
+        }
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (s->cpu >= 0)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(s->cpu, &set);
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        }
+        const int err = pthread_create(&s->thread, &attr, __shard_main, s);
+        pthread_attr_destroy(&attr);
+        if (err)
+        {
+            fprintf(stderr, "Cannot start shard %d%s: %s\n", i, s->cpu >= 0 ? " on its CPU" : "", strerror(err));
+            shard_break(shards, n);
+            shard_wait(shards, n, 0);
+            return -1;
+        }
+        s->started = 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Wait until every shard stopped, printing their statistics added up every `stats_interval` seconds.
+ * If a shard fails, the others are stopped.
+ *
+ * @param shards the shards.
+ * @param n how many.
+ * @param stats_interval seconds, 0 for no reports.
+ * @return int 0 if every shard stopped well, -1 if one failed.
+ */
+int shard_wait(struct shard *shards, int n, int stats_interval)
+{
+    capture *caps[SHARD_MAX];
+    for (int i = 0; i != n; ++i)
+        caps[i] = shards[i].cap;
+    const uint64_t interval = stats_interval * 1000000000ULL;
+    uint64_t reported = now_ns();
+    int failed = 0;
+    for (;;)
+    {
+        int running = 0;
+        for (int i = 0; i != n; ++i)
+        {
+            if (!shards[i].started)
+                continue;
+            if (!__atomic_load_n(&shards[i].done, __ATOMIC_ACQUIRE))
+                ++running;
+            else if (shards[i].failed && !failed)
+            {
+                fprintf(stderr, "Shard %d failed, stopping the others.\n", i);
+                failed = 1;
+                shard_break(shards, n);
+            }
+        }
+        if (!running)
+            break;
+        struct timespec ts = {0, WAIT_INTERVAL * 1000000L};
+        nanosleep(&ts, NULL);
+        // one shard prints its own statistics, see shard_open()
+        if (n > 1 && interval && now_ns() - reported >= interval)
+        {
+            capture_print_group_stats(caps, n, "stats", stderr);
+            reported = now_ns();
+        }
+    }
+    for (int i = 0; i != n; ++i)
+    {
+        if (shards[i].started)
+            pthread_join(shards[i].thread, NULL);
+        shards[i].started = 0;
+    }
+    return failed ? -1 : 0;
+}
+
+/**
+ * @brief Stop every shard. Safe to call from a signal handler.
+ *
+ * @param shards the shards.
+ * @param n how many.
+ */
+void shard_break(struct shard *shards, int n)
+{
+    for (int i = 0; i != n; ++i)
+    {
+        if (shards[i].cap)
+            capture_break(shards[i].cap);
+    }
+}
+
+// the filters of the shards added up, the packets of the interface counted once
+static void __print_filter_stats(struct shard *shards, int n, FILE *fp)
+{
+    struct filter_stats bpf, match, st;
+    memset(&bpf, 0, sizeof(bpf));
+    memset(&match, 0, sizeof(match));
+    for (int i = 0; i != n; ++i)
+    {
+        if (shards[i].bpf && !capture_filter_stats(shards[i].cap, &st))
+        {
+            // a file is read by one shard
+            if (st.packets > bpf.packets)
+                bpf.packets = st.packets;
+            bpf.matched += st.matched;
+            bpf.timed += st.timed;
+            bpf.ns += st.ns;
+            bpf.instructions = st.instructions;
+        }
+        if (shards[i].match)
+        {
+            filter_get_stats(shards[i].match, &st);
+            match.packets += st.packets;
+            match.matched += st.matched;
+            match.timed += st.timed;
+            match.ns += st.ns;
+        }
+    }
+    if (shards[0].bpf)
+        filter_print_stats(&bpf, "filter", shards[0].bpf, fp);
+    if (shards[0].match)
+        filter_print_stats(&match, "match", shards[0].match_expr, fp);
+}
+
+/**
+ * @brief Print the statistics of every shard, then of all of them.
+ *
+ * @param shards the shards, stopped.
+ * @param n how many.
+ * @param fp where to print.
+ */
+void shard_print_stats(struct shard *shards, int n, FILE *fp)
+{
+    if (n == 1)
+    {
+        capture_print_stats(shards[0].cap, fp);
+        if (shards[0].pipe)
+            pipeline_print_stats(shards[0].pipe, fp);
+        if (shards[0].dump)
+            dump_print_stats(shards[0].dump, fp);
+        if (shards[0].flows)
+        {
+            struct flow_stats fs;
+            flow_get_stats(shards[0].flows, &fs);
+            flow_print_stats(&fs, fp);
+        }
+        __print_filter_stats(shards, n, fp);
+        return;
+    }
+    capture *caps[SHARD_MAX];
+    struct pipeline_stats sum;
+    struct dump_stats dump_sum;
+    struct flow_stats flow_sum;
+    memset(&sum, 0, sizeof(sum));
+    memset(&dump_sum, 0, sizeof(dump_sum));
+    memset(&flow_sum, 0, sizeof(flow_sum));
+    for (int i = 0; i != n; ++i)
+    {
+        struct capture_stats st;
+        struct pipeline_stats ps;
+        struct dump_stats ds;
+        caps[i] = shards[i].cap;
+        memset(&ps, 0, sizeof(ps));
+        memset(&ds, 0, sizeof(ds));
+        if (shards[i].pipe)
+            pipeline_get_stats(shards[i].pipe, &ps);
+        if (shards[i].dump)
+            dump_get_stats(shards[i].dump, &ds);
+        dump_sum.packets += ds.packets;
+        dump_sum.bytes += ds.bytes;
+        dump_sum.files += ds.files;
+        dump_sum.waits += ds.waits;
+        if (shards[i].flows)
+        {
+            struct flow_stats fs;
+            flow_get_stats(shards[i].flows, &fs);
+            flow_sum.packets += fs.packets;
+            flow_sum.untracked += fs.untracked;
+            flow_sum.full += fs.full;
+            flow_sum.flows += fs.flows;
+            flow_sum.records += fs.records;
+            // the shards fill up at different times, a sum of their peaks was never in any table
+            if (fs.peak > flow_sum.peak)
+                flow_sum.peak = fs.peak;
+            flow_sum.capacity = fs.capacity;
+            flow_sum.tables += fs.tables;
+        }
+        sum.packets += ps.packets;
+        sum.batches += ps.batches;
+        sum.bytes += ps.bytes;
+        sum.waits += ps.waits;
+        if (capture_stats(shards[i].cap, &st))
+            memset(&st, 0, sizeof(st));
+        fprintf(fp, "[shard %d] %" PRIu64 " packets captured, %" PRIu64 " dropped, %" PRIu64
+            " bytes written, %" PRIu64 " waits for a free batch", i, st.captured, st.dropped, ps.bytes + ds.bytes,
+            ps.waits);
+        if (shards[i].cpu >= 0)
+            fprintf(fp, ", on CPU %d", shards[i].cpu);
+        fprintf(fp, "\n");
+    }
+    capture_print_group_stats(caps, n, "stats", fp);
+    if (shards[0].pipe)
+        fprintf(fp, "[pipeline] %" PRIu64 " packets in %" PRIu64 " batches by %d shards, %" PRIu64
+            " bytes written, the captures waited %" PRIu64 " times for a free batch\n",
+            sum.packets, sum.batches, n, sum.bytes, sum.waits);
+    if (shards[0].dump)
+        fprintf(fp, "[dump] %" PRIu64 " packets, %" PRIu64 " bytes in %" PRIu64 " files by %d shards, "
+            "the captures waited %" PRIu64 " times for the disk\n",
+            dump_sum.packets, dump_sum.bytes, dump_sum.files, n, dump_sum.waits);
+    if (shards[0].flows)
+        flow_print_stats(&flow_sum, fp);
+    __print_filter_stats(shards, n, fp);
+}
+
+/**
+ * @brief Free the captures and pipelines of the shards, not their outputs.
+ *
+ * @param shards the shards, stopped.
+ * @param n how many.
+ */
+void shard_close(struct shard *shards, int n)
+{
+    for (int i = 0; i != n; ++i)
+    {
+        pipeline_free(shards[i].pipe);
+        dump_free(shards[i].dump);
+        filter_free(shards[i].match);
+        flow_free(shards[i].flows);
+        shards[i].match = NULL;
+        shards[i].flows = NULL;
+        capture_close(shards[i].cap);
+        shards[i].pipe = NULL;
+        shards[i].dump = NULL;
+        shards[i].cap = NULL;
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef __SHARD_H
+#define __SHARD_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "capture.h"
+#include "pipeline.h"
+#include "dump.h"
+#include "filter.h"
+#include "flow.h"
+
+/* configurations */
+#define SHARD_MAX 64                /* captures in a fanout group */
+
+/*
+
+Capture Shards:
+    N captures on one interface in one PACKET_FANOUT group (see capture.h),
+    so N cores capture instead of one. Every shard has a thread of its own
+    for its capture, a pipeline of its own (see pipeline.h) and an output of
+    its own, and shares nothing with the others.
+    A shard decodes its packets into text with its pipeline, or counts them
+    into a flow table (see flow.h), writes them into a capture file of its
+    own (see dump.h), or both. Shard 0 writes the file it is given, shard i
+    that file with `.i` after its name.
+    A match filter (see filter.h) decides before all of them which packets
+    go on. Every shard has a filter and a flow table of its own, with the
+    flows of its packets: by flow (FANOUT_HASH) a shard gets both
+    directions of all packets of a flow, by CPU it may not.
+    A shard may be pinned to a CPU: its capture thread is, and the threads of
+    its pipeline, started from there, are too. Pinning shard i to the CPU
+    that serves RX queue i of the NIC, with FANOUT_CPU, keeps a packet on
+    the core that received it from the interrupt to the output.
+    The statistics of all shards are added up every `stats_interval` seconds
+    and at the end.
+
+*/
+
+struct shard
+{
+    int id;
+    int cpu;                // pinned to, -1 for none
+    capture *cap;
+    pipeline *pipe;         // NULL for no text
+    dump *dump;             // NULL for no capture file
+    filter *match;          // NULL for every packet
+    flows *flows;           // NULL for no flow table
+    const char *bpf;        // the capture filter, NULL for none
+    const char *match_expr;
+    FILE *of;               // the output of this shard
+    struct pipeline_config pipe_cfg;
+    struct dump_config dump_cfg;
+    struct flow_config flow_cfg;
+    char dump_file[PATH_MAX];
+    pthread_t thread;
+    int started;
+    int failed;
+    int done;               // the capture loop returned
+};
+
+int shard_open(struct shard *shards, int n, const struct capture_config *cfg, char *errbuf);
+int shard_start(struct shard *shards, int n, const struct pipeline_config *pipe_cfg, const struct dump_config *dump_cfg,
+    const struct flow_config *flow_cfg, const char *match);
+int shard_wait(struct shard *shards, int n, int stats_interval);
+void shard_break(struct shard *shards, int n);
+void shard_print_stats(struct shard *shards, int n, FILE *fp);
+void shard_close(struct shard *shards, int n);
+
+#endif
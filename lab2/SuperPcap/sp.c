@@ -1,61 +1,99 @@
 #include "util.h"
 #include "packet.h"
+#include "capture.h"
+#include "pipeline.h"
+#include "shard.h"
+#include "format.h"
+#include "offline.h"
+#include "dump.h"
+#include "filter.h"
+#include "flow.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
 #include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
 #include <pcap/pcap.h>
 #include <sys/types.h>
 
 #define OPTIONAL(x, y) ((x) ? (x) : (y))
 #define MAX_ADDRESS_PRINT_BUF 1023
 #define TRIM1(s) ((*s==' ') ? (s+1):(s))
+#define MAX_FILTER_EXPR 4096
 
 #define ERR_PCAP_CANNOT_ENUM_IFACES     -10
 #define ERR_PCAP_CANNOT_OPEN_IFACE      -20
 #define ERR_PCAP_CANNOT_ACTIVIATE_IFACE -30
 
 #define eprintf(...) fprintf (stderr, __VA_ARGS__)
-
-static void captured_packet_handler(u_char *user_parameter, const struct pcap_pkthdr *packet_header, const u_char *packet);
+#define mprintf(...) fprintf (msg, __VA_ARGS__)
 
 char errbuf[PCAP_ERRBUF_SIZE] = {'\0'};
-pcap_t *inst = NULL;
+char filter_expr[MAX_FILTER_EXPR];
+struct shard shards[SHARD_MAX];
+int shard_count = 1;
+offline *reader = NULL;
 int link_layer_type;
 FILE *of = NULL;
+FILE *msg = NULL;   // prompts and progress, stderr when stdout carries the output
 
 static void signal_handler(int s)
 {
-    if (s == SIGINT && inst)
-    {
-        puts("Stopping...");
-        pcap_breakloop(inst);
-        pcap_close(inst);
-        puts("SuperPcap is stopped.");
-        fflush(of);
-        exit(0);
-    }
+    // the capture loops return, and main() cleans up
+    if (s == SIGINT && reader)
+        offline_break(reader);
+    else if (s == SIGINT)
+        shard_break(shards, shard_count);
 }
 
-int main(void)
+static void print_usage(const char *name)
 {
-    of = stdout;
-    signal(SIGINT, signal_handler);
-    setbuf(stdout, NULL);
-    puts("SuperPcap: A packet capturing tool based on libpcap.");
-    printf("pcap version: %s\n\n", pcap_lib_version());
+    eprintf("Usage: %s [-i interface | -r file [-H]] [-o file] [-w file [-n] [-C MB] [-G seconds] [-A MB]]\n"
+        "          [-E csv|json [-T flows]]\n"
+        "          [-R] [-B ring MB] [-b block KB] [-t timeout ms] [-I] [-s snaplen] [-S seconds] [-j threads]\n"
+        "          [-F sockets] [-Q] [-P cpu,cpu,...] [-m match] [expression]\n"
+        "  -i  capture on this interface instead of asking which one\n"
+        "  -r  read the packets of a pcap or pcapng file instead of capturing\n"
+        "  -H  read the headers of the packets only, and print statistics of the file instead of the packets\n"
+        "  -o  write the decoded packets (or the flows) to this file, - for stdout, instead of asking where\n"
+        "  -w  write the packets to this pcap file, and decode them only if -o is given too\n"
+        "  -n  write pcapng instead of pcap\n"
+        "  -C  start a new file (file.0, file.1, ...) when this many MB are written\n"
+        "  -G  start a new file when a packet comes this many seconds after the first one of the file\n"
+        "  -A  reserve this many MB of disk for every file when it is opened, with fallocate()\n"
+        "  -E  write a record for every flow instead of the packets, CSV or JSON lines\n"
+        "  -T  flows the table of a socket holds, rounded up to a power of 2, 129 bytes each (default %u)\n"
+        "  -R  capture with a TPACKET_V3 ring of our own instead of libpcap\n"
+        "  -B  size of the kernel ring or buffer (default %u MB)\n"
+        "  -b  block size of the ring, a power of 2 (default %u KB)\n"
+        "  -t  a block that is not full is handed over after this (default %d ms)\n"
+        "  -I  immediate mode, every packet is handed over at once\n"
+        "  -s  bytes kept of every packet (default %d)\n"
+        "  -S  seconds between two statistics reports, 0 for none (default %d)\n"
+        "  -j  decoder threads, 0 to decode in the capture thread (default one per CPU, one per socket with -F)\n"
+        "  -F  capture with this many sockets in a PACKET_FANOUT group, each with its own threads and output\n"
+        "  -Q  share the packets out by the CPU that received them (the RSS queue) instead of by flow\n"
+        "  -P  pin socket i to the i-th of these CPUs, e.g. the CPUs of the NIC's RX queue interrupts\n"
+        "  -m  let through only the packets that match these terms, after the expression:\n"
+        "      contains STRING (\\xHH for any byte), established, first N, joined by `and`, `not` before one\n"
+        "  expression: a pcap filter expression, like `tcp port 80`, run by the kernel on an interface\n",
+        name, FLOW_TABLE_SIZE, CAPTURE_RING_SIZE, CAPTURE_BLOCK_SIZE, CAPTURE_TIMEOUT, CAPTURE_SNAPLEN, CAPTURE_STATS_INTERVAL);
+}
 
-    // print interfaces
-    puts("Available interfaces:");
-    pcap_if_t *devlist;
-    if (pcap_findalldevs(&devlist, errbuf))
+// list the interfaces, and ask which one to capture on
+static const char *ask_interface(pcap_if_t **devlist)
+{
+    mprintf("Available interfaces:\n");
+    if (pcap_findalldevs(devlist, errbuf))
     {
         eprintf("Cannot list pcap interfaces: %s\n", errbuf);
-        return -10;
+        return NULL;
     }
-    pcap_if_t *iter = devlist;
+    pcap_if_t *iter = *devlist;
     int max_dev_id = -1; // max index in devlist
     int i = 0;
     char address_print_buf[MAX_ADDRESS_PRINT_BUF + 1];
@@ -81,129 +119,435 @@ int main(void)
 
         // print interface information
         if (*address_print_buf)
-            printf("[%2d] %20s: (%s) %s\n", i++, iter->name,
+            mprintf("[%2d] %20s: (%s) %s\n", i++, iter->name,
                 TRIM1(address_print_buf), OPTIONAL(iter->description, ""));
         else
-            printf("[%2d] %20s:%s %s\n", i++, iter->name,
+            mprintf("[%2d] %20s:%s %s\n", i++, iter->name,
                 TRIM1(address_print_buf), OPTIONAL(iter->description, ""));
         iter = iter->next;
     }
+    if (max_dev_id < 0)
+    {
+        eprintf("No interface to capture on.\n");
+        return NULL;
+    }
 
     // input selection
-    puts("");
+    mprintf("\n");
     int selection = -1;
     do
     {
-        printf("Select an interface:");
+        mprintf("Select an interface:");
+        fflush(msg);
     } while (scanf("%d", &selection)!= 1 || selection < 0 || selection > max_dev_id); // select interface to use
     
     // extract the interface that we need
-    pcap_if_t *iface = devlist; // the interface to use
+    pcap_if_t *iface = *devlist; // the interface to use
     for (int i=0; i!=selection; ++i)
         iface = iface->next;
+    return iface->name;
+}
 
-    // start capturing
-    if (!(inst = pcap_create(iface->name, errbuf)))
+// ask for a file to write to, NULL for stdout
+static const char *ask_output(char *file_name, size_t size)
+{
+    char c = 0;
+    do
     {
-        eprintf("Cannot open device `%s`: %s\n", iface->name, errbuf);
-        pcap_freealldevs(devlist);
-        return ERR_PCAP_CANNOT_OPEN_IFACE;
+        if (c != '\n' && c != '\r')
+        {
+            mprintf("Where would you like to print capture logs? (f:File, s:STDOUT) ");
+            fflush(msg);
+        }
+    } while (scanf("%c", &c) != 1 || (c != 'f' && c != 'F' && c != 's' && c != 'S'));
+    if (c != 'f' && c != 'F')
+        return NULL;
+    // ask for file name
+    char format[16];
+    snprintf(format, sizeof(format), "%%%zus", size - 1);
+    do
+    {
+        mprintf("Save to:");
+        fflush(msg);
+    } while (scanf(format, file_name) != 1);
+    return file_name;
+}
+
+// socket 0 writes to the file, socket i to file.i
+static int open_outputs(const char *file_name)
+{
+    for (int i = 0; i != shard_count; ++i)
+    {
+        char shard_name[PATH_MAX];
+        if (i)
+            snprintf(shard_name, sizeof(shard_name), "%s.%d", file_name, i);
+        if (!(shards[i].of = fopen(i ? shard_name : file_name, "w")))
+        {
+            eprintf("Cannot open file `%s`: %s\n", i ? shard_name : file_name, strerror(errno));
+            for (int j = 0; j != i; ++j)
+                fclose(shards[j].of);
+            return -1;
+        }
     }
-    
-    // TODO: set filter condition to `inst` here
-    // currently we do not implement that
+    of = shards[0].of;
+    return 0;
+}
 
-    // set timeout
-    pcap_set_timeout(inst, 200);
-    pcap_set_buffer_size(inst, 4096);
+// ask file name or just print to stdout, unless given
+static int choose_outputs(const char *file_name)
+{
+    char asked_name[64];
+    const int ask = !file_name;
+    if (ask)
+        file_name = ask_output(asked_name, sizeof(asked_name));
+    while (file_name && strcmp(file_name, "-") && open_outputs(file_name))
+    {
+        if (!ask)
+            return -1;
+        file_name = ask_output(asked_name, sizeof(asked_name));
+    }
+    if (file_name && strcmp(file_name, "-"))
+    {
+        mprintf("Scan result will be saved in file `%s`.\n", file_name);
+        if (shard_count > 1)
+            mprintf("Socket i writes to `%s.i`, from 1 to %d.\n", file_name, shard_count - 1);
+    }
+    else
+    {
+        msg = stderr;
+        mprintf("Scan result will be printed to STDOUT.\n");
+        of = stdout;
+        for (int i = 0; i != shard_count; ++i)
+            shards[i].of = of;
+    }
+    return 0;
+}
 
-    // activate
-    int pcap_errno;
-    if ((pcap_errno = pcap_activate(inst)))
+// read a pcap file with the parallel reader, see offline.h
+static int read_offline(const char *file, const char *file_name, int headers_only, int workers)
+{
+    struct offline_config off_cfg;
+    offline_default_config(&off_cfg);
+    off_cfg.file = file;
+    off_cfg.workers = workers;
+    off_cfg.headers_only = headers_only;
+    off_cfg.decode = format_frame;
+    if (!headers_only)
     {
-        eprintf("Cannot activate interface %s", iface->name);
-FAIL_BEFORE_ACTIVATE:
-        pcap_perror(inst, "");
-        pcap_freealldevs(devlist);
-        pcap_close(inst);
+        if (choose_outputs(file_name))
+            return -1;
+        off_cfg.out = of;
+    }
+    if (!(reader = offline_open(&off_cfg, errbuf)))
+    {
+        eprintf("Cannot read file %s: %s\n", file, errbuf);
+        if (of != stdout)
+            fclose(of);
         return ERR_PCAP_CANNOT_ACTIVIATE_IFACE;
     }
+    int failed = -1;
+    if (offline_datalink(reader) != DLT_EN10MB)
+    {
+        eprintf("Unsupported link-layer protocol: %d.\n", offline_datalink(reader));
+        goto OFFLINE_DONE;
+    }
+    if (workers)
+        mprintf("Decoding with %d threads.\n", workers);
+    mprintf("Reading `%s`%s... (Ctrl+C to stop)\n", file, headers_only ? ", headers only" : "");
+    failed = offline_run(reader);
+    mprintf("Stopping...\n");
+    offline_print_stats(reader, headers_only ? stdout : stderr);
 
-    // set link-layer type
-    link_layer_type = pcap_datalink(inst);
+OFFLINE_DONE:
+    offline_close(reader);
+    reader = NULL;
+    if (of != stdout)
+        fclose(of);
+    mprintf("SuperPcap is stopped.\n");
+    return failed;
+}
 
-    if (link_layer_type != DLT_EN10MB)
+// the arguments after the options are the filter expression, like tcpdump's, NULL if there are none
+static const char *join_filter(char **args, int n)
+{
+    size_t len = 0;
+    for (int i = 0; i != n; ++i)
     {
-        eprintf("Unsupported link-layer protocol: %d.\n", link_layer_type);
-        goto FAIL_BEFORE_ACTIVATE;
+        const size_t arg_len = strlen(args[i]);
+        if (len + arg_len + 1 >= sizeof(filter_expr))
+            return NULL;
+        if (i)
+            filter_expr[len++] = ' ';
+        memcpy(filter_expr + len, args[i], arg_len);
+        len += arg_len;
     }
+    filter_expr[len] = '\0';
+    return n ? filter_expr : NULL;
+}
 
-    // ask file name or just print to stdout
-    char c = 0;
-    do
+// parse a list of CPUs like 0,2,4
+static int parse_cpus(char *s, int *cpus)
+{
+    int n = 0;
+    for (char *tok = strtok(s, ","); tok; tok = strtok(NULL, ","))
     {
-        if (c != '\n' && c != '\r')
-            printf("Where would you like to print capture logs? (f:File, s:STDOUT) ");
-    } while (scanf("%c", &c) != 1 || (c != 'f' && c != 'F' && c != 's' && c != 'S'));
-    if (c == 'f' || c == 'F')
+        char *end;
+        const long cpu = strtol(tok, &end, 10);
+        if (*end || cpu < 0 || cpu >= sysconf(_SC_NPROCESSORS_CONF) || n == SHARD_MAX)
+            return -1;
+        cpus[n++] = (int)cpu;
+    }
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    of = stdout;
+    msg = stdout;
+
+    struct capture_config cfg;
+    capture_default_config(&cfg);
+    struct pipeline_config pipe_cfg;
+    pipeline_default_config(&pipe_cfg);
+    int workers = -1;
+    int cpus[SHARD_MAX];
+    int cpu_count = 0;
+    const char *iface = NULL;
+    const char *file_name = NULL;
+    int headers_only = 0;
+    const char *match = NULL;
+    struct dump_config dump_cfg;
+    dump_default_config(&dump_cfg);
+    struct flow_config flow_cfg;
+    flow_default_config(&flow_cfg);
+    int flows = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "i:r:Ho:w:nC:G:A:E:T:RB:b:t:Is:S:j:F:QP:m:")) != -1)
     {
-        // ask for file name
-        char file_name[64];
-        do
+        switch (opt)
         {
-            if (!of)
-                perror("Cannot open file");
-            printf("Save to:");
-        } while(scanf("%63s", file_name) != 1 || !(of = fopen(file_name, "w")));
-        printf("Scan result will be saved in file `%s`.\n", file_name);
+            case 'i':
+                iface = optarg;
+                break;
+            case 'r':
+                cfg.file = optarg;
+                break;
+            case 'H':
+                headers_only = 1;
+                break;
+            case 'o':
+                file_name = optarg;
+                break;
+            case 'w':
+                dump_cfg.file = optarg;
+                break;
+            case 'n':
+                dump_cfg.format = DUMP_PCAPNG;
+                break;
+            case 'C':
+                dump_cfg.rotate_size = strtoull(optarg, NULL, 10) << 20;
+                break;
+            case 'G':
+                dump_cfg.rotate_seconds = atoi(optarg);
+                break;
+            case 'A':
+                dump_cfg.preallocate = strtoull(optarg, NULL, 10) << 20;
+                break;
+            case 'E':
+                flows = 1;
+                if (!strcmp(optarg, "json"))
+                    flow_cfg.format = FLOW_JSON;
+                else if (strcmp(optarg, "csv"))
+                    flows = -1;
+                break;
+            case 'T':
+                flow_cfg.capacity = strtoul(optarg, NULL, 10);
+                break;
+            case 'R':
+                cfg.backend = BACKEND_RING;
+                break;
+            case 'B':
+                cfg.ring_size = (size_t)atol(optarg) << 20;
+                break;
+            case 'b':
+                cfg.block_size = (size_t)atol(optarg) << 10;
+                break;
+            case 't':
+                cfg.timeout = atoi(optarg);
+                break;
+            case 'I':
+                cfg.immediate = 1;
+                break;
+            case 's':
+                cfg.snaplen = atoi(optarg);
+                break;
+            case 'S':
+                cfg.stats_interval = atoi(optarg);
+                break;
+            case 'j':
+                workers = atoi(optarg);
+                break;
+            case 'F':
+                shard_count = atoi(optarg);
+                break;
+            case 'Q':
+                cfg.fanout_mode = FANOUT_CPU;
+                break;
+            case 'P':
+                if ((cpu_count = parse_cpus(optarg, cpus)) <= 0)
+                {
+                    print_usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'm':
+                match = optarg;
+                break;
+            default:
+                print_usage(argv[0]);
+                return -1;
+        }
     }
-    else
+    cfg.filter = join_filter(argv + optind, argc - optind);
+    if (!cfg.ring_size || cfg.timeout < 0 || cfg.snaplen <= 0 || cfg.stats_interval < 0 || shard_count < 1 || shard_count > SHARD_MAX
+        || (optind != argc && !cfg.filter) || (cfg.file && (iface || shard_count > 1 || cfg.backend == BACKEND_RING))
+        || (headers_only && (!cfg.file || dump_cfg.file || cfg.filter || match || flows)) || dump_cfg.rotate_seconds < 0
+        || flows < 0 || !flow_cfg.capacity)
     {
-        printf("Scan result will be printed to STDOUT.\n");
-        of = stdout;
+        print_usage(argv[0]);
+        return -1;
+    }
+    // every shard parses its own, so tell what is wrong before capturing
+    filter *check = match ? filter_open(match, errbuf) : NULL;
+    if (match && !check)
+    {
+        eprintf("%s\n", errbuf);
+        return -1;
     }
+    filter_free(check);
+    if (cfg.file)
+        cfg.backend = BACKEND_FILE;
+    if (workers >= 0)
+        pipe_cfg.workers = workers;
+    // shards share stdout, each writes whole batches from a decoder thread
+    if (shard_count > 1)
+        pipe_cfg.workers = workers > 0 ? workers : 1;
 
-    // here we capture packets
-    pcap_loop(inst, -1, captured_packet_handler, NULL);
+    signal(SIGINT, signal_handler);
+    // with -o - or -H the output goes to stdout, buffered, and nothing else does
+    if ((file_name && !strcmp(file_name, "-")) || headers_only)
+        msg = stderr;
+    mprintf("SuperPcap: A packet capturing tool based on libpcap.\n");
+    mprintf("pcap version: %s\n\n", pcap_lib_version());
 
-    // finish capturing
-    pcap_close(inst);
-    puts("SuperPcap is stopped.");
-    fflush(of);
-    return 0;
-}
+    // a pcap file is mapped and decoded by several threads, a pcapng file goes through libpcap
+    if (cfg.file && offline_probe(cfg.file) && !dump_cfg.file && !cfg.filter && !match && !flows)
+        return read_offline(cfg.file, file_name, headers_only, pipe_cfg.workers);
+    if (headers_only)
+    {
+        eprintf("Only a pcap file can be read with -H, not %s.\n", cfg.file);
+        return -1;
+    }
 
-static void captured_packet_handler(u_char *__, const struct pcap_pkthdr *packet_header, const u_char *packet)
-{
-    // handle all captured packets
-    // printf("Packet %" PRIu32 " bytes.\n", packet_header->len);
+    // the interface to capture on, asked for if not given
+    pcap_if_t *devlist = NULL;
+    if (!cfg.file && !iface && !(iface = ask_interface(&devlist)))
+    {
+        if (devlist)
+            pcap_freealldevs(devlist);
+        return ERR_PCAP_CANNOT_ENUM_IFACES;
+    }
 
-    // print capture time
-    fprintf(of, "======== FRAME START ========\n");
-    fprintf(of, "[Frame] time=%ld.%06ld", packet_header->ts.tv_sec, packet_header->ts.tv_usec);
+    // start capturing
+    // a kernel buffer of a few KB drops most packets at any real rate, see capture.h
+    // more than one socket shares the packets out in a fanout group, see shard.h
+    // a file is read through the same decoders and output, see capture.h
+    // the filter expression is attached to every socket as it is opened, see filter.h
+    cfg.iface = iface;
+    if (shard_open(shards, shard_count, &cfg, errbuf))
+    {
+        if (cfg.file)
+            eprintf("Cannot read file %s: %s\n", cfg.file, errbuf);
+        else
+            eprintf("Cannot capture on interface %s: %s\n", iface, errbuf);
+        if (devlist)
+            pcap_freealldevs(devlist);
+        return ERR_PCAP_CANNOT_ACTIVIATE_IFACE;
+    }
 
-    char tmbuf[64];
-    strftime(tmbuf, sizeof(tmbuf), "%Y-%m-%d %H:%M:%S", localtime(&packet_header->ts.tv_sec));
-    fprintf(of, " [%s.%06ld], ", tmbuf, packet_header->ts.tv_usec);
+    // set link-layer type
+    link_layer_type = capture_datalink(shards[0].cap);
 
-    // print packet size
-    if (packet_header->len != packet_header->caplen)
+    if (link_layer_type != DLT_EN10MB)
     {
-        fprintf(of, "%" PRIu32 " bytes captured (%" PRIu32 " bytes in total) ",
-            packet_header->caplen, packet_header->len);
+        eprintf("Unsupported link-layer protocol: %d.\n", link_layer_type);
+        if (devlist)
+            pcap_freealldevs(devlist);
+        shard_close(shards, shard_count);
+        return ERR_PCAP_CANNOT_ACTIVIATE_IFACE;
     }
-    else
+    if (cfg.backend == BACKEND_RING)
+        mprintf("Capturing with a TPACKET_V3 ring of %zu MB in blocks of %zu KB.\n",
+            cfg.ring_size >> 20, cfg.block_size >> 10);
+    if (cfg.filter)
+        mprintf("Filtering with `%s`%s.\n", cfg.filter, cfg.file ? "" : " in the kernel");
+    if (match)
+        mprintf("Letting through the packets that match `%s`.\n", match);
+    if (shard_count > 1)
+        mprintf("Capturing with %d sockets sharing the packets out by %s.\n",
+            shard_count, cfg.fanout_mode == FANOUT_CPU ? "CPU" : "flow");
+    for (int i = 0; i != shard_count && cpu_count; ++i)
+        shards[i].cpu = cpus[i % cpu_count];
+
+    // with a capture file, the packets are decoded only if asked to, with flows they are not
+    const int decode = !flows && (!dump_cfg.file || file_name);
+    if ((decode || flows) && choose_outputs(file_name))
     {
-        fprintf(of, "%" PRIu32 " bytes ", packet_header->len);
+        shard_close(shards, shard_count);
+        if (devlist)
+            pcap_freealldevs(devlist);
+        return -1;
     }
+    if (dump_cfg.file)
+    {
+        dump_cfg.linktype = link_layer_type;
+        dump_cfg.snaplen = cfg.snaplen;
+        mprintf("Packets will be written to %s file `%s`%s%s.\n", dump_cfg.format == DUMP_PCAPNG ? "pcapng" : "pcap",
+            dump_cfg.file, shard_count > 1 ? ", and `.i` after it for socket i" : "",
+            dump_cfg.rotate_size || dump_cfg.rotate_seconds ? ", then `.0`, `.1`, ... for the files it is cut into" : "");
+    }
+
+    if (flows)
+    {
+        flow_cfg.live = !cfg.file;
+        mprintf("Flows are written as %s when they end, in tables of %u flows%s.\n",
+            flow_cfg.format == FLOW_JSON ? "JSON lines" : "CSV", flow_cfg.capacity, shard_count > 1 ? ", one per socket" : "");
+    }
+
+    // the capture threads only copy packets, decoder threads print them, see pipeline.h
+    pipe_cfg.decode = format_frame;
+    if (decode && pipe_cfg.workers)
+        mprintf("Decoding with %d threads%s.\n", pipe_cfg.workers, shard_count > 1 ? " per socket" : "");
 
-    // print packet data
-    fprintf(of, "\n\n");
-    // fprintf(of, "Decoded information:\n");
-    print_decoded_packet(of, (const u_int8_t*)packet, packet_header->caplen);
+    // here we capture packets
+    if (cfg.file)
+        mprintf("Reading `%s`... (Ctrl+C to stop)\n", cfg.file);
+    else
+        mprintf("Capturing... (Ctrl+C to stop)\n");
+    int failed = shard_start(shards, shard_count, decode ? &pipe_cfg : NULL, dump_cfg.file ? &dump_cfg : NULL,
+        flows ? &flow_cfg : NULL, match) || shard_wait(shards, shard_count, cfg.stats_interval) ? -1 : 0;
 
-    fprintf(of, "\n");
-    fprintf(of, "Link-layer frame data:\n");
-    binary_write(of, (void *const)packet, packet_header->caplen);
-    fputs("========  FRAME END  ========\n\n", of);
-}
\ No newline at end of file
+    // finish capturing
+    mprintf("Stopping...\n");
+    shard_print_stats(shards, shard_count, stderr);
+    shard_close(shards, shard_count);
+    for (int i = 0; i != shard_count; ++i)
+    {
+        if (shards[i].of && shards[i].of != stdout)
+            fclose(shards[i].of);
+    }
+    if (devlist)
+        pcap_freealldevs(devlist);
+    mprintf("SuperPcap is stopped.\n");
+    return failed;
+}
@@ -0,0 +1,169 @@
+#include "synth.h"
+#include "util.h"
+
+#include <string.h>
+#include <net/ethernet.h>
+#include <net/if_arp.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+
+#define FLOWS 1024
+
+static uint64_t next(struct synth *s)
+{
+    // xorshift64*
+    s->state ^= s->state >> 12;
+    s->state ^= s->state << 25;
+    s->state ^= s->state >> 27;
+    return s->state * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * @brief Start a synthetic traffic generator.
+ *
+ * @param s the generator.
+ * @param seed the same seed makes the same frames.
+ */
+void synth_init(struct synth *s, uint64_t seed)
+{
+    s->state = seed ? seed : 0x9E3779B97F4A7C15ULL;
+    s->ts.tv_sec = 1600000000;
+    s->ts.tv_usec = 0;
+    s->mix = SYNTH_MIXED;
+}
+
+static size_t frame_size(int mix, uint64_t r)
+{
+    const unsigned int k = mix == SYNTH_SMALL ? 0 : mix == SYNTH_JUMBO ? 99 : r % 100;
+    if (k < 70)
+        return 60 + (r >> 8) % 69;  // small
+    if (k < 98)
+        return 1514;                // full
+    return SYNTH_MAX_FRAME;         // jumbo
+}
+
+/**
+ * @brief Make the next frame.
+ *
+ * @param s the generator.
+ * @param frame SYNTH_MAX_FRAME bytes.
+ * @param h the pcap header of the frame, the whole frame is captured.
+ * @return size_t the size of the frame.
+ */
+size_t synth_frame(struct synth *s, uint8_t *frame, struct pcap_pkthdr *h)
+{
+    const uint64_t r = next(s);
+    const unsigned int kind = r % 16;
+    const unsigned int flow = (r >> 4) % FLOWS;
+    size_t size = frame_size(s->mix, next(s));
+
+    struct ether_header *eth = (struct ether_header *)frame;
+    const uint8_t dst[ETH_ALEN] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x02};
+    const uint8_t src[ETH_ALEN] = {0x02, 0x00, 0x00, 0x00, (uint8_t)(flow >> 8), (uint8_t)flow};
+    memcpy(eth->ether_dhost, dst, ETH_ALEN);
+    memcpy(eth->ether_shost, src, ETH_ALEN);
+    uint8_t *l3 = frame + sizeof(*eth);
+    uint8_t *l4;
+    uint8_t proto;
+
+    if (kind == 15)
+    {
+        // ARP request
+        size = 60;
+        memset(l3, 0, size - sizeof(*eth));
+        eth->ether_type = htons(ETHERTYPE_ARP);
+        struct arphdr *arp = (struct arphdr *)l3;
+        arp->ar_hrd = htons(ARPHRD_ETHER);
+        arp->ar_pro = htons(ETHERTYPE_IP);
+        arp->ar_hln = ETH_ALEN;
+        arp->ar_pln = 4;
+        arp->ar_op = htons(ARPOP_REQUEST);
+        goto FRAME_DONE;
+    }
+    proto = kind < 8 ? IPPROTO_TCP : kind < 11 ? IPPROTO_UDP : kind < 12 ? IPPROTO_ICMP
+        : kind < 14 ? IPPROTO_TCP : IPPROTO_UDP;
+    if (kind < 12)
+    {
+        eth->ether_type = htons(ETHERTYPE_IP);
+        struct iphdr *ip = (struct iphdr *)l3;
+        memset(ip, 0, sizeof(*ip));
+        ip->version = 4;
+        ip->ihl = 5;
+        ip->tot_len = htons(size - sizeof(*eth));
+        ip->id = htons((uint16_t)r);
+        ip->frag_off = htons(IP_DF);
+        ip->ttl = 64;
+        ip->protocol = proto;
+        ip->saddr = htonl(0x0A000000 | flow);
+        ip->daddr = htonl(0x0A010000 | (flow * 7 % FLOWS));
+        ip->check = (uint16_t)(r >> 16);
+        l4 = l3 + sizeof(*ip);
+    }
+    else
+    {
+        eth->ether_type = htons(ETHERTYPE_IPV6);
+        struct ip6_hdr *ip6 = (struct ip6_hdr *)l3;
+        memset(ip6, 0, sizeof(*ip6));
+        ip6->ip6_flow = htonl(6U << 28);
+        ip6->ip6_plen = htons(size - sizeof(*eth) - sizeof(*ip6));
+        ip6->ip6_nxt = proto;
+        ip6->ip6_hlim = 64;
+        ip6->ip6_src.s6_addr[0] = ip6->ip6_dst.s6_addr[0] = 0xFD;
+        ip6->ip6_src.s6_addr[14] = (uint8_t)(flow >> 8);
+        ip6->ip6_src.s6_addr[15] = (uint8_t)flow;
+        ip6->ip6_dst.s6_addr[15] = 1;
+        l4 = l3 + sizeof(*ip6);
+    }
+
+    const uint16_t sport = 10000 + flow, dport = flow % 3 ? 443 : 53;
+    uint8_t *payload;
+    if (proto == IPPROTO_TCP)
+    {
+        struct tcphdr *tcp = (struct tcphdr *)l4;
+        memset(tcp, 0, sizeof(*tcp));
+        tcp->th_sport = htons(sport);
+        tcp->th_dport = htons(dport);
+        tcp->th_seq = htonl((uint32_t)(r >> 32));
+        tcp->th_ack = htonl((uint32_t)r);
+        tcp->th_off = 5;
+        tcp->th_flags = r & 0x100 ? TH_SYN : TH_ACK | (r & 0x200 ? TH_PUSH : 0);
+        tcp->th_win = htons(65535);
+        tcp->th_sum = (uint16_t)(r >> 24);
+        payload = l4 + sizeof(*tcp);
+    }
+    else if (proto == IPPROTO_UDP)
+    {
+        struct udphdr *udp = (struct udphdr *)l4;
+        udp->uh_sport = htons(sport);
+        udp->uh_dport = htons(dport);
+        udp->uh_ulen = htons(frame + size - l4);
+        udp->uh_sum = (uint16_t)(r >> 24);
+        payload = l4 + sizeof(*udp);
+    }
+    else
+    {
+        struct icmphdr *icmp = (struct icmphdr *)l4;
+        memset(icmp, 0, sizeof(*icmp));
+        icmp->type = ICMP_ECHO;
+        icmp->un.echo.id = htons(flow);
+        icmp->un.echo.sequence = htons((uint16_t)r);
+        payload = l4 + sizeof(*icmp);
+    }
+    // text and binary, so the dump shows both
+    for (uint8_t *c = payload; c < frame + size; ++c)
+        *c = (uint8_t)(c - payload) % 96 + ((c - payload) & 64 ? 0 : 32);
+
+FRAME_DONE:
+    s->ts.tv_usec += 1 + (r >> 40) % 8;
+    if (s->ts.tv_usec >= 1000000)
+    {
+        ++s->ts.tv_sec;
+        s->ts.tv_usec -= 1000000;
+    }
+    h->ts = s->ts;
+    h->caplen = h->len = size;
+    return size;
+}
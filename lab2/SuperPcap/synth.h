@@ -0,0 +1,38 @@
+#ifndef __SYNTH_H
+#define __SYNTH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pcap/pcap.h>
+
+/* configurations */
+#define SYNTH_MAX_FRAME 9018U       /* bytes, the largest (jumbo) frame made */
+
+/*
+
+Synthetic Traffic:
+    A reproducible mix of Ethernet frames for benchmarks, the same for the
+    same seed: IPv4 TCP (with and without ACK), UDP and ICMP, IPv6 TCP and
+    UDP, and ARP, from 1024 flows. Most frames are small (60 to 128 bytes),
+    some are full (1514 bytes), a few are jumbo (9018 bytes), unless `mix`
+    asks for small or jumbo frames only. Timestamps go up by a few
+    microseconds per frame.
+
+*/
+
+#define SYNTH_MIXED 0               /* small, full and jumbo frames */
+#define SYNTH_SMALL 1               /* 60 to 128 bytes */
+#define SYNTH_JUMBO 2               /* 9018 bytes, but ARP */
+
+struct synth
+{
+    uint64_t state;
+    struct timeval ts;
+    int mix;                // SYNTH_*, SYNTH_MIXED unless set after synth_init()
+};
+
+void synth_init(struct synth *s, uint64_t seed);
+size_t synth_frame(struct synth *s, uint8_t *frame, struct pcap_pkthdr *h);
+
+#endif
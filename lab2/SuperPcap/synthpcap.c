@@ -0,0 +1,104 @@
+/*
+ * Writes synthetic frames (see synth.h) to a capture file, pcap or pcapng,
+ * through the capture file writer (see dump.h), for the benchmarks and for
+ * `spcap -r`. The same options make the same file.
+ * Usage: sp_synthpcap [-n] [-m mixed|small|jumbo] [-c packets] [-s seed] <file>
+ *   -n  pcapng instead of pcap
+ *   -m  the sizes of the frames (default mixed)
+ *   -c  how many frames (default 100000)
+ *   -s  the seed of the generator (default 1)
+ */
+
+#include "util.h"
+#include "synth.h"
+#include "dump.h"
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+static void print_usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-n] [-m mixed|small|jumbo] [-c packets] [-s seed] <file>\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    struct dump_config cfg;
+    dump_default_config(&cfg);
+    int mix = SYNTH_MIXED;
+    uint64_t packets = 100000;
+    uint64_t seed = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "nm:c:s:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':
+                cfg.format = DUMP_PCAPNG;
+                break;
+            case 'm':
+                if (!strcmp(optarg, "mixed"))
+                    mix = SYNTH_MIXED;
+                else if (!strcmp(optarg, "small"))
+                    mix = SYNTH_SMALL;
+                else if (!strcmp(optarg, "jumbo"))
+                    mix = SYNTH_JUMBO;
+                else
+                {
+                    print_usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'c':
+                packets = strtoull(optarg, NULL, 10);
+                break;
+            case 's':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                print_usage(argv[0]);
+                return -1;
+        }
+    }
+    if (optind != argc - 1 || !packets)
+    {
+        print_usage(argv[0]);
+        return -1;
+    }
+
+    char errbuf[PCAP_ERRBUF_SIZE];
+    cfg.file = argv[optind];
+    dump *d = dump_open(&cfg, errbuf);
+    if (!d)
+    {
+        fprintf(stderr, "%s\n", errbuf);
+        return -1;
+    }
+    uint8_t *frame = malloc(SYNTH_MAX_FRAME);
+    if (!frame)
+    {
+        perror("Failed to malloc");
+        dump_free(d);
+        return -1;
+    }
+    struct synth s;
+    synth_init(&s, seed);
+    s.mix = mix;
+    uint64_t bytes = 0;
+    for (uint64_t i = 0; i != packets; ++i)
+    {
+        struct pcap_pkthdr h;
+        synth_frame(&s, frame, &h);
+        dump_handler((u_char *)d, &h, frame);
+        bytes += h.caplen;
+    }
+    const int failed = dump_close(d);
+    dump_free(d);
+    free(frame);
+    if (failed)
+        return -1;
+    printf("%s: %" PRIu64 " frames, %" PRIu64 " bytes of frames, %s\n", cfg.file, packets, bytes,
+        cfg.format == DUMP_PCAPNG ? "pcapng" : "pcap");
+    return 0;
+}